@@ -16,3 +16,4 @@ FOUNDATION_EXPORT const unsigned char cocoaAsyncSocketVersionString[];
 
 #import <CocoaAsyncSocket/GCDAsyncSocket.h>
 #import <CocoaAsyncSocket/GCDAsyncUdpSocket.h>
+#import <CocoaAsyncSocket/GCDAsyncSocketRegistry.h>
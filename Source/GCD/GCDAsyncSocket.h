@@ -43,6 +43,11 @@ extern NSString *const GCDAsyncSocketSSLSessionOptionFalseStart;
 extern NSString *const GCDAsyncSocketSSLSessionOptionSendOneByteRecord;
 extern NSString *const GCDAsyncSocketSSLCipherSuites;
 extern NSString *const GCDAsyncSocketSSLALPN;
+extern NSString *const GCDAsyncSocketSSLDynamicRecordSizing;
+extern NSString *const GCDAsyncSocketSSLSmallRecordSize;
+extern NSString *const GCDAsyncSocketSSLRecordSizeBoostThreshold;
+extern NSString *const GCDAsyncSocketSSLRecordSizeIdleTimeout;
+extern NSString *const GCDAsyncSocketSSLUseHandshakePool;
 #if !TARGET_OS_IPHONE
 extern NSString *const GCDAsyncSocketSSLDiffieHellmanParameters;
 #endif
@@ -60,8 +65,106 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 	GCDAsyncSocketReadMaxedOutError,     // Reached set maxLength without completing
 	GCDAsyncSocketClosedError,           // The remote peer closed the connection
 	GCDAsyncSocketOtherError,            // Description provided in userInfo
+	GCDAsyncSocketWriteQueueFullError,   // A write would exceed maxQueuedWriteBytes
 };
 
+/**
+ * Completion blocks for the block-based read & write methods.
+ * On success the error is nil. On failure the data is nil.
+**/
+typedef void (^GCDAsyncSocketReadCompletionBlock)(NSData * __nullable data, NSError * __nullable error);
+typedef void (^GCDAsyncSocketWriteCompletionBlock)(NSError * __nullable error);
+typedef void (^GCDAsyncSocketReadDispatchDataCompletionBlock)(dispatch_data_t __nullable data, NSError * __nullable error);
+
+/**
+ * Priority lanes for writeData:priority:withTimeout:tag:.
+ * All other writes use the default priority.
+**/
+typedef NS_ENUM(NSUInteger, GCDAsyncSocketWritePriority) {
+	GCDAsyncSocketWritePriorityHigh = 0,
+	GCDAsyncSocketWritePriorityDefault,
+	GCDAsyncSocketWritePriorityLow,
+};
+
+/**
+ * Completion block for relayTo:bidirectional:completion:, invoked once per direction.
+ * The source is the socket the bytes were read from. On a clean end of stream the error is nil.
+**/
+@class GCDAsyncSocket;
+typedef void (^GCDAsyncSocketRelayCompletionBlock)(GCDAsyncSocket *source, uint64_t bytesRelayed, NSError * __nullable error);
+
+/**
+ * A latency histogram, in microseconds, with log-linear buckets (in the manner of an HDR histogram).
+ * 
+ * Buckets 0-7 each hold a single value (0-7 µs).
+ * Above that, each power of two is split into 4 buckets, so a bucket's width is at most 25% of its values.
+ * The last bucket also holds everything beyond the range (about 2.4 hours).
+ * 
+ * See +[GCDAsyncSocket lowerBoundOfLatencyBucket:] and +[GCDAsyncSocket latencyAtPercentile:ofHistogram:].
+**/
+#define GCDAsyncSocketLatencyBucketCount 128
+
+typedef struct {
+	uint64_t counts[GCDAsyncSocketLatencyBucketCount];
+	uint64_t totalCount;
+	uint64_t maxValue;
+} GCDAsyncSocketLatencyHistogram;
+
+/**
+ * Per-socket I/O statistics. See statisticsEnabled.
+ * 
+ * The counters are cumulative since statistics were first enabled (including across reconnects).
+ * The queue depths are as of the last change.
+**/
+typedef struct {
+	uint64_t bytesRead;               // Bytes read from the socket (as sent over the wire, i.e. encrypted if TLS)
+	uint64_t bytesWritten;            // Bytes written to the socket (likewise)
+	uint64_t readSyscalls;            // read() calls (including those that returned EAGAIN)
+	uint64_t writeSyscalls;           // write(), writev() and sendfile() calls (likewise)
+	uint64_t readsCompleted;          // Read operations completed
+	uint64_t writesCompleted;         // Write operations completed
+	uint64_t preBufferHighWaterMark;  // Most bytes ever held in the read prebuffer
+	uint64_t readQueueDepth;          // Reads queued behind the current read
+	uint64_t writeQueueDepth;         // Writes queued behind the current write
+	uint64_t readQueueHighWaterMark;
+	uint64_t writeQueueHighWaterMark;
+	uint64_t readSourceSuspends;
+	uint64_t readSourceResumes;
+	uint64_t writeSourceSuspends;
+	uint64_t writeSourceResumes;
+	GCDAsyncSocketLatencyHistogram readLatency;   // From queueing a read to its completion
+	GCDAsyncSocketLatencyHistogram writeLatency;  // From queueing a write to its completion
+} GCDAsyncSocketStatistics;
+
+/**
+ * A sample of the kernel's view of a TCP connection. See tcpInfo.
+ * 
+ * Times are in milliseconds. The deliveryRate is derived from bytesSent between consecutive samples.
+**/
+typedef struct {
+	BOOL valid;                     // NO if the sample couldn't be taken (not connected, not TCP, unsupported OS)
+	uint64_t timestamp;             // When the sample was taken (monotonic, in nanoseconds)
+	uint32_t state;                 // TCPS_* (see <netinet/tcp_fsm.h>)
+	uint32_t rtt;                   // Smoothed round trip time
+	uint32_t rttVariance;
+	uint32_t currentRTT;            // Most recent round trip time
+	uint32_t retransmitTimeout;
+	uint32_t maxSegmentSize;
+	uint32_t congestionWindow;      // Bytes
+	uint32_t slowStartThreshold;    // Bytes
+	uint32_t sendWindow;            // Bytes (advertised by the peer)
+	uint32_t receiveWindow;         // Bytes (advertised to the peer)
+	uint32_t sendBufferBytes;       // Bytes in the send buffer: unacknowledged plus not yet sent
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint64_t packetsSent;
+	uint64_t packetsReceived;
+	uint64_t retransmittedBytes;
+	uint64_t retransmittedPackets;
+	uint64_t outOfOrderBytes;       // Bytes received out of order
+	double deliveryRate;            // Bytes per second since the previous sample (0 if unknown)
+} GCDAsyncSocketTCPInfo;
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -119,6 +222,16 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 - (void)synchronouslySetDelegateQueue:(nullable dispatch_queue_t)delegateQueue;
 - (void)synchronouslySetDelegate:(nullable id<GCDAsyncSocketDelegate>)delegate delegateQueue:(nullable dispatch_queue_t)delegateQueue;
 
+/**
+ * The queue on which the completion blocks of the block-based read & write methods are invoked.
+ * If nil (the default), the delegateQueue is used. If that is nil too, the main queue is used.
+**/
+#if OS_OBJECT_USE_OBJC
+@property (atomic, strong, readwrite, nullable) dispatch_queue_t completionQueue;
+#else
+@property (atomic, assign, readwrite, nullable) dispatch_queue_t completionQueue;
+#endif
+
 /**
  * By default, both IPv4 and IPv6 are enabled.
  * 
@@ -151,6 +264,166 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 @property (atomic, strong, readwrite, nullable) id userData;
 
+/**
+ * When using SecureTransport for TLS, incoming data passes through two buffers:
+ * encrypted data read from the socket (but not yet consumed by SecureTransport),
+ * and decrypted data that has been read ahead of the user's read requests.
+ *
+ * These properties cap the number of bytes each of these buffers may hold for this socket.
+ * When the decrypted cap is reached, the socket stops reading until the user issues another read.
+ * Incoming data then accumulates in the kernel's buffer, which in turn applies TCP backpressure to the sender.
+ * A slow consumer on a fast connection can thus no longer cause unbounded memory growth.
+ *
+ * Note that a read request will always make progress, even if the caps are smaller than the requested length.
+ *
+ * The default value is zero, meaning unlimited.
+**/
+@property (atomic, assign, readwrite) NSUInteger maxDecryptedPreBufferSize;
+@property (atomic, assign, readwrite) NSUInteger maxEncryptedPreBufferSize;
+
+/**
+ * The number of times this socket has stopped buffering data because a (per-socket or global) cap was reached.
+**/
+@property (atomic, readonly) NSUInteger decryptedPreBufferCapHitCount;
+@property (atomic, readonly) NSUInteger encryptedPreBufferCapHitCount;
+
+/**
+ * Same as above, but applied to the combined buffers of all sockets in the process.
+ *
+ * The default value is zero, meaning unlimited.
+**/
+@property (class, atomic, assign, readwrite) NSUInteger globalMaxDecryptedPreBufferSize;
+@property (class, atomic, assign, readwrite) NSUInteger globalMaxEncryptedPreBufferSize;
+
+/**
+ * The number of bytes currently buffered by all sockets combined.
+**/
+@property (class, atomic, readonly) NSUInteger globalDecryptedPreBufferSize;
+@property (class, atomic, readonly) NSUInteger globalEncryptedPreBufferSize;
+
+/**
+ * The number of times any socket has stopped buffering data because a cap was reached.
+**/
+@property (class, atomic, readonly) uint64_t globalDecryptedPreBufferCapHitCount;
+@property (class, atomic, readonly) uint64_t globalEncryptedPreBufferCapHitCount;
+
+/**
+ * When the socket doesn't know exactly how much data is available to read (e.g. when using TLS),
+ * it reads a default amount of data at a time.
+ * Rather than being fixed, this amount adapts to the traffic seen on the connection:
+ * it tracks a moving average of the bytes read per read, plus the bytes still waiting on the socket.
+ *
+ * Chatty connections thus settle on small reads (and small buffers),
+ * while bulk transfers grow their reads (reducing the number of syscalls).
+ *
+ * adaptiveReadLength returns the current value.
+ * maxAdaptiveReadLength caps it. The default cap is 256 KB.
+**/
+@property (atomic, readonly) NSUInteger adaptiveReadLength;
+@property (atomic, assign, readwrite) NSUInteger maxAdaptiveReadLength;
+
+/**
+ * Normally, when the current read needs more data than the socket reported as available,
+ * the socket waits for the next readability event before reading again.
+ *
+ * If you enable read draining, the socket instead asks the kernel for the amount of data available right away,
+ * and keeps reading (and completing queued reads) within the same wakeup until no data is left,
+ * or until the wakeup's budget is used up. With a deep read queue, this saves a wakeup per chunk.
+ *
+ * The budget keeps one busy connection from starving others sharing the same socketQueue (or target queue).
+ * Once either limit is reached, the socket yields, and continues reading in a new block on its socketQueue.
+ * Every read attempt counts toward the operation budget, whether or not it yields any data.
+ * Budgets can't be unlimited; setting a budget to zero restores its default.
+ *
+ * The default is NO, with budgets of 256 KB and 16 reads per wakeup.
+**/
+@property (atomic, assign, readwrite, getter=isReadDrainingEnabled) BOOL readDrainingEnabled;
+@property (atomic, assign, readwrite) NSUInteger readDrainByteBudget;
+@property (atomic, assign, readwrite) NSUInteger readDrainOperationBudget;
+
+/**
+ * For large fixed-length reads (readDataToLength:...), the socket would normally be woken up
+ * for every small amount of data that arrives.
+ *
+ * If this property is non-zero, the socket sets its SO_RCVLOWAT (receive low water mark) to the number of bytes
+ * remaining in the current fixed-length read, capped at this value and at half of the socket's receive buffer.
+ * (The size of the receive buffer is looked up once per connection.)
+ * The kernel then only wakes the socket once that much data is available (or the connection is closed).
+ * For all other reads, the low water mark is reset to 1.
+ *
+ * This applies only to plain (non-TLS) connections, as the encrypted length of TLS data isn't known upfront.
+ *
+ * The default value is zero, meaning disabled.
+**/
+@property (atomic, assign, readwrite) NSUInteger maxReceiveLowWaterMark;
+
+/**
+ * Large plaintext writes are copied into the kernel's socket send buffer one buffer-full at a time,
+ * costing a write() and a writeSource wakeup for each.
+ *
+ * If this property is non-zero, the first write (over a plain connection) of at least this many bytes
+ * raises the socket's SO_SNDBUF to largeWriteSendBufferSize, for the rest of the connection.
+ * The send buffer is never lowered, and the kernel may clamp the size (see the kern.ipc.maxsockbuf sysctl).
+ *
+ * Note that setting SO_SNDBUF turns off the kernel's send buffer autosizing for the socket.
+ * On Darwin, autosizing grows the buffer with the connection's throughput (up to the net.inet.tcp.autosndbufmax
+ * sysctl, 4 MB by default), so on a fast, high latency path it may well outgrow largeWriteSendBufferSize.
+ * Once raised, the buffer stays at the fixed size instead. Only enable this if you've measured a benefit,
+ * e.g. on low latency links where autosizing is slow to grow the buffer for bursts of large writes.
+ *
+ * The default threshold is zero, meaning disabled, and the default send buffer size is 2 MB.
+**/
+@property (atomic, assign, readwrite) NSUInteger largeWriteThreshold;
+@property (atomic, assign, readwrite) NSUInteger largeWriteSendBufferSize;
+
+/**
+ * The number of bytes of data that have been queued for writing, but not completely written yet.
+ * File writes (writeFileAtPath:... & writeFileDescriptor:...) are not counted, as their data isn't held in memory.
+ * 
+ * This is updated as soon as a write method returns, and when a write completes.
+ * It may be read from any thread, without waiting for the socketQueue.
+**/
+@property (atomic, readonly) NSUInteger queuedWriteBytes;
+
+/**
+ * Backpressure signals for producers that may outpace the connection.
+ * 
+ * Once queuedWriteBytes reaches the high watermark, the delegate's socketWriteQueueDidExceedHighWatermark: is invoked.
+ * Once it then falls to (or below) the low watermark, socketWriteQueueDidDrainBelowLowWatermark: is invoked.
+ * The calls alternate, so a producer can simply pause and resume on them.
+ * 
+ * A high watermark of zero (the default) disables the signals. The default low watermark is zero.
+**/
+@property (atomic, assign, readwrite) NSUInteger writeQueueHighWatermark;
+@property (atomic, assign, readwrite) NSUInteger writeQueueLowWatermark;
+
+/**
+ * The hard cap on queuedWriteBytes, enforced by writeData:withTimeout:tag:error:.
+ * The default value is zero, meaning unlimited.
+**/
+@property (atomic, assign, readwrite) NSUInteger maxQueuedWriteBytes;
+
+/**
+ * Admission control for the TLS handshake pool (see GCDAsyncSocketSSLUseHandshakePool).
+ *
+ * If the number of handshake steps waiting for, or executing on, the pool reaches this value,
+ * further steps are executed directly on the socket's socketQueue (as if the pool wasn't used)
+ * until the pool has caught up.
+ *
+ * The default value is zero, meaning unlimited.
+**/
+@property (class, atomic, assign, readwrite) NSUInteger tlsHandshakePoolMaxPending;
+
+/**
+ * The number of handshake steps currently waiting for, or executing on, the handshake pool.
+**/
+@property (class, atomic, readonly) NSUInteger tlsHandshakePoolPendingCount;
+
+/**
+ * The number of handshake steps that were executed on the socketQueue because the pool was saturated.
+**/
+@property (class, atomic, readonly) uint64_t tlsHandshakePoolOverflowCount;
+
 #pragma mark Accepting
 
 /**
@@ -408,6 +681,65 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 @property (atomic, readonly) BOOL isSecure;
 
+/**
+ * Enables the recording of I/O statistics (see GCDAsyncSocketStatistics).
+ * 
+ * Recording amounts to a few relaxed atomic increments per operation,
+ * plus about 2 KB of memory per socket once enabled. Disabling stops the recording,
+ * but the statistics gathered so far remain available.
+ * 
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite) BOOL statisticsEnabled;
+
+/**
+ * Returns a copy of the socket's statistics (all zero if statistics were never enabled).
+ * 
+ * This method doesn't wait for the socketQueue, so it's cheap to call from any thread (e.g. a metrics timer).
+ * As the counters are read one by one while the socket may be updating them,
+ * the snapshot isn't necessarily consistent across counters.
+**/
+- (GCDAsyncSocketStatistics)statisticsSnapshot;
+
+/**
+ * The smallest value (in microseconds) held by the given bucket of a GCDAsyncSocketLatencyHistogram.
+**/
++ (uint64_t)lowerBoundOfLatencyBucket:(NSUInteger)bucket;
+
+/**
+ * Returns the latency (in microseconds) below which the given percentage (0-100) of the histogram's values fall,
+ * with the precision of the histogram's buckets (i.e. the upper bound of the bucket). Returns 0 if empty.
+**/
++ (uint64_t)latencyAtPercentile:(double)percentile ofHistogram:(const GCDAsyncSocketLatencyHistogram *)histogram;
+
+/**
+ * Samples the kernel's TCP state of the connection (RTT, congestion window, retransmits, etc).
+ * The sample is also cached (see lastTCPInfo).
+ * 
+ * This uses the TCP_CONNECTION_INFO socket option (OS X 10.11 / iOS 9 and later).
+ * If the sample can't be taken, the returned struct has valid == NO.
+**/
+- (GCDAsyncSocketTCPInfo)tcpInfo;
+
+/**
+ * The most recent sample taken by tcpInfo, or by periodic sampling (see tcpInfoSamplingInterval).
+ * 
+ * This is cheap, and doesn't wait for the socketQueue, so it's suitable for frequent RTT-aware decisions
+ * (e.g. picking a connection from a pool).
+ * 
+ * After a disconnect, the last sample of the connection remains available, until the socket connects again.
+**/
+@property (atomic, readonly) GCDAsyncSocketTCPInfo lastTCPInfo;
+
+/**
+ * If non-zero, the socket samples its TCP state on the socketQueue at this interval (in seconds),
+ * updating lastTCPInfo, for as long as it's connected.
+ * Sampling stops when the socket disconnects, and resumes if it connects again.
+ * 
+ * The default value is 0 (no periodic sampling).
+**/
+@property (atomic, assign, readwrite) NSTimeInterval tcpInfoSamplingInterval;
+
 #pragma mark Reading
 
 // The readData and writeData methods won't block (they are asynchronous).
@@ -507,6 +839,30 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
             bufferOffset:(NSUInteger)offset
                      tag:(long)tag;
 
+/**
+ * Reads the given number of bytes, and stores them in the given file (starting at the given file offset).
+ *
+ * This is intended for large downloads. The bytes are never held in memory as a whole:
+ * the file is mapped into memory a window at a time, and the socket reads (or decrypts) directly into it.
+ * Any data already buffered by the socket is written to the file first.
+ *
+ * The file is extended if needed, so the descriptor must be open for reading and writing.
+ * It is NOT closed by the socket, and MUST remain open (and must not be truncated) until the read has completed.
+ * The file position of the descriptor is neither used nor altered.
+ *
+ * The data passed to socket:didReadData:withTag: is empty, as the bytes are in the file.
+ * Progress (socket:didReadPartialDataOfLength:tag: and progressOfReadReturningTag:bytesDone:total:)
+ * is reported as for any other fixed-length read.
+ * If the file cannot be mapped or extended, the socket is disconnected with the corresponding error.
+ *
+ * If the length is 0, or the offset is negative, this method does nothing and the delegate is not called.
+**/
+- (void)readDataToLength:(NSUInteger)length
+      intoFileDescriptor:(int)fd
+                  offset:(off_t)offset
+             withTimeout:(NSTimeInterval)timeout
+                     tag:(long)tag;
+
 /**
  * Reads bytes until (and including) the passed "data" parameter, which acts as a separator.
  * 
@@ -644,6 +1000,41 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 - (float)progressOfReadReturningTag:(nullable long *)tagPtr bytesDone:(nullable NSUInteger *)donePtr total:(nullable NSUInteger *)totalPtr;
 
+/**
+ * Block-based equivalents of readDataWithTimeout:tag:, readDataToLength:withTimeout:tag:
+ * and readDataToData:withTimeout:tag:.
+ *
+ * Instead of the delegate methods (socket:didReadData:withTag:, socket:didReadPartialDataOfLength:tag:
+ * and socket:shouldTimeoutReadWithTag:elapsed:bytesDone:), the completion block is invoked on the completionQueue.
+ * If the socket is disconnected before the read completes (including due to a timeout),
+ * the completion block is invoked with the error.
+ * If the socket isn't connected when the read is queued, it's invoked with a GCDAsyncSocketOtherError.
+ *
+ * The completion block is always invoked: a read of length 0 completes with empty data,
+ * and nil or zero-length separator data fails with a GCDAsyncSocketBadParamError.
+ *
+ * Block-based and tag-based reads may be freely mixed, and are performed in the order they were queued.
+**/
+- (void)readDataWithTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion;
+- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion;
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion;
+
+/**
+ * Reads the given number of bytes, and hands them to the completion block as a dispatch_data_t.
+ * 
+ * The data is received in chunks (of up to 256 KB), and the result is made of those chunks,
+ * without flattening them into a single buffer. No bytes are copied to build the result,
+ * and a large read never needs a single allocation of its full length.
+ * Use dispatch_data_apply to walk the regions, or dispatch_data_create_map to get a contiguous buffer.
+ * 
+ * The timeout applies to each chunk.
+ * Otherwise this behaves like readDataToLength:withTimeout:completion:,
+ * and may be freely mixed with the other read methods.
+**/
+- (void)readDispatchDataToLength:(NSUInteger)length
+                     withTimeout:(NSTimeInterval)timeout
+                      completion:(GCDAsyncSocketReadDispatchDataCompletionBlock)completion;
+
 #pragma mark Writing
 
 /**
@@ -665,12 +1056,132 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 - (void)writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
+/**
+ * Same as writeData:withTimeout:tag:, but the write is queued in the given priority lane.
+ * 
+ * Whenever a write completes, the next write is taken from the highest priority lane that has queued writes.
+ * So a small control message isn't stuck behind a bulk transfer queued earlier (at a lower priority).
+ * Writes are never interrupted though: the control message still waits for the write in progress to complete.
+ * Within a lane, writes are performed in the order they were queued.
+ * 
+ * Writes aren't moved across startTLS, and to keep lower priority lanes moving,
+ * a queued write can only be overtaken a limited number of times (8).
+**/
+- (void)writeData:(nullable NSData *)data
+         priority:(GCDAsyncSocketWritePriority)priority
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag;
+
+/**
+ * Same as writeData:withTimeout:tag:, but refuses the write if it would push the number of queued bytes
+ * (see queuedWriteBytes) beyond maxQueuedWriteBytes.
+ * In that case the method returns NO, sets errPtr to a GCDAsyncSocketWriteQueueFullError, and nothing is queued.
+ * 
+ * Note that writeData:withTimeout:tag: (and the other write methods) never refuse writes.
+**/
+- (BOOL)writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag error:(NSError **)errPtr;
+
 /**
  * Returns progress of the current write, from 0.0 to 1.0, or NaN if no current write (use isnan() to check).
  * The parameters "tag", "done" and "total" will be filled in if they aren't NULL.
 **/
 - (float)progressOfWriteReturningTag:(nullable long *)tagPtr bytesDone:(nullable NSUInteger *)donePtr total:(nullable NSUInteger *)totalPtr;
 
+/**
+ * Block-based equivalent of writeData:withTimeout:tag:.
+ * 
+ * Instead of the delegate methods (socket:didWriteDataWithTag:, socket:didWritePartialDataOfLength:tag:
+ * and socket:shouldTimeoutWriteWithTag:elapsed:bytesDone:), the completion block is invoked on the completionQueue.
+ * If the socket is disconnected before the write completes (including due to a timeout),
+ * the completion block is invoked with the error.
+ * If the socket isn't connected when the write is queued, it's invoked with a GCDAsyncSocketOtherError.
+ * Writing nil or zero-length data completes right away.
+ * 
+ * Block-based and tag-based writes may be freely mixed, and are performed in the order they were queued.
+**/
+- (void)writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketWriteCompletionBlock)completion;
+
+/**
+ * Writes discontiguous data, such as headers plus body chunks, without concatenating it first.
+ * 
+ * Each region of the dispatch_data_t is retained (not copied), and the regions are handed to the kernel
+ * together with a single writev() call where possible. (Secure sockets encrypt the regions one after another.)
+ * The write is reported once, when all of it has been written, via socket:didWriteDataWithTag:
+ * (socket:didWritePartialDataOfLength:tag: may be invoked for each region).
+ * No other write is ever placed between the regions.
+ * 
+ * The timeout applies to each region.
+**/
+- (void)writeDispatchData:(nullable dispatch_data_t)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+/**
+ * Block-based equivalent of writeDispatchData:withTimeout:tag:.
+ * See writeData:withTimeout:completion:.
+**/
+- (void)writeDispatchData:(nullable dispatch_data_t)data
+              withTimeout:(NSTimeInterval)timeout
+               completion:(GCDAsyncSocketWriteCompletionBlock)completion;
+
+/**
+ * Writes the given range of a file to the socket, and calls the delegate when finished.
+ *
+ * The file is never read into memory as a whole.
+ * On a plaintext connection the bytes are handed to the kernel via sendfile(), and never enter userspace.
+ * Once TLS is involved (or if the socket doesn't support sendfile), the file is mapped into memory
+ * a window at a time, and each window is written like regular data.
+ *
+ * The range is clipped to the end of the file, so NSMakeRange(0, NSUIntegerMax) writes the entire file.
+ * If the file cannot be opened, or the range starts beyond the end of the file,
+ * the socket is disconnected with the corresponding error once the write is dequeued.
+ * If the range is empty, this method does nothing and the delegate will not be called.
+ *
+ * The delegate callbacks are the same as for writeData:withTimeout:tag:,
+ * and the progress reported by progressOfWriteReturningTag:bytesDone:total: is relative to the given range.
+**/
+- (void)writeFileAtPath:(NSString *)path range:(NSRange)range withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+/**
+ * Same as writeFileAtPath:range:withTimeout:tag:, but writes from an already open file descriptor.
+ *
+ * The file descriptor is NOT closed by the socket, and MUST remain open until the write has completed
+ * (or the socket has disconnected). The file position of the descriptor is neither used nor altered.
+**/
+- (void)writeFileDescriptor:(int)fd range:(NSRange)range withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+#pragma mark Relaying
+
+/**
+ * Forwards everything read from this socket to the destination socket (and vice versa, if bidirectional),
+ * until the end of the stream or an error.
+ *
+ * This is intended for proxies. The bytes are moved from one socket's queue to the other's,
+ * without going through the delegate (or completion queue) for each chunk.
+ * Any data this socket has already buffered is forwarded first.
+ * The amount of data that has been read but not yet written to the destination is bounded,
+ * so a slow destination slows down reading from the source.
+ *
+ * When the source reaches the end of the stream, the pending bytes are written,
+ * and then the destination's write side is shut down (half-close), signaling the end of the stream to its peer.
+ * To keep the source open for writing in that case (e.g. for the other direction of a bidirectional relay),
+ * set autoDisconnectOnClosedReadStream to NO on the source.
+ *
+ * The completion block is invoked on the source's completionQueue once its direction has finished,
+ * with the number of bytes relayed. If either socket fails (or is disconnected), the error is passed along.
+ * Neither socket is disconnected by the relay itself.
+ *
+ * While a socket is relaying, you should not queue reads on it, nor writes on its destination,
+ * as they would be interleaved with the relayed data. Each socket may be the source of only one relay.
+**/
+- (void)relayTo:(GCDAsyncSocket *)destination
+  bidirectional:(BOOL)bidirectional
+     completion:(nullable GCDAsyncSocketRelayCompletionBlock)completion;
+
+/**
+ * The total number of bytes this socket has relayed (read and then written to a relay destination).
+ * This method is thread-safe, and may be called while the relay is running.
+**/
+@property (atomic, readonly) uint64_t relayedByteCount;
+
 #pragma mark Security
 
 /**
@@ -762,6 +1273,51 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
  *     The value must be of type NSData.
  *     See Apple's documentation for SSLSetDiffieHellmanParams.
  * 
+ * - GCDAsyncSocketSSLDynamicRecordSizing
+ *     The value must be of type NSNumber, encapsulating a BOOL value.
+ *     If YES, GCDAsyncSocket will size the TLS records it writes based on the state of the connection.
+ *     Right after the handshake, and again after the connection has been idle for a while,
+ *     data is written in small records that fit within a single TCP segment.
+ *     This allows the remote endpoint to decrypt and process the first bytes as soon as they arrive,
+ *     rather than waiting for a large record spanning many segments.
+ *     Once enough data has been written, the records grow to the maximum TLS record size (16 KB) for throughput.
+ *     This option only applies to SecureTransport (it is ignored when using CFStream for TLS).
+ *     
+ *     If unspecified, the default value is NO.
+ * 
+ * - GCDAsyncSocketSSLSmallRecordSize
+ *     The value must be of type NSNumber, encapsulating an unsigned integer value.
+ *     The number of plaintext bytes per record while records are small.
+ *     Only used if GCDAsyncSocketSSLDynamicRecordSizing is enabled.
+ *     
+ *     If unspecified, the default value is 1400.
+ * 
+ * - GCDAsyncSocketSSLRecordSizeBoostThreshold
+ *     The value must be of type NSNumber, encapsulating an unsigned integer value.
+ *     The number of plaintext bytes to write in small records before switching to large records.
+ *     Only used if GCDAsyncSocketSSLDynamicRecordSizing is enabled.
+ *     
+ *     If unspecified, the default value is 1 MB.
+ * 
+ * - GCDAsyncSocketSSLRecordSizeIdleTimeout
+ *     The value must be of type NSNumber, encapsulating an NSTimeInterval value.
+ *     If nothing has been written for this amount of time, records are reset to the small size.
+ *     Only used if GCDAsyncSocketSSLDynamicRecordSizing is enabled.
+ *     
+ *     If unspecified, the default value is 1 second.
+ * 
+ * - GCDAsyncSocketSSLUseHandshakePool
+ *     The value must be of type NSNumber, encapsulating a BOOL value.
+ *     If YES, the CPU intensive work of the handshake (the SSLHandshake calls) is executed on a shared pool
+ *     of handshake queues (one per core), rather than on the socketQueue.
+ *     The results are posted back to the socketQueue, and the handshake proceeds as usual.
+ *     This is useful when many sockets share a small number of socket queues,
+ *     as a burst of handshakes would otherwise be serialized behind those queues.
+ *     See also the tlsHandshakePoolMaxPending class property.
+ *     This option only applies to SecureTransport (it is ignored when using CFStream for TLS).
+ *     
+ *     If unspecified, the default value is NO.
+ * 
  * ==== The following UNAVAILABLE KEYS are: (with throw an exception)
  * 
  * - kCFStreamSSLAllowsAnyRoot (UNAVAILABLE)
@@ -840,6 +1396,43 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 @property (atomic, assign, readwrite) BOOL autoDisconnectOnClosedReadStream;
 
+/**
+ * Normally every delegate method is dispatched asynchronously onto the delegateQueue,
+ * even if the delegateQueue is the very same serial queue as the socketQueue.
+ *
+ * If you enable this property, and the delegateQueue is the socketQueue,
+ * then the read & write callbacks (socket:didReadData:withTag:, socket:didReadPartialDataOfLength:tag:,
+ * socket:didWriteDataWithTag: & socket:didWritePartialDataOfLength:tag:) are invoked directly from the socketQueue,
+ * saving a queue hop per event. All other delegate methods are still dispatched asynchronously.
+ *
+ * Reads & writes issued from within such a callback are queued immediately, in order,
+ * and are picked up once the callback returns.
+ * Invoking disconnect from within such a callback stops all further reads, writes & callbacks immediately,
+ * but the socket is closed only after the callback has returned.
+ *
+ * The data passed to socket:didReadData:withTag: may reference your read buffer directly (as usual).
+ *
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite) BOOL synchronousDelegateCallbacks;
+
+/**
+ * Writes issued from the socketQueue (e.g. from a delegate method when the delegateQueue is the socketQueue)
+ * take a fast path when the socket is idle: nothing queued, nothing in progress, and the socket known to accept bytes.
+ * The data is handed to the kernel immediately, without allocating a write packet or hopping queues,
+ * and only the part the kernel didn't accept is queued.
+ * Completion is reported exactly as for queued writes (socket:didWriteDataWithTag: or the completion block).
+ * 
+ * Secure (TLS) sockets always queue their writes.
+ * 
+ * If synchronousWrites is enabled, writes issued from other threads take the fast path as well,
+ * by synchronously dispatching onto the socketQueue. This means the write methods may block briefly,
+ * and must not be invoked from a queue the socketQueue targets or waits on.
+ * 
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite) BOOL synchronousWrites;
+
 /**
  * GCDAsyncSocket maintains thread safety by using an internal serial dispatch_queue.
  * In most cases, the instance creates this queue itself.
@@ -1061,6 +1654,127 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+typedef void (^GCDAsyncSocketBroadcastLagBlock)(GCDAsyncSocket *sock, NSUInteger queuedWriteBytes, BOOL dropped);
+
+/**
+ * A GCDAsyncSocketBroadcastGroup writes the same data to many sockets (e.g. the subscribers of a pub/sub server).
+ * 
+ * All sockets share the one (immutable) buffer of a broadcast, rather than each getting a copy.
+ * The writes are queued with a single block per socketQueue, rather than one per socket.
+ * So sockets sharing a socketQueue (or a few queues) can be fanned out to far more cheaply
+ * than by invoking writeData:withTimeout:tag: on each of them.
+ * 
+ * A subscriber that doesn't keep up (whose queuedWriteBytes exceed maxSubscriberLag) misses broadcasts,
+ * rather than buffering ever more data. Optionally it's dropped from the group instead.
+ * 
+ * All methods are thread-safe.
+**/
+@interface GCDAsyncSocketBroadcastGroup : NSObject
+
+/**
+ * Adds a socket to the group. Sockets are held weakly, and removed once deallocated.
+ * Adding a socket that's already in the group has no effect.
+**/
+- (void)addSocket:(GCDAsyncSocket *)sock;
+
+/**
+ * Removes a socket from the group. Broadcasts already queued on it are still written.
+**/
+- (void)removeSocket:(GCDAsyncSocket *)sock;
+
+/**
+ * The number of sockets in the group.
+**/
+@property (atomic, readonly) NSUInteger socketCount;
+
+/**
+ * Queues the data for writing on every socket in the group, as if by writeData:withTimeout:tag:.
+ * The data is not copied, so it must not be altered afterwards. (Pass an immutable copy if needed.)
+ * 
+ * Sockets that aren't connected, or are lagging (see maxSubscriberLag), are skipped.
+ * Returns immediately. The writes are queued asynchronously, but in the order broadcasts are made.
+**/
+- (void)broadcastData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+/**
+ * The number of bytes a socket may have queued for writing (see queuedWriteBytes)
+ * and still receive further broadcasts.
+ * 
+ * If zero (the default), each socket's own writeQueueHighWatermark is used instead.
+ * If that is zero as well, the socket is never considered lagging.
+**/
+@property (atomic, assign, readwrite) NSUInteger maxSubscriberLag;
+
+/**
+ * If YES, a lagging socket is removed from the group (rather than just skipped).
+ * The socket itself is not disconnected, which may be done from the lagHandler.
+ * 
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite) BOOL dropsLaggingSubscribers;
+
+/**
+ * Sets a block invoked (asynchronously, on the given queue) when a socket starts missing broadcasts,
+ * or is dropped, with the number of bytes it has queued at the time.
+ * A skipped socket is reported again only after it has caught up and then fallen behind once more.
+ * 
+ * If the queue is NULL, the main queue is used.
+**/
+- (void)setLagHandler:(nullable GCDAsyncSocketBroadcastLagBlock)lagHandler queue:(nullable dispatch_queue_t)queue;
+
+/**
+ * Reports the lag of each socket in the group:
+ * the number of bytes it has queued for writing, and the number of broadcasts it has missed.
+**/
+- (void)enumerateSubscriberLagUsingBlock:(void (^)(GCDAsyncSocket *sock, NSUInteger queuedWriteBytes, uint64_t missedBroadcasts))block;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Binary event tracing of the socket state machine.
+ * 
+ * Tracing is compiled in only if GCDAsyncSocketTracingEnabled is defined to 1
+ * (e.g. GCC_PREPROCESSOR_DEFINITIONS = GCDAsyncSocketTracingEnabled=1). Otherwise it costs nothing.
+ * 
+ * When compiled in, every socket records fixed-size events into a ring buffer owned by its socketQueue,
+ * with nanosecond timestamps: read/write enqueue and dequeue, read/write syscalls (with their result, errno
+ * and duration), read/write source suspend/resume, TLS start and handshake steps, and close.
+ * Recording happens on the socketQueue without locks, so it's cheap enough for production builds.
+ * Each ring keeps the most recent GCDAsyncSocketTraceRingCapacity events (1024 by default, about 40 KB),
+ * and is allocated when the first event is recorded on its socketQueue.
+ * Once a socketQueue is deallocated, its ring is kept for export and reuse, up to a few (GCDAsyncSocketTraceRetiredRingLimit).
+ * 
+ * The recorded events can be exported in the Chrome trace event format,
+ * which can be opened in chrome://tracing or Perfetto. Each socketQueue is shown as a thread.
+**/
+@interface GCDAsyncSocketTracing : NSObject
+
+/**
+ * Returns YES if tracing was compiled in.
+**/
++ (BOOL)isCompiledIn;
+
+/**
+ * Returns the recorded events as a Chrome trace (JSON), or nil if tracing wasn't compiled in.
+ * Exporting doesn't interfere with recording, and may be done from any thread.
+**/
++ (nullable NSData *)chromeTraceData;
+
+/**
+ * Writes the recorded events as a Chrome trace (JSON) to the given file.
+**/
++ (BOOL)writeChromeTraceToURL:(NSURL *)url error:(NSError **)errPtr;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 @protocol GCDAsyncSocketDelegate <NSObject>
 @optional
 
@@ -1170,6 +1884,18 @@ typedef NS_ERROR_ENUM(GCDAsyncSocketErrorDomain, GCDAsyncSocketError) {
 **/
 - (void)socketDidCloseReadStream:(GCDAsyncSocket *)sock;
 
+/**
+ * Called when the number of bytes queued for writing reaches the socket's writeQueueHighWatermark.
+ * It's a good time to stop producing data, until socketWriteQueueDidDrainBelowLowWatermark: is called.
+**/
+- (void)socketWriteQueueDidExceedHighWatermark:(GCDAsyncSocket *)sock;
+
+/**
+ * Called when the number of bytes queued for writing falls to the socket's writeQueueLowWatermark,
+ * after having exceeded the high watermark.
+**/
+- (void)socketWriteQueueDidDrainBelowLowWatermark:(GCDAsyncSocket *)sock;
+
 /**
  * Called when a socket disconnects with or without error.
  * 
@@ -9,6 +9,7 @@
 //
 
 #import "GCDAsyncSocket.h"
+#import "GCDAsyncSocketRegistry.h"
 
 #if TARGET_OS_IPHONE
 #import <CFNetwork/CFNetwork.h>
@@ -18,12 +19,20 @@
 #import <arpa/inet.h>
 #import <fcntl.h>
 #import <ifaddrs.h>
+#import <mach/mach_time.h>
 #import <netdb.h>
+#import <stdatomic.h>
 #import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <pthread.h>
+#import <objc/message.h>
+#import <objc/runtime.h>
 #import <net/if.h>
 #import <sys/socket.h>
+#import <sys/stat.h>
 #import <sys/types.h>
 #import <sys/ioctl.h>
+#import <sys/mman.h>
 #import <sys/poll.h>
 #import <sys/uio.h>
 #import <sys/un.h>
@@ -94,6 +103,23 @@ static const int logLevel = GCDAsyncSocketLogLevel;
 
 #endif
 
+// Binary event tracing of the socket state machine - See GCDAsyncSocketTracing.
+// Unlike logging, this is cheap enough to be compiled into production builds.
+
+#ifndef GCDAsyncSocketTracingEnabled
+#define GCDAsyncSocketTracingEnabled 0
+#endif
+
+// The number of events kept per socketQueue (must be a power of 2)
+#ifndef GCDAsyncSocketTraceRingCapacity
+#define GCDAsyncSocketTraceRingCapacity 1024
+#endif
+
+// The number of rings kept around (for export & reuse) after their socketQueue has been deallocated
+#ifndef GCDAsyncSocketTraceRetiredRingLimit
+#define GCDAsyncSocketTraceRetiredRingLimit 4
+#endif
+
 /**
  * Seeing a return statements within an inner block
  * can sometimes be mistaken for a return point of the enclosing method.
@@ -108,6 +134,22 @@ static const int logLevel = GCDAsyncSocketLogLevel;
 **/
 #define SOCKET_NULL -1
 
+/**
+ * Returns a monotonically increasing timestamp, in nanoseconds.
+ * Unlike the wall clock, this is not affected by changes to the system time,
+ * which makes it suitable for measuring intervals (such as idle periods).
+**/
+static uint64_t GCDAsyncSocketMonotonicTime(void)
+{
+	static mach_timebase_info_data_t timebase;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		mach_timebase_info(&timebase);
+	});
+	
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
 
 NSString *const GCDAsyncSocketException = @"GCDAsyncSocketException";
 NSString *const GCDAsyncSocketErrorDomain = @"GCDAsyncSocketErrorDomain";
@@ -126,6 +168,11 @@ NSString *const GCDAsyncSocketSSLSessionOptionFalseStart = @"GCDAsyncSocketSSLSe
 NSString *const GCDAsyncSocketSSLSessionOptionSendOneByteRecord = @"GCDAsyncSocketSSLSessionOptionSendOneByteRecord";
 NSString *const GCDAsyncSocketSSLCipherSuites = @"GCDAsyncSocketSSLCipherSuites";
 NSString *const GCDAsyncSocketSSLALPN = @"GCDAsyncSocketSSLALPN";
+NSString *const GCDAsyncSocketSSLDynamicRecordSizing = @"GCDAsyncSocketSSLDynamicRecordSizing";
+NSString *const GCDAsyncSocketSSLSmallRecordSize = @"GCDAsyncSocketSSLSmallRecordSize";
+NSString *const GCDAsyncSocketSSLRecordSizeBoostThreshold = @"GCDAsyncSocketSSLRecordSizeBoostThreshold";
+NSString *const GCDAsyncSocketSSLRecordSizeIdleTimeout = @"GCDAsyncSocketSSLRecordSizeIdleTimeout";
+NSString *const GCDAsyncSocketSSLUseHandshakePool = @"GCDAsyncSocketSSLUseHandshakePool";
 #if !TARGET_OS_IPHONE
 NSString *const GCDAsyncSocketSSLDiffieHellmanParameters = @"GCDAsyncSocketSSLDiffieHellmanParameters";
 #endif
@@ -154,6 +201,10 @@ enum GCDAsyncSocketFlags
 	kUsingCFStreamForTLS           = 1 << 18,  // If set, we're forced to use CFStream instead of SecureTransport
 	kSecureSocketHasBytesAvailable = 1 << 19,  // If set, CFReadStream has notified us of bytes available
 #endif
+	kSSLHandshakeInFlight          = 1 << 20,  // If set, a handshake step is executing on the handshake pool
+	kDisconnectAfterCallout        = 1 << 21,  // If set, disconnect was requested from within a synchronous delegate callout
+	kReadDrainYieldPending         = 1 << 22,  // If set, reading resumes in a new socketQueue block (read budget exhausted)
+	kSendBufferRaised              = 1 << 23,  // If set, SO_SNDBUF has been raised for large writes
 };
 
 enum GCDAsyncSocketConfig
@@ -162,8 +213,396 @@ enum GCDAsyncSocketConfig
 	kIPv6Disabled              = 1 << 1,  // If set, IPv6 is disabled
 	kPreferIPv6                = 1 << 2,  // If set, IPv6 is preferred over IPv4
 	kAllowHalfDuplexConnection = 1 << 3,  // If set, the socket will stay open even if the read stream closes
+	kSynchronousDelegateCalls  = 1 << 4,  // If set, data callbacks are invoked inline when delegateQueue == socketQueue
+	kDrainReads                = 1 << 5,  // If set, reads continue within a wakeup until EAGAIN or the budget runs out
+};
+
+enum GCDAsyncSocketDelegateCapabilities
+{
+	kDelegateDidReadData         = 1 << 0,  // If set, the delegate implements socket:didReadData:withTag:
+	kDelegateDidReadPartialData  = 1 << 1,  // If set, the delegate implements socket:didReadPartialDataOfLength:tag:
+	kDelegateDidWriteData        = 1 << 2,  // If set, the delegate implements socket:didWriteDataWithTag:
+	kDelegateDidWritePartialData = 1 << 3,  // If set, the delegate implements socket:didWritePartialDataOfLength:tag:
+};
+
+typedef void (*GCDAsyncSocketDidReadDataIMP)(id, SEL, GCDAsyncSocket *, NSData *, long);
+typedef void (*GCDAsyncSocketDidWriteDataIMP)(id, SEL, GCDAsyncSocket *, long);
+
+// Used in place of the cached IMPs when the delegate's implementation can't be called directly
+// (i.e. the delegate is a proxy, or forwards the message)
+
+static void GCDAsyncSocketSendDidReadData(id delegate, SEL _cmd, GCDAsyncSocket *sock, NSData *data, long tag)
+{
+	[delegate socket:sock didReadData:data withTag:tag];
+}
+
+static void GCDAsyncSocketSendDidWriteData(id delegate, SEL _cmd, GCDAsyncSocket *sock, long tag)
+{
+	[delegate socket:sock didWriteDataWithTag:tag];
+}
+
+// Totals and caps for the TLS prebuffers of all sockets combined (a cap of zero means unlimited)
+static atomic_size_t globalDecryptedPreBufferSize;
+static atomic_size_t globalEncryptedPreBufferSize;
+static atomic_size_t globalMaxDecryptedPreBufferSize;
+static atomic_size_t globalMaxEncryptedPreBufferSize;
+static atomic_uint_fast64_t globalDecryptedPreBufferCapHitCount;
+static atomic_uint_fast64_t globalEncryptedPreBufferCapHitCount;
+
+/**
+ * Returns the number of bytes that may be added to a prebuffer,
+ * given the number of bytes it currently holds, and the per-socket & global caps (zero means unlimited).
+**/
+static size_t GCDAsyncSocketPreBufferAllowance(size_t buffered, size_t max,
+                                               atomic_size_t *globalBuffered, atomic_size_t *globalMax)
+{
+	size_t allowance = SIZE_MAX;
+	
+	if (max > 0)
+	{
+		allowance = (buffered < max) ? (max - buffered) : 0;
+	}
+	
+	size_t gMax = atomic_load_explicit(globalMax, memory_order_relaxed);
+	if (gMax > 0)
+	{
+		size_t gBuffered = atomic_load_explicit(globalBuffered, memory_order_relaxed);
+		
+		allowance = MIN(allowance, (gBuffered < gMax) ? (gMax - gBuffered) : 0);
+	}
+	
+	return allowance;
+}
+
+// The handshake pool (see GCDAsyncSocketSSLUseHandshakePool)
+#define TLS_HANDSHAKE_POOL_MAX_WIDTH 16
+
+// The maximum amount of plaintext a TLS record carries
+#define TLS_MAX_RECORD_PLAINTEXT_SIZE (1024 * 16)
+
+// The maximum number of finished read (and write) packets each socket keeps around for reuse
+#define PACKET_POOL_CAPACITY 16
+
+// Bounds & initial value for the adaptive read length (see updateReadLengthWithBytesRead:)
+#define ADAPTIVE_READ_LENGTH_MIN      (1024 * 4)
+#define ADAPTIVE_READ_LENGTH_INITIAL  (1024 * 16)
+#define ADAPTIVE_READ_LENGTH_MAX      (1024 * 256)
+
+// Default per-wakeup budgets when draining reads (see readDrainingEnabled)
+#define READ_DRAIN_BYTE_BUDGET       (1024 * 256)
+#define READ_DRAIN_OPERATION_BUDGET  16
+
+// How many times a queued write may be overtaken by higher priority writes (see writeData:priority:withTimeout:tag:)
+#define WRITE_PRIORITY_MAX_BYPASS 8
+
+// Default socket send buffer size for large writes (see largeWriteThreshold)
+#define LARGE_WRITE_SEND_BUFFER_SIZE (1024 * 1024 * 2)
+
+// How much a relay reads per chunk, and how much it lets pile up in the destination's write queue
+// (see relayTo:bidirectional:completion:)
+#define RELAY_READ_LENGTH            (1024 * 64)
+#define RELAY_MAX_BYTES_IN_FLIGHT    (1024 * 1024)
+
+// How much of a file is mapped into memory at a time
+// (see GCDAsyncFileReadPacket, and GCDAsyncFileWritePacket when it can't use sendfile())
+#define FILE_MAPPING_WINDOW_SIZE (1024 * 1024 * 8)
+
+// How much data each chunk of a dispatch_data read holds at most
+// (see readDispatchDataToLength:withTimeout:completion:)
+#define DISPATCH_DATA_READ_CHUNK_LENGTH (1024 * 256)
+
+/**
+ * The statistics of a socket (see statisticsEnabled), as recorded.
+ * 
+ * The counters are only updated on the socketQueue, but may be read from any thread (see statisticsSnapshot),
+ * hence the (relaxed) atomics.
+**/
+typedef struct {
+	atomic_uint_fast64_t bytesRead;
+	atomic_uint_fast64_t bytesWritten;
+	atomic_uint_fast64_t readSyscalls;
+	atomic_uint_fast64_t writeSyscalls;
+	atomic_uint_fast64_t readsCompleted;
+	atomic_uint_fast64_t writesCompleted;
+	atomic_uint_fast64_t preBufferHighWaterMark;
+	atomic_uint_fast64_t readQueueDepth;
+	atomic_uint_fast64_t writeQueueDepth;
+	atomic_uint_fast64_t readQueueHighWaterMark;
+	atomic_uint_fast64_t writeQueueHighWaterMark;
+	atomic_uint_fast64_t readSourceSuspends;
+	atomic_uint_fast64_t readSourceResumes;
+	atomic_uint_fast64_t writeSourceSuspends;
+	atomic_uint_fast64_t writeSourceResumes;
+	atomic_uint_fast64_t readLatency[GCDAsyncSocketLatencyBucketCount];
+	atomic_uint_fast64_t readLatencyMax;
+	atomic_uint_fast64_t writeLatency[GCDAsyncSocketLatencyBucketCount];
+	atomic_uint_fast64_t writeLatencyMax;
+} GCDAsyncSocketStatisticsCounters;
+
+// Record a statistic, if statistics are enabled. Must be used on the socketQueue.
+#define STATISTICS_ADD(field, value) do { \
+	GCDAsyncSocketStatisticsCounters *stats_ = self->statistics; \
+	if (stats_) atomic_fetch_add_explicit(&stats_->field, (uint_fast64_t)(value), memory_order_relaxed); \
+} while (0)
+
+#define STATISTICS_MAX(field, value) do { \
+	GCDAsyncSocketStatisticsCounters *stats_ = self->statistics; \
+	if (stats_ && ((uint_fast64_t)(value) > atomic_load_explicit(&stats_->field, memory_order_relaxed))) \
+		atomic_store_explicit(&stats_->field, (uint_fast64_t)(value), memory_order_relaxed); \
+} while (0)
+
+/**
+ * Maps a latency (in microseconds) to its GCDAsyncSocketLatencyHistogram bucket.
+**/
+static NSUInteger GCDAsyncSocketLatencyBucket(uint64_t micros)
+{
+	if (micros < 8) return (NSUInteger)micros;
+	
+	NSUInteger exponent = 63 - (NSUInteger)__builtin_clzll(micros);
+	NSUInteger sub = (NSUInteger)((micros >> (exponent - 2)) & 3);
+	
+	NSUInteger bucket = 8 + ((exponent - 3) * 4) + sub;
+	
+	return MIN(bucket, (NSUInteger)(GCDAsyncSocketLatencyBucketCount - 1));
+}
+
+/**
+ * The events recorded by GCDAsyncSocketTracing.
+**/
+typedef NS_ENUM(uint16_t, GCDAsyncSocketTraceEventType) {
+	GCDAsyncSocketTraceReadEnqueue = 1,  // value = tag
+	GCDAsyncSocketTraceReadDequeue,      // value = tag (-1 for startTLS)
+	GCDAsyncSocketTraceWriteEnqueue,     // value = tag
+	GCDAsyncSocketTraceWriteDequeue,     // value = tag (-1 for startTLS)
+	GCDAsyncSocketTraceReadSyscall,      // value = result, error = errno
+	GCDAsyncSocketTraceWriteSyscall,     // value = result, error = errno
+	GCDAsyncSocketTraceReadSourceSuspend,
+	GCDAsyncSocketTraceReadSourceResume,
+	GCDAsyncSocketTraceWriteSourceSuspend,
+	GCDAsyncSocketTraceWriteSourceResume,
+	GCDAsyncSocketTraceTLSStart,
+	GCDAsyncSocketTraceTLSHandshakeStep, // value = OSStatus (noErr once complete)
+	GCDAsyncSocketTraceClose,            // value = error code (0 if none)
 };
 
+#if GCDAsyncSocketTracingEnabled
+
+_Static_assert((GCDAsyncSocketTraceRingCapacity & (GCDAsyncSocketTraceRingCapacity - 1)) == 0,
+               "GCDAsyncSocketTraceRingCapacity must be a power of 2");
+
+/**
+ * A fixed-size (40 byte) trace event.
+ * 
+ * The sequence number is a seqlock: it's zero while the event is being written,
+ * and the event's index (plus one) once it's complete.
+ * This lets a reader copy events without ever blocking the writer.
+**/
+typedef struct {
+	atomic_uint_fast64_t sequence;
+	uint64_t timestamp; // GCDAsyncSocketMonotonicTime
+	uint64_t socket;    // Address of the GCDAsyncSocket
+	int64_t value;
+	uint32_t duration;  // Nanoseconds (syscalls only)
+	int16_t error;
+	uint16_t type;
+} GCDAsyncSocketTraceEvent;
+
+/**
+ * The events recorded on a socketQueue.
+ * 
+ * There's a single writer (whoever is running on the queue), so recording needs neither locks nor atomic RMW.
+ * A ring is attached to its queue when the first event is recorded there, so idle queues cost nothing.
+ * 
+ * Once its queue is deallocated, a ring is retired: it can still be exported, and is reused by the next queue.
+ * Only the most recently retired rings (GCDAsyncSocketTraceRetiredRingLimit) are kept, older ones are freed.
+**/
+typedef struct GCDAsyncSocketTraceRing {
+	struct GCDAsyncSocketTraceRing *next;
+	atomic_uint_fast64_t head;
+	uint64_t retirement; // Order in which the ring was retired
+	uint32_t identifier;
+	BOOL inUse;
+	char label[64];
+	GCDAsyncSocketTraceEvent events[GCDAsyncSocketTraceRingCapacity];
+} GCDAsyncSocketTraceRing;
+
+static pthread_mutex_t traceRingsLock = PTHREAD_MUTEX_INITIALIZER;
+static GCDAsyncSocketTraceRing *traceRings;
+static uint32_t traceRingCount;
+static uint32_t traceRetiredRingCount;
+static uint64_t traceRingRetirements;
+static char traceRingKey;
+
+/**
+ * Returns the link (in traceRings) to the retired ring that was retired first, or NULL if there is none.
+ * Must be invoked with traceRingsLock held.
+**/
+static GCDAsyncSocketTraceRing **GCDAsyncSocketTraceOldestRetiredRing(void)
+{
+	GCDAsyncSocketTraceRing **result = NULL;
+	
+	for (GCDAsyncSocketTraceRing **link = &traceRings; *link; link = &(*link)->next)
+	{
+		if (!(*link)->inUse && ((result == NULL) || ((*link)->retirement < (*result)->retirement)))
+		{
+			result = link;
+		}
+	}
+	
+	return result;
+}
+
+static void GCDAsyncSocketTraceRingRetire(void *context)
+{
+	GCDAsyncSocketTraceRing *ring = (GCDAsyncSocketTraceRing *)context;
+	
+	pthread_mutex_lock(&traceRingsLock);
+	
+	ring->inUse = NO;
+	ring->retirement = ++traceRingRetirements;
+	traceRetiredRingCount++;
+	
+	if (traceRetiredRingCount > GCDAsyncSocketTraceRetiredRingLimit)
+	{
+		// Nobody is writing to a retired ring, and readers hold the lock
+		GCDAsyncSocketTraceRing **link = GCDAsyncSocketTraceOldestRetiredRing();
+		GCDAsyncSocketTraceRing *oldest = *link;
+		
+		*link = oldest->next;
+		traceRetiredRingCount--;
+		
+		free(oldest);
+	}
+	
+	pthread_mutex_unlock(&traceRingsLock);
+}
+
+/**
+ * Returns the ring of the given socketQueue, attaching one to it (via dispatch_queue_set_specific) if needed.
+**/
+static GCDAsyncSocketTraceRing *GCDAsyncSocketTraceRingForQueue(dispatch_queue_t queue)
+{
+	pthread_mutex_lock(&traceRingsLock);
+	
+	GCDAsyncSocketTraceRing *ring = dispatch_queue_get_specific(queue, &traceRingKey);
+	if (ring == NULL)
+	{
+		GCDAsyncSocketTraceRing **link = GCDAsyncSocketTraceOldestRetiredRing();
+		
+		if (link)
+		{
+			ring = *link;
+			traceRetiredRingCount--;
+			
+			// Nobody is writing to a retired ring, and readers hold the lock
+			atomic_store(&ring->head, 0);
+			for (NSUInteger i = 0; i < GCDAsyncSocketTraceRingCapacity; i++)
+			{
+				atomic_store_explicit(&ring->events[i].sequence, 0, memory_order_relaxed);
+			}
+		}
+		else
+		{
+			ring = calloc(1, sizeof(GCDAsyncSocketTraceRing));
+			ring->identifier = ++traceRingCount;
+			ring->next = traceRings;
+			traceRings = ring;
+		}
+		
+		const char *label = dispatch_queue_get_label(queue);
+		strlcpy(ring->label, label ? label : "", sizeof(ring->label));
+		ring->inUse = YES;
+		
+		dispatch_queue_set_specific(queue, &traceRingKey, ring, GCDAsyncSocketTraceRingRetire);
+	}
+	
+	pthread_mutex_unlock(&traceRingsLock);
+	
+	return ring;
+}
+
+/**
+ * Records an event. Must be invoked on the queue the ring belongs to.
+ * If a start time is given, the event spans from then until now.
+**/
+static inline void GCDAsyncSocketTraceRecord(GCDAsyncSocketTraceRing *ring, const void *sock,
+                                             GCDAsyncSocketTraceEventType type, int64_t value, int error,
+                                             uint64_t start)
+{
+	uint64_t now = GCDAsyncSocketMonotonicTime();
+	
+	uint_fast64_t index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	GCDAsyncSocketTraceEvent *event = &ring->events[index & (GCDAsyncSocketTraceRingCapacity - 1)];
+	
+	atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	
+	event->timestamp = start ? start : now;
+	event->duration = start ? (uint32_t)MIN(now - start, (uint64_t)UINT32_MAX) : 0;
+	event->socket = (uint64_t)(uintptr_t)sock;
+	event->value = value;
+	event->error = (int16_t)error;
+	event->type = type;
+	
+	atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+	atomic_store_explicit(&ring->head, index + 1, memory_order_release);
+}
+
+// The socket's ring, attached to its socketQueue on first use. Must be used on the socketQueue.
+#define TRACE_RING() \
+	(self->traceRing ? self->traceRing : (self->traceRing = GCDAsyncSocketTraceRingForQueue(self->socketQueue)))
+
+// Record a trace event. Must be used on the socketQueue.
+#define TRACE_EVENT(type, value) \
+	GCDAsyncSocketTraceRecord(TRACE_RING(), (__bridge const void *)self, (type), (int64_t)(value), 0, 0)
+
+// Record a syscall, spanning from TRACE_SYSCALL_BEGIN(). Must directly follow the syscall (so errno is intact).
+#define TRACE_SYSCALL_BEGIN() \
+	uint64_t traceSyscallStart = GCDAsyncSocketMonotonicTime()
+
+#define TRACE_SYSCALL(type, value, failed) \
+	GCDAsyncSocketTraceRecord(TRACE_RING(), (__bridge const void *)self, (type), (int64_t)(value), \
+	                          (failed) ? errno : 0, traceSyscallStart)
+
+#else
+
+#define TRACE_EVENT(type, value)             {}
+#define TRACE_SYSCALL_BEGIN()                {}
+#define TRACE_SYSCALL(type, value, failed)   {}
+
+#endif
+
+static dispatch_queue_t tlsHandshakeQueues[TLS_HANDSHAKE_POOL_MAX_WIDTH];
+static NSUInteger tlsHandshakeQueueCount;
+static atomic_uint_fast32_t tlsHandshakeQueueIndex;
+static atomic_size_t tlsHandshakePoolPendingCount;
+static atomic_size_t tlsHandshakePoolMaxPending;
+static atomic_uint_fast64_t tlsHandshakePoolOverflowCount;
+
+/**
+ * Returns one of the (serial) handshake queues, in round-robin fashion.
+ * There is one queue per active processor (up to a limit),
+ * so handshakes run in parallel without ever using more threads than there are cores.
+**/
+static dispatch_queue_t GCDAsyncSocketNextHandshakeQueue(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		
+		NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+		tlsHandshakeQueueCount = MAX(MIN(processorCount, (NSUInteger)TLS_HANDSHAKE_POOL_MAX_WIDTH), (NSUInteger)1);
+		
+		for (NSUInteger i = 0; i < tlsHandshakeQueueCount; i++)
+		{
+			tlsHandshakeQueues[i] = dispatch_queue_create("GCDAsyncSocket-TLSHandshake", DISPATCH_QUEUE_SERIAL);
+		}
+	});
+	
+	uint_fast32_t index = atomic_fetch_add_explicit(&tlsHandshakeQueueIndex, 1, memory_order_relaxed);
+	
+	return tlsHandshakeQueues[index % tlsHandshakeQueueCount];
+}
+
 #if TARGET_OS_IPHONE
   static NSThread *cfstreamThread;  // Used for CFStreams
 
@@ -201,10 +640,14 @@ enum GCDAsyncSocketConfig
 	
 	uint8_t *readPointer;
 	uint8_t *writePointer;
+	
+	atomic_size_t *byteCounter;
 }
 
 - (instancetype)initWithCapacity:(size_t)numBytes NS_DESIGNATED_INITIALIZER;
 
+- (void)setByteCounter:(atomic_size_t *)counter;
+
 - (void)ensureCapacityForWrite:(size_t)numBytes;
 
 - (size_t)availableBytes;
@@ -248,10 +691,29 @@ enum GCDAsyncSocketConfig
 
 - (void)dealloc
 {
+	[self setByteCounter:NULL];
+	
 	if (preBuffer)
 		free(preBuffer);
 }
 
+/**
+ * Optionally attaches a counter that tracks the number of bytes buffered (across multiple prebuffers).
+ * The currently buffered bytes are moved from the old counter (if any) to the new counter (if any).
+**/
+- (void)setByteCounter:(atomic_size_t *)counter
+{
+	size_t availableBytes = [self availableBytes];
+	
+	if (byteCounter && availableBytes > 0)
+		atomic_fetch_sub_explicit(byteCounter, availableBytes, memory_order_relaxed);
+	
+	byteCounter = counter;
+	
+	if (byteCounter && availableBytes > 0)
+		atomic_fetch_add_explicit(byteCounter, availableBytes, memory_order_relaxed);
+}
+
 - (void)ensureCapacityForWrite:(size_t)numBytes
 {
 	size_t availableSpace = [self availableSpace];
@@ -294,6 +756,9 @@ enum GCDAsyncSocketConfig
 {
 	readPointer += bytesRead;
 	
+	if (byteCounter)
+		atomic_fetch_sub_explicit(byteCounter, bytesRead, memory_order_relaxed);
+	
 	if (readPointer == writePointer)
 	{
 		// The prebuffer has been drained. Reset pointers.
@@ -321,10 +786,16 @@ enum GCDAsyncSocketConfig
 - (void)didWrite:(size_t)bytesWritten
 {
 	writePointer += bytesWritten;
+	
+	if (byteCounter)
+		atomic_fetch_add_explicit(byteCounter, bytesWritten, memory_order_relaxed);
 }
 
 - (void)reset
 {
+	if (byteCounter)
+		atomic_fetch_sub_explicit(byteCounter, [self availableBytes], memory_order_relaxed);
+	
 	readPointer  = preBuffer;
 	writePointer = preBuffer;
 }
@@ -335,6 +806,155 @@ enum GCDAsyncSocketConfig
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * A simple FIFO queue of objects, backed by a ring buffer.
+ * 
+ * Used for the read & write queues (and the packet pools).
+ * Adding to the tail and removing from the head never moves the other elements,
+ * and once the ring has grown to the working size of the queue, neither allocates.
+ * 
+ * The ring grows (doubling in size) as needed, but never shrinks.
+**/
+@interface GCDAsyncSocketPacketQueue : NSObject
+{
+	void **ring;
+	NSUInteger capacity;
+	NSUInteger head;
+	NSUInteger count;
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)numObjects NS_DESIGNATED_INITIALIZER;
+
+- (NSUInteger)count;
+
+- (id)objectAtIndex:(NSUInteger)index;
+
+- (void)addObject:(id)object;
+- (void)insertObject:(id)object atIndex:(NSUInteger)index;
+- (id)removeFirstObject;
+- (void)removeAllObjects;
+
+@end
+
+@implementation GCDAsyncSocketPacketQueue
+
+// Cover the superclass' designated initializer
+- (instancetype)init NS_UNAVAILABLE
+{
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)numObjects
+{
+	if ((self = [super init]))
+	{
+		capacity = 1;
+		while (capacity < numObjects) capacity <<= 1;
+		
+		ring = calloc(capacity, sizeof(void *));
+		head = 0;
+		count = 0;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[self removeAllObjects];
+	free(ring);
+}
+
+- (NSUInteger)count
+{
+	return count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index
+{
+	NSAssert(index < count, @"Index out of bounds");
+	
+	return (__bridge id)ring[(head + index) & (capacity - 1)];
+}
+
+- (void)addObject:(id)object
+{
+	NSAssert(object != nil, @"Cannot add nil object");
+	
+	if (count == capacity)
+	{
+		// Grow the ring, unwrapping the elements in the process
+		
+		NSUInteger newCapacity = capacity << 1;
+		void **newRing = calloc(newCapacity, sizeof(void *));
+		
+		for (NSUInteger i = 0; i < count; i++)
+		{
+			newRing[i] = ring[(head + i) & (capacity - 1)];
+		}
+		
+		free(ring);
+		
+		ring = newRing;
+		capacity = newCapacity;
+		head = 0;
+	}
+	
+	ring[(head + count) & (capacity - 1)] = (__bridge_retained void *)object;
+	count++;
+}
+
+- (void)insertObject:(id)object atIndex:(NSUInteger)index
+{
+	NSAssert(index <= count, @"Index out of bounds");
+	
+	[self addObject:object];
+	
+	// Move the new object from the end into place, shifting the objects after the index back by one
+	
+	void *inserted = ring[(head + count - 1) & (capacity - 1)];
+	
+	for (NSUInteger i = count - 1; i > index; i--)
+	{
+		ring[(head + i) & (capacity - 1)] = ring[(head + i - 1) & (capacity - 1)];
+	}
+	
+	ring[(head + index) & (capacity - 1)] = inserted;
+}
+
+- (id)removeFirstObject
+{
+	if (count == 0) return nil;
+	
+	id object = (__bridge_transfer id)ring[head];
+	ring[head] = NULL;
+	
+	head = (head + 1) & (capacity - 1);
+	count--;
+	
+	return object;
+}
+
+- (void)removeAllObjects
+{
+	while (count > 0)
+	{
+		CFBridgingRelease(ring[head]);
+		ring[head] = NULL;
+		
+		head = (head + 1) & (capacity - 1);
+		count--;
+	}
+	
+	head = 0;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
  * The GCDAsyncReadPacket encompasses the instructions for any given read.
  * The content of a read packet allows the code to determine if we're:
@@ -355,6 +975,9 @@ enum GCDAsyncSocketConfig
 	BOOL bufferOwner;
 	NSUInteger originalBufferLength;
 	long tag;
+	GCDAsyncSocketReadCompletionBlock completion;
+	BOOL completesOnSocketQueue;
+	uint64_t enqueueTime;
 }
 - (instancetype)initWithData:(NSMutableData *)d
                  startOffset:(NSUInteger)s
@@ -364,6 +987,16 @@ enum GCDAsyncSocketConfig
                   terminator:(NSData *)e
                          tag:(long)i NS_DESIGNATED_INITIALIZER;
 
+- (void)reuseWithData:(NSMutableData *)d
+          startOffset:(NSUInteger)s
+            maxLength:(NSUInteger)m
+              timeout:(NSTimeInterval)t
+           readLength:(NSUInteger)l
+           terminator:(NSData *)e
+                  tag:(long)i;
+
+- (void)prepareForReuse;
+
 - (void)ensureCapacityForAdditionalDataOfLength:(NSUInteger)bytesToRead;
 
 - (NSUInteger)optimalReadLengthWithDefault:(NSUInteger)defaultValue shouldPreBuffer:(BOOL *)shouldPreBufferPtr;
@@ -395,35 +1028,63 @@ enum GCDAsyncSocketConfig
 {
 	if((self = [super init]))
 	{
-		bytesDone = 0;
-		maxLength = m;
-		timeout = t;
-		readLength = l;
-		term = [e copy];
-		tag = i;
-		
-		if (d)
-		{
-			buffer = d;
-			startOffset = s;
-			bufferOwner = NO;
-			originalBufferLength = [d length];
-		}
-		else
-		{
-			if (readLength > 0)
-				buffer = [[NSMutableData alloc] initWithLength:readLength];
-			else
-				buffer = [[NSMutableData alloc] initWithLength:0];
-			
-			startOffset = 0;
-			bufferOwner = YES;
-			originalBufferLength = 0;
-		}
+		[self reuseWithData:d startOffset:s maxLength:m timeout:t readLength:l terminator:e tag:i];
 	}
 	return self;
 }
 
+/**
+ * (Re)initializes the packet for a new read.
+ * Used by the designated initializer, and for packets taken from the socket's packet pool.
+**/
+- (void)reuseWithData:(NSMutableData *)d
+          startOffset:(NSUInteger)s
+            maxLength:(NSUInteger)m
+              timeout:(NSTimeInterval)t
+           readLength:(NSUInteger)l
+           terminator:(NSData *)e
+                  tag:(long)i
+{
+	bytesDone = 0;
+	maxLength = m;
+	timeout = t;
+	readLength = l;
+	term = [e copy];
+	tag = i;
+	completion = nil;
+	completesOnSocketQueue = NO;
+	enqueueTime = 0;
+	
+	if (d)
+	{
+		buffer = d;
+		startOffset = s;
+		bufferOwner = NO;
+		originalBufferLength = [d length];
+	}
+	else
+	{
+		if (readLength > 0)
+			buffer = [[NSMutableData alloc] initWithLength:readLength];
+		else
+			buffer = [[NSMutableData alloc] initWithLength:0];
+		
+		startOffset = 0;
+		bufferOwner = YES;
+		originalBufferLength = 0;
+	}
+}
+
+/**
+ * Drops all references held by a finished packet, before it's returned to the socket's packet pool.
+**/
+- (void)prepareForReuse
+{
+	buffer = nil;
+	term = nil;
+	completion = nil;
+}
+
 /**
  * Increases the length of the buffer (if needed) to ensure a read of the given size will fit.
 **/
@@ -812,40 +1473,107 @@ enum GCDAsyncSocketConfig
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * The GCDAsyncWritePacket encompasses the instructions for any given write.
+ * A mutable data object over a region of memory owned by someone else (i.e. a mapped window of a file).
+ * 
+ * NSMutableData itself can't be used for this, as its NoCopy initializers may copy the bytes anyway.
+ * The length may be reduced, but never increased beyond the region.
 **/
-@interface GCDAsyncWritePacket : NSObject
+@interface GCDAsyncMappedBuffer : NSMutableData
 {
-  @public
-	NSData *buffer;
-	NSUInteger bytesDone;
-	long tag;
-	NSTimeInterval timeout;
+	void *regionBytes;
+	NSUInteger regionLength;
+	NSUInteger usedLength;
 }
-- (instancetype)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i NS_DESIGNATED_INITIALIZER;
+- (instancetype)initWithRegionBytes:(void *)bytes length:(NSUInteger)length;
 @end
 
-@implementation GCDAsyncWritePacket
+@implementation GCDAsyncMappedBuffer
 
-// Cover the superclass' designated initializer
-- (instancetype)init NS_UNAVAILABLE
+- (instancetype)initWithRegionBytes:(void *)bytes length:(NSUInteger)length
 {
-	NSAssert(0, @"Use the designated initializer");
-	return nil;
+	if ((self = [super init]))
+	{
+		regionBytes = bytes;
+		regionLength = length;
+		usedLength = length;
+	}
+	return self;
 }
 
-- (instancetype)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
+- (NSUInteger)length
 {
-	if((self = [super init]))
+	return usedLength;
+}
+
+- (const void *)bytes
+{
+	return regionBytes;
+}
+
+- (void *)mutableBytes
+{
+	return regionBytes;
+}
+
+- (void)setLength:(NSUInteger)length
+{
+	NSAssert(length <= regionLength, @"A mapped buffer can't grow beyond its region");
+	
+	usedLength = MIN(length, regionLength);
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * An immutable data object over one contiguous region of a dispatch_data_t.
+ * 
+ * It retains the region (and thus its memory), so the bytes can be written without being copied.
+**/
+@interface GCDAsyncDispatchDataRegion : NSData
+{
+	dispatch_data_t region;
+	const void *regionBytes;
+	NSUInteger regionLength;
+}
+- (instancetype)initWithRegion:(dispatch_data_t)r bytes:(const void *)bytes length:(NSUInteger)length;
+@end
+
+@implementation GCDAsyncDispatchDataRegion
+
+- (instancetype)initWithRegion:(dispatch_data_t)r bytes:(const void *)bytes length:(NSUInteger)length
+{
+	if ((self = [super init]))
 	{
-		buffer = d; // Retain not copy. For performance as documented in header file.
-		bytesDone = 0;
-		timeout = t;
-		tag = i;
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_retain(r);
+		#endif
+		region = r;
+		regionBytes = bytes;
+		regionLength = length;
 	}
 	return self;
 }
 
+- (NSUInteger)length
+{
+	return regionLength;
+}
+
+- (const void *)bytes
+{
+	return regionBytes;
+}
+
+- (void)dealloc
+{
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(region);
+	#endif
+}
 
 @end
 
@@ -854,1713 +1582,2093 @@ enum GCDAsyncSocketConfig
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * The GCDAsyncSpecialPacket encompasses special instructions for interruptions in the read/write queues.
- * This class my be altered to support more than just TLS in the future.
+ * The GCDAsyncFileReadPacket reads a specific length of data into a file, without buffering it in memory.
+ * 
+ * The file is mapped into memory one window at a time, and the window becomes the buffer of a fixed-length read.
+ * Thus the data is read from the socket (or decrypted, or copied from the prebuffer) straight into the file's pages.
+ * 
+ * The readLength and bytesDone ivars are relative to the current window,
+ * which starts windowOffset bytes into the read.
 **/
-@interface GCDAsyncSpecialPacket : NSObject
+@interface GCDAsyncFileReadPacket : GCDAsyncReadPacket
 {
   @public
-	NSDictionary *tlsSettings;
-}
-- (instancetype)initWithTLSSettings:(NSDictionary <NSString*,NSObject*>*)settings NS_DESIGNATED_INITIALIZER;
+	int fileFD;
+	off_t fileOffset;
+	off_t fileLength;
+	off_t windowOffset;
+	void *mappedBytes;
+	size_t mappedLength;
+}
+- (instancetype)initWithFileDescriptor:(int)fd
+                                offset:(off_t)offset
+                                length:(off_t)length
+                               timeout:(NSTimeInterval)t
+                                   tag:(long)i NS_DESIGNATED_INITIALIZER;
+- (off_t)fileBytesDone;
+- (BOOL)isDone;
+- (BOOL)prepareWindow:(NSError **)errPtr;
+- (void)unmapWindow;
 @end
 
-@implementation GCDAsyncSpecialPacket
+@implementation GCDAsyncFileReadPacket
 
 // Cover the superclass' designated initializer
-- (instancetype)init NS_UNAVAILABLE
+- (instancetype)initWithData:(NSMutableData *)d
+                 startOffset:(NSUInteger)s
+                   maxLength:(NSUInteger)m
+                     timeout:(NSTimeInterval)t
+                  readLength:(NSUInteger)l
+                  terminator:(NSData *)e
+                         tag:(long)i NS_UNAVAILABLE
 {
 	NSAssert(0, @"Use the designated initializer");
 	return nil;
 }
 
-- (instancetype)initWithTLSSettings:(NSDictionary <NSString*,NSObject*>*)settings
+- (instancetype)initWithFileDescriptor:(int)fd
+                                offset:(off_t)offset
+                                length:(off_t)length
+                               timeout:(NSTimeInterval)t
+                                   tag:(long)i
 {
-	if((self = [super init]))
+	NSMutableData *emptyBuffer = [NSMutableData data];
+	
+	if((self = [super initWithData:emptyBuffer startOffset:0 maxLength:0 timeout:t readLength:0 terminator:nil tag:i]))
 	{
-		tlsSettings = [settings copy];
+		fileFD = fd;
+		fileOffset = offset;
+		fileLength = length;
+		windowOffset = 0;
+		mappedBytes = NULL;
+		mappedLength = 0;
+		
+		// The buffer is mapped in prepareWindow:
+		readLength = (NSUInteger)MIN(length, (off_t)FILE_MAPPING_WINDOW_SIZE);
 	}
 	return self;
 }
 
+- (void)unmapWindow
+{
+	buffer = nil;
+	
+	if (mappedBytes)
+	{
+		munmap(mappedBytes, mappedLength);
+		mappedBytes = NULL;
+		mappedLength = 0;
+	}
+}
 
-@end
+- (void)dealloc
+{
+	[self unmapWindow];
+}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark -
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (off_t)fileBytesDone
+{
+	return windowOffset + (off_t)bytesDone;
+}
 
-@implementation GCDAsyncSocket
+- (BOOL)isDone
 {
-	uint32_t flags;
-	uint16_t config;
+	return ([self fileBytesDone] == fileLength);
+}
+
+- (NSError *)errorWithReason:(NSString *)reason
+{
+	int err = errno;
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(err)];
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg,
+	                           NSLocalizedFailureReasonErrorKey : reason};
 	
-	__weak id<GCDAsyncSocketDelegate> delegate;
-	dispatch_queue_t delegateQueue;
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:userInfo];
+}
+
+/**
+ * Readies the packet for the next read.
+ * 
+ * If the current window has been filled, this maps the next window of the file into the buffer.
+ * The file is extended first if it's too short to hold the data, as a mapping can't extend the file.
+**/
+- (BOOL)prepareWindow:(NSError **)errPtr
+{
+	if (mappedBytes && (bytesDone < readLength))
+	{
+		// Still filling the current window
+		return YES;
+	}
 	
-	int socket4FD;
-	int socket6FD;
-	int socketUN;
-	NSURL *socketUrl;
-	int stateIndex;
-	NSData * connectInterface4;
-	NSData * connectInterface6;
-	NSData * connectInterfaceUN;
+	if (mappedBytes == NULL && windowOffset == 0)
+	{
+		struct stat st;
+		
+		if (fstat(fileFD, &st) < 0)
+		{
+			if (errPtr) *errPtr = [self errorWithReason:@"Error in fstat() function"];
+			return NO;
+		}
+		
+		if ((st.st_size < fileOffset + fileLength) && (ftruncate(fileFD, fileOffset + fileLength) < 0))
+		{
+			if (errPtr) *errPtr = [self errorWithReason:@"Error in ftruncate() function"];
+			return NO;
+		}
+	}
 	
-	dispatch_queue_t socketQueue;
+	windowOffset += (off_t)bytesDone;
+	bytesDone = 0;
 	
-	dispatch_source_t accept4Source;
-	dispatch_source_t accept6Source;
-	dispatch_source_t acceptUNSource;
-	dispatch_source_t connectTimer;
-	dispatch_source_t readSource;
-	dispatch_source_t writeSource;
-	dispatch_source_t readTimer;
-	dispatch_source_t writeTimer;
+	[self unmapWindow];
+	
+	if (windowOffset == fileLength)
+	{
+		return YES;
+	}
 	
-	NSMutableArray *readQueue;
-	NSMutableArray *writeQueue;
+	// mmap requires a page aligned offset
 	
-	GCDAsyncReadPacket *currentRead;
-	GCDAsyncWritePacket *currentWrite;
+	const off_t pageSize = (off_t)getpagesize();
 	
-	unsigned long socketFDBytesAvailable;
+	off_t position = fileOffset + windowOffset;
+	off_t alignedPosition = position - (position % pageSize);
 	
-	GCDAsyncSocketPreBuffer *preBuffer;
-		
-#if TARGET_OS_IPHONE
-	CFStreamClientContext streamContext;
-	CFReadStreamRef readStream;
-	CFWriteStreamRef writeStream;
-#endif
-	SSLContextRef sslContext;
-	GCDAsyncSocketPreBuffer *sslPreBuffer;
-	size_t sslWriteCachedLength;
-	OSStatus sslErrCode;
-    OSStatus lastSSLHandshakeError;
+	size_t padding = (size_t)(position - alignedPosition);
+	size_t length = (size_t)MIN(fileLength - windowOffset, (off_t)FILE_MAPPING_WINDOW_SIZE);
 	
-	void *IsOnSocketQueueOrTargetQueueKey;
+	void *bytes = mmap(NULL, padding + length, PROT_READ | PROT_WRITE, MAP_SHARED, fileFD, alignedPosition);
 	
-	id userData;
-    NSTimeInterval alternateAddressDelay;
+	if (bytes == MAP_FAILED)
+	{
+		if (errPtr) *errPtr = [self errorWithReason:@"Error in mmap() function"];
+		return NO;
+	}
+	
+	mappedBytes = bytes;
+	mappedLength = padding + length;
+	
+	buffer = [[GCDAsyncMappedBuffer alloc] initWithRegionBytes:((uint8_t *)bytes + padding) length:length];
+	originalBufferLength = length;
+	readLength = length;
+	
+	return YES;
 }
 
-- (instancetype)init
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncWritePacket encompasses the instructions for any given write.
+**/
+@interface GCDAsyncWritePacket : NSObject
 {
-	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:NULL];
+  @public
+	NSData *buffer;
+	NSUInteger bytesDone;
+	long tag;
+	NSTimeInterval timeout;
+	GCDAsyncSocketWriteCompletionBlock completion;
+	BOOL completesOnSocketQueue;
+	NSUInteger queuedLength;
+	GCDAsyncSocketWritePriority priority;
+	NSUInteger bypassCount;
+	BOOL continuedByNext;
+	uint64_t enqueueTime;
 }
+- (instancetype)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i NS_DESIGNATED_INITIALIZER;
+- (void)reuseWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i;
+- (void)prepareForReuse;
+@end
 
-- (instancetype)initWithSocketQueue:(dispatch_queue_t)sq
+@implementation GCDAsyncWritePacket
+
+// Cover the superclass' designated initializer
+- (instancetype)init NS_UNAVAILABLE
 {
-	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:sq];
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
 }
 
-- (instancetype)initWithDelegate:(id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(dispatch_queue_t)dq
+- (instancetype)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
 {
-	return [self initWithDelegate:aDelegate delegateQueue:dq socketQueue:NULL];
+	if((self = [super init]))
+	{
+		[self reuseWithData:d timeout:t tag:i];
+	}
+	return self;
 }
 
-- (instancetype)initWithDelegate:(id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(dispatch_queue_t)dq socketQueue:(dispatch_queue_t)sq
+- (void)reuseWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
 {
-	if((self = [super init]))
+	buffer = d; // Retain not copy. For performance as documented in header file.
+	bytesDone = 0;
+	timeout = t;
+	tag = i;
+	completion = nil;
+	completesOnSocketQueue = NO;
+	queuedLength = 0;
+	priority = GCDAsyncSocketWritePriorityDefault;
+	bypassCount = 0;
+	continuedByNext = NO;
+	enqueueTime = 0;
+}
+
+- (void)prepareForReuse
+{
+	buffer = nil;
+	completion = nil;
+}
+
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncFileWritePacket writes a range of a file, without reading the file into memory.
+ * 
+ * On plaintext sockets the file is handed to the kernel via sendfile(), and the buffer stays nil.
+ * Otherwise the file is mapped into memory one window at a time, and the window becomes the buffer,
+ * which is written just like the buffer of any other write packet.
+ * 
+ * Either way, bytesDone is relative to windowOffset (the number of bytes of the range written before the window).
+**/
+@interface GCDAsyncFileWritePacket : GCDAsyncWritePacket
+{
+  @public
+	int fileFD;
+	BOOL closeFileWhenDone;
+	BOOL usesSendfile;
+	off_t fileOffset;
+	off_t fileLength;
+	off_t windowOffset;
+	void *mappedBytes;
+	size_t mappedLength;
+	NSError *fileError;
+}
+- (instancetype)initWithFileDescriptor:(int)fd
+                         closeWhenDone:(BOOL)closeWhenDone
+                                offset:(off_t)offset
+                                length:(off_t)length
+                               timeout:(NSTimeInterval)t
+                                   tag:(long)i NS_DESIGNATED_INITIALIZER;
+- (off_t)fileBytesDone;
+- (BOOL)isDone;
+- (BOOL)prepareWindow:(NSError **)errPtr;
+@end
+
+@implementation GCDAsyncFileWritePacket
+
+// Cover the superclass' designated initializer
+- (instancetype)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i NS_UNAVAILABLE
+{
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
+}
+
+- (instancetype)initWithFileDescriptor:(int)fd
+                         closeWhenDone:(BOOL)closeWhenDone
+                                offset:(off_t)offset
+                                length:(off_t)length
+                               timeout:(NSTimeInterval)t
+                                   tag:(long)i
+{
+	if((self = [super initWithData:nil timeout:t tag:i]))
 	{
-		delegate = aDelegate;
-		delegateQueue = dq;
+		fileFD = fd;
+		closeFileWhenDone = closeWhenDone;
+		fileOffset = offset;
+		fileLength = length;
+		windowOffset = 0;
+		mappedBytes = NULL;
+		mappedLength = 0;
 		
-		#if !OS_OBJECT_USE_OBJC
-		if (dq) dispatch_retain(dq);
+		#if TARGET_OS_IPHONE
+		usesSendfile = NO;
+		#else
+		usesSendfile = YES;
 		#endif
-		
-		socket4FD = SOCKET_NULL;
-		socket6FD = SOCKET_NULL;
-		socketUN = SOCKET_NULL;
-		socketUrl = nil;
-		stateIndex = 0;
-		
-		if (sq)
-		{
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			
-			socketQueue = sq;
-			#if !OS_OBJECT_USE_OBJC
-			dispatch_retain(sq);
-			#endif
-		}
-		else
-		{
-			socketQueue = dispatch_queue_create([GCDAsyncSocketQueueName UTF8String], NULL);
-		}
-		
-		// The dispatch_queue_set_specific() and dispatch_get_specific() functions take a "void *key" parameter.
-		// From the documentation:
-		//
-		// > Keys are only compared as pointers and are never dereferenced.
-		// > Thus, you can use a pointer to a static variable for a specific subsystem or
-		// > any other value that allows you to identify the value uniquely.
-		//
-		// We're just going to use the memory address of an ivar.
-		// Specifically an ivar that is explicitly named for our purpose to make the code more readable.
-		//
-		// However, it feels tedious (and less readable) to include the "&" all the time:
-		// dispatch_get_specific(&IsOnSocketQueueOrTargetQueueKey)
-		//
-		// So we're going to make it so it doesn't matter if we use the '&' or not,
-		// by assigning the value of the ivar to the address of the ivar.
-		// Thus: IsOnSocketQueueOrTargetQueueKey == &IsOnSocketQueueOrTargetQueueKey;
-		
-		IsOnSocketQueueOrTargetQueueKey = &IsOnSocketQueueOrTargetQueueKey;
-		
-		void *nonNullUnusedPointer = (__bridge void *)self;
-		dispatch_queue_set_specific(socketQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
-		
-		readQueue = [[NSMutableArray alloc] initWithCapacity:5];
-		currentRead = nil;
-		
-		writeQueue = [[NSMutableArray alloc] initWithCapacity:5];
-		currentWrite = nil;
-		
-		preBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
-        alternateAddressDelay = 0.3;
 	}
 	return self;
 }
 
+- (void)unmapWindow
+{
+	buffer = nil;
+	
+	if (mappedBytes)
+	{
+		munmap(mappedBytes, mappedLength);
+		mappedBytes = NULL;
+		mappedLength = 0;
+	}
+}
+
 - (void)dealloc
 {
-	LogInfo(@"%@ - %@ (start)", THIS_METHOD, self);
+	[self unmapWindow];
 	
-	// Set dealloc flag.
-	// This is used by closeWithError to ensure we don't accidentally retain ourself.
-	flags |= kDealloc;
+	if (closeFileWhenDone && fileFD >= 0)
+	{
+		close(fileFD);
+	}
+}
+
+- (off_t)fileBytesDone
+{
+	return windowOffset + (off_t)bytesDone;
+}
+
+- (BOOL)isDone
+{
+	return ([self fileBytesDone] == fileLength);
+}
+
+/**
+ * Readies the packet for the next write.
+ * 
+ * If the packet doesn't use sendfile, and the current window has been entirely written,
+ * this maps the next window of the file into the buffer.
+**/
+- (BOOL)prepareWindow:(NSError **)errPtr
+{
+	if (fileError)
+	{
+		if (errPtr) *errPtr = fileError;
+		return NO;
+	}
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (buffer && (bytesDone < [buffer length]))
 	{
-		[self closeWithError:nil];
+		// Still writing the current window
+		return YES;
 	}
-	else
+	
+	windowOffset += (off_t)bytesDone;
+	bytesDone = 0;
+	
+	[self unmapWindow];
+	
+	if (usesSendfile || (windowOffset == fileLength))
 	{
-		dispatch_sync(socketQueue, ^{
-			[self closeWithError:nil];
-		});
+		return YES;
 	}
 	
-	delegate = nil;
+	// mmap requires a page aligned offset
 	
-	#if !OS_OBJECT_USE_OBJC
-	if (delegateQueue) dispatch_release(delegateQueue);
-	#endif
-	delegateQueue = NULL;
+	const off_t pageSize = (off_t)getpagesize();
 	
-	#if !OS_OBJECT_USE_OBJC
-	if (socketQueue) dispatch_release(socketQueue);
-	#endif
-	socketQueue = NULL;
+	off_t position = fileOffset + windowOffset;
+	off_t alignedPosition = position - (position % pageSize);
 	
-	LogInfo(@"%@ - %@ (finish)", THIS_METHOD, self);
+	size_t padding = (size_t)(position - alignedPosition);
+	size_t length = (size_t)MIN(fileLength - windowOffset, (off_t)FILE_MAPPING_WINDOW_SIZE);
+	
+	void *bytes = mmap(NULL, padding + length, PROT_READ, MAP_SHARED, fileFD, alignedPosition);
+	
+	if (bytes == MAP_FAILED)
+	{
+		if (errPtr)
+		{
+			int err = errno;
+			NSString *errMsg = [NSString stringWithUTF8String:strerror(err)];
+			NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg,
+			                           NSLocalizedFailureReasonErrorKey : @"Error in mmap() function"};
+			
+			*errPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:userInfo];
+		}
+		return NO;
+	}
+	
+	mappedBytes = bytes;
+	mappedLength = padding + length;
+	
+	buffer = [NSData dataWithBytesNoCopy:((uint8_t *)bytes + padding) length:length freeWhenDone:NO];
+	return YES;
 }
 
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-+ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD socketQueue:(nullable dispatch_queue_t)sq error:(NSError**)error {
-  return [self socketFromConnectedSocketFD:socketFD delegate:nil delegateQueue:NULL socketQueue:sq error:error];
+/**
+ * The GCDAsyncSpecialPacket encompasses special instructions for interruptions in the read/write queues.
+ * This class my be altered to support more than just TLS in the future.
+**/
+@interface GCDAsyncSpecialPacket : NSObject
+{
+  @public
+	NSDictionary *tlsSettings;
 }
+- (instancetype)initWithTLSSettings:(NSDictionary <NSString*,NSObject*>*)settings NS_DESIGNATED_INITIALIZER;
+@end
 
-+ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD delegate:(nullable id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(nullable dispatch_queue_t)dq error:(NSError**)error {
-  return [self socketFromConnectedSocketFD:socketFD delegate:aDelegate delegateQueue:dq socketQueue:NULL error:error];
-}
+@implementation GCDAsyncSpecialPacket
 
-+ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD delegate:(nullable id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(nullable dispatch_queue_t)dq socketQueue:(nullable dispatch_queue_t)sq error:(NSError* __autoreleasing *)error
+// Cover the superclass' designated initializer
+- (instancetype)init NS_UNAVAILABLE
 {
-  __block BOOL errorOccured = NO;
-  __block NSError *thisError = nil;
-  
-  GCDAsyncSocket *socket = [[[self class] alloc] initWithDelegate:aDelegate delegateQueue:dq socketQueue:sq];
-  
-  dispatch_sync(socket->socketQueue, ^{ @autoreleasepool {
-    struct sockaddr addr;
-    socklen_t addr_size = sizeof(struct sockaddr);
-    int retVal = getpeername(socketFD, (struct sockaddr *)&addr, &addr_size);
-    if (retVal)
-    {
-      NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketOtherError",
-                                                           @"GCDAsyncSocket", [NSBundle mainBundle],
-                                                           @"Attempt to create socket from socket FD failed. getpeername() failed", nil);
-      
-      NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
-
-      errorOccured = YES;
-      thisError = [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
-      return;
-    }
-    
-    if (addr.sa_family == AF_INET)
-    {
-      socket->socket4FD = socketFD;
-    }
-    else if (addr.sa_family == AF_INET6)
-    {
-      socket->socket6FD = socketFD;
-    }
-    else
-    {
-      NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketOtherError",
-                                                           @"GCDAsyncSocket", [NSBundle mainBundle],
-                                                           @"Attempt to create socket from socket FD failed. socket FD is neither IPv4 nor IPv6", nil);
-      
-      NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
-      
-      errorOccured = YES;
-      thisError = [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
-      return;
-    }
-    
-    socket->flags = kSocketStarted;
-    [socket didConnect:socket->stateIndex];
-  }});
-  
-  if (error && thisError) {
-    *error = thisError;
-  }
-  
-  return errorOccured? nil: socket;
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Configuration
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (id)delegate
+- (instancetype)initWithTLSSettings:(NSDictionary <NSString*,NSObject*>*)settings
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return delegate;
-	}
-	else
+	if((self = [super init]))
 	{
-		__block id result;
-		
-		dispatch_sync(socketQueue, ^{
-            result = self->delegate;
-		});
-		
-		return result;
+		tlsSettings = [settings copy];
 	}
+	return self;
 }
 
-- (void)setDelegate:(id)newDelegate synchronously:(BOOL)synchronously
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncSocketSSLHandshakeIO is the SSLConnectionRef of sockets that use the handshake pool.
+ * 
+ * While a handshake step is executing on the handshake pool, the socket's state must not be touched.
+ * So SecureTransport's IO is redirected to a pair of private buffers:
+ * the socket fills the input buffer with encrypted data before submitting the step,
+ * and flushes the output buffer to the socket after the step completes.
+ * 
+ * At all other times, IO is forwarded to the socket as usual.
+**/
+@interface GCDAsyncSocketSSLHandshakeIO : NSObject
 {
-	dispatch_block_t block = ^{
-        self->delegate = newDelegate;
-	};
+  @public
+	__unsafe_unretained GCDAsyncSocket *socket;
+	SSLContextRef sslContext;
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
-	}
-	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
-	}
+	GCDAsyncSocketPreBuffer *inBuffer;
+	GCDAsyncSocketPreBuffer *outBuffer;
+	BOOL inputClosed;
+	
+	BOOL offSocketQueue;
+	
+	BOOL hasPendingStatus;
+	OSStatus pendingStatus;
 }
+- (instancetype)initWithSocket:(GCDAsyncSocket *)socket sslContext:(SSLContextRef)context NS_DESIGNATED_INITIALIZER;
+@end
 
-- (void)setDelegate:(id<GCDAsyncSocketDelegate>)newDelegate
-{
-	[self setDelegate:newDelegate synchronously:NO];
-}
+@implementation GCDAsyncSocketSSLHandshakeIO
 
-- (void)synchronouslySetDelegate:(id<GCDAsyncSocketDelegate>)newDelegate
+// Cover the superclass' designated initializer
+- (instancetype)init NS_UNAVAILABLE
 {
-	[self setDelegate:newDelegate synchronously:YES];
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
 }
 
-- (dispatch_queue_t)delegateQueue
+- (instancetype)initWithSocket:(GCDAsyncSocket *)aSocket sslContext:(SSLContextRef)context
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if ((self = [super init]))
 	{
-		return delegateQueue;
-	}
-	else
-	{
-		__block dispatch_queue_t result;
+		socket = aSocket;
 		
-		dispatch_sync(socketQueue, ^{
-            result = self->delegateQueue;
-		});
+		// The context must outlive any handshake step that is executing on the pool,
+		// even if the socket is closed (and releases its reference) in the meantime.
+		sslContext = (SSLContextRef)CFRetain(context);
 		
-		return result;
+		inBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+		outBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
 	}
+	return self;
 }
 
-- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+- (void)dealloc
 {
-	dispatch_block_t block = ^{
-		
-		#if !OS_OBJECT_USE_OBJC
-        if (self->delegateQueue) dispatch_release(self->delegateQueue);
-		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
-		#endif
-		
-        self->delegateQueue = newDelegateQueue;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
-	}
-	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
-	}
+	if (sslContext)
+		CFRelease(sslContext);
 }
 
-- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncSocketRelay is the state of one direction of a relay (see relayTo:bidirectional:completion:).
+ * 
+ * Its reads complete on the source's socketQueue, and its writes on the destination's socketQueue,
+ * so the state shared between the two is protected by a lock.
+ * The relay retains both sockets until it has finished.
+**/
+@interface GCDAsyncSocketRelay : NSObject
 {
-	[self setDelegateQueue:newDelegateQueue synchronously:NO];
-}
+  @public
+	GCDAsyncSocket *source;
+	GCDAsyncSocket *destination;
+	GCDAsyncSocketRelayCompletionBlock completion;
+	
+	pthread_mutex_t lock;
+	
+	GCDAsyncReadPacket *pendingRead; // The relay's read, while it's queued on the source
+	NSUInteger bytesInFlight;
+	NSUInteger writesInFlight;
+	uint64_t bytesRelayed;
+	BOOL readPending;
+	BOOL sourceDidEnd;
+	BOOL finished;
+}
+- (instancetype)initWithSource:(GCDAsyncSocket *)source
+                   destination:(GCDAsyncSocket *)destination
+                    completion:(GCDAsyncSocketRelayCompletionBlock)completion NS_DESIGNATED_INITIALIZER;
+@end
 
-- (void)synchronouslySetDelegateQueue:(dispatch_queue_t)newDelegateQueue
+@implementation GCDAsyncSocketRelay
+
+// Cover the superclass' designated initializer
+- (instancetype)init NS_UNAVAILABLE
 {
-	[self setDelegateQueue:newDelegateQueue synchronously:YES];
+	NSAssert(0, @"Use the designated initializer");
+	return nil;
 }
 
-- (void)getDelegate:(id<GCDAsyncSocketDelegate> *)delegatePtr delegateQueue:(dispatch_queue_t *)delegateQueuePtr
+- (instancetype)initWithSource:(GCDAsyncSocket *)aSource
+                   destination:(GCDAsyncSocket *)aDestination
+                    completion:(GCDAsyncSocketRelayCompletionBlock)aCompletion
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (delegatePtr) *delegatePtr = delegate;
-		if (delegateQueuePtr) *delegateQueuePtr = delegateQueue;
-	}
-	else
+	if ((self = [super init]))
 	{
-		__block id dPtr = NULL;
-		__block dispatch_queue_t dqPtr = NULL;
+		source = aSource;
+		destination = aDestination;
+		completion = [aCompletion copy];
 		
-		dispatch_sync(socketQueue, ^{
-            dPtr = self->delegate;
-            dqPtr = self->delegateQueue;
-		});
-		
-		if (delegatePtr) *delegatePtr = dPtr;
-		if (delegateQueuePtr) *delegateQueuePtr = dqPtr;
+		pthread_mutex_init(&lock, NULL);
 	}
+	return self;
 }
 
-- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+- (void)dealloc
 {
-	dispatch_block_t block = ^{
-		
-        self->delegate = newDelegate;
-		
-		#if !OS_OBJECT_USE_OBJC
-        if (self->delegateQueue) dispatch_release(self->delegateQueue);
-		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
-		#endif
-		
-        self->delegateQueue = newDelegateQueue;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
-	}
-	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
-	}
+	pthread_mutex_destroy(&lock);
 }
 
-- (void)setDelegate:(id<GCDAsyncSocketDelegate>)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
-{
-	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:NO];
-}
+@end
 
-- (void)synchronouslySetDelegate:(id<GCDAsyncSocketDelegate>)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
-{
-	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:YES];
-}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-- (BOOL)isIPv4Enabled
+@interface GCDAsyncSocket () <GCDAsyncSocketRegistryEntry>
+
+// For GCDAsyncSocketBroadcastGroup
+- (dispatch_queue_t)broadcastQueue;
+- (BOOL)enqueueBroadcastData:(NSData *)data
+                     timeout:(NSTimeInterval)timeout
+                         tag:(long)tag
+                      maxLag:(NSUInteger)maxLag
+                         lag:(NSUInteger *)lagPtr;
+
+@end
+
+@implementation GCDAsyncSocket
 {
-	// Note: YES means kIPv4Disabled is OFF
+	uint32_t flags;
+	uint16_t config;
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return ((config & kIPv4Disabled) == 0);
-	}
-	else
-	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-            result = ((self->config & kIPv4Disabled) == 0);
-		});
+	__weak id<GCDAsyncSocketDelegate> delegate;
+	dispatch_queue_t delegateQueue;
+	
+	int socket4FD;
+	int socket6FD;
+	int socketUN;
+	NSURL *socketUrl;
+	int stateIndex;
+	NSData * connectInterface4;
+	NSData * connectInterface6;
+	NSData * connectInterfaceUN;
+	
+	dispatch_queue_t socketQueue;
+	
+	dispatch_source_t accept4Source;
+	dispatch_source_t accept6Source;
+	dispatch_source_t acceptUNSource;
+	dispatch_source_t connectTimer;
+	dispatch_source_t readSource;
+	dispatch_source_t writeSource;
+	dispatch_source_t readTimer;
+	
+	int *socketFDRefCount;
+	
+	NSUInteger delegateCalloutDepth;
+	
+	GCDAsyncSocketRelay *outgoingRelay;
+	atomic_uint_fast64_t relayedByteCount;
+	
+	__unsafe_unretained Class delegateClass;
+	BOOL delegateIsProxy;
+	uint16_t delegateCapabilities;
+	GCDAsyncSocketDidReadDataIMP delegateDidReadData;
+	GCDAsyncSocketDidWriteDataIMP delegateDidWriteData;
+	
+	dispatch_queue_t completionQueue;
+	dispatch_source_t writeTimer;
+	
+	GCDAsyncSocketPacketQueue *readQueue;
+	GCDAsyncSocketPacketQueue *writeQueue;
+	
+	GCDAsyncSocketPacketQueue *readPacketPool;
+	GCDAsyncSocketPacketQueue *writePacketPool;
+	pthread_mutex_t packetPoolLock;
+	NSUInteger packetAllocationCount;
+	
+	GCDAsyncReadPacket *currentRead;
+	GCDAsyncWritePacket *currentWrite;
+	
+	unsigned long socketFDBytesAvailable;
+	NSUInteger readLengthEstimate;
+	NSUInteger maxReadLength;
+	
+	NSUInteger readDrainByteBudget;
+	NSUInteger readDrainOperationBudget;
+	NSUInteger readDrainBytes;
+	NSUInteger readDrainOperations;
+	
+	NSUInteger maxReceiveLowWaterMark;
+	int receiveLowWaterMark;
+	int receiveBufferSize;
+	
+	NSUInteger largeWriteThreshold;
+	NSUInteger largeWriteSendBufferSize;
+	
+	atomic_uint_fast64_t queuedWriteByteCount;
+	atomic_uint_fast64_t writeQueueHighWatermark;
+	atomic_uint_fast64_t writeQueueLowWatermark;
+	atomic_uint_fast64_t maxQueuedWriteBytes;
+	atomic_bool writeQueueAboveHighWatermark;
+	
+	atomic_bool synchronousWrites;
+	atomic_uint_fast32_t pendingWriteEnqueueCount; // Write-side blocks (writes, startTLS) dispatched but not yet run
+	
+	GCDAsyncSocketStatisticsCounters *statistics;        // Non-NULL while recording (socketQueue only)
+	GCDAsyncSocketStatisticsCounters *_Atomic statisticsStorage; // Allocated once enabled, read by statisticsSnapshot
+	
+#if GCDAsyncSocketTracingEnabled
+	GCDAsyncSocketTraceRing *traceRing; // Owned by the socketQueue (attached on the first event, see TRACE_RING)
+#endif
+	
+	pthread_mutex_t tcpInfoLock;
+	GCDAsyncSocketTCPInfo lastTCPInfo;
+	NSTimeInterval tcpInfoSamplingInterval;
+	dispatch_source_t tcpInfoTimer;
+	
+	GCDAsyncSocketPreBuffer *preBuffer;
 		
-		return result;
-	}
+#if TARGET_OS_IPHONE
+	CFStreamClientContext streamContext;
+	CFReadStreamRef readStream;
+	CFWriteStreamRef writeStream;
+#endif
+	SSLContextRef sslContext;
+	GCDAsyncSocketPreBuffer *sslPreBuffer;
+	size_t sslWriteCachedLength;
+	size_t maxDecryptedPreBufferSize;
+	size_t maxEncryptedPreBufferSize;
+	NSUInteger decryptedPreBufferCapHitCount;
+	NSUInteger encryptedPreBufferCapHitCount;
+	GCDAsyncSocketSSLHandshakeIO *sslHandshakeIO;
+	size_t sslSmallRecordSize;
+	uint64_t sslRecordSizeBoostThreshold;
+	uint64_t sslRecordSizeIdleTimeout;
+	uint64_t sslBytesWrittenSinceIdle;
+	uint64_t sslLastWriteTime;
+	OSStatus sslErrCode;
+    OSStatus lastSSLHandshakeError;
+	
+	void *IsOnSocketQueueOrTargetQueueKey;
+	
+	id userData;
+    NSTimeInterval alternateAddressDelay;
 }
 
-- (void)setIPv4Enabled:(BOOL)flag
+- (instancetype)init
 {
-	// Note: YES means kIPv4Disabled is OFF
-	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-            self->config &= ~kIPv4Disabled;
-		else
-            self->config |= kIPv4Disabled;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:NULL];
 }
 
-- (BOOL)isIPv6Enabled
+- (instancetype)initWithSocketQueue:(dispatch_queue_t)sq
 {
-	// Note: YES means kIPv6Disabled is OFF
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return ((config & kIPv6Disabled) == 0);
-	}
-	else
-	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-            result = ((self->config & kIPv6Disabled) == 0);
-		});
-		
-		return result;
-	}
+	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:sq];
 }
 
-- (void)setIPv6Enabled:(BOOL)flag
+- (instancetype)initWithDelegate:(id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(dispatch_queue_t)dq
 {
-	// Note: YES means kIPv6Disabled is OFF
-	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-            self->config &= ~kIPv6Disabled;
-		else
-            self->config |= kIPv6Disabled;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	return [self initWithDelegate:aDelegate delegateQueue:dq socketQueue:NULL];
 }
 
-- (BOOL)isIPv4PreferredOverIPv6
+- (instancetype)initWithDelegate:(id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(dispatch_queue_t)dq socketQueue:(dispatch_queue_t)sq
 {
-	// Note: YES means kPreferIPv6 is OFF
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return ((config & kPreferIPv6) == 0);
-	}
-	else
+	if((self = [super init]))
 	{
-		__block BOOL result;
+		delegate = aDelegate;
+		delegateQueue = dq;
 		
-		dispatch_sync(socketQueue, ^{
-            result = ((self->config & kPreferIPv6) == 0);
-		});
+		[self updateDelegateCapabilities:aDelegate];
 		
-		return result;
+		#if !OS_OBJECT_USE_OBJC
+		if (dq) dispatch_retain(dq);
+		#endif
+		
+		socket4FD = SOCKET_NULL;
+		socket6FD = SOCKET_NULL;
+		socketUN = SOCKET_NULL;
+		socketUrl = nil;
+		stateIndex = 0;
+		
+		if (sq)
+		{
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			
+			socketQueue = sq;
+			#if !OS_OBJECT_USE_OBJC
+			dispatch_retain(sq);
+			#endif
+		}
+		else
+		{
+			socketQueue = dispatch_queue_create([GCDAsyncSocketQueueName UTF8String], NULL);
+		}
+		
+		// The dispatch_queue_set_specific() and dispatch_get_specific() functions take a "void *key" parameter.
+		// From the documentation:
+		//
+		// > Keys are only compared as pointers and are never dereferenced.
+		// > Thus, you can use a pointer to a static variable for a specific subsystem or
+		// > any other value that allows you to identify the value uniquely.
+		//
+		// We're just going to use the memory address of an ivar.
+		// Specifically an ivar that is explicitly named for our purpose to make the code more readable.
+		//
+		// However, it feels tedious (and less readable) to include the "&" all the time:
+		// dispatch_get_specific(&IsOnSocketQueueOrTargetQueueKey)
+		//
+		// So we're going to make it so it doesn't matter if we use the '&' or not,
+		// by assigning the value of the ivar to the address of the ivar.
+		// Thus: IsOnSocketQueueOrTargetQueueKey == &IsOnSocketQueueOrTargetQueueKey;
+		
+		IsOnSocketQueueOrTargetQueueKey = &IsOnSocketQueueOrTargetQueueKey;
+		
+		void *nonNullUnusedPointer = (__bridge void *)self;
+		dispatch_queue_set_specific(socketQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
+		
+		readQueue = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:8];
+		currentRead = nil;
+		
+		writeQueue = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:8];
+		currentWrite = nil;
+		
+		readPacketPool = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:PACKET_POOL_CAPACITY];
+		writePacketPool = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:PACKET_POOL_CAPACITY];
+		pthread_mutex_init(&packetPoolLock, NULL);
+		
+		pthread_mutex_init(&tcpInfoLock, NULL);
+		
+		preBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+		
+		readLengthEstimate = ADAPTIVE_READ_LENGTH_INITIAL;
+		maxReadLength = ADAPTIVE_READ_LENGTH_MAX;
+		
+		readDrainByteBudget = READ_DRAIN_BYTE_BUDGET;
+		readDrainOperationBudget = READ_DRAIN_OPERATION_BUDGET;
+		
+		receiveLowWaterMark = 1;
+		largeWriteSendBufferSize = LARGE_WRITE_SEND_BUFFER_SIZE;
+        alternateAddressDelay = 0.3;
+		
+		[[GCDAsyncSocketRegistry sharedRegistry] registerSocket:self];
 	}
+	return self;
 }
 
-- (void)setIPv4PreferredOverIPv6:(BOOL)flag
+- (void)dealloc
 {
-	// Note: YES means kPreferIPv6 is OFF
+	LogInfo(@"%@ - %@ (start)", THIS_METHOD, self);
 	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-            self->config &= ~kPreferIPv6;
-		else
-            self->config |= kPreferIPv6;
-	};
+	// Set dealloc flag.
+	// This is used by closeWithError to ensure we don't accidentally retain ourself.
+	flags |= kDealloc;
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
+	{
+		[self closeWithError:nil];
+	}
 	else
-		dispatch_async(socketQueue, block);
+	{
+		dispatch_sync(socketQueue, ^{
+			[self closeWithError:nil];
+		});
+	}
+	
+	delegate = nil;
+	
+	#if !OS_OBJECT_USE_OBJC
+	if (delegateQueue) dispatch_release(delegateQueue);
+	#endif
+	delegateQueue = NULL;
+	
+	#if !OS_OBJECT_USE_OBJC
+	if (completionQueue) dispatch_release(completionQueue);
+	#endif
+	completionQueue = NULL;
+	
+	#if !OS_OBJECT_USE_OBJC
+	if (socketQueue) dispatch_release(socketQueue);
+	#endif
+	socketQueue = NULL;
+	
+	pthread_mutex_destroy(&packetPoolLock);
+	
+	free(atomic_load(&statisticsStorage));
+	
+	if (tcpInfoTimer)
+	{
+		dispatch_source_cancel(tcpInfoTimer);
+		tcpInfoTimer = NULL;
+	}
+	pthread_mutex_destroy(&tcpInfoLock);
+	
+	LogInfo(@"%@ - %@ (finish)", THIS_METHOD, self);
 }
 
-- (NSTimeInterval) alternateAddressDelay {
-    __block NSTimeInterval delay;
-    dispatch_block_t block = ^{
-        delay = self->alternateAddressDelay;
-    };
-    if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-        block();
-    else
-        dispatch_sync(socketQueue, block);
-    return delay;
+#pragma mark -
+
++ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD socketQueue:(nullable dispatch_queue_t)sq error:(NSError**)error {
+  return [self socketFromConnectedSocketFD:socketFD delegate:nil delegateQueue:NULL socketQueue:sq error:error];
 }
 
-- (void) setAlternateAddressDelay:(NSTimeInterval)delay {
-    dispatch_block_t block = ^{
-        self->alternateAddressDelay = delay;
-    };
-    if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-        block();
++ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD delegate:(nullable id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(nullable dispatch_queue_t)dq error:(NSError**)error {
+  return [self socketFromConnectedSocketFD:socketFD delegate:aDelegate delegateQueue:dq socketQueue:NULL error:error];
+}
+
++ (nullable instancetype)socketFromConnectedSocketFD:(int)socketFD delegate:(nullable id<GCDAsyncSocketDelegate>)aDelegate delegateQueue:(nullable dispatch_queue_t)dq socketQueue:(nullable dispatch_queue_t)sq error:(NSError* __autoreleasing *)error
+{
+  __block BOOL errorOccured = NO;
+  __block NSError *thisError = nil;
+  
+  GCDAsyncSocket *socket = [[[self class] alloc] initWithDelegate:aDelegate delegateQueue:dq socketQueue:sq];
+  
+  dispatch_sync(socket->socketQueue, ^{ @autoreleasepool {
+    struct sockaddr addr;
+    socklen_t addr_size = sizeof(struct sockaddr);
+    int retVal = getpeername(socketFD, (struct sockaddr *)&addr, &addr_size);
+    if (retVal)
+    {
+      NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketOtherError",
+                                                           @"GCDAsyncSocket", [NSBundle mainBundle],
+                                                           @"Attempt to create socket from socket FD failed. getpeername() failed", nil);
+      
+      NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+
+      errorOccured = YES;
+      thisError = [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+      return;
+    }
+    
+    if (addr.sa_family == AF_INET)
+    {
+      socket->socket4FD = socketFD;
+    }
+    else if (addr.sa_family == AF_INET6)
+    {
+      socket->socket6FD = socketFD;
+    }
     else
-        dispatch_async(socketQueue, block);
+    {
+      NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketOtherError",
+                                                           @"GCDAsyncSocket", [NSBundle mainBundle],
+                                                           @"Attempt to create socket from socket FD failed. socket FD is neither IPv4 nor IPv6", nil);
+      
+      NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+      
+      errorOccured = YES;
+      thisError = [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+      return;
+    }
+    
+    socket->flags = kSocketStarted;
+    [socket didConnect:socket->stateIndex];
+  }});
+  
+  if (error && thisError) {
+    *error = thisError;
+  }
+  
+  return errorOccured? nil: socket;
 }
 
-- (id)userData
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Configuration
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (id)delegate
 {
-	__block id result = nil;
-	
-	dispatch_block_t block = ^{
-		
-        result = self->userData;
-	};
-	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
+	{
+		return delegate;
+	}
 	else
-		dispatch_sync(socketQueue, block);
-	
-	return result;
+	{
+		__block id result;
+		
+		dispatch_sync(socketQueue, ^{
+            result = self->delegate;
+		});
+		
+		return result;
+	}
 }
 
-- (void)setUserData:(id)arbitraryUserData
+- (void)setDelegate:(id)newDelegate synchronously:(BOOL)synchronously
 {
 	dispatch_block_t block = ^{
-		
-        if (self->userData != arbitraryUserData)
-		{
-            self->userData = arbitraryUserData;
-		}
+        self->delegate = newDelegate;
+		[self invalidateDelegateCapabilities];
 	};
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
 		block();
-	else
-		dispatch_async(socketQueue, block);
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
+	}
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Accepting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (void)setDelegate:(id<GCDAsyncSocketDelegate>)newDelegate
+{
+	[self setDelegate:newDelegate synchronously:NO];
+}
 
-- (BOOL)acceptOnPort:(uint16_t)port error:(NSError **)errPtr
+- (void)synchronouslySetDelegate:(id<GCDAsyncSocketDelegate>)newDelegate
 {
-	return [self acceptOnInterface:nil port:port error:errPtr];
+	[self setDelegate:newDelegate synchronously:YES];
 }
 
-- (BOOL)acceptOnInterface:(NSString *)inInterface port:(uint16_t)port error:(NSError **)errPtr
+- (dispatch_queue_t)delegateQueue
 {
-	LogTrace();
-	
-	// Just in-case interface parameter is immutable.
-	NSString *interface = [inInterface copy];
-	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
-	
-	// CreateSocket Block
-	// This block will be invoked within the dispatch block below.
-	
-	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return delegateQueue;
+	}
+	else
+	{
+		__block dispatch_queue_t result;
 		
-		int socketFD = socket(domain, SOCK_STREAM, 0);
+		dispatch_sync(socketQueue, ^{
+            result = self->delegateQueue;
+		});
 		
-		if (socketFD == SOCKET_NULL)
-		{
-			NSString *reason = @"Error in socket() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			return SOCKET_NULL;
-		}
+		return result;
+	}
+}
+
+- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+{
+	dispatch_block_t block = ^{
 		
-		int status;
+		#if !OS_OBJECT_USE_OBJC
+        if (self->delegateQueue) dispatch_release(self->delegateQueue);
+		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
+		#endif
 		
-		// Set socket options
+        self->delegateQueue = newDelegateQueue;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
+		block();
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
+	}
+}
+
+- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegateQueue:newDelegateQueue synchronously:NO];
+}
+
+- (void)synchronouslySetDelegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegateQueue:newDelegateQueue synchronously:YES];
+}
+
+- (void)getDelegate:(id<GCDAsyncSocketDelegate> *)delegatePtr delegateQueue:(dispatch_queue_t *)delegateQueuePtr
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (delegatePtr) *delegatePtr = delegate;
+		if (delegateQueuePtr) *delegateQueuePtr = delegateQueue;
+	}
+	else
+	{
+		__block id dPtr = NULL;
+		__block dispatch_queue_t dqPtr = NULL;
 		
-		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
-		if (status == -1)
-		{
-			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		dispatch_sync(socketQueue, ^{
+            dPtr = self->delegate;
+            dqPtr = self->delegateQueue;
+		});
 		
-		int reuseOn = 1;
-		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-		if (status == -1)
-		{
-			NSString *reason = @"Error enabling address reuse (setsockopt)";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		if (delegatePtr) *delegatePtr = dPtr;
+		if (delegateQueuePtr) *delegateQueuePtr = dqPtr;
+	}
+}
+
+- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+{
+	dispatch_block_t block = ^{
 		
-		// Bind socket
+        self->delegate = newDelegate;
+		[self invalidateDelegateCapabilities];
 		
-		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in bind() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		#if !OS_OBJECT_USE_OBJC
+        if (self->delegateQueue) dispatch_release(self->delegateQueue);
+		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
+		#endif
 		
-		// Listen
+        self->delegateQueue = newDelegateQueue;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
+		block();
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
+	}
+}
+
+- (void)setDelegate:(id<GCDAsyncSocketDelegate>)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:NO];
+}
+
+- (void)synchronouslySetDelegate:(id<GCDAsyncSocketDelegate>)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:YES];
+}
+
+- (dispatch_queue_t)completionQueue
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return completionQueue;
+	}
+	else
+	{
+		__block dispatch_queue_t result;
 		
-		status = listen(socketFD, 1024);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in listen() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		dispatch_sync(socketQueue, ^{
+			result = self->completionQueue;
+		});
 		
-		return socketFD;
+		return result;
+	}
+}
+
+- (void)setCompletionQueue:(dispatch_queue_t)newCompletionQueue
+{
+	dispatch_block_t block = ^{
+		
+		#if !OS_OBJECT_USE_OBJC
+		if (self->completionQueue) dispatch_release(self->completionQueue);
+		if (newCompletionQueue) dispatch_retain(newCompletionQueue);
+		#endif
+		
+		self->completionQueue = newCompletionQueue;
 	};
 	
-	// Create dispatch block and run on socketQueue
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+/**
+ * Caches which of the (per-event) read/write delegate methods the given delegate implements,
+ * along with the implementations of the hottest ones.
+ * This saves a respondsToSelector: and a method lookup for every read & write.
+**/
+- (void)updateDelegateCapabilities:(id)theDelegate
+{
+	uint16_t capabilities = 0;
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-        if (self->delegate == nil) // Must have delegate set
+	if ([theDelegate respondsToSelector:@selector(socket:didReadData:withTag:)])
+		capabilities |= kDelegateDidReadData;
+	
+	if ([theDelegate respondsToSelector:@selector(socket:didReadPartialDataOfLength:tag:)])
+		capabilities |= kDelegateDidReadPartialData;
+	
+	if ([theDelegate respondsToSelector:@selector(socket:didWriteDataWithTag:)])
+		capabilities |= kDelegateDidWriteData;
+	
+	if ([theDelegate respondsToSelector:@selector(socket:didWritePartialDataOfLength:tag:)])
+		capabilities |= kDelegateDidWritePartialData;
+	
+	delegateClass = object_getClass(theDelegate);
+	delegateIsProxy = [theDelegate isProxy];
+	delegateCapabilities = capabilities;
+	
+	// A proxy's methodForSelector: describes the proxy, not its target,
+	// and a forwarded method's IMP is the forwarding trampoline. Neither may be called directly.
+	
+	delegateDidReadData = GCDAsyncSocketSendDidReadData;
+	delegateDidWriteData = GCDAsyncSocketSendDidWriteData;
+	
+	if (!delegateIsProxy)
+	{
+		if (capabilities & kDelegateDidReadData)
 		{
-			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
-			err = [self badConfigError:msg];
+			IMP imp = [theDelegate methodForSelector:@selector(socket:didReadData:withTag:)];
 			
-			return_from_block;
+			if (imp && (imp != (IMP)_objc_msgForward))
+				delegateDidReadData = (GCDAsyncSocketDidReadDataIMP)imp;
 		}
 		
-        if (self->delegateQueue == NULL) // Must have delegate queue set
+		if (capabilities & kDelegateDidWriteData)
 		{
-			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
-			err = [self badConfigError:msg];
+			IMP imp = [theDelegate methodForSelector:@selector(socket:didWriteDataWithTag:)];
 			
-			return_from_block;
+			if (imp && (imp != (IMP)_objc_msgForward))
+				delegateDidWriteData = (GCDAsyncSocketDidWriteDataIMP)imp;
 		}
+	}
+}
+
+/**
+ * Invoked when the delegate is set. The capabilities of the new delegate are looked up on first use.
+**/
+- (void)invalidateDelegateCapabilities
+{
+	delegateClass = Nil;
+	delegateIsProxy = NO;
+	delegateCapabilities = 0;
+	delegateDidReadData = NULL;
+	delegateDidWriteData = NULL;
+}
+
+/**
+ * Returns the cached capabilities of the given delegate.
+ * 
+ * The cache is keyed on the delegate's class, and cleared whenever the delegate is set.
+ * So it's refreshed if the delegate has since changed class (e.g. due to KVO), or has been deallocated.
+ * A proxy's capabilities depend on its target rather than its class, so they're never cached.
+**/
+- (uint16_t)capabilitiesOfDelegate:(id)theDelegate
+{
+	if ((object_getClass(theDelegate) != delegateClass) || delegateIsProxy)
+	{
+		[self updateDelegateCapabilities:theDelegate];
+	}
+	
+	return delegateCapabilities;
+}
+
+- (BOOL)isIPv4Enabled
+{
+	// Note: YES means kIPv4Disabled is OFF
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kIPv4Disabled) == 0);
+	}
+	else
+	{
+		__block BOOL result;
 		
-        BOOL isIPv4Disabled = (self->config & kIPv4Disabled) ? YES : NO;
-        BOOL isIPv6Disabled = (self->config & kIPv6Disabled) ? YES : NO;
+		dispatch_sync(socketQueue, ^{
+            result = ((self->config & kIPv4Disabled) == 0);
+		});
 		
-		if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
-		{
-			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
+		return result;
+	}
+}
+
+- (void)setIPv4Enabled:(BOOL)flag
+{
+	// Note: YES means kIPv4Disabled is OFF
+	
+	dispatch_block_t block = ^{
 		
-		if (![self isDisconnected]) // Must be disconnected
-		{
-			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
-		
-		// Clear queues (spurious read/write requests post disconnect)
-        [self->readQueue removeAllObjects];
-        [self->writeQueue removeAllObjects];
-		
-		// Resolve interface from description
-		
-		NSMutableData *interface4 = nil;
-		NSMutableData *interface6 = nil;
-		
-		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:port];
-		
-		if ((interface4 == nil) && (interface6 == nil))
-		{
-			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		if (isIPv4Disabled && (interface6 == nil))
-		{
-			NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		if (isIPv6Disabled && (interface4 == nil))
-		{
-			NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		BOOL enableIPv4 = !isIPv4Disabled && (interface4 != nil);
-		BOOL enableIPv6 = !isIPv6Disabled && (interface6 != nil);
-		
-		// Create sockets, configure, bind, and listen
-		
-		if (enableIPv4)
-		{
-			LogVerbose(@"Creating IPv4 socket");
-            self->socket4FD = createSocket(AF_INET, interface4);
-			
-            if (self->socket4FD == SOCKET_NULL)
-			{
-				return_from_block;
-			}
-		}
-		
-		if (enableIPv6)
-		{
-			LogVerbose(@"Creating IPv6 socket");
-			
-			if (enableIPv4 && (port == 0))
-			{
-				// No specific port was specified, so we allowed the OS to pick an available port for us.
-				// Now we need to make sure the IPv6 socket listens on the same port as the IPv4 socket.
-				
-				struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)[interface6 mutableBytes];
-				addr6->sin6_port = htons([self localPort4]);
-			}
-			
-            self->socket6FD = createSocket(AF_INET6, interface6);
-			
-            if (self->socket6FD == SOCKET_NULL)
-			{
-                if (self->socket4FD != SOCKET_NULL)
-				{
-					LogVerbose(@"close(socket4FD)");
-                    close(self->socket4FD);
-                    self->socket4FD = SOCKET_NULL;
-				}
-				
-				return_from_block;
-			}
-		}
-		
-		// Create accept sources
-		
-		if (enableIPv4)
-		{
-            self->accept4Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socket4FD, 0, self->socketQueue);
-			
-            int socketFD = self->socket4FD;
-            dispatch_source_t acceptSource = self->accept4Source;
-			
-			__weak GCDAsyncSocket *weakSelf = self;
-			
-            dispatch_source_set_event_handler(self->accept4Source, ^{ @autoreleasepool {
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				__strong GCDAsyncSocket *strongSelf = weakSelf;
-				if (strongSelf == nil) return_from_block;
-				
-				LogVerbose(@"event4Block");
-				
-				unsigned long i = 0;
-				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
-				
-				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
-				
-				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
-				
-			#pragma clang diagnostic pop
-			}});
-			
-			
-            dispatch_source_set_cancel_handler(self->accept4Source, ^{
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				#if !OS_OBJECT_USE_OBJC
-				LogVerbose(@"dispatch_release(accept4Source)");
-				dispatch_release(acceptSource);
-				#endif
-				
-				LogVerbose(@"close(socket4FD)");
-				close(socketFD);
-			
-			#pragma clang diagnostic pop
-			});
-			
-			LogVerbose(@"dispatch_resume(accept4Source)");
-            dispatch_resume(self->accept4Source);
-		}
-		
-		if (enableIPv6)
-		{
-            self->accept6Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socket6FD, 0, self->socketQueue);
-			
-            int socketFD = self->socket6FD;
-            dispatch_source_t acceptSource = self->accept6Source;
-			
-			__weak GCDAsyncSocket *weakSelf = self;
-			
-            dispatch_source_set_event_handler(self->accept6Source, ^{ @autoreleasepool {
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				__strong GCDAsyncSocket *strongSelf = weakSelf;
-				if (strongSelf == nil) return_from_block;
-				
-				LogVerbose(@"event6Block");
-				
-				unsigned long i = 0;
-				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
-				
-				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
-				
-				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
-				
-			#pragma clang diagnostic pop
-			}});
-			
-            dispatch_source_set_cancel_handler(self->accept6Source, ^{
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				#if !OS_OBJECT_USE_OBJC
-				LogVerbose(@"dispatch_release(accept6Source)");
-				dispatch_release(acceptSource);
-				#endif
-				
-				LogVerbose(@"close(socket6FD)");
-				close(socketFD);
-				
-			#pragma clang diagnostic pop
-			});
-			
-			LogVerbose(@"dispatch_resume(accept6Source)");
-            dispatch_resume(self->accept6Source);
-		}
-		
-        self->flags |= kSocketStarted;
-		
-		result = YES;
-	}};
+		if (flag)
+            self->config &= ~kIPv4Disabled;
+		else
+            self->config |= kIPv4Disabled;
+	};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 		block();
 	else
-		dispatch_sync(socketQueue, block);
+		dispatch_async(socketQueue, block);
+}
+
+- (BOOL)isIPv6Enabled
+{
+	// Note: YES means kIPv6Disabled is OFF
 	
-	if (result == NO)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		LogInfo(@"Error in accept: %@", err);
+		return ((config & kIPv6Disabled) == 0);
+	}
+	else
+	{
+		__block BOOL result;
 		
-		if (errPtr)
-			*errPtr = err;
+		dispatch_sync(socketQueue, ^{
+            result = ((self->config & kIPv6Disabled) == 0);
+		});
+		
+		return result;
 	}
-	
-	return result;
 }
 
-- (BOOL)acceptOnUrl:(NSURL *)url error:(NSError **)errPtr
+- (void)setIPv6Enabled:(BOOL)flag
 {
-	LogTrace();
+	// Note: YES means kIPv6Disabled is OFF
 	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
+	dispatch_block_t block = ^{
+		
+		if (flag)
+            self->config &= ~kIPv6Disabled;
+		else
+            self->config |= kIPv6Disabled;
+	};
 	
-	// CreateSocket Block
-	// This block will be invoked within the dispatch block below.
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (BOOL)isIPv4PreferredOverIPv6
+{
+	// Note: YES means kPreferIPv6 is OFF
 	
-	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kPreferIPv6) == 0);
+	}
+	else
+	{
+		__block BOOL result;
 		
-		int socketFD = socket(domain, SOCK_STREAM, 0);
+		dispatch_sync(socketQueue, ^{
+            result = ((self->config & kPreferIPv6) == 0);
+		});
 		
-		if (socketFD == SOCKET_NULL)
-		{
-			NSString *reason = @"Error in socket() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			return SOCKET_NULL;
-		}
-		
-		int status;
-		
-		// Set socket options
-		
-		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
-		if (status == -1)
-		{
-			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
-		
-		int reuseOn = 1;
-		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-		if (status == -1)
-		{
-			NSString *reason = @"Error enabling address reuse (setsockopt)";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
-		
-		// Bind socket
-		
-		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in bind() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
-		
-		// Listen
-		
-		status = listen(socketFD, 1024);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in listen() function";
-			err = [self errorWithErrno:errno reason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		return result;
+	}
+}
+
+- (void)setIPv4PreferredOverIPv6:(BOOL)flag
+{
+	// Note: YES means kPreferIPv6 is OFF
+	
+	dispatch_block_t block = ^{
 		
-		return socketFD;
+		if (flag)
+            self->config &= ~kPreferIPv6;
+		else
+            self->config |= kPreferIPv6;
 	};
 	
-	// Create dispatch block and run on socketQueue
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSTimeInterval) alternateAddressDelay {
+    __block NSTimeInterval delay;
+    dispatch_block_t block = ^{
+        delay = self->alternateAddressDelay;
+    };
+    if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+        block();
+    else
+        dispatch_sync(socketQueue, block);
+    return delay;
+}
+
+- (void) setAlternateAddressDelay:(NSTimeInterval)delay {
+    dispatch_block_t block = ^{
+        self->alternateAddressDelay = delay;
+    };
+    if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+        block();
+    else
+        dispatch_async(socketQueue, block);
+}
+
+- (id)userData
+{
+	__block id result = nil;
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-        if (self->delegate == nil) // Must have delegate set
-		{
-			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
-		
-        if (self->delegateQueue == NULL) // Must have delegate queue set
-		{
-			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
-		
-		if (![self isDisconnected]) // Must be disconnected
-		{
-			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
-		
-		// Clear queues (spurious read/write requests post disconnect)
-        [self->readQueue removeAllObjects];
-        [self->writeQueue removeAllObjects];
-		
-		// Remove a previous socket
-		
-		NSError *error = nil;
-		NSFileManager *fileManager = [NSFileManager defaultManager];
-		NSString *urlPath = url.path;
-		if (urlPath && [fileManager fileExistsAtPath:urlPath]) {
-			if (![fileManager removeItemAtURL:url error:&error]) {
-				NSString *msg = @"Could not remove previous unix domain socket at given url.";
-				err = [self otherError:msg];
-				
-				return_from_block;
-			}
-		}
-		
-		// Resolve interface from description
-		
-		NSData *interface = [self getInterfaceAddressFromUrl:url];
-		
-		if (interface == nil)
-		{
-			NSString *msg = @"Invalid unix domain url. Specify a valid file url that does not exist (e.g. \"file:///tmp/socket\")";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		// Create sockets, configure, bind, and listen
+	dispatch_block_t block = ^{
 		
-		LogVerbose(@"Creating unix domain socket");
-        self->socketUN = createSocket(AF_UNIX, interface);
+        result = self->userData;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setUserData:(id)arbitraryUserData
+{
+	dispatch_block_t block = ^{
 		
-        if (self->socketUN == SOCKET_NULL)
+        if (self->userData != arbitraryUserData)
 		{
-			return_from_block;
+            self->userData = arbitraryUserData;
 		}
-		
-        self->socketUrl = url;
-		
-		// Create accept sources
-		
-        self->acceptUNSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socketUN, 0, self->socketQueue);
-		
-        int socketFD = self->socketUN;
-        dispatch_source_t acceptSource = self->acceptUNSource;
-		
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-        dispatch_source_set_event_handler(self->acceptUNSource, ^{ @autoreleasepool {
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			
-			LogVerbose(@"eventUNBlock");
-			
-			unsigned long i = 0;
-			unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
-			
-			LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
-			
-			while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
-		}});
-		
-        dispatch_source_set_cancel_handler(self->acceptUNSource, ^{
-			
-#if !OS_OBJECT_USE_OBJC
-			LogVerbose(@"dispatch_release(acceptUNSource)");
-			dispatch_release(acceptSource);
-#endif
-			
-			LogVerbose(@"close(socketUN)");
-			close(socketFD);
-		});
-		
-		LogVerbose(@"dispatch_resume(acceptUNSource)");
-        dispatch_resume(self->acceptUNSource);
-		
-        self->flags |= kSocketStarted;
-		
-		result = YES;
-	}};
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSUInteger)maxDecryptedPreBufferSize
+{
+	__block NSUInteger result;
+	
+	dispatch_block_t block = ^{
+		result = self->maxDecryptedPreBufferSize;
+	};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 		block();
 	else
 		dispatch_sync(socketQueue, block);
 	
-	if (result == NO)
-	{
-		LogInfo(@"Error in accept: %@", err);
-		
-		if (errPtr)
-			*errPtr = err;
-	}
+	return result;
+}
+
+- (void)setMaxDecryptedPreBufferSize:(NSUInteger)maxSize
+{
+	dispatch_block_t block = ^{
+		self->maxDecryptedPreBufferSize = maxSize;
+	};
 	
-	return result;	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (BOOL)doAccept:(int)parentSocketFD
+- (NSUInteger)maxEncryptedPreBufferSize
 {
-	LogTrace();
+	__block NSUInteger result;
 	
-	int socketType;
-	int childSocketFD;
-	NSData *childSocketAddress;
+	dispatch_block_t block = ^{
+		result = self->maxEncryptedPreBufferSize;
+	};
 	
-	if (parentSocketFD == socket4FD)
-	{
-		socketType = 0;
-		
-		struct sockaddr_in addr;
-		socklen_t addrLen = sizeof(addr);
-		
-		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
-		
-		if (childSocketFD == -1)
-		{
-			LogWarn(@"Accept failed with error: %@", [self errnoError]);
-			return NO;
-		}
-		
-		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
-	}
-	else if (parentSocketFD == socket6FD)
-	{
-		socketType = 1;
-		
-		struct sockaddr_in6 addr;
-		socklen_t addrLen = sizeof(addr);
-		
-		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
-		
-		if (childSocketFD == -1)
-		{
-			LogWarn(@"Accept failed with error: %@", [self errnoError]);
-			return NO;
-		}
-		
-		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
-	}
-	else // if (parentSocketFD == socketUN)
-	{
-		socketType = 2;
-		
-		struct sockaddr_un addr;
-		socklen_t addrLen = sizeof(addr);
-		
-		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
-		
-		if (childSocketFD == -1)
-		{
-			LogWarn(@"Accept failed with error: %@", [self errnoError]);
-			return NO;
-		}
-		
-		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
-	}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	// Enable non-blocking IO on the socket
+	return result;
+}
+
+- (void)setMaxEncryptedPreBufferSize:(NSUInteger)maxSize
+{
+	dispatch_block_t block = ^{
+		self->maxEncryptedPreBufferSize = maxSize;
+	};
 	
-	int result = fcntl(childSocketFD, F_SETFL, O_NONBLOCK);
-	if (result == -1)
-	{
-		LogWarn(@"Error enabling non-blocking IO on accepted socket (fcntl)");
-		LogVerbose(@"close(childSocketFD)");
-		close(childSocketFD);
-		return NO;
-	}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSUInteger)decryptedPreBufferCapHitCount
+{
+	__block NSUInteger result;
 	
-	// Prevent SIGPIPE signals
+	dispatch_block_t block = ^{
+		result = self->decryptedPreBufferCapHitCount;
+	};
 	
-	int nosigpipe = 1;
-	setsockopt(childSocketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	// Notify delegate
+	return result;
+}
+
+- (NSUInteger)encryptedPreBufferCapHitCount
+{
+	__block NSUInteger result;
 	
-	if (delegateQueue)
-	{
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			// Query delegate for custom socket queue
-			
-			dispatch_queue_t childSocketQueue = NULL;
-			
-			if ([theDelegate respondsToSelector:@selector(newSocketQueueForConnectionFromAddress:onSocket:)])
-			{
-				childSocketQueue = [theDelegate newSocketQueueForConnectionFromAddress:childSocketAddress
-				                                                              onSocket:self];
-			}
-			
-			// Create GCDAsyncSocket instance for accepted socket
-			
-			GCDAsyncSocket *acceptedSocket = [[[self class] alloc] initWithDelegate:theDelegate
-                                                                      delegateQueue:self->delegateQueue
-																		socketQueue:childSocketQueue];
-			
-			if (socketType == 0)
-				acceptedSocket->socket4FD = childSocketFD;
-			else if (socketType == 1)
-				acceptedSocket->socket6FD = childSocketFD;
-			else
-				acceptedSocket->socketUN = childSocketFD;
-			
-			acceptedSocket->flags = (kSocketStarted | kConnected);
-			
-			// Setup read and write sources for accepted socket
-			
-			dispatch_async(acceptedSocket->socketQueue, ^{ @autoreleasepool {
-				
-				[acceptedSocket setupReadAndWriteSourcesForNewlyConnectedSocket:childSocketFD];
-			}});
-			
-			// Notify delegate
-			
-			if ([theDelegate respondsToSelector:@selector(socket:didAcceptNewSocket:)])
-			{
-				[theDelegate socket:self didAcceptNewSocket:acceptedSocket];
-			}
-			
-			// Release the socket queue returned from the delegate (it was retained by acceptedSocket)
-			#if !OS_OBJECT_USE_OBJC
-			if (childSocketQueue) dispatch_release(childSocketQueue);
-			#endif
-			
-			// The accepted socket should have been retained by the delegate.
-			// Otherwise it gets properly released when exiting the block.
-		}});
-	}
+	dispatch_block_t block = ^{
+		result = self->encryptedPreBufferCapHitCount;
+	};
 	
-	return YES;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Connecting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-/**
- * This method runs through the various checks required prior to a connection attempt.
- * It is shared between the connectToHost and connectToAddress methods.
- * 
-**/
-- (BOOL)preConnectWithInterface:(NSString *)interface error:(NSError **)errPtr
+- (NSUInteger)adaptiveReadLength
 {
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	__block NSUInteger result;
 	
-	if (delegate == nil) // Must have delegate set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	dispatch_block_t block = ^{
+		result = self->readLengthEstimate;
+	};
 	
-	if (delegateQueue == NULL) // Must have delegate queue set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	if (![self isDisconnected]) // Must be disconnected
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	return result;
+}
+
+- (NSUInteger)maxAdaptiveReadLength
+{
+	__block NSUInteger result;
 	
-	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	dispatch_block_t block = ^{
+		result = self->maxReadLength;
+	};
 	
-	if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	if (interface)
-	{
-		NSMutableData *interface4 = nil;
-		NSMutableData *interface6 = nil;
-		
-		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:0];
-		
-		if ((interface4 == nil) && (interface6 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
-		
-		if (isIPv4Disabled && (interface6 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
+	return result;
+}
+
+- (void)setMaxAdaptiveReadLength:(NSUInteger)maxLength
+{
+	dispatch_block_t block = ^{
 		
-		if (isIPv6Disabled && (interface4 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
-		
-		connectInterface4 = interface4;
-		connectInterface6 = interface6;
-	}
-	
-	// Clear queues (spurious read/write requests post disconnect)
-	[readQueue removeAllObjects];
-	[writeQueue removeAllObjects];
+		self->maxReadLength = MAX(maxLength, (NSUInteger)ADAPTIVE_READ_LENGTH_MIN);
+		self->readLengthEstimate = MIN(self->readLengthEstimate, self->maxReadLength);
+	};
 	
-	return YES;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (BOOL)preConnectWithUrl:(NSURL *)url error:(NSError **)errPtr
+- (NSUInteger)maxReceiveLowWaterMark
 {
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	if (delegate == nil) // Must have delegate set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
-	
-	if (delegateQueue == NULL) // Must have delegate queue set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
-	
-	if (![self isDisconnected]) // Must be disconnected
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
-	
-	NSData *interface = [self getInterfaceAddressFromUrl:url];
+	__block NSUInteger result;
 	
-	if (interface == nil)
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
-			*errPtr = [self badParamError:msg];
-		}
-		return NO;
-	}
+	dispatch_block_t block = ^{
+		result = self->maxReceiveLowWaterMark;
+	};
 	
-	connectInterfaceUN = interface;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	// Clear queues (spurious read/write requests post disconnect)
-	[readQueue removeAllObjects];
-	[writeQueue removeAllObjects];
+	return result;
+}
+
+- (void)setMaxReceiveLowWaterMark:(NSUInteger)maxLowWaterMark
+{
+	dispatch_block_t block = ^{
+		self->maxReceiveLowWaterMark = maxLowWaterMark;
+	};
 	
-	return YES;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (BOOL)connectToHost:(NSString*)host onPort:(uint16_t)port error:(NSError **)errPtr
+- (NSUInteger)queuedWriteBytes
 {
-	return [self connectToHost:host onPort:port withTimeout:-1 error:errPtr];
+	return (NSUInteger)atomic_load(&queuedWriteByteCount);
 }
 
-- (BOOL)connectToHost:(NSString *)host
-               onPort:(uint16_t)port
-          withTimeout:(NSTimeInterval)timeout
-                error:(NSError **)errPtr
+- (NSUInteger)writeQueueHighWatermark
 {
-	return [self connectToHost:host onPort:port viaInterface:nil withTimeout:timeout error:errPtr];
+	return (NSUInteger)atomic_load(&writeQueueHighWatermark);
 }
 
-- (BOOL)connectToHost:(NSString *)inHost
-               onPort:(uint16_t)port
-         viaInterface:(NSString *)inInterface
-          withTimeout:(NSTimeInterval)timeout
-                error:(NSError **)errPtr
+- (void)setWriteQueueHighWatermark:(NSUInteger)highWatermark
 {
-	LogTrace();
-	
-	// Just in case immutable objects were passed
-	NSString *host = [inHost copy];
-	NSString *interface = [inInterface copy];
-	
-	__block BOOL result = NO;
-	__block NSError *preConnectErr = nil;
+	atomic_store(&writeQueueHighWatermark, highWatermark);
+}
+
+- (NSUInteger)writeQueueLowWatermark
+{
+	return (NSUInteger)atomic_load(&writeQueueLowWatermark);
+}
+
+- (void)setWriteQueueLowWatermark:(NSUInteger)lowWatermark
+{
+	atomic_store(&writeQueueLowWatermark, lowWatermark);
+}
+
+- (NSUInteger)maxQueuedWriteBytes
+{
+	return (NSUInteger)atomic_load(&maxQueuedWriteBytes);
+}
+
+- (void)setMaxQueuedWriteBytes:(NSUInteger)maxBytes
+{
+	atomic_store(&maxQueuedWriteBytes, maxBytes);
+}
+
+- (NSUInteger)largeWriteThreshold
+{
+	__block NSUInteger result;
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-		// Check for problems with host parameter
-		
-		if ([host length] == 0)
-		{
-			NSString *msg = @"Invalid host parameter (nil or \"\"). Should be a domain name or IP address string.";
-			preConnectErr = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		// Run through standard pre-connect checks
-		
-		if (![self preConnectWithInterface:interface error:&preConnectErr])
-		{
-			return_from_block;
-		}
-		
-		// We've made it past all the checks.
-		// It's time to start the connection process.
-		
-        self->flags |= kSocketStarted;
-		
-		LogVerbose(@"Dispatching DNS lookup...");
-		
-		// It's possible that the given host parameter is actually a NSMutableString.
-		// So we want to copy it now, within this block that will be executed synchronously.
-		// This way the asynchronous lookup block below doesn't have to worry about it changing.
-		
-		NSString *hostCpy = [host copy];
-		
-        int aStateIndex = self->stateIndex;
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-		dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-		dispatch_async(globalConcurrentQueue, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			NSError *lookupErr = nil;
-			NSMutableArray *addresses = [[self class] lookupHost:hostCpy port:port error:&lookupErr];
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			if (lookupErr)
-			{
-				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-					
-					[strongSelf lookup:aStateIndex didFail:lookupErr];
-				}});
-			}
-			else
-			{
-				NSData *address4 = nil;
-				NSData *address6 = nil;
-				
-				for (NSData *address in addresses)
-				{
-					if (!address4 && [[self class] isIPv4Address:address])
-					{
-						address4 = address;
-					}
-					else if (!address6 && [[self class] isIPv6Address:address])
-					{
-						address6 = address;
-					}
-				}
-				
-				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-					
-					[strongSelf lookup:aStateIndex didSucceedWithAddress4:address4 address6:address6];
-				}});
-			}
-			
-		#pragma clang diagnostic pop
-		}});
-		
-		[self startConnectTimeout:timeout];
-		
-		result = YES;
-	}};
+	dispatch_block_t block = ^{
+		result = self->largeWriteThreshold;
+	};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 		block();
 	else
 		dispatch_sync(socketQueue, block);
 	
-	
-	if (errPtr) *errPtr = preConnectErr;
 	return result;
 }
 
-- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
+- (void)setLargeWriteThreshold:(NSUInteger)threshold
 {
-	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
+	dispatch_block_t block = ^{
+		self->largeWriteThreshold = threshold;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+- (NSUInteger)largeWriteSendBufferSize
 {
-	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
+	__block NSUInteger result;
+	
+	dispatch_block_t block = ^{
+		result = self->largeWriteSendBufferSize;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
 }
 
-- (BOOL)connectToAddress:(NSData *)inRemoteAddr
-            viaInterface:(NSString *)inInterface
-             withTimeout:(NSTimeInterval)timeout
-                   error:(NSError **)errPtr
+- (void)setLargeWriteSendBufferSize:(NSUInteger)size
 {
-	LogTrace();
+	dispatch_block_t block = ^{
+		self->largeWriteSendBufferSize = size;
+	};
 	
-	// Just in case immutable objects were passed
-	NSData *remoteAddr = [inRemoteAddr copy];
-	NSString *interface = [inInterface copy];
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (BOOL)isReadDrainingEnabled
+{
+	__block BOOL result;
 	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
+	dispatch_block_t block = ^{
+		result = ((self->config & kDrainReads) != 0);
+	};
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-		// Check for problems with remoteAddr parameter
-		
-		NSData *address4 = nil;
-		NSData *address6 = nil;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setReadDrainingEnabled:(BOOL)flag
+{
+	dispatch_block_t block = ^{
 		
-		if ([remoteAddr length] >= sizeof(struct sockaddr))
-		{
-			const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
-			
-			if (sockaddr->sa_family == AF_INET)
-			{
-				if ([remoteAddr length] == sizeof(struct sockaddr_in))
-				{
-					address4 = remoteAddr;
-				}
-			}
-			else if (sockaddr->sa_family == AF_INET6)
-			{
-				if ([remoteAddr length] == sizeof(struct sockaddr_in6))
-				{
-					address6 = remoteAddr;
-				}
-			}
-		}
+		if (flag)
+			self->config |= kDrainReads;
+		else
+			self->config &= ~kDrainReads;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSUInteger)readDrainByteBudget
+{
+	__block NSUInteger result;
+	
+	dispatch_block_t block = ^{
+		result = self->readDrainByteBudget;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setReadDrainByteBudget:(NSUInteger)budget
+{
+	dispatch_block_t block = ^{
+		// An unlimited budget would let a busy connection starve the others on the queue
+		self->readDrainByteBudget = (budget > 0) ? budget : READ_DRAIN_BYTE_BUDGET;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSUInteger)readDrainOperationBudget
+{
+	__block NSUInteger result;
+	
+	dispatch_block_t block = ^{
+		result = self->readDrainOperationBudget;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setReadDrainOperationBudget:(NSUInteger)budget
+{
+	dispatch_block_t block = ^{
+		self->readDrainOperationBudget = (budget > 0) ? budget : READ_DRAIN_OPERATION_BUDGET;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
++ (NSUInteger)globalMaxDecryptedPreBufferSize
+{
+	return atomic_load_explicit(&globalMaxDecryptedPreBufferSize, memory_order_relaxed);
+}
+
++ (void)setGlobalMaxDecryptedPreBufferSize:(NSUInteger)maxSize
+{
+	atomic_store_explicit(&globalMaxDecryptedPreBufferSize, maxSize, memory_order_relaxed);
+}
+
++ (NSUInteger)globalMaxEncryptedPreBufferSize
+{
+	return atomic_load_explicit(&globalMaxEncryptedPreBufferSize, memory_order_relaxed);
+}
+
++ (void)setGlobalMaxEncryptedPreBufferSize:(NSUInteger)maxSize
+{
+	atomic_store_explicit(&globalMaxEncryptedPreBufferSize, maxSize, memory_order_relaxed);
+}
+
++ (NSUInteger)globalDecryptedPreBufferSize
+{
+	return atomic_load_explicit(&globalDecryptedPreBufferSize, memory_order_relaxed);
+}
+
++ (NSUInteger)globalEncryptedPreBufferSize
+{
+	return atomic_load_explicit(&globalEncryptedPreBufferSize, memory_order_relaxed);
+}
+
++ (uint64_t)globalDecryptedPreBufferCapHitCount
+{
+	return atomic_load_explicit(&globalDecryptedPreBufferCapHitCount, memory_order_relaxed);
+}
+
++ (uint64_t)globalEncryptedPreBufferCapHitCount
+{
+	return atomic_load_explicit(&globalEncryptedPreBufferCapHitCount, memory_order_relaxed);
+}
+
++ (NSUInteger)tlsHandshakePoolMaxPending
+{
+	return atomic_load_explicit(&tlsHandshakePoolMaxPending, memory_order_relaxed);
+}
+
++ (void)setTlsHandshakePoolMaxPending:(NSUInteger)maxPending
+{
+	atomic_store_explicit(&tlsHandshakePoolMaxPending, maxPending, memory_order_relaxed);
+}
+
++ (NSUInteger)tlsHandshakePoolPendingCount
+{
+	return atomic_load_explicit(&tlsHandshakePoolPendingCount, memory_order_relaxed);
+}
+
++ (uint64_t)tlsHandshakePoolOverflowCount
+{
+	return atomic_load_explicit(&tlsHandshakePoolOverflowCount, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Accepting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)acceptOnPort:(uint16_t)port error:(NSError **)errPtr
+{
+	return [self acceptOnInterface:nil port:port error:errPtr];
+}
+
+- (BOOL)acceptOnInterface:(NSString *)inInterface port:(uint16_t)port error:(NSError **)errPtr
+{
+	LogTrace();
+	
+	// Just in-case interface parameter is immutable.
+	NSString *interface = [inInterface copy];
+	
+	__block BOOL result = NO;
+	__block NSError *err = nil;
+	
+	// CreateSocket Block
+	// This block will be invoked within the dispatch block below.
+	
+	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
 		
-		if ((address4 == nil) && (address6 == nil))
+		int socketFD = socket(domain, SOCK_STREAM, 0);
+		
+		if (socketFD == SOCKET_NULL)
 		{
-			NSString *msg = @"A valid IPv4 or IPv6 address was not given";
-			err = [self badParamError:msg];
+			NSString *reason = @"Error in socket() function";
+			err = [self errorWithErrno:errno reason:reason];
 			
-			return_from_block;
+			return SOCKET_NULL;
 		}
 		
-        BOOL isIPv4Disabled = (self->config & kIPv4Disabled) ? YES : NO;
-        BOOL isIPv6Disabled = (self->config & kIPv6Disabled) ? YES : NO;
+		int status;
 		
-		if (isIPv4Disabled && (address4 != nil))
+		// Set socket options
+		
+		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
+		if (status == -1)
 		{
-			NSString *msg = @"IPv4 has been disabled and an IPv4 address was passed.";
-			err = [self badParamError:msg];
+			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
+			err = [self errorWithErrno:errno reason:reason];
 			
-			return_from_block;
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
 		}
 		
-		if (isIPv6Disabled && (address6 != nil))
+		int reuseOn = 1;
+		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+		if (status == -1)
 		{
-			NSString *msg = @"IPv6 has been disabled and an IPv6 address was passed.";
-			err = [self badParamError:msg];
+			NSString *reason = @"Error enabling address reuse (setsockopt)";
+			err = [self errorWithErrno:errno reason:reason];
 			
-			return_from_block;
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
 		}
 		
-		// Run through standard pre-connect checks
+		// Bind socket
 		
-		if (![self preConnectWithInterface:interface error:&err])
+		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
+		if (status == -1)
 		{
-			return_from_block;
+			NSString *reason = @"Error in bind() function";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
 		}
 		
-		// We've made it past all the checks.
-		// It's time to start the connection process.
+		// Listen
 		
-		if (![self connectWithAddress4:address4 address6:address6 error:&err])
+		status = listen(socketFD, 1024);
+		if (status == -1)
 		{
-			return_from_block;
+			NSString *reason = @"Error in listen() function";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
 		}
 		
-        self->flags |= kSocketStarted;
-		
-		[self startConnectTimeout:timeout];
-		
-		result = YES;
-	}};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	if (result == NO)
-	{
-		if (errPtr)
-			*errPtr = err;
-	}
-	
-	return result;
-}
-
-- (BOOL)connectToUrl:(NSURL *)url withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
-{
-	LogTrace();
+		return socketFD;
+	};
 	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
+	// Create dispatch block and run on socketQueue
 	
 	dispatch_block_t block = ^{ @autoreleasepool {
 		
-		// Check for problems with host parameter
-		
-		if ([url.path length] == 0)
+        if (self->delegate == nil) // Must have delegate set
 		{
-			NSString *msg = @"Invalid unix domain socket url.";
-			err = [self badParamError:msg];
+			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
+			err = [self badConfigError:msg];
 			
 			return_from_block;
 		}
 		
-		// Run through standard pre-connect checks
-		
-		if (![self preConnectWithUrl:url error:&err])
+        if (self->delegateQueue == NULL) // Must have delegate queue set
 		{
+			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
+			err = [self badConfigError:msg];
+			
 			return_from_block;
 		}
 		
-		// We've made it past all the checks.
-		// It's time to start the connection process.
+        BOOL isIPv4Disabled = (self->config & kIPv4Disabled) ? YES : NO;
+        BOOL isIPv6Disabled = (self->config & kIPv6Disabled) ? YES : NO;
 		
-        self->flags |= kSocketStarted;
+		if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+		{
+			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
 		
-		// Start the normal connection process
+		if (![self isDisconnected]) // Must be disconnected
+		{
+			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
 		
-		NSError *connectError = nil;
-        if (![self connectWithAddressUN:self->connectInterfaceUN error:&connectError])
+		// Clear queues (spurious read/write requests post disconnect)
+        [self->readQueue removeAllObjects];
+        [self->writeQueue removeAllObjects];
+		
+		// Resolve interface from description
+		
+		NSMutableData *interface4 = nil;
+		NSMutableData *interface6 = nil;
+		
+		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:port];
+		
+		if ((interface4 == nil) && (interface6 == nil))
 		{
-			[self closeWithError:connectError];
+			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
+			err = [self badParamError:msg];
 			
 			return_from_block;
 		}
-
-		[self startConnectTimeout:timeout];
+		
+		if (isIPv4Disabled && (interface6 == nil))
+		{
+			NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		if (isIPv6Disabled && (interface4 == nil))
+		{
+			NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		BOOL enableIPv4 = !isIPv4Disabled && (interface4 != nil);
+		BOOL enableIPv6 = !isIPv6Disabled && (interface6 != nil);
+		
+		// Create sockets, configure, bind, and listen
+		
+		if (enableIPv4)
+		{
+			LogVerbose(@"Creating IPv4 socket");
+            self->socket4FD = createSocket(AF_INET, interface4);
+			
+            if (self->socket4FD == SOCKET_NULL)
+			{
+				return_from_block;
+			}
+		}
+		
+		if (enableIPv6)
+		{
+			LogVerbose(@"Creating IPv6 socket");
+			
+			if (enableIPv4 && (port == 0))
+			{
+				// No specific port was specified, so we allowed the OS to pick an available port for us.
+				// Now we need to make sure the IPv6 socket listens on the same port as the IPv4 socket.
+				
+				struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)[interface6 mutableBytes];
+				addr6->sin6_port = htons([self localPort4]);
+			}
+			
+            self->socket6FD = createSocket(AF_INET6, interface6);
+			
+            if (self->socket6FD == SOCKET_NULL)
+			{
+                if (self->socket4FD != SOCKET_NULL)
+				{
+					LogVerbose(@"close(socket4FD)");
+                    close(self->socket4FD);
+                    self->socket4FD = SOCKET_NULL;
+				}
+				
+				return_from_block;
+			}
+		}
+		
+		// Create accept sources
+		
+		if (enableIPv4)
+		{
+            self->accept4Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socket4FD, 0, self->socketQueue);
+			
+            int socketFD = self->socket4FD;
+            dispatch_source_t acceptSource = self->accept4Source;
+			
+			__weak GCDAsyncSocket *weakSelf = self;
+			
+            dispatch_source_set_event_handler(self->accept4Source, ^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				LogVerbose(@"event4Block");
+				
+				unsigned long i = 0;
+				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
+				
+				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
+				
+				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
+				
+			#pragma clang diagnostic pop
+			}});
+			
+			
+            dispatch_source_set_cancel_handler(self->accept4Source, ^{
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				#if !OS_OBJECT_USE_OBJC
+				LogVerbose(@"dispatch_release(accept4Source)");
+				dispatch_release(acceptSource);
+				#endif
+				
+				LogVerbose(@"close(socket4FD)");
+				close(socketFD);
+			
+			#pragma clang diagnostic pop
+			});
+			
+			LogVerbose(@"dispatch_resume(accept4Source)");
+            dispatch_resume(self->accept4Source);
+		}
+		
+		if (enableIPv6)
+		{
+            self->accept6Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socket6FD, 0, self->socketQueue);
+			
+            int socketFD = self->socket6FD;
+            dispatch_source_t acceptSource = self->accept6Source;
+			
+			__weak GCDAsyncSocket *weakSelf = self;
+			
+            dispatch_source_set_event_handler(self->accept6Source, ^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				LogVerbose(@"event6Block");
+				
+				unsigned long i = 0;
+				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
+				
+				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
+				
+				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
+				
+			#pragma clang diagnostic pop
+			}});
+			
+            dispatch_source_set_cancel_handler(self->accept6Source, ^{
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				#if !OS_OBJECT_USE_OBJC
+				LogVerbose(@"dispatch_release(accept6Source)");
+				dispatch_release(acceptSource);
+				#endif
+				
+				LogVerbose(@"close(socket6FD)");
+				close(socketFD);
+				
+			#pragma clang diagnostic pop
+			});
+			
+			LogVerbose(@"dispatch_resume(accept6Source)");
+            dispatch_resume(self->accept6Source);
+		}
+		
+        self->flags |= kSocketStarted;
 		
 		result = YES;
 	}};
@@ -2572,6 +3680,8 @@ enum GCDAsyncSocketConfig
 	
 	if (result == NO)
 	{
+		LogInfo(@"Error in accept: %@", err);
+		
 		if (errPtr)
 			*errPtr = err;
 	}
@@ -2579,2990 +3689,6633 @@ enum GCDAsyncSocketConfig
 	return result;
 }
 
-- (BOOL)connectToNetService:(NSNetService *)netService error:(NSError **)errPtr
-{
-	NSArray* addresses = [netService addresses];
-	for (NSData* address in addresses)
-	{
-		BOOL result = [self connectToAddress:address error:errPtr];
-		if (result)
-		{
-			return YES;
-		}
-	}
-	
-	return NO;
-}
-
-- (void)lookup:(int)aStateIndex didSucceedWithAddress4:(NSData *)address4 address6:(NSData *)address6
+- (BOOL)acceptOnUrl:(NSURL *)url error:(NSError **)errPtr
 {
 	LogTrace();
 	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert(address4 || address6, @"Expected at least one valid address");
-	
-	if (aStateIndex != stateIndex)
-	{
-		LogInfo(@"Ignoring lookupDidSucceed, already disconnected");
-		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
-	}
-	
-	// Check for problems
+	__block BOOL result = NO;
+	__block NSError *err = nil;
 	
-	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	// CreateSocket Block
+	// This block will be invoked within the dispatch block below.
 	
-	if (isIPv4Disabled && (address6 == nil))
-	{
-		NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
+	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
 		
-		[self closeWithError:[self otherError:msg]];
-		return;
-	}
-	
-	if (isIPv6Disabled && (address4 == nil))
-	{
-		NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
+		int socketFD = socket(domain, SOCK_STREAM, 0);
 		
-		[self closeWithError:[self otherError:msg]];
-		return;
-	}
-	
-	// Start the normal connection process
-	
-	NSError *err = nil;
-	if (![self connectWithAddress4:address4 address6:address6 error:&err])
-	{
-		[self closeWithError:err];
-	}
-}
-
-/**
- * This method is called if the DNS lookup fails.
- * This method is executed on the socketQueue.
- * 
- * Since the DNS lookup executed synchronously on a global concurrent queue,
- * the original connection request may have already been cancelled or timed-out by the time this method is invoked.
- * The lookupIndex tells us whether the lookup is still valid or not.
-**/
-- (void)lookup:(int)aStateIndex didFail:(NSError *)error
-{
-	LogTrace();
+		if (socketFD == SOCKET_NULL)
+		{
+			NSString *reason = @"Error in socket() function";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			return SOCKET_NULL;
+		}
+		
+		int status;
+		
+		// Set socket options
+		
+		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
+		if (status == -1)
+		{
+			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		int reuseOn = 1;
+		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+		if (status == -1)
+		{
+			NSString *reason = @"Error enabling address reuse (setsockopt)";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		// Bind socket
+		
+		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
+		if (status == -1)
+		{
+			NSString *reason = @"Error in bind() function";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		// Listen
+		
+		status = listen(socketFD, 1024);
+		if (status == -1)
+		{
+			NSString *reason = @"Error in listen() function";
+			err = [self errorWithErrno:errno reason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		return socketFD;
+	};
 	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	// Create dispatch block and run on socketQueue
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+        if (self->delegate == nil) // Must have delegate set
+		{
+			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+        if (self->delegateQueue == NULL) // Must have delegate queue set
+		{
+			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		if (![self isDisconnected]) // Must be disconnected
+		{
+			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		// Clear queues (spurious read/write requests post disconnect)
+        [self->readQueue removeAllObjects];
+        [self->writeQueue removeAllObjects];
+		
+		// Remove a previous socket
+		
+		NSError *error = nil;
+		NSFileManager *fileManager = [NSFileManager defaultManager];
+		NSString *urlPath = url.path;
+		if (urlPath && [fileManager fileExistsAtPath:urlPath]) {
+			if (![fileManager removeItemAtURL:url error:&error]) {
+				NSString *msg = @"Could not remove previous unix domain socket at given url.";
+				err = [self otherError:msg];
+				
+				return_from_block;
+			}
+		}
+		
+		// Resolve interface from description
+		
+		NSData *interface = [self getInterfaceAddressFromUrl:url];
+		
+		if (interface == nil)
+		{
+			NSString *msg = @"Invalid unix domain url. Specify a valid file url that does not exist (e.g. \"file:///tmp/socket\")";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		// Create sockets, configure, bind, and listen
+		
+		LogVerbose(@"Creating unix domain socket");
+        self->socketUN = createSocket(AF_UNIX, interface);
+		
+        if (self->socketUN == SOCKET_NULL)
+		{
+			return_from_block;
+		}
+		
+        self->socketUrl = url;
+		
+		// Create accept sources
+		
+        self->acceptUNSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, self->socketUN, 0, self->socketQueue);
+		
+        int socketFD = self->socketUN;
+        dispatch_source_t acceptSource = self->acceptUNSource;
+		
+		__weak GCDAsyncSocket *weakSelf = self;
+		
+        dispatch_source_set_event_handler(self->acceptUNSource, ^{ @autoreleasepool {
+			
+			__strong GCDAsyncSocket *strongSelf = weakSelf;
+			
+			LogVerbose(@"eventUNBlock");
+			
+			unsigned long i = 0;
+			unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
+			
+			LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
+			
+			while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
+		}});
+		
+        dispatch_source_set_cancel_handler(self->acceptUNSource, ^{
+			
+#if !OS_OBJECT_USE_OBJC
+			LogVerbose(@"dispatch_release(acceptUNSource)");
+			dispatch_release(acceptSource);
+#endif
+			
+			LogVerbose(@"close(socketUN)");
+			close(socketFD);
+		});
+		
+		LogVerbose(@"dispatch_resume(acceptUNSource)");
+        dispatch_resume(self->acceptUNSource);
+		
+        self->flags |= kSocketStarted;
+		
+		result = YES;
+	}};
 	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	if (aStateIndex != stateIndex)
+	if (result == NO)
 	{
-		LogInfo(@"Ignoring lookup:didFail: - already disconnected");
+		LogInfo(@"Error in accept: %@", err);
 		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
+		if (errPtr)
+			*errPtr = err;
 	}
 	
-	[self endConnectTimeout];
-	[self closeWithError:error];
-}
-
-- (BOOL)bindSocket:(int)socketFD toInterface:(NSData *)connectInterface error:(NSError **)errPtr
-{
-    // Bind the socket to the desired interface (if needed)
-    
-    if (connectInterface)
-    {
-        LogVerbose(@"Binding socket...");
-        
-        if ([[self class] portFromAddress:connectInterface] > 0)
-        {
-            // Since we're going to be binding to a specific port,
-            // we should turn on reuseaddr to allow us to override sockets in time_wait.
-            
-            int reuseOn = 1;
-            setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-        }
-        
-        const struct sockaddr *interfaceAddr = (const struct sockaddr *)[connectInterface bytes];
-        
-        int result = bind(socketFD, interfaceAddr, (socklen_t)[connectInterface length]);
-        if (result != 0)
-        {
-            if (errPtr)
-                *errPtr = [self errorWithErrno:errno reason:@"Error in bind() function"];
-            
-            return NO;
-        }
-    }
-    
-    return YES;
+	return result;	
 }
 
-- (int)createSocket:(int)family connectInterface:(NSData *)connectInterface errPtr:(NSError **)errPtr
-{
-    int socketFD = socket(family, SOCK_STREAM, 0);
-    
-    if (socketFD == SOCKET_NULL)
-    {
-        if (errPtr)
-            *errPtr = [self errorWithErrno:errno reason:@"Error in socket() function"];
-        
-        return socketFD;
-    }
-    
-    if (![self bindSocket:socketFD toInterface:connectInterface error:errPtr])
-    {
-        [self closeSocket:socketFD];
-        
-        return SOCKET_NULL;
-    }
-    
-    // Prevent SIGPIPE signals
-    
-    int nosigpipe = 1;
-    setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
-    
-    return socketFD;
-}
-
-- (void)connectSocket:(int)socketFD address:(NSData *)address stateIndex:(int)aStateIndex
-{
-    // If there already is a socket connected, we close socketFD and return
-    if (self.isConnected)
-    {
-        [self closeSocket:socketFD];
-        return;
-    }
-    
-    // Start the connection process in a background queue
-    
-    __weak GCDAsyncSocket *weakSelf = self;
-    
-    dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-    dispatch_async(globalConcurrentQueue, ^{
-#pragma clang diagnostic push
-#pragma clang diagnostic warning "-Wimplicit-retain-self"
-        
-        int result = connect(socketFD, (const struct sockaddr *)[address bytes], (socklen_t)[address length]);
-        int err = errno;
-        
-        __strong GCDAsyncSocket *strongSelf = weakSelf;
-        if (strongSelf == nil) return_from_block;
-        
-        dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-            
-            if (strongSelf.isConnected)
-            {
-                [strongSelf closeSocket:socketFD];
-                return_from_block;
-            }
-            
-            if (result == 0)
-            {
-                [self closeUnusedSocket:socketFD];
-                
-                [strongSelf didConnect:aStateIndex];
-            }
-            else
-            {
-                [strongSelf closeSocket:socketFD];
-                
-                // If there are no more sockets trying to connect, we inform the error to the delegate
-                if (strongSelf.socket4FD == SOCKET_NULL && strongSelf.socket6FD == SOCKET_NULL)
-                {
-                    NSError *error = [strongSelf errorWithErrno:err reason:@"Error in connect() function"];
-                    [strongSelf didNotConnect:aStateIndex error:error];
-                }
-            }
-        }});
-        
-#pragma clang diagnostic pop
-    });
-    
-    LogVerbose(@"Connecting...");
-}
-
-- (void)closeSocket:(int)socketFD
-{
-    if (socketFD != SOCKET_NULL &&
-        (socketFD == socket6FD || socketFD == socket4FD))
-    {
-        close(socketFD);
-        
-        if (socketFD == socket4FD)
-        {
-            LogVerbose(@"close(socket4FD)");
-            socket4FD = SOCKET_NULL;
-        }
-        else if (socketFD == socket6FD)
-        {
-            LogVerbose(@"close(socket6FD)");
-            socket6FD = SOCKET_NULL;
-        }
-    }
-}
-
-- (void)closeUnusedSocket:(int)usedSocketFD
-{
-    if (usedSocketFD != socket4FD)
-    {
-        [self closeSocket:socket4FD];
-    }
-    else if (usedSocketFD != socket6FD)
-    {
-        [self closeSocket:socket6FD];
-    }
-}
-
-- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
-{
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	LogVerbose(@"IPv4: %@:%hu", [[self class] hostFromAddress:address4], [[self class] portFromAddress:address4]);
-	LogVerbose(@"IPv6: %@:%hu", [[self class] hostFromAddress:address6], [[self class] portFromAddress:address6]);
-	
-	// Determine socket type
-	
-	BOOL preferIPv6 = (config & kPreferIPv6) ? YES : NO;
-	
-	// Create and bind the sockets
-    
-    if (address4)
-    {
-        LogVerbose(@"Creating IPv4 socket");
-        
-        socket4FD = [self createSocket:AF_INET connectInterface:connectInterface4 errPtr:errPtr];
-    }
-    
-    if (address6)
-    {
-        LogVerbose(@"Creating IPv6 socket");
-        
-        socket6FD = [self createSocket:AF_INET6 connectInterface:connectInterface6 errPtr:errPtr];
-    }
-    
-    if (socket4FD == SOCKET_NULL && socket6FD == SOCKET_NULL)
-    {
-        return NO;
-    }
-	
-	int socketFD, alternateSocketFD;
-	NSData *address, *alternateAddress;
-	
-    if ((preferIPv6 && socket6FD != SOCKET_NULL) || socket4FD == SOCKET_NULL)
-    {
-        socketFD = socket6FD;
-        alternateSocketFD = socket4FD;
-        address = address6;
-        alternateAddress = address4;
-    }
-    else
-    {
-        socketFD = socket4FD;
-        alternateSocketFD = socket6FD;
-        address = address4;
-        alternateAddress = address6;
-    }
-
-    int aStateIndex = stateIndex;
-    
-    [self connectSocket:socketFD address:address stateIndex:aStateIndex];
-    
-    if (alternateAddress)
-    {
-        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(alternateAddressDelay * NSEC_PER_SEC)), socketQueue, ^{
-            [self connectSocket:alternateSocketFD address:alternateAddress stateIndex:aStateIndex];
-        });
-    }
-	
-	return YES;
-}
-
-- (BOOL)connectWithAddressUN:(NSData *)address error:(NSError **)errPtr
+- (BOOL)doAccept:(int)parentSocketFD
 {
 	LogTrace();
 	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	// Create the socket
-	
-	int socketFD;
-	
-	LogVerbose(@"Creating unix domain socket");
-	
-	socketUN = socket(AF_UNIX, SOCK_STREAM, 0);
-	
-	socketFD = socketUN;
+	int socketType;
+	int childSocketFD;
+	NSData *childSocketAddress;
 	
-	if (socketFD == SOCKET_NULL)
+	if (parentSocketFD == socket4FD)
 	{
-		if (errPtr)
-			*errPtr = [self errorWithErrno:errno reason:@"Error in socket() function"];
+		socketType = 0;
 		
-		return NO;
+		struct sockaddr_in addr;
+		socklen_t addrLen = sizeof(addr);
+		
+		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		
+		if (childSocketFD == -1)
+		{
+			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			return NO;
+		}
+		
+		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+	}
+	else if (parentSocketFD == socket6FD)
+	{
+		socketType = 1;
+		
+		struct sockaddr_in6 addr;
+		socklen_t addrLen = sizeof(addr);
+		
+		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		
+		if (childSocketFD == -1)
+		{
+			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			return NO;
+		}
+		
+		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+	}
+	else // if (parentSocketFD == socketUN)
+	{
+		socketType = 2;
+		
+		struct sockaddr_un addr;
+		socklen_t addrLen = sizeof(addr);
+		
+		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		
+		if (childSocketFD == -1)
+		{
+			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			return NO;
+		}
+		
+		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
 	}
 	
-	// Bind the socket to the desired interface (if needed)
-	
-	LogVerbose(@"Binding socket...");
+	// Enable non-blocking IO on the socket
 	
-	int reuseOn = 1;
-	setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-
-//	const struct sockaddr *interfaceAddr = (const struct sockaddr *)[address bytes];
-//	
-//	int result = bind(socketFD, interfaceAddr, (socklen_t)[address length]);
-//	if (result != 0)
-//	{
-//		if (errPtr)
-//			*errPtr = [self errnoErrorWithReason:@"Error in bind() function"];
-//		
-//		return NO;
-//	}
+	int result = fcntl(childSocketFD, F_SETFL, O_NONBLOCK);
+	if (result == -1)
+	{
+		LogWarn(@"Error enabling non-blocking IO on accepted socket (fcntl)");
+		LogVerbose(@"close(childSocketFD)");
+		close(childSocketFD);
+		return NO;
+	}
 	
 	// Prevent SIGPIPE signals
 	
 	int nosigpipe = 1;
-	setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	setsockopt(childSocketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
 	
-	// Start the connection process in a background queue
-	
-	int aStateIndex = stateIndex;
+	// Notify delegate
 	
-	dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-	dispatch_async(globalConcurrentQueue, ^{
+	if (delegateQueue)
+	{
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
 		
-		const struct sockaddr *addr = (const struct sockaddr *)[address bytes];
-		int result = connect(socketFD, addr, addr->sa_len);
-		if (result == 0)
-		{
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
-				
-				[self didConnect:aStateIndex];
-			}});
-		}
-		else
-		{
-			// TODO: Bad file descriptor
-			perror("connect");
-			NSError *error = [self errorWithErrno:errno reason:@"Error in connect() function"];
+		dispatch_async(delegateQueue, ^{ @autoreleasepool {
 			
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+			// Query delegate for custom socket queue
+			
+			dispatch_queue_t childSocketQueue = NULL;
+			
+			if ([theDelegate respondsToSelector:@selector(newSocketQueueForConnectionFromAddress:onSocket:)])
+			{
+				childSocketQueue = [theDelegate newSocketQueueForConnectionFromAddress:childSocketAddress
+				                                                              onSocket:self];
+			}
+			
+			// Create GCDAsyncSocket instance for accepted socket
+			
+			GCDAsyncSocket *acceptedSocket = [[[self class] alloc] initWithDelegate:theDelegate
+                                                                      delegateQueue:self->delegateQueue
+																		socketQueue:childSocketQueue];
+			
+			if (socketType == 0)
+				acceptedSocket->socket4FD = childSocketFD;
+			else if (socketType == 1)
+				acceptedSocket->socket6FD = childSocketFD;
+			else
+				acceptedSocket->socketUN = childSocketFD;
+			
+			acceptedSocket->flags = (kSocketStarted | kConnected);
+			
+			// Setup read and write sources for accepted socket
+			
+			dispatch_async(acceptedSocket->socketQueue, ^{ @autoreleasepool {
 				
-				[self didNotConnect:aStateIndex error:error];
+				[acceptedSocket setupReadAndWriteSourcesForNewlyConnectedSocket:childSocketFD];
 			}});
-		}
-	});
-	
-	LogVerbose(@"Connecting...");
+			
+			// Notify delegate
+			
+			if ([theDelegate respondsToSelector:@selector(socket:didAcceptNewSocket:)])
+			{
+				[theDelegate socket:self didAcceptNewSocket:acceptedSocket];
+			}
+			
+			// Release the socket queue returned from the delegate (it was retained by acceptedSocket)
+			#if !OS_OBJECT_USE_OBJC
+			if (childSocketQueue) dispatch_release(childSocketQueue);
+			#endif
+			
+			// The accepted socket should have been retained by the delegate.
+			// Otherwise it gets properly released when exiting the block.
+		}});
+	}
 	
 	return YES;
 }
 
-- (void)didConnect:(int)aStateIndex
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Connecting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * This method runs through the various checks required prior to a connection attempt.
+ * It is shared between the connectToHost and connectToAddress methods.
+ * 
+**/
+- (BOOL)preConnectWithInterface:(NSString *)interface error:(NSError **)errPtr
 {
-	LogTrace();
-	
 	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	
-	if (aStateIndex != stateIndex)
+	if (delegate == nil) // Must have delegate set
 	{
-		LogInfo(@"Ignoring didConnect, already disconnected");
-		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
 	}
 	
-	flags |= kConnected;
-	
-	[self endConnectTimeout];
-	
-	#if TARGET_OS_IPHONE
-	// The endConnectTimeout method executed above incremented the stateIndex.
-	aStateIndex = stateIndex;
-	#endif
-	
-	// Setup read/write streams (as workaround for specific shortcomings in the iOS platform)
-	// 
-	// Note:
-	// There may be configuration options that must be set by the delegate before opening the streams.
-	// The primary example is the kCFStreamNetworkServiceTypeVoIP flag, which only works on an unopened stream.
-	// 
-	// Thus we wait until after the socket:didConnectToHost:port: delegate method has completed.
-	// This gives the delegate time to properly configure the streams if needed.
+	if (delegateQueue == NULL) // Must have delegate queue set
+	{
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
+	}
 	
-	dispatch_block_t SetupStreamsPart1 = ^{
-		#if TARGET_OS_IPHONE
-		
-		if (![self createReadAndWriteStream])
+	if (![self isDisconnected]) // Must be disconnected
+	{
+		if (errPtr)
 		{
-			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
-			return;
+			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
+			*errPtr = [self badConfigError:msg];
 		}
-		
-		if (![self registerForStreamCallbacksIncludingReadWrite:NO])
+		return NO;
+	}
+	
+	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	
+	if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+	{
+		if (errPtr)
 		{
-			[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
-			return;
+			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
+			*errPtr = [self badConfigError:msg];
 		}
+		return NO;
+	}
+	
+	if (interface)
+	{
+		NSMutableData *interface4 = nil;
+		NSMutableData *interface6 = nil;
 		
-		#endif
-	};
-	dispatch_block_t SetupStreamsPart2 = ^{
-		#if TARGET_OS_IPHONE
+		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:0];
 		
-        if (aStateIndex != self->stateIndex)
+		if ((interface4 == nil) && (interface6 == nil))
 		{
-			// The socket has been disconnected.
-			return;
+			if (errPtr)
+			{
+				NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
 		}
 		
-		if (![self addStreamsToRunLoop])
+		if (isIPv4Disabled && (interface6 == nil))
 		{
-			[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
-			return;
+			if (errPtr)
+			{
+				NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
 		}
 		
-		if (![self openStreams])
+		if (isIPv6Disabled && (interface4 == nil))
 		{
-			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
-			return;
+			if (errPtr)
+			{
+				NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
 		}
 		
-		#endif
-	};
-	
-	// Notify delegate
+		connectInterface4 = interface4;
+		connectInterface6 = interface6;
+	}
 	
-	NSString *host = [self connectedHost];
-	uint16_t port = [self connectedPort];
-	NSURL *url = [self connectedUrl];
+	// Clear queues (spurious read/write requests post disconnect)
+	[readQueue removeAllObjects];
+	[writeQueue removeAllObjects];
 	
-	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+	return YES;
+}
 
-	if (delegateQueue && host != nil && [theDelegate respondsToSelector:@selector(socket:didConnectToHost:port:)])
+- (BOOL)preConnectWithUrl:(NSURL *)url error:(NSError **)errPtr
+{
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	if (delegate == nil) // Must have delegate set
 	{
-		SetupStreamsPart1();
-		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			[theDelegate socket:self didConnectToHost:host port:port];
-			
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
-				
-				SetupStreamsPart2();
-			}});
-		}});
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
 	}
-	else if (delegateQueue && url != nil && [theDelegate respondsToSelector:@selector(socket:didConnectToUrl:)])
+	
+	if (delegateQueue == NULL) // Must have delegate queue set
 	{
-		SetupStreamsPart1();
-		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			[theDelegate socket:self didConnectToUrl:url];
-			
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
-				
-				SetupStreamsPart2();
-			}});
-		}});
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
 	}
-	else
+	
+	if (![self isDisconnected]) // Must be disconnected
 	{
-		SetupStreamsPart1();
-		SetupStreamsPart2();
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
 	}
-		
-	// Get the connected socket
 	
-	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
-	
-	// Enable non-blocking IO on the socket
+	NSData *interface = [self getInterfaceAddressFromUrl:url];
 	
-	int result = fcntl(socketFD, F_SETFL, O_NONBLOCK);
-	if (result == -1)
+	if (interface == nil)
 	{
-		NSString *errMsg = @"Error enabling non-blocking IO on socket (fcntl)";
-		[self closeWithError:[self otherError:errMsg]];
-		
-		return;
+		if (errPtr)
+		{
+			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
+			*errPtr = [self badParamError:msg];
+		}
+		return NO;
 	}
 	
-	// Setup our read/write sources
-	
-	[self setupReadAndWriteSourcesForNewlyConnectedSocket:socketFD];
+	connectInterfaceUN = interface;
 	
-	// Dequeue any pending read/write requests
+	// Clear queues (spurious read/write requests post disconnect)
+	[readQueue removeAllObjects];
+	[writeQueue removeAllObjects];
 	
-	[self maybeDequeueRead];
-	[self maybeDequeueWrite];
+	return YES;
 }
 
-- (void)didNotConnect:(int)aStateIndex error:(NSError *)error
+- (BOOL)connectToHost:(NSString*)host onPort:(uint16_t)port error:(NSError **)errPtr
+{
+	return [self connectToHost:host onPort:port withTimeout:-1 error:errPtr];
+}
+
+- (BOOL)connectToHost:(NSString *)host
+               onPort:(uint16_t)port
+          withTimeout:(NSTimeInterval)timeout
+                error:(NSError **)errPtr
+{
+	return [self connectToHost:host onPort:port viaInterface:nil withTimeout:timeout error:errPtr];
+}
+
+- (BOOL)connectToHost:(NSString *)inHost
+               onPort:(uint16_t)port
+         viaInterface:(NSString *)inInterface
+          withTimeout:(NSTimeInterval)timeout
+                error:(NSError **)errPtr
 {
 	LogTrace();
 	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	// Just in case immutable objects were passed
+	NSString *host = [inHost copy];
+	NSString *interface = [inInterface copy];
 	
+	__block BOOL result = NO;
+	__block NSError *preConnectErr = nil;
 	
-	if (aStateIndex != stateIndex)
-	{
-		LogInfo(@"Ignoring didNotConnect, already disconnected");
+	dispatch_block_t block = ^{ @autoreleasepool {
 		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
-	}
-	
-	[self closeWithError:error];
-}
-
-- (void)startConnectTimeout:(NSTimeInterval)timeout
-{
-	if (timeout >= 0.0)
-	{
-		connectTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
+		// Check for problems with host parameter
+		
+		if ([host length] == 0)
+		{
+			NSString *msg = @"Invalid host parameter (nil or \"\"). Should be a domain name or IP address string.";
+			preConnectErr = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		// Run through standard pre-connect checks
+		
+		if (![self preConnectWithInterface:interface error:&preConnectErr])
+		{
+			return_from_block;
+		}
+		
+		// We've made it past all the checks.
+		// It's time to start the connection process.
+		
+        self->flags |= kSocketStarted;
+		
+		LogVerbose(@"Dispatching DNS lookup...");
+		
+		// It's possible that the given host parameter is actually a NSMutableString.
+		// So we want to copy it now, within this block that will be executed synchronously.
+		// This way the asynchronous lookup block below doesn't have to worry about it changing.
+		
+		NSString *hostCpy = [host copy];
 		
+        int aStateIndex = self->stateIndex;
 		__weak GCDAsyncSocket *weakSelf = self;
 		
-		dispatch_source_set_event_handler(connectTimer, ^{ @autoreleasepool {
+		dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+		dispatch_async(globalConcurrentQueue, ^{ @autoreleasepool {
 		#pragma clang diagnostic push
 		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
+			
+			NSError *lookupErr = nil;
+			NSMutableArray *addresses = [[self class] lookupHost:hostCpy port:port error:&lookupErr];
+			
 			__strong GCDAsyncSocket *strongSelf = weakSelf;
 			if (strongSelf == nil) return_from_block;
 			
-			[strongSelf doConnectTimeout];
+			if (lookupErr)
+			{
+				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+					
+					[strongSelf lookup:aStateIndex didFail:lookupErr];
+				}});
+			}
+			else
+			{
+				NSData *address4 = nil;
+				NSData *address6 = nil;
+				
+				for (NSData *address in addresses)
+				{
+					if (!address4 && [[self class] isIPv4Address:address])
+					{
+						address4 = address;
+					}
+					else if (!address6 && [[self class] isIPv6Address:address])
+					{
+						address6 = address;
+					}
+				}
+				
+				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+					
+					[strongSelf lookup:aStateIndex didSucceedWithAddress4:address4 address6:address6];
+				}});
+			}
 			
 		#pragma clang diagnostic pop
 		}});
 		
-		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theConnectTimer = connectTimer;
-		dispatch_source_set_cancel_handler(connectTimer, ^{
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			LogVerbose(@"dispatch_release(connectTimer)");
-			dispatch_release(theConnectTimer);
-			
-		#pragma clang diagnostic pop
-		});
-		#endif
-		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
-		dispatch_source_set_timer(connectTimer, tt, DISPATCH_TIME_FOREVER, 0);
+		[self startConnectTimeout:timeout];
 		
-		dispatch_resume(connectTimer);
-	}
-}
-
-- (void)endConnectTimeout
-{
-	LogTrace();
-	
-	if (connectTimer)
-	{
-		dispatch_source_cancel(connectTimer);
-		connectTimer = NULL;
-	}
+		result = YES;
+	}};
 	
-	// Increment stateIndex.
-	// This will prevent us from processing results from any related background asynchronous operations.
-	// 
-	// Note: This should be called from close method even if connectTimer is NULL.
-	// This is because one might disconnect a socket prior to a successful connection which had no timeout.
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	stateIndex++;
 	
-	if (connectInterface4)
-	{
-		connectInterface4 = nil;
-	}
-	if (connectInterface6)
-	{
-		connectInterface6 = nil;
-	}
+	if (errPtr) *errPtr = preConnectErr;
+	return result;
 }
 
-- (void)doConnectTimeout
+- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
 {
-	LogTrace();
-	
-	[self endConnectTimeout];
-	[self closeWithError:[self connectTimeoutError]];
+	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Disconnecting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+{
+	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
+}
 
-- (void)closeWithError:(NSError *)error
+- (BOOL)connectToAddress:(NSData *)inRemoteAddr
+            viaInterface:(NSString *)inInterface
+             withTimeout:(NSTimeInterval)timeout
+                   error:(NSError **)errPtr
 {
 	LogTrace();
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	[self endConnectTimeout];
-	
-	if (currentRead != nil)  [self endCurrentRead];
-	if (currentWrite != nil) [self endCurrentWrite];
 	
-	[readQueue removeAllObjects];
-	[writeQueue removeAllObjects];
+	// Just in case immutable objects were passed
+	NSData *remoteAddr = [inRemoteAddr copy];
+	NSString *interface = [inInterface copy];
 	
-	[preBuffer reset];
+	__block BOOL result = NO;
+	__block NSError *err = nil;
 	
-	#if TARGET_OS_IPHONE
-	{
-		if (readStream || writeStream)
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		// Check for problems with remoteAddr parameter
+		
+		NSData *address4 = nil;
+		NSData *address6 = nil;
+		
+		if ([remoteAddr length] >= sizeof(struct sockaddr))
 		{
-			[self removeStreamsFromRunLoop];
+			const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
 			
-			if (readStream)
-			{
-				CFReadStreamSetClient(readStream, kCFStreamEventNone, NULL, NULL);
-				CFReadStreamClose(readStream);
-				CFRelease(readStream);
-				readStream = NULL;
-			}
-			if (writeStream)
+			if (sockaddr->sa_family == AF_INET)
 			{
-				CFWriteStreamSetClient(writeStream, kCFStreamEventNone, NULL, NULL);
-				CFWriteStreamClose(writeStream);
-				CFRelease(writeStream);
-				writeStream = NULL;
+				if ([remoteAddr length] == sizeof(struct sockaddr_in))
+				{
+					address4 = remoteAddr;
+				}
+			}
+			else if (sockaddr->sa_family == AF_INET6)
+			{
+				if ([remoteAddr length] == sizeof(struct sockaddr_in6))
+				{
+					address6 = remoteAddr;
+				}
 			}
-		}
-	}
-	#endif
-	
-	[sslPreBuffer reset];
-	sslErrCode = lastSSLHandshakeError = noErr;
-	
-	if (sslContext)
-	{
-		// Getting a linker error here about the SSLx() functions?
-		// You need to add the Security Framework to your application.
-		
-		SSLClose(sslContext);
-		
-		#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
-		CFRelease(sslContext);
-		#else
-		SSLDisposeContext(sslContext);
-		#endif
-		
-		sslContext = NULL;
-	}
-	
-	// For some crazy reason (in my opinion), cancelling a dispatch source doesn't
-	// invoke the cancel handler if the dispatch source is paused.
-	// So we have to unpause the source if needed.
-	// This allows the cancel handler to be run, which in turn releases the source and closes the socket.
-	
-	if (!accept4Source && !accept6Source && !acceptUNSource && !readSource && !writeSource)
-	{
-		LogVerbose(@"manually closing close");
-
-		if (socket4FD != SOCKET_NULL)
-		{
-			LogVerbose(@"close(socket4FD)");
-			close(socket4FD);
-			socket4FD = SOCKET_NULL;
-		}
-
-		if (socket6FD != SOCKET_NULL)
-		{
-			LogVerbose(@"close(socket6FD)");
-			close(socket6FD);
-			socket6FD = SOCKET_NULL;
 		}
 		
-		if (socketUN != SOCKET_NULL)
-		{
-			LogVerbose(@"close(socketUN)");
-			close(socketUN);
-			socketUN = SOCKET_NULL;
-			unlink(socketUrl.path.fileSystemRepresentation);
-			socketUrl = nil;
-		}
-	}
-	else
-	{
-		if (accept4Source)
+		if ((address4 == nil) && (address6 == nil))
 		{
-			LogVerbose(@"dispatch_source_cancel(accept4Source)");
-			dispatch_source_cancel(accept4Source);
-			
-			// We never suspend accept4Source
+			NSString *msg = @"A valid IPv4 or IPv6 address was not given";
+			err = [self badParamError:msg];
 			
-			accept4Source = NULL;
+			return_from_block;
 		}
 		
-		if (accept6Source)
+        BOOL isIPv4Disabled = (self->config & kIPv4Disabled) ? YES : NO;
+        BOOL isIPv6Disabled = (self->config & kIPv6Disabled) ? YES : NO;
+		
+		if (isIPv4Disabled && (address4 != nil))
 		{
-			LogVerbose(@"dispatch_source_cancel(accept6Source)");
-			dispatch_source_cancel(accept6Source);
-			
-			// We never suspend accept6Source
+			NSString *msg = @"IPv4 has been disabled and an IPv4 address was passed.";
+			err = [self badParamError:msg];
 			
-			accept6Source = NULL;
+			return_from_block;
 		}
 		
-		if (acceptUNSource)
+		if (isIPv6Disabled && (address6 != nil))
 		{
-			LogVerbose(@"dispatch_source_cancel(acceptUNSource)");
-			dispatch_source_cancel(acceptUNSource);
-			
-			// We never suspend acceptUNSource
+			NSString *msg = @"IPv6 has been disabled and an IPv6 address was passed.";
+			err = [self badParamError:msg];
 			
-			acceptUNSource = NULL;
+			return_from_block;
 		}
-	
-		if (readSource)
+		
+		// Run through standard pre-connect checks
+		
+		if (![self preConnectWithInterface:interface error:&err])
 		{
-			LogVerbose(@"dispatch_source_cancel(readSource)");
-			dispatch_source_cancel(readSource);
-			
-			[self resumeReadSource];
-			
-			readSource = NULL;
+			return_from_block;
 		}
 		
-		if (writeSource)
+		// We've made it past all the checks.
+		// It's time to start the connection process.
+		
+		if (![self connectWithAddress4:address4 address6:address6 error:&err])
 		{
-			LogVerbose(@"dispatch_source_cancel(writeSource)");
-			dispatch_source_cancel(writeSource);
-			
-			[self resumeWriteSource];
-			
-			writeSource = NULL;
+			return_from_block;
 		}
 		
-		// The sockets will be closed by the cancel handlers of the corresponding source
+        self->flags |= kSocketStarted;
+		
+		[self startConnectTimeout:timeout];
 		
-		socket4FD = SOCKET_NULL;
-		socket6FD = SOCKET_NULL;
-		socketUN = SOCKET_NULL;
-	}
-	
-	// If the client has passed the connect/accept method, then the connection has at least begun.
-	// Notify delegate that it is now ending.
-	BOOL shouldCallDelegate = (flags & kSocketStarted) ? YES : NO;
-	BOOL isDeallocating = (flags & kDealloc) ? YES : NO;
+		result = YES;
+	}};
 	
-	// Clear stored socket info and all flags (config remains as is)
-	socketFDBytesAvailable = 0;
-	flags = 0;
-	sslWriteCachedLength = 0;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	if (shouldCallDelegate)
+	if (result == NO)
 	{
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-		__strong id theSelf = isDeallocating ? nil : self;
-		
-		if (delegateQueue && [theDelegate respondsToSelector: @selector(socketDidDisconnect:withError:)])
-		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
-				
-				[theDelegate socketDidDisconnect:theSelf withError:error];
-			}});
-		}	
+		if (errPtr)
+			*errPtr = err;
 	}
+	
+	return result;
 }
 
-- (void)disconnect
+- (BOOL)connectToUrl:(NSURL *)url withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
 {
+	LogTrace();
+	
+	__block BOOL result = NO;
+	__block NSError *err = nil;
+	
 	dispatch_block_t block = ^{ @autoreleasepool {
 		
-        if (self->flags & kSocketStarted)
+		// Check for problems with host parameter
+		
+		if ([url.path length] == 0)
 		{
-			[self closeWithError:nil];
+			NSString *msg = @"Invalid unix domain socket url.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		// Run through standard pre-connect checks
+		
+		if (![self preConnectWithUrl:url error:&err])
+		{
+			return_from_block;
+		}
+		
+		// We've made it past all the checks.
+		// It's time to start the connection process.
+		
+        self->flags |= kSocketStarted;
+		
+		// Start the normal connection process
+		
+		NSError *connectError = nil;
+        if (![self connectWithAddressUN:self->connectInterfaceUN error:&connectError])
+		{
+			[self closeWithError:connectError];
+			
+			return_from_block;
 		}
+
+		[self startConnectTimeout:timeout];
+		
+		result = YES;
 	}};
 	
-	// Synchronous disconnection, as documented in the header file
-	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 		block();
 	else
 		dispatch_sync(socketQueue, block);
+	
+	if (result == NO)
+	{
+		if (errPtr)
+			*errPtr = err;
+	}
+	
+	return result;
 }
 
-- (void)disconnectAfterReading
+- (BOOL)connectToNetService:(NSNetService *)netService error:(NSError **)errPtr
 {
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-        if (self->flags & kSocketStarted)
+	NSArray* addresses = [netService addresses];
+	for (NSData* address in addresses)
+	{
+		BOOL result = [self connectToAddress:address error:errPtr];
+		if (result)
 		{
-            self->flags |= (kForbidReadsWrites | kDisconnectAfterReads);
-			[self maybeClose];
+			return YES;
 		}
-	}});
+	}
+	
+	return NO;
 }
 
-- (void)disconnectAfterWriting
+- (void)lookup:(int)aStateIndex didSucceedWithAddress4:(NSData *)address4 address6:(NSData *)address6
 {
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert(address4 || address6, @"Expected at least one valid address");
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring lookupDidSucceed, already disconnected");
 		
-        if (self->flags & kSocketStarted)
-		{
-            self->flags |= (kForbidReadsWrites | kDisconnectAfterWrites);
-			[self maybeClose];
-		}
-	}});
-}
-
-- (void)disconnectAfterReadingAndWriting
-{
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-        if (self->flags & kSocketStarted)
-		{
-            self->flags |= (kForbidReadsWrites | kDisconnectAfterReads | kDisconnectAfterWrites);
-			[self maybeClose];
-		}
-	}});
-}
-
-/**
- * Closes the socket if possible.
- * That is, if all writes have completed, and we're set to disconnect after writing,
- * or if all reads have completed, and we're set to disconnect after reading.
-**/
-- (void)maybeClose
-{
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
 	
-	BOOL shouldClose = NO;
+	// Check for problems
 	
-	if (flags & kDisconnectAfterReads)
+	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	
+	if (isIPv4Disabled && (address6 == nil))
 	{
-		if (([readQueue count] == 0) && (currentRead == nil))
-		{
-			if (flags & kDisconnectAfterWrites)
-			{
-				if (([writeQueue count] == 0) && (currentWrite == nil))
-				{
-					shouldClose = YES;
-				}
-			}
-			else
-			{
-				shouldClose = YES;
-			}
-		}
+		NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
+		
+		[self closeWithError:[self otherError:msg]];
+		return;
 	}
-	else if (flags & kDisconnectAfterWrites)
+	
+	if (isIPv6Disabled && (address4 == nil))
 	{
-		if (([writeQueue count] == 0) && (currentWrite == nil))
-		{
-			shouldClose = YES;
-		}
+		NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
+		
+		[self closeWithError:[self otherError:msg]];
+		return;
 	}
 	
-	if (shouldClose)
+	// Start the normal connection process
+	
+	NSError *err = nil;
+	if (![self connectWithAddress4:address4 address6:address6 error:&err])
 	{
-		[self closeWithError:nil];
+		[self closeWithError:err];
 	}
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Errors
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (NSError *)badConfigError:(NSString *)errMsg
+/**
+ * This method is called if the DNS lookup fails.
+ * This method is executed on the socketQueue.
+ * 
+ * Since the DNS lookup executed synchronously on a global concurrent queue,
+ * the original connection request may have already been cancelled or timed-out by the time this method is invoked.
+ * The lookupIndex tells us whether the lookup is still valid or not.
+**/
+- (void)lookup:(int)aStateIndex didFail:(NSError *)error
 {
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	LogTrace();
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadConfigError userInfo:userInfo];
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring lookup:didFail: - already disconnected");
+		
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
+	
+	[self endConnectTimeout];
+	[self closeWithError:error];
 }
 
-- (NSError *)badParamError:(NSString *)errMsg
+- (BOOL)bindSocket:(int)socketFD toInterface:(NSData *)connectInterface error:(NSError **)errPtr
 {
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadParamError userInfo:userInfo];
+    // Bind the socket to the desired interface (if needed)
+    
+    if (connectInterface)
+    {
+        LogVerbose(@"Binding socket...");
+        
+        if ([[self class] portFromAddress:connectInterface] > 0)
+        {
+            // Since we're going to be binding to a specific port,
+            // we should turn on reuseaddr to allow us to override sockets in time_wait.
+            
+            int reuseOn = 1;
+            setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+        }
+        
+        const struct sockaddr *interfaceAddr = (const struct sockaddr *)[connectInterface bytes];
+        
+        int result = bind(socketFD, interfaceAddr, (socklen_t)[connectInterface length]);
+        if (result != 0)
+        {
+            if (errPtr)
+                *errPtr = [self errorWithErrno:errno reason:@"Error in bind() function"];
+            
+            return NO;
+        }
+    }
+    
+    return YES;
 }
 
-+ (NSError *)gaiError:(int)gai_error
+- (int)createSocket:(int)family connectInterface:(NSData *)connectInterface errPtr:(NSError **)errPtr
 {
-	NSString *errMsg = [NSString stringWithCString:gai_strerror(gai_error) encoding:NSASCIIStringEncoding];
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
-	
-	return [NSError errorWithDomain:@"kCFStreamErrorDomainNetDB" code:gai_error userInfo:userInfo];
+    int socketFD = socket(family, SOCK_STREAM, 0);
+    
+    if (socketFD == SOCKET_NULL)
+    {
+        if (errPtr)
+            *errPtr = [self errorWithErrno:errno reason:@"Error in socket() function"];
+        
+        return socketFD;
+    }
+    
+    if (![self bindSocket:socketFD toInterface:connectInterface error:errPtr])
+    {
+        [self closeSocket:socketFD];
+        
+        return SOCKET_NULL;
+    }
+    
+    // Prevent SIGPIPE signals
+    
+    int nosigpipe = 1;
+    setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+    
+    return socketFD;
 }
 
-- (NSError *)errorWithErrno:(int)err reason:(NSString *)reason
+- (void)connectSocket:(int)socketFD address:(NSData *)address stateIndex:(int)aStateIndex
 {
-	NSString *errMsg = [NSString stringWithUTF8String:strerror(err)];
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg,
-							   NSLocalizedFailureReasonErrorKey : reason};
-	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:userInfo];
+    // If there already is a socket connected, we close socketFD and return
+    if (self.isConnected)
+    {
+        [self closeSocket:socketFD];
+        return;
+    }
+    
+    // Start the connection process in a background queue
+    
+    __weak GCDAsyncSocket *weakSelf = self;
+    
+    dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_async(globalConcurrentQueue, ^{
+#pragma clang diagnostic push
+#pragma clang diagnostic warning "-Wimplicit-retain-self"
+        
+        int result = connect(socketFD, (const struct sockaddr *)[address bytes], (socklen_t)[address length]);
+        int err = errno;
+        
+        __strong GCDAsyncSocket *strongSelf = weakSelf;
+        if (strongSelf == nil) return_from_block;
+        
+        dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+            
+            if (strongSelf.isConnected)
+            {
+                [strongSelf closeSocket:socketFD];
+                return_from_block;
+            }
+            
+            if (result == 0)
+            {
+                [self closeUnusedSocket:socketFD];
+                
+                [strongSelf didConnect:aStateIndex];
+            }
+            else
+            {
+                [strongSelf closeSocket:socketFD];
+                
+                // If there are no more sockets trying to connect, we inform the error to the delegate
+                if (strongSelf.socket4FD == SOCKET_NULL && strongSelf.socket6FD == SOCKET_NULL)
+                {
+                    NSError *error = [strongSelf errorWithErrno:err reason:@"Error in connect() function"];
+                    [strongSelf didNotConnect:aStateIndex error:error];
+                }
+            }
+        }});
+        
+#pragma clang diagnostic pop
+    });
+    
+    LogVerbose(@"Connecting...");
 }
 
-- (NSError *)errnoError
+- (void)closeSocket:(int)socketFD
 {
-	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
-	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+    if (socketFD != SOCKET_NULL &&
+        (socketFD == socket6FD || socketFD == socket4FD))
+    {
+        close(socketFD);
+        
+        if (socketFD == socket4FD)
+        {
+            LogVerbose(@"close(socket4FD)");
+            socket4FD = SOCKET_NULL;
+        }
+        else if (socketFD == socket6FD)
+        {
+            LogVerbose(@"close(socket6FD)");
+            socket6FD = SOCKET_NULL;
+        }
+    }
 }
 
-- (NSError *)sslError:(OSStatus)ssl_error
+- (void)closeUnusedSocket:(int)usedSocketFD
 {
-	NSString *msg = @"Error code definition can be found in Apple's SecureTransport.h";
-	NSDictionary *userInfo = @{NSLocalizedRecoverySuggestionErrorKey : msg};
-	
-	return [NSError errorWithDomain:@"kCFStreamErrorDomainSSL" code:ssl_error userInfo:userInfo];
+    if (usedSocketFD != socket4FD)
+    {
+        [self closeSocket:socket4FD];
+    }
+    else if (usedSocketFD != socket6FD)
+    {
+        [self closeSocket:socket6FD];
+    }
 }
 
-- (NSError *)connectTimeoutError
+- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketConnectTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Attempt to connect to host timed out", nil);
-	
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	LogTrace();
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketConnectTimeoutError userInfo:userInfo];
-}
-
-/**
- * Returns a standard AsyncSocket maxed out error.
-**/
-- (NSError *)readMaxedOutError
-{
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadMaxedOutError",
-														 @"GCDAsyncSocket", [NSBundle mainBundle],
-														 @"Read operation reached set maximum length", nil);
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	NSDictionary *info = @{NSLocalizedDescriptionKey : errMsg};
+	LogVerbose(@"IPv4: %@:%hu", [[self class] hostFromAddress:address4], [[self class] portFromAddress:address4]);
+	LogVerbose(@"IPv6: %@:%hu", [[self class] hostFromAddress:address6], [[self class] portFromAddress:address6]);
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadMaxedOutError userInfo:info];
-}
-
-/**
- * Returns a standard AsyncSocket write timeout error.
-**/
-- (NSError *)readTimeoutError
-{
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Read operation timed out", nil);
+	// Determine socket type
 	
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	BOOL preferIPv6 = (config & kPreferIPv6) ? YES : NO;
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadTimeoutError userInfo:userInfo];
-}
-
-/**
- * Returns a standard AsyncSocket write timeout error.
-**/
-- (NSError *)writeTimeoutError
-{
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketWriteTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Write operation timed out", nil);
+	// Create and bind the sockets
+    
+    if (address4)
+    {
+        LogVerbose(@"Creating IPv4 socket");
+        
+        socket4FD = [self createSocket:AF_INET connectInterface:connectInterface4 errPtr:errPtr];
+    }
+    
+    if (address6)
+    {
+        LogVerbose(@"Creating IPv6 socket");
+        
+        socket6FD = [self createSocket:AF_INET6 connectInterface:connectInterface6 errPtr:errPtr];
+    }
+    
+    if (socket4FD == SOCKET_NULL && socket6FD == SOCKET_NULL)
+    {
+        return NO;
+    }
 	
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	int socketFD, alternateSocketFD;
+	NSData *address, *alternateAddress;
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketWriteTimeoutError userInfo:userInfo];
-}
+    if ((preferIPv6 && socket6FD != SOCKET_NULL) || socket4FD == SOCKET_NULL)
+    {
+        socketFD = socket6FD;
+        alternateSocketFD = socket4FD;
+        address = address6;
+        alternateAddress = address4;
+    }
+    else
+    {
+        socketFD = socket4FD;
+        alternateSocketFD = socket6FD;
+        address = address4;
+        alternateAddress = address6;
+    }
 
-- (NSError *)connectionClosedError
-{
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketClosedError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Socket closed by remote peer", nil);
-	
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+    int aStateIndex = stateIndex;
+    
+    [self connectSocket:socketFD address:address stateIndex:aStateIndex];
+    
+    if (alternateAddress)
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(alternateAddressDelay * NSEC_PER_SEC)), socketQueue, ^{
+            [self connectSocket:alternateSocketFD address:alternateAddress stateIndex:aStateIndex];
+        });
+    }
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketClosedError userInfo:userInfo];
+	return YES;
 }
 
-- (NSError *)otherError:(NSString *)errMsg
+- (BOOL)connectWithAddressUN:(NSData *)address error:(NSError **)errPtr
 {
-	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	LogTrace();
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Diagnostics
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (BOOL)isDisconnected
-{
-	__block BOOL result = NO;
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	dispatch_block_t block = ^{
-        result = (self->flags & kSocketStarted) ? NO : YES;
-	};
+	// Create the socket
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	int socketFD;
 	
-	return result;
-}
-
-- (BOOL)isConnected
-{
-	__block BOOL result = NO;
+	LogVerbose(@"Creating unix domain socket");
 	
-	dispatch_block_t block = ^{
-        result = (self->flags & kConnected) ? YES : NO;
-	};
+	socketUN = socket(AF_UNIX, SOCK_STREAM, 0);
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	socketFD = socketUN;
 	
-	return result;
-}
-
-- (NSString *)connectedHost
-{
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (socketFD == SOCKET_NULL)
 	{
-		if (socket4FD != SOCKET_NULL)
-			return [self connectedHostFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self connectedHostFromSocket6:socket6FD];
+		if (errPtr)
+			*errPtr = [self errorWithErrno:errno reason:@"Error in socket() function"];
 		
-		return nil;
+		return NO;
 	}
-	else
-	{
-		__block NSString *result = nil;
+	
+	// Bind the socket to the desired interface (if needed)
+	
+	LogVerbose(@"Binding socket...");
+	
+	int reuseOn = 1;
+	setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+
+//	const struct sockaddr *interfaceAddr = (const struct sockaddr *)[address bytes];
+//	
+//	int result = bind(socketFD, interfaceAddr, (socklen_t)[address length]);
+//	if (result != 0)
+//	{
+//		if (errPtr)
+//			*errPtr = [self errnoErrorWithReason:@"Error in bind() function"];
+//		
+//		return NO;
+//	}
+	
+	// Prevent SIGPIPE signals
+	
+	int nosigpipe = 1;
+	setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	
+	// Start the connection process in a background queue
+	
+	int aStateIndex = stateIndex;
+	
+	dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	dispatch_async(globalConcurrentQueue, ^{
 		
-		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+		const struct sockaddr *addr = (const struct sockaddr *)[address bytes];
+		int result = connect(socketFD, addr, addr->sa_len);
+		if (result == 0)
+		{
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self didConnect:aStateIndex];
+			}});
+		}
+		else
+		{
+			// TODO: Bad file descriptor
+			perror("connect");
+			NSError *error = [self errorWithErrno:errno reason:@"Error in connect() function"];
 			
-            if (self->socket4FD != SOCKET_NULL)
-                result = [self connectedHostFromSocket4:self->socket4FD];
-            else if (self->socket6FD != SOCKET_NULL)
-                result = [self connectedHostFromSocket6:self->socket6FD];
-		}});
-		
-		return result;
-	}
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self didNotConnect:aStateIndex error:error];
+			}});
+		}
+	});
+	
+	LogVerbose(@"Connecting...");
+	
+	return YES;
 }
 
-- (uint16_t)connectedPort
+- (void)didConnect:(int)aStateIndex
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
 	{
-		if (socket4FD != SOCKET_NULL)
-			return [self connectedPortFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self connectedPortFromSocket6:socket6FD];
+		LogInfo(@"Ignoring didConnect, already disconnected");
 		
-		return 0;
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
 	}
-	else
-	{
-		__block uint16_t result = 0;
-		
-		dispatch_sync(socketQueue, ^{
-			// No need for autorelease pool
-			
-            if (self->socket4FD != SOCKET_NULL)
-                result = [self connectedPortFromSocket4:self->socket4FD];
-            else if (self->socket6FD != SOCKET_NULL)
-                result = [self connectedPortFromSocket6:self->socket6FD];
-		});
-		
-		return result;
+	
+	flags |= kConnected;
+	
+	[self endConnectTimeout];
+	
+	// Don't carry TCP info over from a previous connection, and resume periodic sampling (if enabled)
+	pthread_mutex_lock(&tcpInfoLock);
+	memset(&lastTCPInfo, 0, sizeof(lastTCPInfo));
+	pthread_mutex_unlock(&tcpInfoLock);
+	
+	[self setupTCPInfoTimer];
+	
+	#if TARGET_OS_IPHONE
+	// The endConnectTimeout method executed above incremented the stateIndex.
+	aStateIndex = stateIndex;
+	#endif
+	
+	// Setup read/write streams (as workaround for specific shortcomings in the iOS platform)
+	// 
+	// Note:
+	// There may be configuration options that must be set by the delegate before opening the streams.
+	// The primary example is the kCFStreamNetworkServiceTypeVoIP flag, which only works on an unopened stream.
+	// 
+	// Thus we wait until after the socket:didConnectToHost:port: delegate method has completed.
+	// This gives the delegate time to properly configure the streams if needed.
+	
+	dispatch_block_t SetupStreamsPart1 = ^{
+		#if TARGET_OS_IPHONE
+		
+		if (![self createReadAndWriteStream])
+		{
+			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
+			return;
+		}
+		
+		if (![self registerForStreamCallbacksIncludingReadWrite:NO])
+		{
+			[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
+			return;
+		}
+		
+		#endif
+	};
+	dispatch_block_t SetupStreamsPart2 = ^{
+		#if TARGET_OS_IPHONE
+		
+        if (aStateIndex != self->stateIndex)
+		{
+			// The socket has been disconnected.
+			return;
+		}
+		
+		if (![self addStreamsToRunLoop])
+		{
+			[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
+			return;
+		}
+		
+		if (![self openStreams])
+		{
+			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
+			return;
+		}
+		
+		#endif
+	};
+	
+	// Notify delegate
+	
+	NSString *host = [self connectedHost];
+	uint16_t port = [self connectedPort];
+	NSURL *url = [self connectedUrl];
+	
+	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+	if (delegateQueue && host != nil && [theDelegate respondsToSelector:@selector(socket:didConnectToHost:port:)])
+	{
+		SetupStreamsPart1();
+		
+		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			
+			[theDelegate socket:self didConnectToHost:host port:port];
+			
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				SetupStreamsPart2();
+			}});
+		}});
+	}
+	else if (delegateQueue && url != nil && [theDelegate respondsToSelector:@selector(socket:didConnectToUrl:)])
+	{
+		SetupStreamsPart1();
+		
+		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			
+			[theDelegate socket:self didConnectToUrl:url];
+			
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				SetupStreamsPart2();
+			}});
+		}});
+	}
+	else
+	{
+		SetupStreamsPart1();
+		SetupStreamsPart2();
+	}
+		
+	// Get the connected socket
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	// Enable non-blocking IO on the socket
+	
+	int result = fcntl(socketFD, F_SETFL, O_NONBLOCK);
+	if (result == -1)
+	{
+		NSString *errMsg = @"Error enabling non-blocking IO on socket (fcntl)";
+		[self closeWithError:[self otherError:errMsg]];
+		
+		return;
 	}
+	
+	// Setup our read/write sources
+	
+	[self setupReadAndWriteSourcesForNewlyConnectedSocket:socketFD];
+	
+	// Dequeue any pending read/write requests
+	
+	[self maybeDequeueRead];
+	[self maybeDequeueWrite];
 }
 
-- (NSURL *)connectedUrl
+- (void)didNotConnect:(int)aStateIndex error:(NSError *)error
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
 	{
-		if (socketUN != SOCKET_NULL)
-			return [self connectedUrlFromSocketUN:socketUN];
+		LogInfo(@"Ignoring didNotConnect, already disconnected");
 		
-		return nil;
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
 	}
-	else
+	
+	[self closeWithError:error];
+}
+
+- (void)startConnectTimeout:(NSTimeInterval)timeout
+{
+	if (timeout >= 0.0)
 	{
-		__block NSURL *result = nil;
+		connectTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
 		
-		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+		__weak GCDAsyncSocket *weakSelf = self;
+		
+		dispatch_source_set_event_handler(connectTimer, ^{ @autoreleasepool {
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+			__strong GCDAsyncSocket *strongSelf = weakSelf;
+			if (strongSelf == nil) return_from_block;
 			
-            if (self->socketUN != SOCKET_NULL)
-                result = [self connectedUrlFromSocketUN:self->socketUN];
+			[strongSelf doConnectTimeout];
+			
+		#pragma clang diagnostic pop
 		}});
 		
-		return result;
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_source_t theConnectTimer = connectTimer;
+		dispatch_source_set_cancel_handler(connectTimer, ^{
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+			LogVerbose(@"dispatch_release(connectTimer)");
+			dispatch_release(theConnectTimer);
+			
+		#pragma clang diagnostic pop
+		});
+		#endif
+		
+		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		dispatch_source_set_timer(connectTimer, tt, DISPATCH_TIME_FOREVER, 0);
+		
+		dispatch_resume(connectTimer);
 	}
 }
 
-- (NSString *)localHost
+- (void)endConnectTimeout
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	LogTrace();
+	
+	if (connectTimer)
 	{
-		if (socket4FD != SOCKET_NULL)
-			return [self localHostFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self localHostFromSocket6:socket6FD];
-		
-		return nil;
+		dispatch_source_cancel(connectTimer);
+		connectTimer = NULL;
 	}
-	else
+	
+	// Increment stateIndex.
+	// This will prevent us from processing results from any related background asynchronous operations.
+	// 
+	// Note: This should be called from close method even if connectTimer is NULL.
+	// This is because one might disconnect a socket prior to a successful connection which had no timeout.
+	
+	stateIndex++;
+	
+	if (connectInterface4)
 	{
-		__block NSString *result = nil;
-		
-		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+		connectInterface4 = nil;
+	}
+	if (connectInterface6)
+	{
+		connectInterface6 = nil;
+	}
+}
+
+- (void)doConnectTimeout
+{
+	LogTrace();
+	
+	[self endConnectTimeout];
+	[self closeWithError:[self connectTimeoutError]];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Disconnecting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)closeWithError:(NSError *)error
+{
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	TRACE_EVENT(GCDAsyncSocketTraceClose, [error code]);
+	
+	[self endConnectTimeout];
+	
+	[self failPendingCompletionsWithError:error];
+	[self discardQueuedWriteBytes];
+	
+	if (currentRead != nil)  [self endCurrentRead];
+	if (currentWrite != nil) [self endCurrentWrite];
+	
+	[readQueue removeAllObjects];
+	[writeQueue removeAllObjects];
+	[self updateQueueDepthStatistics];
+	
+	[preBuffer reset];
+	[preBuffer setByteCounter:NULL];
+	
+	#if TARGET_OS_IPHONE
+	{
+		if (readStream || writeStream)
+		{
+			[self removeStreamsFromRunLoop];
+			
+			if (readStream)
+			{
+				CFReadStreamSetClient(readStream, kCFStreamEventNone, NULL, NULL);
+				CFReadStreamClose(readStream);
+				CFRelease(readStream);
+				readStream = NULL;
+			}
+			if (writeStream)
+			{
+				CFWriteStreamSetClient(writeStream, kCFStreamEventNone, NULL, NULL);
+				CFWriteStreamClose(writeStream);
+				CFRelease(writeStream);
+				writeStream = NULL;
+			}
+		}
+	}
+	#endif
+	
+	[sslPreBuffer reset];
+	sslErrCode = lastSSLHandshakeError = noErr;
+	
+	// If a handshake step is executing on the handshake pool, it retains the sslContext.
+	// The step's completion will notice the socket has been closed, and simply discard the result.
+	sslHandshakeIO = nil;
+	
+	if (sslContext)
+	{
+		// Getting a linker error here about the SSLx() functions?
+		// You need to add the Security Framework to your application.
+		
+		if (!(flags & kSSLHandshakeInFlight))
+		{
+			SSLClose(sslContext);
+		}
+		
+		#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
+		CFRelease(sslContext);
+		#else
+		SSLDisposeContext(sslContext);
+		#endif
+		
+		sslContext = NULL;
+	}
+	
+	// For some crazy reason (in my opinion), cancelling a dispatch source doesn't
+	// invoke the cancel handler if the dispatch source is paused.
+	// So we have to unpause the source if needed.
+	// This allows the cancel handler to be run, which in turn releases the source and closes the socket.
+	
+	if (!accept4Source && !accept6Source && !acceptUNSource && !readSource && !writeSource)
+	{
+		LogVerbose(@"manually closing close");
+
+		if (socket4FD != SOCKET_NULL)
+		{
+			LogVerbose(@"close(socket4FD)");
+			close(socket4FD);
+			socket4FD = SOCKET_NULL;
+		}
+
+		if (socket6FD != SOCKET_NULL)
+		{
+			LogVerbose(@"close(socket6FD)");
+			close(socket6FD);
+			socket6FD = SOCKET_NULL;
+		}
+		
+		if (socketUN != SOCKET_NULL)
+		{
+			LogVerbose(@"close(socketUN)");
+			close(socketUN);
+			socketUN = SOCKET_NULL;
+			unlink(socketUrl.path.fileSystemRepresentation);
+			socketUrl = nil;
+		}
+	}
+	else
+	{
+		if (accept4Source)
+		{
+			LogVerbose(@"dispatch_source_cancel(accept4Source)");
+			dispatch_source_cancel(accept4Source);
+			
+			// We never suspend accept4Source
+			
+			accept4Source = NULL;
+		}
+		
+		if (accept6Source)
+		{
+			LogVerbose(@"dispatch_source_cancel(accept6Source)");
+			dispatch_source_cancel(accept6Source);
+			
+			// We never suspend accept6Source
+			
+			accept6Source = NULL;
+		}
+		
+		if (acceptUNSource)
+		{
+			LogVerbose(@"dispatch_source_cancel(acceptUNSource)");
+			dispatch_source_cancel(acceptUNSource);
+			
+			// We never suspend acceptUNSource
+			
+			acceptUNSource = NULL;
+		}
+	
+		if (readSource)
+		{
+			LogVerbose(@"dispatch_source_cancel(readSource)");
+			dispatch_source_cancel(readSource);
+			
+			[self resumeReadSource];
+			
+			readSource = NULL;
+		}
+		
+		if (writeSource)
+		{
+			LogVerbose(@"dispatch_source_cancel(writeSource)");
+			dispatch_source_cancel(writeSource);
+			
+			[self resumeWriteSource];
+			
+			writeSource = NULL;
+		}
+		
+		// The sockets will be closed by the cancel handlers of the corresponding source.
+		// The ref count is owned by those handlers from here on.
+		
+		socketFDRefCount = NULL;
+		
+		socket4FD = SOCKET_NULL;
+		socket6FD = SOCKET_NULL;
+		socketUN = SOCKET_NULL;
+	}
+	
+	if (tcpInfoTimer)
+	{
+		// Restarted by didConnect: (if the socket is reused)
+		dispatch_source_cancel(tcpInfoTimer);
+		tcpInfoTimer = NULL;
+	}
+	
+	// If the client has passed the connect/accept method, then the connection has at least begun.
+	// Notify delegate that it is now ending.
+	BOOL shouldCallDelegate = (flags & kSocketStarted) ? YES : NO;
+	BOOL isDeallocating = (flags & kDealloc) ? YES : NO;
+	
+	// Clear stored socket info and all flags (config remains as is)
+	socketFDBytesAvailable = 0;
+	receiveLowWaterMark = 1;
+	receiveBufferSize = 0;
+	flags = 0;
+	sslWriteCachedLength = 0;
+	
+	if (shouldCallDelegate)
+	{
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+		__strong id theSelf = isDeallocating ? nil : self;
+		
+		if (delegateQueue && [theDelegate respondsToSelector: @selector(socketDidDisconnect:withError:)])
+		{
+			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+				
+				[theDelegate socketDidDisconnect:theSelf withError:error];
+			}});
+		}	
+	}
+}
+
+/**
+ * Invokes the completion block of every pending block-based read & write with the given error.
+ * Called when the socket is closed, before the read & write queues are cleared.
+**/
+- (void)failPendingCompletionsWithError:(NSError *)error
+{
+	NSMutableArray *completions = nil;
+	
+	NSMutableArray *readPackets = [NSMutableArray arrayWithCapacity:([readQueue count] + 1)];
+	if (currentRead) [readPackets addObject:currentRead];
+	for (NSUInteger i = 0; i < [readQueue count]; i++) [readPackets addObject:[readQueue objectAtIndex:i]];
+	
+	for (id packet in readPackets)
+	{
+		if ([packet isKindOfClass:[GCDAsyncReadPacket class]] && ((GCDAsyncReadPacket *)packet)->completion)
+		{
+			if (completions == nil) completions = [NSMutableArray array];
+			
+			GCDAsyncSocketReadCompletionBlock completion = ((GCDAsyncReadPacket *)packet)->completion;
+			[completions addObject:^(NSError *err){ completion(nil, err); }];
+		}
+	}
+	
+	NSMutableArray *writePackets = [NSMutableArray arrayWithCapacity:([writeQueue count] + 1)];
+	if (currentWrite) [writePackets addObject:currentWrite];
+	for (NSUInteger i = 0; i < [writeQueue count]; i++) [writePackets addObject:[writeQueue objectAtIndex:i]];
+	
+	for (id packet in writePackets)
+	{
+		if ([packet isKindOfClass:[GCDAsyncWritePacket class]] && ((GCDAsyncWritePacket *)packet)->completion)
+		{
+			if (completions == nil) completions = [NSMutableArray array];
+			
+			[completions addObject:((GCDAsyncWritePacket *)packet)->completion];
+		}
+	}
+	
+	if (completions == nil) return;
+	
+	NSError *theError = error;
+	if (theError == nil)
+	{
+		theError = [self otherError:@"Socket disconnected before the operation completed"];
+	}
+	
+	dispatch_queue_t queue = completionQueue ? completionQueue : (delegateQueue ? delegateQueue : dispatch_get_main_queue());
+	
+	dispatch_async(queue, ^{ @autoreleasepool {
+		
+		for (GCDAsyncSocketWriteCompletionBlock completion in completions)
+		{
+			completion(theError);
+		}
+	}});
+}
+
+- (void)disconnect
+{
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+        if (self->flags & kSocketStarted)
+		{
+			if (self->delegateCalloutDepth > 0)
+			{
+				// We're within a synchronous delegate callout, in the middle of the read/write machinery.
+				// Closing the socket here would pull the rug out from under it.
+				// So we stop all further reads, writes & data callbacks now, and close once the stack unwinds.
+				
+				self->flags |= (kForbidReadsWrites | kDisconnectAfterCallout);
+				
+				dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+					
+					if (self->flags & kDisconnectAfterCallout)
+					{
+						[self closeWithError:nil];
+					}
+				}});
+			}
+			else
+			{
+				[self closeWithError:nil];
+			}
+		}
+	}};
+	
+	// Synchronous disconnection, as documented in the header file
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+}
+
+- (void)disconnectAfterReading
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+        if (self->flags & kSocketStarted)
+		{
+            self->flags |= (kForbidReadsWrites | kDisconnectAfterReads);
+			[self maybeClose];
+		}
+	}});
+}
+
+- (void)disconnectAfterWriting
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+        if (self->flags & kSocketStarted)
+		{
+            self->flags |= (kForbidReadsWrites | kDisconnectAfterWrites);
+			[self maybeClose];
+		}
+	}});
+}
+
+- (void)disconnectAfterReadingAndWriting
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+        if (self->flags & kSocketStarted)
+		{
+            self->flags |= (kForbidReadsWrites | kDisconnectAfterReads | kDisconnectAfterWrites);
+			[self maybeClose];
+		}
+	}});
+}
+
+/**
+ * Closes the socket if possible.
+ * That is, if all writes have completed, and we're set to disconnect after writing,
+ * or if all reads have completed, and we're set to disconnect after reading.
+**/
+- (void)maybeClose
+{
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	BOOL shouldClose = NO;
+	
+	if (flags & kDisconnectAfterReads)
+	{
+		if (([readQueue count] == 0) && (currentRead == nil))
+		{
+			if (flags & kDisconnectAfterWrites)
+			{
+				if (([writeQueue count] == 0) && (currentWrite == nil))
+				{
+					shouldClose = YES;
+				}
+			}
+			else
+			{
+				shouldClose = YES;
+			}
+		}
+	}
+	else if (flags & kDisconnectAfterWrites)
+	{
+		if (([writeQueue count] == 0) && (currentWrite == nil))
+		{
+			shouldClose = YES;
+		}
+	}
+	
+	if (shouldClose)
+	{
+		[self closeWithError:nil];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Errors
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (NSError *)badConfigError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadConfigError userInfo:userInfo];
+}
+
+- (NSError *)badParamError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadParamError userInfo:userInfo];
+}
+
++ (NSError *)gaiError:(int)gai_error
+{
+	NSString *errMsg = [NSString stringWithCString:gai_strerror(gai_error) encoding:NSASCIIStringEncoding];
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:@"kCFStreamErrorDomainNetDB" code:gai_error userInfo:userInfo];
+}
+
+- (NSError *)errorWithErrno:(int)err reason:(NSString *)reason
+{
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(err)];
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg,
+							   NSLocalizedFailureReasonErrorKey : reason};
+	
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:userInfo];
+}
+
+- (NSError *)errnoError
+{
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+}
+
+- (NSError *)sslError:(OSStatus)ssl_error
+{
+	NSString *msg = @"Error code definition can be found in Apple's SecureTransport.h";
+	NSDictionary *userInfo = @{NSLocalizedRecoverySuggestionErrorKey : msg};
+	
+	return [NSError errorWithDomain:@"kCFStreamErrorDomainSSL" code:ssl_error userInfo:userInfo];
+}
+
+- (NSError *)connectTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketConnectTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Attempt to connect to host timed out", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketConnectTimeoutError userInfo:userInfo];
+}
+
+/**
+ * Returns a standard AsyncSocket maxed out error.
+**/
+- (NSError *)readMaxedOutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadMaxedOutError",
+														 @"GCDAsyncSocket", [NSBundle mainBundle],
+														 @"Read operation reached set maximum length", nil);
+	
+	NSDictionary *info = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadMaxedOutError userInfo:info];
+}
+
+/**
+ * Returns a standard AsyncSocket write timeout error.
+**/
+- (NSError *)readTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Read operation timed out", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadTimeoutError userInfo:userInfo];
+}
+
+/**
+ * Returns a standard AsyncSocket write timeout error.
+**/
+- (NSError *)writeTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketWriteTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Write operation timed out", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketWriteTimeoutError userInfo:userInfo];
+}
+
+- (NSError *)writeQueueFullError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketWriteQueueFullError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Write queue is full", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketWriteQueueFullError userInfo:userInfo];
+}
+
+- (NSError *)connectionClosedError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketClosedError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Socket closed by remote peer", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketClosedError userInfo:userInfo];
+}
+
+- (NSError *)notConnectedError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketNotConnectedError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Socket is not connected", nil);
+	
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+}
+
+- (NSError *)otherError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Diagnostics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)isDisconnected
+{
+	__block BOOL result = NO;
+	
+	dispatch_block_t block = ^{
+        result = (self->flags & kSocketStarted) ? NO : YES;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (BOOL)isConnected
+{
+	__block BOOL result = NO;
+	
+	dispatch_block_t block = ^{
+        result = (self->flags & kConnected) ? YES : NO;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (NSString *)connectedHost
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self connectedHostFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self connectedHostFromSocket6:socket6FD];
+		
+		return nil;
+	}
+	else
+	{
+		__block NSString *result = nil;
+		
+		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+			
+            if (self->socket4FD != SOCKET_NULL)
+                result = [self connectedHostFromSocket4:self->socket4FD];
+            else if (self->socket6FD != SOCKET_NULL)
+                result = [self connectedHostFromSocket6:self->socket6FD];
+		}});
+		
+		return result;
+	}
+}
+
+- (uint16_t)connectedPort
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self connectedPortFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self connectedPortFromSocket6:socket6FD];
+		
+		return 0;
+	}
+	else
+	{
+		__block uint16_t result = 0;
+		
+		dispatch_sync(socketQueue, ^{
+			// No need for autorelease pool
+			
+            if (self->socket4FD != SOCKET_NULL)
+                result = [self connectedPortFromSocket4:self->socket4FD];
+            else if (self->socket6FD != SOCKET_NULL)
+                result = [self connectedPortFromSocket6:self->socket6FD];
+		});
+		
+		return result;
+	}
+}
+
+- (NSURL *)connectedUrl
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socketUN != SOCKET_NULL)
+			return [self connectedUrlFromSocketUN:socketUN];
+		
+		return nil;
+	}
+	else
+	{
+		__block NSURL *result = nil;
+		
+		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+			
+            if (self->socketUN != SOCKET_NULL)
+                result = [self connectedUrlFromSocketUN:self->socketUN];
+		}});
+		
+		return result;
+	}
+}
+
+- (NSString *)localHost
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self localHostFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self localHostFromSocket6:socket6FD];
+		
+		return nil;
+	}
+	else
+	{
+		__block NSString *result = nil;
+		
+		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+			
+            if (self->socket4FD != SOCKET_NULL)
+                result = [self localHostFromSocket4:self->socket4FD];
+            else if (self->socket6FD != SOCKET_NULL)
+                result = [self localHostFromSocket6:self->socket6FD];
+		}});
+		
+		return result;
+	}
+}
+
+- (uint16_t)localPort
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self localPortFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self localPortFromSocket6:socket6FD];
+		
+		return 0;
+	}
+	else
+	{
+		__block uint16_t result = 0;
+		
+		dispatch_sync(socketQueue, ^{
+			// No need for autorelease pool
+			
+            if (self->socket4FD != SOCKET_NULL)
+                result = [self localPortFromSocket4:self->socket4FD];
+            else if (self->socket6FD != SOCKET_NULL)
+                result = [self localPortFromSocket6:self->socket6FD];
+		});
+		
+		return result;
+	}
+}
+
+- (NSString *)connectedHost4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self connectedHostFromSocket4:socket4FD];
+	
+	return nil;
+}
+
+- (NSString *)connectedHost6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self connectedHostFromSocket6:socket6FD];
+	
+	return nil;
+}
+
+- (uint16_t)connectedPort4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self connectedPortFromSocket4:socket4FD];
+	
+	return 0;
+}
+
+- (uint16_t)connectedPort6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self connectedPortFromSocket6:socket6FD];
+	
+	return 0;
+}
+
+- (NSString *)localHost4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self localHostFromSocket4:socket4FD];
+	
+	return nil;
+}
+
+- (NSString *)localHost6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self localHostFromSocket6:socket6FD];
+	
+	return nil;
+}
+
+- (uint16_t)localPort4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self localPortFromSocket4:socket4FD];
+	
+	return 0;
+}
+
+- (uint16_t)localPort6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self localPortFromSocket6:socket6FD];
+	
+	return 0;
+}
+
+- (NSString *)connectedHostFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr4:&sockaddr4];
+}
+
+- (NSString *)connectedHostFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr6:&sockaddr6];
+}
+
+- (uint16_t)connectedPortFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr4:&sockaddr4];
+}
+
+- (uint16_t)connectedPortFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr6:&sockaddr6];
+}
+
+- (NSURL *)connectedUrlFromSocketUN:(int)socketFD
+{
+	struct sockaddr_un sockaddr;
+	socklen_t sockaddrlen = sizeof(sockaddr);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr, &sockaddrlen) < 0)
+	{
+		return 0;
+	}
+	return [[self class] urlFromSockaddrUN:&sockaddr];
+}
+
+- (NSString *)localHostFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr4:&sockaddr4];
+}
+
+- (NSString *)localHostFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr6:&sockaddr6];
+}
+
+- (uint16_t)localPortFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr4:&sockaddr4];
+}
+
+- (uint16_t)localPortFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr6:&sockaddr6];
+}
+
+- (NSData *)connectedAddress
+{
+	__block NSData *result = nil;
+	
+	dispatch_block_t block = ^{
+        if (self->socket4FD != SOCKET_NULL)
+		{
+			struct sockaddr_in sockaddr4;
+			socklen_t sockaddr4len = sizeof(sockaddr4);
+			
+            if (getpeername(self->socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
+			}
+		}
+		
+        if (self->socket6FD != SOCKET_NULL)
+		{
+			struct sockaddr_in6 sockaddr6;
+			socklen_t sockaddr6len = sizeof(sockaddr6);
+			
+            if (getpeername(self->socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+			}
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (NSData *)localAddress
+{
+	__block NSData *result = nil;
+	
+	dispatch_block_t block = ^{
+        if (self->socket4FD != SOCKET_NULL)
+		{
+			struct sockaddr_in sockaddr4;
+			socklen_t sockaddr4len = sizeof(sockaddr4);
+			
+            if (getsockname(self->socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
+			}
+		}
+		
+        if (self->socket6FD != SOCKET_NULL)
+		{
+			struct sockaddr_in6 sockaddr6;
+			socklen_t sockaddr6len = sizeof(sockaddr6);
+			
+            if (getsockname(self->socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+			}
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (BOOL)isIPv4
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (socket4FD != SOCKET_NULL);
+	}
+	else
+	{
+		__block BOOL result = NO;
+		
+		dispatch_sync(socketQueue, ^{
+            result = (self->socket4FD != SOCKET_NULL);
+		});
+		
+		return result;
+	}
+}
+
+- (BOOL)isIPv6
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (socket6FD != SOCKET_NULL);
+	}
+	else
+	{
+		__block BOOL result = NO;
+		
+		dispatch_sync(socketQueue, ^{
+            result = (self->socket6FD != SOCKET_NULL);
+		});
+		
+		return result;
+	}
+}
+
+- (BOOL)isSecure
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (flags & kSocketSecure) ? YES : NO;
+	}
+	else
+	{
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+            result = (self->flags & kSocketSecure) ? YES : NO;
+		});
+		
+		return result;
+	}
+}
+
+- (BOOL)statisticsEnabled
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (statistics != NULL);
+	}
+	else
+	{
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = (self->statistics != NULL);
+		});
+		
+		return result;
+	}
+}
+
+- (void)setStatisticsEnabled:(BOOL)flag
+{
+	dispatch_block_t block = ^{
+		
+		if (flag)
+		{
+			GCDAsyncSocketStatisticsCounters *storage = atomic_load(&self->statisticsStorage);
+			if (storage == NULL)
+			{
+				storage = calloc(1, sizeof(GCDAsyncSocketStatisticsCounters));
+				atomic_store(&self->statisticsStorage, storage);
+			}
+			
+			self->statistics = storage;
+			[self updateQueueDepthStatistics];
+		}
+		else
+		{
+			self->statistics = NULL;
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (GCDAsyncSocketStatistics)statisticsSnapshot
+{
+	GCDAsyncSocketStatistics snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	
+	// The storage is never freed (or moved) before the socket is deallocated,
+	// so it may be read without involving the socketQueue.
+	GCDAsyncSocketStatisticsCounters *stats = atomic_load(&statisticsStorage);
+	if (stats == NULL) return snapshot;
+	
+	#define SNAPSHOT(field) snapshot.field = (uint64_t)atomic_load_explicit(&stats->field, memory_order_relaxed)
+	
+	SNAPSHOT(bytesRead);
+	SNAPSHOT(bytesWritten);
+	SNAPSHOT(readSyscalls);
+	SNAPSHOT(writeSyscalls);
+	SNAPSHOT(readsCompleted);
+	SNAPSHOT(writesCompleted);
+	SNAPSHOT(preBufferHighWaterMark);
+	SNAPSHOT(readQueueDepth);
+	SNAPSHOT(writeQueueDepth);
+	SNAPSHOT(readQueueHighWaterMark);
+	SNAPSHOT(writeQueueHighWaterMark);
+	SNAPSHOT(readSourceSuspends);
+	SNAPSHOT(readSourceResumes);
+	SNAPSHOT(writeSourceSuspends);
+	SNAPSHOT(writeSourceResumes);
+	
+	#undef SNAPSHOT
+	
+	for (NSUInteger i = 0; i < GCDAsyncSocketLatencyBucketCount; i++)
+	{
+		snapshot.readLatency.counts[i] = (uint64_t)atomic_load_explicit(&stats->readLatency[i], memory_order_relaxed);
+		snapshot.readLatency.totalCount += snapshot.readLatency.counts[i];
+		
+		snapshot.writeLatency.counts[i] = (uint64_t)atomic_load_explicit(&stats->writeLatency[i], memory_order_relaxed);
+		snapshot.writeLatency.totalCount += snapshot.writeLatency.counts[i];
+	}
+	
+	snapshot.readLatency.maxValue = (uint64_t)atomic_load_explicit(&stats->readLatencyMax, memory_order_relaxed);
+	snapshot.writeLatency.maxValue = (uint64_t)atomic_load_explicit(&stats->writeLatencyMax, memory_order_relaxed);
+	
+	return snapshot;
+}
+
+/**
+ * Records the current depth of the read & write queues (if statistics are enabled).
+**/
+- (void)updateQueueDepthStatistics
+{
+	if (statistics == NULL) return;
+	
+	NSUInteger readQueueDepth = [readQueue count];
+	NSUInteger writeQueueDepth = [writeQueue count];
+	
+	atomic_store_explicit(&statistics->readQueueDepth, (uint_fast64_t)readQueueDepth, memory_order_relaxed);
+	atomic_store_explicit(&statistics->writeQueueDepth, (uint_fast64_t)writeQueueDepth, memory_order_relaxed);
+	
+	STATISTICS_MAX(readQueueHighWaterMark, readQueueDepth);
+	STATISTICS_MAX(writeQueueHighWaterMark, writeQueueDepth);
+}
+
+/**
+ * Records a completed read or write, and its latency since it was queued (if statistics are enabled).
+ * Packets queued before statistics were enabled aren't included in the latency histograms.
+**/
+- (void)recordCompletionOfPacketQueuedAt:(uint64_t)enqueueTime isRead:(BOOL)isRead
+{
+	if (statistics == NULL) return;
+	
+	if (isRead)
+		STATISTICS_ADD(readsCompleted, 1);
+	else
+		STATISTICS_ADD(writesCompleted, 1);
+	
+	if (enqueueTime == 0) return;
+	
+	uint64_t now = GCDAsyncSocketMonotonicTime();
+	uint64_t micros = (now > enqueueTime) ? ((now - enqueueTime) / NSEC_PER_USEC) : 0;
+	
+	NSUInteger bucket = GCDAsyncSocketLatencyBucket(micros);
+	
+	if (isRead)
+	{
+		STATISTICS_ADD(readLatency[bucket], 1);
+		STATISTICS_MAX(readLatencyMax, micros);
+	}
+	else
+	{
+		STATISTICS_ADD(writeLatency[bucket], 1);
+		STATISTICS_MAX(writeLatencyMax, micros);
+	}
+}
+
++ (uint64_t)lowerBoundOfLatencyBucket:(NSUInteger)bucket
+{
+	if (bucket < 8) return bucket;
+	
+	bucket = MIN(bucket, (NSUInteger)(GCDAsyncSocketLatencyBucketCount - 1));
+	
+	NSUInteger exponent = ((bucket - 8) / 4) + 3;
+	NSUInteger sub = (bucket - 8) % 4;
+	
+	return (1ULL << exponent) + ((uint64_t)sub << (exponent - 2));
+}
+
++ (uint64_t)latencyAtPercentile:(double)percentile ofHistogram:(const GCDAsyncSocketLatencyHistogram *)histogram
+{
+	if ((histogram == NULL) || (histogram->totalCount == 0)) return 0;
+	
+	double clamped = MAX(0.0, MIN(percentile, 100.0));
+	uint64_t target = (uint64_t)ceil((clamped / 100.0) * (double)histogram->totalCount);
+	if (target == 0) target = 1;
+	
+	uint64_t seen = 0;
+	
+	for (NSUInteger i = 0; i < GCDAsyncSocketLatencyBucketCount; i++)
+	{
+		seen += histogram->counts[i];
+		
+		if (seen >= target)
+		{
+			if (i == (GCDAsyncSocketLatencyBucketCount - 1)) return histogram->maxValue;
+			
+			uint64_t upperBound = [self lowerBoundOfLatencyBucket:(i + 1)] - 1;
+			return MIN(upperBound, histogram->maxValue);
+		}
+	}
+	
+	return histogram->maxValue;
+}
+
+- (GCDAsyncSocketTCPInfo)tcpInfo
+{
+	__block GCDAsyncSocketTCPInfo result;
+	
+	dispatch_block_t block = ^{
+		result = [self sampleTCPInfo];
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (GCDAsyncSocketTCPInfo)lastTCPInfo
+{
+	pthread_mutex_lock(&tcpInfoLock);
+	GCDAsyncSocketTCPInfo result = lastTCPInfo;
+	pthread_mutex_unlock(&tcpInfoLock);
+	
+	return result;
+}
+
+/**
+ * Reads the TCP_CONNECTION_INFO of the socket, and caches it as lastTCPInfo.
+ * Must be invoked on the socketQueue.
+**/
+- (GCDAsyncSocketTCPInfo)sampleTCPInfo
+{
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	GCDAsyncSocketTCPInfo info;
+	memset(&info, 0, sizeof(info));
+	
+	info.timestamp = GCDAsyncSocketMonotonicTime();
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : socket6FD;
+	
+	if (!(flags & kConnected) || (socketFD == SOCKET_NULL))
+	{
+		return info;
+	}
+	
+#ifdef TCP_CONNECTION_INFO
+	
+	struct tcp_connection_info connectionInfo;
+	socklen_t length = sizeof(connectionInfo);
+	
+	if (getsockopt(socketFD, IPPROTO_TCP, TCP_CONNECTION_INFO, &connectionInfo, &length) < 0)
+	{
+		// ENOPROTOOPT prior to OS X 10.11 / iOS 9
+		LogVerbose(@"Error in getsockopt(TCP_CONNECTION_INFO): %@", [self errnoError]);
+		return info;
+	}
+	
+	info.valid = YES;
+	info.state = connectionInfo.tcpi_state;
+	info.rtt = connectionInfo.tcpi_srtt;
+	info.rttVariance = connectionInfo.tcpi_rttvar;
+	info.currentRTT = connectionInfo.tcpi_rttcur;
+	info.retransmitTimeout = connectionInfo.tcpi_rto;
+	info.maxSegmentSize = connectionInfo.tcpi_maxseg;
+	info.congestionWindow = connectionInfo.tcpi_snd_cwnd;
+	info.slowStartThreshold = connectionInfo.tcpi_snd_ssthresh;
+	info.sendWindow = connectionInfo.tcpi_snd_wnd;
+	info.receiveWindow = connectionInfo.tcpi_rcv_wnd;
+	info.sendBufferBytes = connectionInfo.tcpi_snd_sbbytes;
+	info.bytesSent = connectionInfo.tcpi_txbytes;
+	info.bytesReceived = connectionInfo.tcpi_rxbytes;
+	info.packetsSent = connectionInfo.tcpi_txpackets;
+	info.packetsReceived = connectionInfo.tcpi_rxpackets;
+	info.retransmittedBytes = connectionInfo.tcpi_txretransmitbytes;
+	info.retransmittedPackets = connectionInfo.tcpi_txretransmitpackets;
+	info.outOfOrderBytes = connectionInfo.tcpi_rxoutoforderbytes;
+	
+	pthread_mutex_lock(&tcpInfoLock);
+	{
+		// Delivery rate: new (not retransmitted) bytes sent since the previous sample of this connection
+		
+		uint64_t delivered = info.bytesSent - info.retransmittedBytes;
+		uint64_t previouslyDelivered = lastTCPInfo.bytesSent - lastTCPInfo.retransmittedBytes;
+		
+		if (lastTCPInfo.valid && (delivered >= previouslyDelivered) && (info.timestamp > lastTCPInfo.timestamp))
+		{
+			double elapsed = (double)(info.timestamp - lastTCPInfo.timestamp) / (double)NSEC_PER_SEC;
+			
+			info.deliveryRate = (double)(delivered - previouslyDelivered) / elapsed;
+		}
+		
+		lastTCPInfo = info;
+	}
+	pthread_mutex_unlock(&tcpInfoLock);
+	
+#endif
+	
+	return info;
+}
+
+- (NSTimeInterval)tcpInfoSamplingInterval
+{
+	__block NSTimeInterval result;
+	
+	dispatch_block_t block = ^{
+		result = self->tcpInfoSamplingInterval;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setTcpInfoSamplingInterval:(NSTimeInterval)interval
+{
+	dispatch_block_t block = ^{
+		
+		self->tcpInfoSamplingInterval = interval;
+		[self setupTCPInfoTimer];
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+/**
+ * (Re)starts the periodic TCP info sampling timer, or stops it if the interval is zero.
+ * The timer only runs while connected. It's cancelled in closeWithError:, and started again in didConnect:.
+**/
+- (void)setupTCPInfoTimer
+{
+	if (tcpInfoTimer)
+	{
+		dispatch_source_cancel(tcpInfoTimer);
+		tcpInfoTimer = NULL;
+	}
+	
+	if ((tcpInfoSamplingInterval <= 0.0) || !(flags & kConnected)) return;
+	
+	tcpInfoTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
+	
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	dispatch_source_set_event_handler(tcpInfoTimer, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		if (strongSelf->flags & kConnected)
+		{
+			[strongSelf sampleTCPInfo];
+		}
+		
+	#pragma clang diagnostic pop
+	}});
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_source_t theTCPInfoTimer = tcpInfoTimer;
+	dispatch_source_set_cancel_handler(tcpInfoTimer, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		LogVerbose(@"dispatch_release(tcpInfoTimer)");
+		dispatch_release(theTCPInfoTimer);
+		
+	#pragma clang diagnostic pop
+	});
+	#endif
+	
+	uint64_t interval = (uint64_t)(tcpInfoSamplingInterval * NSEC_PER_SEC);
+	
+	dispatch_source_set_timer(tcpInfoTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+	dispatch_resume(tcpInfoTimer);
+}
+
+- (NSDictionary *)registrySnapshot
+{
+	__block NSDictionary *result = nil;
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		NSString *state;
+		if (self->flags & kConnected)
+			state = @"connected";
+		else if (self->accept4Source || self->accept6Source || self->acceptUNSource)
+			state = @"accepting";
+		else if (self->flags & kSocketStarted)
+			state = @"connecting";
+		else
+			state = @"disconnected";
+		
+		NSUInteger readQueueDepth = [self->readQueue count] + (self->currentRead ? 1 : 0);
+		NSUInteger writeQueueDepth = [self->writeQueue count] + (self->currentWrite ? 1 : 0);
+		
+		NSUInteger queuedWriteBytes = (NSUInteger)atomic_load(&self->queuedWriteByteCount);
+		NSUInteger preBufferBytes = (NSUInteger)[self->preBuffer availableBytes];
+		
+		NSMutableDictionary *snapshot = [NSMutableDictionary dictionaryWithCapacity:16];
+		
+		snapshot[@"class"] = NSStringFromClass([self class]);
+		snapshot[@"state"] = state;
+		snapshot[@"socketQueue"] = [NSString stringWithFormat:@"%s (%p)",
+		                             dispatch_queue_get_label(self->socketQueue), self->socketQueue];
+		snapshot[@"secure"] = @((self->flags & kSocketSecure) ? YES : NO);
+		snapshot[@"readQueueDepth"] = @(readQueueDepth);
+		snapshot[@"writeQueueDepth"] = @(writeQueueDepth);
+		snapshot[@"queuedWriteBytes"] = @(queuedWriteBytes);
+		snapshot[@"preBufferBytes"] = @(preBufferBytes);
+		snapshot[@"bufferedBytes"] = @(queuedWriteBytes + preBufferBytes);
+		
+		if (self->flags & kConnected)
+		{
+			NSString *localHost = [self localHost];
+			NSString *connectedHost = [self connectedHost];
+			
+			if (localHost) snapshot[@"localHost"] = localHost;
+			if (connectedHost) snapshot[@"connectedHost"] = connectedHost;
+			
+			snapshot[@"localPort"] = @([self localPort]);
+			snapshot[@"connectedPort"] = @([self connectedPort]);
+		}
+		
+		result = [snapshot copy];
+	}};
+	
+	// The registry waits on each socket's socketQueue in turn.
+	// On a socketQueue, that's a recipe for deadlock (and the key below can't tell our queue from another socket's).
+	NSAssert(!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey),
+	         @"The socket registry must not be queried from a socketQueue");
+	
+	dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Utilities
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Finds the address of an interface description.
+ * An inteface description may be an interface name (en0, en1, lo0) or corresponding IP (192.168.4.34).
+ * 
+ * The interface description may optionally contain a port number at the end, separated by a colon.
+ * If a non-zero port parameter is provided, any port number in the interface description is ignored.
+ * 
+ * The returned value is a 'struct sockaddr' wrapped in an NSMutableData object.
+**/
+- (void)getInterfaceAddress4:(NSMutableData **)interfaceAddr4Ptr
+                    address6:(NSMutableData **)interfaceAddr6Ptr
+             fromDescription:(NSString *)interfaceDescription
+                        port:(uint16_t)port
+{
+	NSMutableData *addr4 = nil;
+	NSMutableData *addr6 = nil;
+	
+	NSString *interface = nil;
+	
+	NSArray *components = [interfaceDescription componentsSeparatedByString:@":"];
+	if ([components count] > 0)
+	{
+		NSString *temp = [components objectAtIndex:0];
+		if ([temp length] > 0)
+		{
+			interface = temp;
+		}
+	}
+	if ([components count] > 1 && port == 0)
+	{
+		NSString *temp = [components objectAtIndex:1];
+		long portL = strtol([temp UTF8String], NULL, 10);
+		
+		if (portL > 0 && portL <= UINT16_MAX)
+		{
+			port = (uint16_t)portL;
+		}
+	}
+	
+	if (interface == nil)
+	{
+		// ANY address
+		
+		struct sockaddr_in sockaddr4;
+		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		
+		sockaddr4.sin_len         = sizeof(sockaddr4);
+		sockaddr4.sin_family      = AF_INET;
+		sockaddr4.sin_port        = htons(port);
+		sockaddr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		
+		struct sockaddr_in6 sockaddr6;
+		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		
+		sockaddr6.sin6_len       = sizeof(sockaddr6);
+		sockaddr6.sin6_family    = AF_INET6;
+		sockaddr6.sin6_port      = htons(port);
+		sockaddr6.sin6_addr      = in6addr_any;
+		
+		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
+		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+	}
+	else if ([interface isEqualToString:@"localhost"] || [interface isEqualToString:@"loopback"])
+	{
+		// LOOPBACK address
+		
+		struct sockaddr_in sockaddr4;
+		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		
+		sockaddr4.sin_len         = sizeof(sockaddr4);
+		sockaddr4.sin_family      = AF_INET;
+		sockaddr4.sin_port        = htons(port);
+		sockaddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		
+		struct sockaddr_in6 sockaddr6;
+		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		
+		sockaddr6.sin6_len       = sizeof(sockaddr6);
+		sockaddr6.sin6_family    = AF_INET6;
+		sockaddr6.sin6_port      = htons(port);
+		sockaddr6.sin6_addr      = in6addr_loopback;
+		
+		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
+		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+	}
+	else
+	{
+		const char *iface = [interface UTF8String];
+		
+		struct ifaddrs *addrs;
+		const struct ifaddrs *cursor;
+		
+		if ((getifaddrs(&addrs) == 0))
+		{
+			cursor = addrs;
+			while (cursor != NULL)
+			{
+				if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET))
+				{
+					// IPv4
+					
+					struct sockaddr_in nativeAddr4;
+					memcpy(&nativeAddr4, cursor->ifa_addr, sizeof(nativeAddr4));
+					
+					if (strcmp(cursor->ifa_name, iface) == 0)
+					{
+						// Name match
+						
+						nativeAddr4.sin_port = htons(port);
+						
+						addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
+					}
+					else
+					{
+						char ip[INET_ADDRSTRLEN];
+						
+						const char *conversion = inet_ntop(AF_INET, &nativeAddr4.sin_addr, ip, sizeof(ip));
+						
+						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
+						{
+							// IP match
+							
+							nativeAddr4.sin_port = htons(port);
+							
+							addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
+						}
+					}
+				}
+				else if ((addr6 == nil) && (cursor->ifa_addr->sa_family == AF_INET6))
+				{
+					// IPv6
+					
+					struct sockaddr_in6 nativeAddr6;
+					memcpy(&nativeAddr6, cursor->ifa_addr, sizeof(nativeAddr6));
+					
+					if (strcmp(cursor->ifa_name, iface) == 0)
+					{
+						// Name match
+						
+						nativeAddr6.sin6_port = htons(port);
+						
+						addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
+					}
+					else
+					{
+						char ip[INET6_ADDRSTRLEN];
+						
+						const char *conversion = inet_ntop(AF_INET6, &nativeAddr6.sin6_addr, ip, sizeof(ip));
+						
+						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
+						{
+							// IP match
+							
+							nativeAddr6.sin6_port = htons(port);
+							
+							addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
+						}
+					}
+				}
+				
+				cursor = cursor->ifa_next;
+			}
+			
+			freeifaddrs(addrs);
+		}
+	}
+	
+	if (interfaceAddr4Ptr) *interfaceAddr4Ptr = addr4;
+	if (interfaceAddr6Ptr) *interfaceAddr6Ptr = addr6;
+}
+
+- (NSData *)getInterfaceAddressFromUrl:(NSURL *)url
+{
+	NSString *path = url.path;
+	if (path.length == 0) {
+		return nil;
+	}
+	
+    struct sockaddr_un nativeAddr;
+    nativeAddr.sun_family = AF_UNIX;
+    strlcpy(nativeAddr.sun_path, path.fileSystemRepresentation, sizeof(nativeAddr.sun_path));
+    nativeAddr.sun_len = (unsigned char)SUN_LEN(&nativeAddr);
+    NSData *interface = [NSData dataWithBytes:&nativeAddr length:sizeof(struct sockaddr_un)];
+	
+	return interface;
+}
+
+- (void)setupReadAndWriteSourcesForNewlyConnectedSocket:(int)socketFD
+{
+	readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socketFD, 0, socketQueue);
+	
+	// The writeSource is not created here.
+	// Most writes complete immediately, since the socket's send buffer has room for them.
+	// So we only register for write events (via setupWriteSource) the first time a write would block.
+	// This keeps idle connections down to a single kqueue registration.
+	
+	// Setup event handler
+	
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	dispatch_source_set_event_handler(readSource, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		LogVerbose(@"readEventBlock");
+		
+		// A new wakeup, and thus a fresh read budget
+		strongSelf->readDrainBytes = 0;
+		strongSelf->readDrainOperations = 0;
+		
+		strongSelf->socketFDBytesAvailable = dispatch_source_get_data(strongSelf->readSource);
+		LogVerbose(@"socketFDBytesAvailable: %lu", strongSelf->socketFDBytesAvailable);
+		
+		if (strongSelf->socketFDBytesAvailable > 0)
+			[strongSelf doReadData];
+		else
+			[strongSelf doReadEOF];
+		
+	#pragma clang diagnostic pop
+	}});
+	
+	// Setup cancel handler
+	// 
+	// The socket is closed once every source that references it has been cancelled.
+	// The count lives on the heap, since the writeSource may be created (and add a reference) later.
+	
+	int *refCount = malloc(sizeof(int));
+	*refCount = 1;
+	socketFDRefCount = refCount;
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_source_t theReadSource = readSource;
+	#endif
+	
+	dispatch_source_set_cancel_handler(readSource, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		LogVerbose(@"readCancelBlock");
+		
+		#if !OS_OBJECT_USE_OBJC
+		LogVerbose(@"dispatch_release(readSource)");
+		dispatch_release(theReadSource);
+		#endif
+		
+		if (--(*refCount) == 0)
+		{
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			free(refCount);
+		}
+		
+	#pragma clang diagnostic pop
+	});
+	
+	// We will not be able to read until data arrives.
+	// But we should be able to write immediately.
+	
+	socketFDBytesAvailable = 0;
+	flags &= ~kReadSourceSuspended;
+	
+	LogVerbose(@"dispatch_resume(readSource)");
+	dispatch_resume(readSource);
+	
+	flags |= kSocketCanAcceptBytes;
+	flags |= kWriteSourceSuspended;
+}
+
+/**
+ * Creates the (suspended) writeSource for the connected socket.
+ * Invoked lazily by resumeWriteSource, the first time we need to wait for room in the socket's send buffer.
+**/
+- (BOOL)setupWriteSource
+{
+	NSAssert(writeSource == NULL, @"writeSource already exists");
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	if (socketFD == SOCKET_NULL || socketFDRefCount == NULL)
+	{
+		return NO;
+	}
+	
+	writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, socketFD, 0, socketQueue);
+	
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	dispatch_source_set_event_handler(writeSource, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		LogVerbose(@"writeEventBlock");
+		
+		strongSelf->flags |= kSocketCanAcceptBytes;
+		[strongSelf doWriteData];
+		
+	#pragma clang diagnostic pop
+	}});
+	
+	int *refCount = socketFDRefCount;
+	(*refCount)++;
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_source_t theWriteSource = writeSource;
+	#endif
+	
+	dispatch_source_set_cancel_handler(writeSource, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		LogVerbose(@"writeCancelBlock");
+		
+		#if !OS_OBJECT_USE_OBJC
+		LogVerbose(@"dispatch_release(writeSource)");
+		dispatch_release(theWriteSource);
+		#endif
+		
+		if (--(*refCount) == 0)
+		{
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			free(refCount);
+		}
+		
+	#pragma clang diagnostic pop
+	});
+	
+	// Dispatch sources are created in a suspended state
+	flags |= kWriteSourceSuspended;
+	
+	return YES;
+}
+
+- (BOOL)usingCFStreamForTLS
+{
+	#if TARGET_OS_IPHONE
+	
+	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	{
+		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		
+		return YES;
+	}
+	
+	#endif
+	
+	return NO;
+}
+
+- (BOOL)usingSecureTransportForTLS
+{
+	// Invoking this method is equivalent to ![self usingCFStreamForTLS] (just more readable)
+	
+	#if TARGET_OS_IPHONE
+	
+	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	{
+		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		
+		return NO;
+	}
+	
+	#endif
+	
+	return YES;
+}
+
+- (void)suspendReadSource
+{
+	if (!(flags & kReadSourceSuspended))
+	{
+		LogVerbose(@"dispatch_suspend(readSource)");
+		
+		dispatch_suspend(readSource);
+		flags |= kReadSourceSuspended;
+		
+		STATISTICS_ADD(readSourceSuspends, 1);
+		TRACE_EVENT(GCDAsyncSocketTraceReadSourceSuspend, 0);
+	}
+}
+
+- (void)resumeReadSource
+{
+	if (flags & kReadSourceSuspended)
+	{
+		LogVerbose(@"dispatch_resume(readSource)");
+		
+		dispatch_resume(readSource);
+		flags &= ~kReadSourceSuspended;
+		
+		STATISTICS_ADD(readSourceResumes, 1);
+		TRACE_EVENT(GCDAsyncSocketTraceReadSourceResume, 0);
+	}
+}
+
+- (void)suspendWriteSource
+{
+	if (!(flags & kWriteSourceSuspended) && writeSource)
+	{
+		LogVerbose(@"dispatch_suspend(writeSource)");
+		
+		dispatch_suspend(writeSource);
+		flags |= kWriteSourceSuspended;
+		
+		STATISTICS_ADD(writeSourceSuspends, 1);
+		TRACE_EVENT(GCDAsyncSocketTraceWriteSourceSuspend, 0);
+	}
+}
+
+- (void)resumeWriteSource
+{
+	if (writeSource == NULL)
+	{
+		if (![self setupWriteSource]) return;
+	}
+	
+	if (flags & kWriteSourceSuspended)
+	{
+		LogVerbose(@"dispatch_resume(writeSource)");
+		
+		dispatch_resume(writeSource);
+		flags &= ~kWriteSourceSuspended;
+		
+		STATISTICS_ADD(writeSourceResumes, 1);
+		TRACE_EVENT(GCDAsyncSocketTraceWriteSourceResume, 0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Reading
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Returns a read packet configured with the given parameters.
+ * Packets are taken from the socket's packet pool if possible, saving an allocation per read.
+**/
+- (GCDAsyncReadPacket *)readPacketWithData:(NSMutableData *)d
+                               startOffset:(NSUInteger)s
+                                 maxLength:(NSUInteger)m
+                                   timeout:(NSTimeInterval)t
+                                readLength:(NSUInteger)l
+                                terminator:(NSData *)e
+                                       tag:(long)i
+{
+	pthread_mutex_lock(&packetPoolLock);
+	GCDAsyncReadPacket *packet = [readPacketPool removeFirstObject];
+	if (packet == nil) packetAllocationCount++;
+	pthread_mutex_unlock(&packetPoolLock);
+	
+	if (packet)
+	{
+		[packet reuseWithData:d startOffset:s maxLength:m timeout:t readLength:l terminator:e tag:i];
+		return packet;
+	}
+	
+	return [[GCDAsyncReadPacket alloc] initWithData:d
+	                                    startOffset:s
+	                                      maxLength:m
+	                                        timeout:t
+	                                     readLength:l
+	                                     terminator:e
+	                                            tag:i];
+}
+
+/**
+ * Returns a finished read packet to the socket's packet pool.
+ * 
+ * The caller must ensure nothing else references the packet anymore.
+ * (E.g. a delegate block that still needs the buffer of the packet.)
+**/
+- (void)recycleReadPacket:(GCDAsyncReadPacket *)packet
+{
+	[packet prepareForReuse];
+	
+	pthread_mutex_lock(&packetPoolLock);
+	if ([readPacketPool count] < PACKET_POOL_CAPACITY)
+	{
+		[readPacketPool addObject:packet];
+	}
+	pthread_mutex_unlock(&packetPoolLock);
+}
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	[self readDataWithTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
+}
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                        tag:(long)tag
+{
+	[self readDataWithTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
+}
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                  maxLength:(NSUInteger)length
+                        tag:(long)tag
+{
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
+	
+	GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+	                                          startOffset:offset
+	                                            maxLength:length
+	                                              timeout:timeout
+	                                           readLength:0
+	                                           terminator:nil
+	                                                  tag:tag];
+	
+	[self enqueueRead:packet];
+	
+	// Do not rely on the block being run in order to release the packet,
+	// as the queue might get released without the block completing.
+}
+
+- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	[self readDataToLength:length withTimeout:timeout buffer:nil bufferOffset:0 tag:tag];
+}
+
+- (void)readDataToLength:(NSUInteger)length
+             withTimeout:(NSTimeInterval)timeout
+                  buffer:(NSMutableData *)buffer
+            bufferOffset:(NSUInteger)offset
+                     tag:(long)tag
+{
+	if (length == 0) {
+		LogWarn(@"Cannot read: length == 0");
+		return;
+	}
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
+	
+	GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+	                                          startOffset:offset
+	                                            maxLength:0
+	                                              timeout:timeout
+	                                           readLength:length
+	                                           terminator:nil
+	                                                  tag:tag];
+	
+	[self enqueueRead:packet];
+	
+	// Do not rely on the block being run in order to release the packet,
+	// as the queue might get released without the block completing.
+}
+
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
+}
+
+- (void)readDataToData:(NSData *)data
+           withTimeout:(NSTimeInterval)timeout
+                buffer:(NSMutableData *)buffer
+          bufferOffset:(NSUInteger)offset
+                   tag:(long)tag
+{
+	[self readDataToData:data withTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
+}
+
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag
+{
+	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:length tag:tag];
+}
+
+- (void)readDataToData:(NSData *)data
+           withTimeout:(NSTimeInterval)timeout
+                buffer:(NSMutableData *)buffer
+          bufferOffset:(NSUInteger)offset
+             maxLength:(NSUInteger)maxLength
+                   tag:(long)tag
+{
+	if ([data length] == 0) {
+		LogWarn(@"Cannot read: [data length] == 0");
+		return;
+	}
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
+	if (maxLength > 0 && maxLength < [data length]) {
+		LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
+		return;
+	}
+	
+	GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+	                                          startOffset:offset
+	                                            maxLength:maxLength
+	                                              timeout:timeout
+	                                           readLength:0
+	                                           terminator:data
+	                                                  tag:tag];
+	
+	[self enqueueRead:packet];
+	
+	// Do not rely on the block being run in order to release the packet,
+	// as the queue might get released without the block completing.
+}
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion
+{
+	GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+	                                          startOffset:0
+	                                            maxLength:0
+	                                              timeout:timeout
+	                                           readLength:0
+	                                           terminator:nil
+	                                                  tag:0];
+	packet->completion = [completion copy];
+	
+	[self enqueueRead:packet];
+}
+
+- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion
+{
+	if (length == 0)
+	{
+		// Nothing to read, so the read is complete (like an empty write)
+		
+		if (completion)
+		{
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self invokeCompletionBlock:^{
+					completion([NSData data], nil);
+				}];
+			}});
+		}
+		return;
+	}
+	
+	GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+	                                          startOffset:0
+	                                            maxLength:0
+	                                              timeout:timeout
+	                                           readLength:length
+	                                           terminator:nil
+	                                                  tag:0];
+	packet->completion = [completion copy];
+	
+	[self enqueueRead:packet];
+}
+
+/**
+ * Queues the read as a series of fixed-length reads of at most DISPATCH_DATA_READ_CHUNK_LENGTH,
+ * all at once (so no other read can get in between), and concatenates the chunks as they complete.
+ * 
+ * Concatenating dispatch_data_t objects doesn't copy their bytes,
+ * and each chunk is wrapped as is, so the received data is never flattened into a single buffer.
+**/
+- (void)readDispatchDataToLength:(NSUInteger)length
+                     withTimeout:(NSTimeInterval)timeout
+                      completion:(GCDAsyncSocketReadDispatchDataCompletionBlock)completion
+{
+	if (length == 0)
+	{
+		// Nothing to read, so the read is complete (like an empty write)
+		
+		if (completion)
+		{
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self invokeCompletionBlock:^{
+					completion(dispatch_data_empty, nil);
+				}];
+			}});
+		}
+		return;
+	}
+	
+	GCDAsyncSocketReadDispatchDataCompletionBlock theCompletion = [completion copy];
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if (!(self->flags & kSocketStarted) || (self->flags & kForbidReadsWrites))
+		{
+			if (theCompletion)
+			{
+				NSError *error = [self notConnectedError];
+				
+				[self invokeCompletionBlock:^{
+					theCompletion(nil, error);
+				}];
+			}
+			return_from_block;
+		}
+		
+		__block dispatch_data_t received = dispatch_data_empty;
+		__block BOOL finished = NO;
+		
+		NSUInteger remaining = length;
+		
+		while (remaining > 0)
+		{
+			NSUInteger chunkLength = MIN(remaining, (NSUInteger)DISPATCH_DATA_READ_CHUNK_LENGTH);
+			remaining -= chunkLength;
+			
+			BOOL isLastChunk = (remaining == 0);
+			
+			GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+			                                          startOffset:0
+			                                            maxLength:0
+			                                              timeout:timeout
+			                                           readLength:chunkLength
+			                                           terminator:nil
+			                                                  tag:0];
+			packet->completesOnSocketQueue = YES;
+			packet->completion = ^(NSData *chunk, NSError *error) {
+				
+				// Successful chunks complete on the socketQueue.
+				// Failures (the socket was closed) are reported on the completionQueue, after all successes.
+				
+				if (finished) return;
+				
+				if (error)
+				{
+					finished = YES;
+					theCompletion(nil, error);
+					return;
+				}
+				
+				dispatch_data_t chunkData = dispatch_data_create([chunk bytes], [chunk length], NULL, ^{
+					
+					// The chunk owns its bytes, so this only keeps it alive
+					[chunk length];
+				});
+				
+				dispatch_data_t concatenated = dispatch_data_create_concat(received, chunkData);
+				
+				#if !OS_OBJECT_USE_OBJC
+				dispatch_release(chunkData);
+				if (received != dispatch_data_empty) dispatch_release(received);
+				#endif
+				
+				received = concatenated;
+				
+				if (isLastChunk)
+				{
+					finished = YES;
+					
+					dispatch_data_t result = received;
+					
+					[self invokeCompletionBlock:^{
+						
+						theCompletion(result, nil);
+						
+						#if !OS_OBJECT_USE_OBJC
+						dispatch_release(result);
+						#endif
+					}];
+				}
+			};
+			
+			[self addToReadQueue:packet];
+		}
+		
+		dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+			
+			[self maybeDequeueRead];
+		}});
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketReadCompletionBlock)completion
+{
+	if ([data length] == 0)
+	{
+		// There's no separator to read up to, so the read can never complete
+		
+		if (completion)
+		{
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				NSError *error = [self badParamError:@"Invalid separator data (nil or zero-length)"];
+				
+				[self invokeCompletionBlock:^{
+					completion(nil, error);
+				}];
+			}});
+		}
+		return;
+	}
+	
+	GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+	                                          startOffset:0
+	                                            maxLength:0
+	                                              timeout:timeout
+	                                           readLength:0
+	                                           terminator:data
+	                                                  tag:0];
+	packet->completion = [completion copy];
+	
+	[self enqueueRead:packet];
+}
+
+- (void)readDataToLength:(NSUInteger)length
+      intoFileDescriptor:(int)fd
+                  offset:(off_t)offset
+             withTimeout:(NSTimeInterval)timeout
+                     tag:(long)tag
+{
+	if (length == 0) {
+		LogWarn(@"Cannot read: length == 0");
+		return;
+	}
+	if (offset < 0) {
+		LogWarn(@"Cannot read: offset < 0");
+		return;
+	}
+	
+	GCDAsyncFileReadPacket *packet = [[GCDAsyncFileReadPacket alloc] initWithFileDescriptor:fd
+	                                                                                 offset:offset
+	                                                                                 length:(off_t)length
+	                                                                                timeout:timeout
+	                                                                                    tag:tag];
+	
+	[self enqueueRead:packet];
+}
+
+- (float)progressOfReadReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
+{
+	__block float result = 0.0F;
+	
+	dispatch_block_t block = ^{
+		
+        if (!self->currentRead || ![self->currentRead isKindOfClass:[GCDAsyncReadPacket class]])
+		{
+			// We're not reading anything right now.
+			
+			if (tagPtr != NULL)   *tagPtr = 0;
+			if (donePtr != NULL)  *donePtr = 0;
+			if (totalPtr != NULL) *totalPtr = 0;
+			
+			result = NAN;
+		}
+		else
+		{
+			// It's only possible to know the progress of our read if we're reading to a certain length.
+			// If we're reading to data, we of course have no idea when the data will arrive.
+			// If we're reading to timeout, then we have no idea when the next chunk of data will arrive.
+			
+            NSUInteger done = self->currentRead->bytesDone;
+            NSUInteger total = self->currentRead->readLength;
+			
+			if ([self->currentRead isKindOfClass:[GCDAsyncFileReadPacket class]])
+			{
+				GCDAsyncFileReadPacket *fileRead = (GCDAsyncFileReadPacket *)self->currentRead;
+				
+				done = (NSUInteger)[fileRead fileBytesDone];
+				total = (NSUInteger)fileRead->fileLength;
+			}
+			
+            if (tagPtr != NULL)   *tagPtr = self->currentRead->tag;
+			if (donePtr != NULL)  *donePtr = done;
+			if (totalPtr != NULL) *totalPtr = total;
+			
+			if (total > 0)
+				result = (float)done / (float)total;
+			else
+				result = 1.0F;
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+/**
+ * Adds the given packet to the read queue.
+ * 
+ * Normally this hops onto the socketQueue.
+ * But if we're already on the socketQueue within a synchronous delegate callout,
+ * the packet is queued immediately (so the read machinery that invoked the callout may pick it up),
+ * while the dequeue itself is deferred, as the read machinery is still mid-flight.
+**/
+- (void)enqueueRead:(GCDAsyncReadPacket *)packet
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) && (delegateCalloutDepth > 0))
+	{
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			[self addToReadQueue:packet];
+			
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self maybeDequeueRead];
+			}});
+		}
+		else
+		{
+			[self failDroppedPacket:packet];
+		}
+		return;
+	}
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
+		{
+            [self addToReadQueue:packet];
+			[self maybeDequeueRead];
+		}
+		else
+		{
+			[self failDroppedPacket:packet];
+		}
+	}});
+}
+
+/**
+ * Invoked on the socketQueue when a read or write is dropped because the socket isn't connected.
+ * Delegate-based packets are simply dropped (as they always have been),
+ * but a completion block is always invoked, so it's given a not-connected error.
+**/
+- (void)failDroppedPacket:(id)packet
+{
+	if ([packet isKindOfClass:[GCDAsyncReadPacket class]])
+	{
+		GCDAsyncReadPacket *readPacket = (GCDAsyncReadPacket *)packet;
+		GCDAsyncSocketReadCompletionBlock completion = readPacket->completion;
+		
+		if (completion == nil) return;
+		
+		NSError *error = [self notConnectedError];
+		
+		[self invokeCompletionBlock:^{
+			completion(nil, error);
+		} onSocketQueue:readPacket->completesOnSocketQueue];
+	}
+	else if ([packet isKindOfClass:[GCDAsyncWritePacket class]])
+	{
+		GCDAsyncWritePacket *writePacket = (GCDAsyncWritePacket *)packet;
+		GCDAsyncSocketWriteCompletionBlock completion = writePacket->completion;
+		
+		if (completion == nil) return;
+		
+		NSError *error = [self notConnectedError];
+		
+		[self invokeCompletionBlock:^{
+			completion(error);
+		} onSocketQueue:writePacket->completesOnSocketQueue];
+	}
+}
+
+/**
+ * Adds the packet to the readQueue, noting the time for the read latency statistics.
+**/
+- (void)addToReadQueue:(GCDAsyncReadPacket *)packet
+{
+	if (statistics) packet->enqueueTime = GCDAsyncSocketMonotonicTime();
+	
+	[readQueue addObject:packet];
+	[self updateQueueDepthStatistics];
+	
+	TRACE_EVENT(GCDAsyncSocketTraceReadEnqueue, packet->tag);
+}
+
+/**
+ * This method starts a new read, if needed.
+ * 
+ * It is called when:
+ * - a user requests a read
+ * - after a read request has finished (to handle the next request)
+ * - immediately after the socket opens to handle any pending requests
+ * 
+ * This method also handles auto-disconnect post read/write completion.
+**/
+- (void)maybeDequeueRead
+{
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	// If we're not currently processing a read AND we have an available read stream
+	if ((currentRead == nil) && (flags & kConnected))
+	{
+		if ([readQueue count] > 0)
+		{
+			// Dequeue the next object in the write queue
+			currentRead = [readQueue removeFirstObject];
+			[self updateQueueDepthStatistics];
+			
+			TRACE_EVENT(GCDAsyncSocketTraceReadDequeue,
+			            [currentRead isKindOfClass:[GCDAsyncReadPacket class]] ? currentRead->tag : -1);
+			
+			
+			if ([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]])
+			{
+				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
+				
+				// Attempt to start TLS
+				flags |= kStartingReadTLS;
+				
+				// The TLS handshake needs every byte as it arrives
+				if (receiveLowWaterMark > 1)
+				{
+					[self setReceiveLowWaterMark:1];
+				}
+				
+				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
+				[self maybeStartTLS];
+			}
+			else
+			{
+				LogVerbose(@"Dequeued GCDAsyncReadPacket");
+				
+				// Don't hold back data the new read could use,
+				// as the low water mark may still be that of the previous (fixed-length) read.
+				if (receiveLowWaterMark > 1)
+				{
+					[self updateReceiveLowWaterMark];
+				}
+				
+				// Setup read timer (if needed)
+				[self setupReadTimerWithTimeout:currentRead->timeout];
+				
+				// Immediately read, if possible
+				if ((config & kDrainReads) && [self isReadDrainBudgetExhausted])
+				{
+					// We've done our share of reading for this wakeup.
+					// Give other sockets on the socketQueue (or its target queue) a turn first.
+					[self yieldReadDrain];
+				}
+				else
+				{
+					[self doReadData];
+				}
+			}
+		}
+		else if (flags & kDisconnectAfterReads)
+		{
+			if (flags & kDisconnectAfterWrites)
+			{
+				if (([writeQueue count] == 0) && (currentWrite == nil))
+				{
+					[self closeWithError:nil];
+				}
+			}
+			else
+			{
+				[self closeWithError:nil];
+			}
+		}
+		else if (flags & kSocketSecure)
+		{
+			[self flushSSLBuffers];
+			
+			// Edge case:
+			// 
+			// We just drained all data from the ssl buffers,
+			// and all known data from the socket (socketFDBytesAvailable).
+			// 
+			// If we didn't get any data from this process,
+			// then we may have reached the end of the TCP stream.
+			// 
+			// Be sure callbacks are enabled so we're notified about a disconnection.
+			
+			if ([preBuffer availableBytes] == 0)
+			{
+				if ([self usingCFStreamForTLS]) {
+					// Callbacks never disabled
+				}
+				else {
+					[self resumeReadSource];
+				}
+			}
+		}
+	}
+}
+
+- (void)flushSSLBuffers
+{
+	LogTrace();
+	
+	NSAssert((flags & kSocketSecure), @"Cannot flush ssl buffers on non-secure socket");
+	
+	if ([preBuffer availableBytes] > 0)
+	{
+		// Only flush the ssl buffers if the prebuffer is empty.
+		// This is to avoid growing the prebuffer inifinitely large.
+		
+		return;
+	}
+	
+	#if TARGET_OS_IPHONE
+	
+	if ([self usingCFStreamForTLS])
+	{
+		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
+		{
+			LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
+			
+			CFIndex defaultBytesToRead = (1024 * 4);
+			
+			[preBuffer ensureCapacityForWrite:defaultBytesToRead];
+			
+			uint8_t *buffer = [preBuffer writeBuffer];
+			
+			TRACE_SYSCALL_BEGIN();
+			CFIndex result = CFReadStreamRead(readStream, buffer, defaultBytesToRead);
+			TRACE_SYSCALL(GCDAsyncSocketTraceReadSyscall, result, NO);
+			LogVerbose(@"%@ - CFReadStreamRead(): result = %i", THIS_METHOD, (int)result);
+			
+			STATISTICS_ADD(readSyscalls, 1);
+			
+			if (result > 0)
+			{
+				[preBuffer didWrite:result];
+				
+				STATISTICS_ADD(bytesRead, result);
+				STATISTICS_MAX(preBufferHighWaterMark, [preBuffer availableBytes]);
+			}
+			
+			flags &= ~kSecureSocketHasBytesAvailable;
+		}
+		
+		return;
+	}
+	
+	#endif
+	
+	__block NSUInteger estimatedBytesAvailable = 0;
+	
+	dispatch_block_t updateEstimatedBytesAvailable = ^{
+		
+		// Figure out if there is any data available to be read
+		// 
+		// socketFDBytesAvailable        <- Number of encrypted bytes we haven't read from the bsd socket
+		// [sslPreBuffer availableBytes] <- Number of encrypted bytes we've buffered from bsd socket
+		// sslInternalBufSize            <- Number of decrypted bytes SecureTransport has buffered
+		// 
+		// We call the variable "estimated" because we don't know how many decrypted bytes we'll get
+		// from the encrypted bytes in the sslPreBuffer.
+		// However, we do know this is an upper bound on the estimation.
+		
+        estimatedBytesAvailable = self->socketFDBytesAvailable + [self->sslPreBuffer availableBytes];
+		
+		size_t sslInternalBufSize = 0;
+        SSLGetBufferedReadSize(self->sslContext, &sslInternalBufSize);
+		
+		estimatedBytesAvailable += sslInternalBufSize;
+	};
+	
+	updateEstimatedBytesAvailable();
+	
+	if (estimatedBytesAvailable > 0)
+	{
+		LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
+		
+		BOOL done = NO;
+		do
+		{
+			LogVerbose(@"%@ - estimatedBytesAvailable = %lu", THIS_METHOD, (unsigned long)estimatedBytesAvailable);
+			
+			// Don't decrypt more than we're allowed to buffer.
+			// 
+			// If we've hit the cap, we stop reading from the socket until the user issues a read.
+			// This allows the kernel buffer to fill up, which in turn applies TCP backpressure to the sender.
+			
+			size_t bytesToRead = [self ssl_decryptedPreBufferAllowance];
+			if (bytesToRead == 0)
+			{
+				LogVerbose(@"%@ - Reached decrypted prebuffer cap", THIS_METHOD);
+				
+				decryptedPreBufferCapHitCount++;
+				atomic_fetch_add_explicit(&globalDecryptedPreBufferCapHitCount, 1, memory_order_relaxed);
+				
+				[self suspendReadSource];
+				break;
+			}
+			
+			bytesToRead = MIN(bytesToRead, (size_t)estimatedBytesAvailable);
+			
+			// Make sure there's enough room in the prebuffer
+			
+			[preBuffer ensureCapacityForWrite:bytesToRead];
+			
+			// Read data into prebuffer
+			
+			uint8_t *buffer = [preBuffer writeBuffer];
+			size_t bytesRead = 0;
+			
+			OSStatus result = SSLRead(sslContext, buffer, bytesToRead, &bytesRead);
+			LogVerbose(@"%@ - read from secure socket = %u", THIS_METHOD, (unsigned)bytesRead);
+			
+			if (bytesRead > 0)
+			{
+				[preBuffer didWrite:bytesRead];
+				
+				STATISTICS_MAX(preBufferHighWaterMark, [preBuffer availableBytes]);
+			}
+			
+			LogVerbose(@"%@ - prebuffer.length = %zu", THIS_METHOD, [preBuffer availableBytes]);
+			
+			if (result != noErr)
+			{
+				done = YES;
+			}
+			else
+			{
+				updateEstimatedBytesAvailable();
+			}
+			
+		} while (!done && estimatedBytesAvailable > 0);
+	}
+}
+
+/**
+ * Returns the number of decrypted bytes we're allowed to add to the preBuffer,
+ * taking into account both the per-socket cap and the global cap.
+**/
+- (size_t)ssl_decryptedPreBufferAllowance
+{
+	return GCDAsyncSocketPreBufferAllowance([preBuffer availableBytes], maxDecryptedPreBufferSize,
+	                                        &globalDecryptedPreBufferSize,
+	                                        &globalMaxDecryptedPreBufferSize);
+}
+
+- (void)doReadData
+{
+	LogTrace();
+	
+	// This method is called on the socketQueue.
+	// It might be called directly, or via the readSource when data is available to be read.
+	// 
+	// When draining reads (see readDrainingEnabled), we keep reading within this wakeup
+	// for as long as the budget allows. This is done iteratively, so the stack doesn't grow with the budget.
+	
+	while ([self doReadDataPass])
+	{
+		LogVerbose(@"Continuing to drain socket");
+	}
+}
+
+/**
+ * Reads whatever is available for the current read (see doReadData).
+ * Returns YES if more data is available right away, and reading should continue within this wakeup.
+**/
+- (BOOL)doReadDataPass
+{
+	if ((currentRead == nil) || (flags & kReadsPaused))
+	{
+		LogVerbose(@"No currentRead or kReadsPaused");
+		
+		// Unable to read at this time
+		
+		if (flags & kSocketSecure)
+		{
+			// Here's the situation:
+			// 
+			// We have an established secure connection.
+			// There may not be a currentRead, but there might be encrypted data sitting around for us.
+			// When the user does get around to issuing a read, that encrypted data will need to be decrypted.
+			// 
+			// So why make the user wait?
+			// We might as well get a head start on decrypting some data now.
+			// 
+			// The other reason we do this has to do with detecting a socket disconnection.
+			// The SSL/TLS protocol has it's own disconnection handshake.
+			// So when a secure socket is closed, a "goodbye" packet comes across the wire.
+			// We want to make sure we read the "goodbye" packet so we can properly detect the TCP disconnection.
+			
+			[self flushSSLBuffers];
+		}
+		
+		if ([self usingCFStreamForTLS])
+		{
+			// CFReadStream only fires once when there is available data.
+			// It won't fire again until we've invoked CFReadStreamRead.
+		}
+		else
+		{
+			// If the readSource is firing, we need to pause it
+			// or else it will continue to fire over and over again.
+			// 
+			// If the readSource is not firing,
+			// we want it to continue monitoring the socket.
+			
+			if (socketFDBytesAvailable > 0)
+			{
+				[self suspendReadSource];
+			}
+		}
+		return NO;
+	}
+	
+	BOOL hasBytesAvailable = NO;
+	unsigned long estimatedBytesAvailable = 0;
+	
+	if ([self usingCFStreamForTLS])
+	{
+		#if TARGET_OS_IPHONE
+		
+		// Requested CFStream, rather than SecureTransport, for TLS (via GCDAsyncSocketUseCFStreamForTLS)
+		
+		estimatedBytesAvailable = 0;
+		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
+			hasBytesAvailable = YES;
+		else
+			hasBytesAvailable = NO;
+		
+		#endif
+	}
+	else
+	{
+		estimatedBytesAvailable = socketFDBytesAvailable;
+		
+		if (flags & kSocketSecure)
+		{
+			// There are 2 buffers to be aware of here.
+			// 
+			// We are using SecureTransport, a TLS/SSL security layer which sits atop TCP.
+			// We issue a read to the SecureTranport API, which in turn issues a read to our SSLReadFunction.
+			// Our SSLReadFunction then reads from the BSD socket and returns the encrypted data to SecureTransport.
+			// SecureTransport then decrypts the data, and finally returns the decrypted data back to us.
+			// 
+			// The first buffer is one we create.
+			// SecureTransport often requests small amounts of data.
+			// This has to do with the encypted packets that are coming across the TCP stream.
+			// But it's non-optimal to do a bunch of small reads from the BSD socket.
+			// So our SSLReadFunction reads all available data from the socket (optimizing the sys call)
+			// and may store excess in the sslPreBuffer.
+			
+			estimatedBytesAvailable += [sslPreBuffer availableBytes];
+			
+			// The second buffer is within SecureTransport.
+			// As mentioned earlier, there are encrypted packets coming across the TCP stream.
+			// SecureTransport needs the entire packet to decrypt it.
+			// But if the entire packet produces X bytes of decrypted data,
+			// and we only asked SecureTransport for X/2 bytes of data,
+			// it must store the extra X/2 bytes of decrypted data for the next read.
+			// 
+			// The SSLGetBufferedReadSize function will tell us the size of this internal buffer.
+			// From the documentation:
+			// 
+			// "This function does not block or cause any low-level read operations to occur."
+			
+			size_t sslInternalBufSize = 0;
+			SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
+			
+			estimatedBytesAvailable += sslInternalBufSize;
+		}
+		
+		hasBytesAvailable = (estimatedBytesAvailable > 0);
+	}
+	
+	if ((hasBytesAvailable == NO) && ([preBuffer availableBytes] == 0))
+	{
+		LogVerbose(@"No data available to read...");
+		
+		// No data available to read.
+		
+		if (![self usingCFStreamForTLS])
+		{
+			// Need to wait for readSource to fire and notify us of
+			// available data in the socket's internal read buffer.
+			
+			[self resumeReadSource];
+		}
+		return NO;
+	}
+	
+	if (flags & kStartingReadTLS)
+	{
+		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
+		
+		// The readQueue is waiting for SSL/TLS handshake to complete.
+		
+		if (flags & kStartingWriteTLS)
+		{
+			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
+			{
+				// We are in the process of a SSL Handshake.
+				// We were waiting for incoming data which has just arrived.
+				
+				[self ssl_continueSSLHandshake];
+			}
+		}
+		else
+		{
+			// We are still waiting for the writeQueue to drain and start the SSL/TLS process.
+			// We now know data is available to read.
+			
+			if (![self usingCFStreamForTLS])
+			{
+				// Suspend the read source or else it will continue to fire nonstop.
+				
+				[self suspendReadSource];
+			}
+		}
+		
+		return NO;
+	}
+	
+	BOOL done        = NO;  // Completed read operation
+	NSError *error   = nil; // Error occurred
+	
+	NSUInteger totalBytesReadForCurrentRead = 0;
+	
+	GCDAsyncFileReadPacket *fileRead = nil;
+	
+	if ([currentRead isKindOfClass:[GCDAsyncFileReadPacket class]])
+	{
+		// Reads into a file are fixed-length reads into the current (mapped) window of the file.
+		// Map the next window if the current one is full.
+		
+		fileRead = (GCDAsyncFileReadPacket *)currentRead;
+		
+		if (![fileRead prepareWindow:&error])
+		{
+			[self closeWithError:error];
+			return NO;
+		}
+	}
+	
+	// 
+	// STEP 1 - READ FROM PREBUFFER
+	// 
+	
+	if ([preBuffer availableBytes] > 0)
+	{
+		// There are 3 types of read packets:
+		// 
+		// 1) Read all available data.
+		// 2) Read a specific length of data.
+		// 3) Read up to a particular terminator.
+		
+		NSUInteger bytesToCopy;
+		
+		if (currentRead->term != nil)
+		{
+			// Read type #3 - read up to a terminator
+			
+			bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+		}
+		else
+		{
+			// Read type #1 or #2
+			
+			bytesToCopy = [currentRead readLengthForNonTermWithHint:[preBuffer availableBytes]];
+		}
+		
+		// Make sure we have enough room in the buffer for our read.
+		
+		[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
+		
+		// Copy bytes from prebuffer into packet buffer
+		
+		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset +
+		                                                                  currentRead->bytesDone;
+		
+		memcpy(buffer, [preBuffer readBuffer], bytesToCopy);
+		
+		// Remove the copied bytes from the preBuffer
+		[preBuffer didRead:bytesToCopy];
+		
+		LogVerbose(@"copied(%lu) preBufferLength(%zu)", (unsigned long)bytesToCopy, [preBuffer availableBytes]);
+		
+		// Update totals
+		
+		currentRead->bytesDone += bytesToCopy;
+		totalBytesReadForCurrentRead += bytesToCopy;
+		
+		// Check to see if the read operation is done
+		
+		if (currentRead->readLength > 0)
+		{
+			// Read type #2 - read a specific length of data
+			
+			done = (currentRead->bytesDone == currentRead->readLength);
+		}
+		else if (currentRead->term != nil)
+		{
+			// Read type #3 - read up to a terminator
+			
+			// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method
+			
+			if (!done && currentRead->maxLength > 0)
+			{
+				// We're not done and there's a set maxLength.
+				// Have we reached that maxLength yet?
+				
+				if (currentRead->bytesDone >= currentRead->maxLength)
+				{
+					error = [self readMaxedOutError];
+				}
+			}
+		}
+		else
+		{
+			// Read type #1 - read all available data
+			// 
+			// We're done as soon as
+			// - we've read all available data (in prebuffer and socket)
+			// - we've read the maxLength of read packet.
+			
+			done = ((currentRead->maxLength > 0) && (currentRead->bytesDone == currentRead->maxLength));
+		}
+		
+	}
+	
+	// 
+	// STEP 2 - READ FROM SOCKET
+	// 
+	
+	BOOL socketEOF = (flags & kSocketHasReadEOF) ? YES : NO;  // Nothing more to read via socket (end of file)
+	BOOL waiting   = !done && !error && !socketEOF && !hasBytesAvailable; // Ran out of data, waiting for more
+	
+	if (!done && !error && !socketEOF && hasBytesAvailable)
+	{
+		NSAssert(([preBuffer availableBytes] == 0), @"Invalid logic");
+		
+		// Every attempt counts toward the wakeup's budget, even one that yields nothing.
+		// (E.g. SSLRead consuming part of a TLS record, without any decrypted data to show for it.)
+		readDrainOperations++;
+		
+		BOOL readIntoPreBuffer = NO;
+		uint8_t *buffer = NULL;
+		size_t bytesRead = 0;
+		
+		if (flags & kSocketSecure)
+		{
+			if ([self usingCFStreamForTLS])
+			{
+				#if TARGET_OS_IPHONE
+				
+				// Using CFStream, rather than SecureTransport, for TLS
+				
+				NSUInteger defaultReadLength = readLengthEstimate;
+				
+				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
+				                                                   shouldPreBuffer:&readIntoPreBuffer];
+				
+				// Make sure we have enough room in the buffer for our read.
+				//
+				// We are either reading directly into the currentRead->buffer,
+				// or we're reading into the temporary preBuffer.
+				
+				if (readIntoPreBuffer)
+				{
+					[preBuffer ensureCapacityForWrite:bytesToRead];
+					
+					buffer = [preBuffer writeBuffer];
+				}
+				else
+				{
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+					
+					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+					       + currentRead->startOffset
+					       + currentRead->bytesDone;
+				}
+				
+				// Read data into buffer
+				
+				TRACE_SYSCALL_BEGIN();
+				CFIndex result = CFReadStreamRead(readStream, buffer, (CFIndex)bytesToRead);
+				TRACE_SYSCALL(GCDAsyncSocketTraceReadSyscall, result, NO);
+				LogVerbose(@"CFReadStreamRead(): result = %i", (int)result);
+				
+				STATISTICS_ADD(readSyscalls, 1);
+				if (result > 0) STATISTICS_ADD(bytesRead, result);
+				
+				if (result < 0)
+				{
+					error = (__bridge_transfer NSError *)CFReadStreamCopyError(readStream);
+				}
+				else if (result == 0)
+				{
+					socketEOF = YES;
+				}
+				else
+				{
+					waiting = YES;
+					bytesRead = (size_t)result;
+				}
+				
+				// We only know how many decrypted bytes were read.
+				// The actual number of bytes read was likely more due to the overhead of the encryption.
+				// So we reset our flag, and rely on the next callback to alert us of more data.
+				flags &= ~kSecureSocketHasBytesAvailable;
+				
+				#endif
+			}
+			else
+			{
+				// Using SecureTransport for TLS
+				//
+				// We know:
+				// - how many bytes are available on the socket
+				// - how many encrypted bytes are sitting in the sslPreBuffer
+				// - how many decypted bytes are sitting in the sslContext
+				//
+				// But we do NOT know:
+				// - how many encypted bytes are sitting in the sslContext
+				//
+				// So we play the regular game of using an upper bound instead.
+				
+				NSUInteger defaultReadLength = readLengthEstimate;
+				
+				if (defaultReadLength < estimatedBytesAvailable) {
+					defaultReadLength = estimatedBytesAvailable + (1024 * 16);
+				}
+				
+				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
+				                                                   shouldPreBuffer:&readIntoPreBuffer];
+				
+				if (readIntoPreBuffer)
+				{
+					// Don't decrypt more into the prebuffer than we're allowed to hold (per-socket and global caps).
+					// 
+					// The current read must make progress though, even if the global cap has been reached.
+					// In that case we decrypt (at most) one record, which SecureTransport would be holding anyway.
+					
+					size_t allowance = [self ssl_decryptedPreBufferAllowance];
+					
+					if (bytesToRead > allowance)
+					{
+						decryptedPreBufferCapHitCount++;
+						atomic_fetch_add_explicit(&globalDecryptedPreBufferCapHitCount, 1, memory_order_relaxed);
+						
+						if (allowance > 0)
+							bytesToRead = allowance;
+						else
+							bytesToRead = MIN(bytesToRead, (NSUInteger)TLS_MAX_RECORD_PLAINTEXT_SIZE);
+					}
+				}
+				
+				if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t
+					bytesToRead = SIZE_MAX;
+				}
+				
+				// Make sure we have enough room in the buffer for our read.
+				//
+				// We are either reading directly into the currentRead->buffer,
+				// or we're reading into the temporary preBuffer.
+				
+				if (readIntoPreBuffer)
+				{
+					[preBuffer ensureCapacityForWrite:bytesToRead];
+					
+					buffer = [preBuffer writeBuffer];
+				}
+				else
+				{
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+					
+					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+					       + currentRead->startOffset
+					       + currentRead->bytesDone;
+				}
+				
+				// The documentation from Apple states:
+				// 
+				//     "a read operation might return errSSLWouldBlock,
+				//      indicating that less data than requested was actually transferred"
+				// 
+				// However, starting around 10.7, the function will sometimes return noErr,
+				// even if it didn't read as much data as requested. So we need to watch out for that.
+				
+				OSStatus result;
+				do
+				{
+					void *loop_buffer = buffer + bytesRead;
+					size_t loop_bytesToRead = (size_t)bytesToRead - bytesRead;
+					size_t loop_bytesRead = 0;
+					
+					result = SSLRead(sslContext, loop_buffer, loop_bytesToRead, &loop_bytesRead);
+					LogVerbose(@"read from secure socket = %u", (unsigned)loop_bytesRead);
+					
+					bytesRead += loop_bytesRead;
+					
+				} while ((result == noErr) && (bytesRead < bytesToRead));
+				
+				
+				if (result != noErr)
+				{
+					if (result == errSSLWouldBlock)
+						waiting = YES;
+					else
+					{
+						if (result == errSSLClosedGraceful || result == errSSLClosedAbort)
+						{
+							// We've reached the end of the stream.
+							// Handle this the same way we would an EOF from the socket.
+							socketEOF = YES;
+							sslErrCode = result;
+						}
+						else
+						{
+							error = [self sslError:result];
+						}
+					}
+					// It's possible that bytesRead > 0, even if the result was errSSLWouldBlock.
+					// This happens when the SSLRead function is able to read some data,
+					// but not the entire amount we requested.
+					
+					if (bytesRead <= 0)
+					{
+						bytesRead = 0;
+					}
+				}
+				
+				// Do not modify socketFDBytesAvailable.
+				// It will be updated via the SSLReadFunction().
+			}
+		}
+		else
+		{
+			// Normal socket operation
+			
+			NSUInteger bytesToRead;
+			
+			// There are 3 types of read packets:
+			//
+			// 1) Read all available data.
+			// 2) Read a specific length of data.
+			// 3) Read up to a particular terminator.
+			
+			if (currentRead->term != nil)
+			{
+				// Read type #3 - read up to a terminator
+				
+				bytesToRead = [currentRead readLengthForTermWithHint:estimatedBytesAvailable
+				                                     shouldPreBuffer:&readIntoPreBuffer];
+			}
+			else
+			{
+				// Read type #1 or #2
+				
+				bytesToRead = [currentRead readLengthForNonTermWithHint:estimatedBytesAvailable];
+			}
+			
+			if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t (read param 3)
+				bytesToRead = SIZE_MAX;
+			}
+			
+			// Make sure we have enough room in the buffer for our read.
+			//
+			// We are either reading directly into the currentRead->buffer,
+			// or we're reading into the temporary preBuffer.
+			
+			if (readIntoPreBuffer)
+			{
+				[preBuffer ensureCapacityForWrite:bytesToRead];
+				
+				buffer = [preBuffer writeBuffer];
+			}
+			else
+			{
+				[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+				
+				buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+				       + currentRead->startOffset
+				       + currentRead->bytesDone;
+			}
+			
+			// Read data into buffer
+			
+			int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+			
+			TRACE_SYSCALL_BEGIN();
+			ssize_t result = read(socketFD, buffer, (size_t)bytesToRead);
+			TRACE_SYSCALL(GCDAsyncSocketTraceReadSyscall, result, result < 0);
+			LogVerbose(@"read from socket = %i", (int)result);
+			
+			STATISTICS_ADD(readSyscalls, 1);
+			if (result > 0) STATISTICS_ADD(bytesRead, result);
+			
+			if (result < 0)
+			{
+				if (errno == EWOULDBLOCK)
+					waiting = YES;
+				else
+					error = [self errorWithErrno:errno reason:@"Error in read() function"];
+				
+				socketFDBytesAvailable = 0;
+			}
+			else if (result == 0)
+			{
+				socketEOF = YES;
+				socketFDBytesAvailable = 0;
+			}
+			else
+			{
+				bytesRead = result;
+				
+				if (bytesRead < bytesToRead)
+				{
+					// The read returned less data than requested.
+					// This means socketFDBytesAvailable was a bit off due to timing,
+					// because we read from the socket right when the readSource event was firing.
+					socketFDBytesAvailable = 0;
+				}
+				else
+				{
+					if (socketFDBytesAvailable <= bytesRead)
+						socketFDBytesAvailable = 0;
+					else
+						socketFDBytesAvailable -= bytesRead;
+				}
+				
+				if (socketFDBytesAvailable == 0)
+				{
+					waiting = YES;
+				}
+			}
+		}
+		
+		if (bytesRead > 0)
+		{
+			[self updateReadLengthWithBytesRead:bytesRead];
+			
+			readDrainBytes += bytesRead;
+			
+			// Check to see if the read operation is done
+			
+			if (currentRead->readLength > 0)
+			{
+				// Read type #2 - read a specific length of data
+				// 
+				// Note: We should never be using a prebuffer when we're reading a specific length of data.
+				
+				NSAssert(readIntoPreBuffer == NO, @"Invalid logic");
+				
+				currentRead->bytesDone += bytesRead;
+				totalBytesReadForCurrentRead += bytesRead;
+				
+				done = (currentRead->bytesDone == currentRead->readLength);
+			}
+			else if (currentRead->term != nil)
+			{
+				// Read type #3 - read up to a terminator
+				
+				if (readIntoPreBuffer)
+				{
+					// We just read a big chunk of data into the preBuffer
+					
+					[preBuffer didWrite:bytesRead];
+					LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
+					
+					STATISTICS_MAX(preBufferHighWaterMark, [preBuffer availableBytes]);
+					
+					// Search for the terminating sequence
+					
+					NSUInteger bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+					LogVerbose(@"copying %lu bytes from preBuffer", (unsigned long)bytesToCopy);
+					
+					// Ensure there's room on the read packet's buffer
+					
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
+					
+					// Copy bytes from prebuffer into read buffer
+					
+					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
+					                                                                 + currentRead->bytesDone;
+					
+					memcpy(readBuf, [preBuffer readBuffer], bytesToCopy);
+					
+					// Remove the copied bytes from the prebuffer
+					[preBuffer didRead:bytesToCopy];
+					LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
+					
+					// Update totals
+					currentRead->bytesDone += bytesToCopy;
+					totalBytesReadForCurrentRead += bytesToCopy;
+					
+					// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method above
+				}
+				else
+				{
+					// We just read a big chunk of data directly into the packet's buffer.
+					// We need to move any overflow into the prebuffer.
+					
+					NSInteger overflow = [currentRead searchForTermAfterPreBuffering:bytesRead];
+					
+					if (overflow == 0)
+					{
+						// Perfect match!
+						// Every byte we read stays in the read buffer,
+						// and the last byte we read was the last byte of the term.
+						
+						currentRead->bytesDone += bytesRead;
+						totalBytesReadForCurrentRead += bytesRead;
+						done = YES;
+					}
+					else if (overflow > 0)
+					{
+						// The term was found within the data that we read,
+						// and there are extra bytes that extend past the end of the term.
+						// We need to move these excess bytes out of the read packet and into the prebuffer.
+						
+						NSInteger underflow = bytesRead - overflow;
+						
+						// Copy excess data into preBuffer
+						
+						LogVerbose(@"copying %ld overflow bytes into preBuffer", (long)overflow);
+						[preBuffer ensureCapacityForWrite:overflow];
+						
+						uint8_t *overflowBuffer = buffer + underflow;
+						memcpy([preBuffer writeBuffer], overflowBuffer, overflow);
+						
+						[preBuffer didWrite:overflow];
+						LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
+						
+						STATISTICS_MAX(preBufferHighWaterMark, [preBuffer availableBytes]);
+						
+						// Note: The completeCurrentRead method will trim the buffer for us.
+						
+						currentRead->bytesDone += underflow;
+						totalBytesReadForCurrentRead += underflow;
+						done = YES;
+					}
+					else
+					{
+						// The term was not found within the data that we read.
+						
+						currentRead->bytesDone += bytesRead;
+						totalBytesReadForCurrentRead += bytesRead;
+						done = NO;
+					}
+				}
+				
+				if (!done && currentRead->maxLength > 0)
+				{
+					// We're not done and there's a set maxLength.
+					// Have we reached that maxLength yet?
+					
+					if (currentRead->bytesDone >= currentRead->maxLength)
+					{
+						error = [self readMaxedOutError];
+					}
+				}
+			}
+			else
+			{
+				// Read type #1 - read all available data
+				
+				if (readIntoPreBuffer)
+				{
+					// We just read a chunk of data into the preBuffer
+					
+					[preBuffer didWrite:bytesRead];
+					
+					STATISTICS_MAX(preBufferHighWaterMark, [preBuffer availableBytes]);
+					
+					// Now copy the data into the read packet.
+					// 
+					// Recall that we didn't read directly into the packet's buffer to avoid
+					// over-allocating memory since we had no clue how much data was available to be read.
+					// 
+					// Ensure there's room on the read packet's buffer
+					
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesRead];
+					
+					// Copy bytes from prebuffer into read buffer
+					
+					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
+					                                                                 + currentRead->bytesDone;
+					
+					memcpy(readBuf, [preBuffer readBuffer], bytesRead);
+					
+					// Remove the copied bytes from the prebuffer
+					[preBuffer didRead:bytesRead];
+					
+					// Update totals
+					currentRead->bytesDone += bytesRead;
+					totalBytesReadForCurrentRead += bytesRead;
+				}
+				else
+				{
+					currentRead->bytesDone += bytesRead;
+					totalBytesReadForCurrentRead += bytesRead;
+				}
+				
+				done = YES;
+			}
 			
-            if (self->socket4FD != SOCKET_NULL)
-                result = [self localHostFromSocket4:self->socket4FD];
-            else if (self->socket6FD != SOCKET_NULL)
-                result = [self localHostFromSocket6:self->socket6FD];
-		}});
-		
-		return result;
-	}
-}
-
-- (uint16_t)localPort
-{
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (socket4FD != SOCKET_NULL)
-			return [self localPortFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self localPortFromSocket6:socket6FD];
+		} // if (bytesRead > 0)
 		
-		return 0;
-	}
-	else
+	} // if (!done && !error && !socketEOF && hasBytesAvailable)
+	
+	
+	if (!done && currentRead->readLength == 0 && currentRead->term == nil)
 	{
-		__block uint16_t result = 0;
-		
-		dispatch_sync(socketQueue, ^{
-			// No need for autorelease pool
-			
-            if (self->socket4FD != SOCKET_NULL)
-                result = [self localPortFromSocket4:self->socket4FD];
-            else if (self->socket6FD != SOCKET_NULL)
-                result = [self localPortFromSocket6:self->socket6FD];
-		});
+		// Read type #1 - read all available data
+		// 
+		// We might arrive here if we read data from the prebuffer but not from the socket.
 		
-		return result;
+		done = (totalBytesReadForCurrentRead > 0);
 	}
-}
-
-- (NSString *)connectedHost4
-{
-	if (socket4FD != SOCKET_NULL)
-		return [self connectedHostFromSocket4:socket4FD];
-	
-	return nil;
-}
-
-- (NSString *)connectedHost6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self connectedHostFromSocket6:socket6FD];
 	
-	return nil;
-}
-
-- (uint16_t)connectedPort4
-{
-	if (socket4FD != SOCKET_NULL)
-		return [self connectedPortFromSocket4:socket4FD];
-	
-	return 0;
-}
-
-- (uint16_t)connectedPort6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self connectedPortFromSocket6:socket6FD];
-	
-	return 0;
-}
-
-- (NSString *)localHost4
-{
-	if (socket4FD != SOCKET_NULL)
-		return [self localHostFromSocket4:socket4FD];
-	
-	return nil;
-}
-
-- (NSString *)localHost6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self localHostFromSocket6:socket6FD];
-	
-	return nil;
-}
-
-- (uint16_t)localPort4
-{
-	if (socket4FD != SOCKET_NULL)
-		return [self localPortFromSocket4:socket4FD];
-	
-	return 0;
-}
-
-- (uint16_t)localPort6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self localPortFromSocket6:socket6FD];
-	
-	return 0;
-}
-
-- (NSString *)connectedHostFromSocket4:(int)socketFD
-{
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
+	BOOL windowFilled = NO;
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	if (done && fileRead)
 	{
-		return nil;
+		// We've filled the current window of the file.
+		// The next window is mapped on the next pass.
+		
+		done = [fileRead isDone];
+		windowFilled = !done;
 	}
-	return [[self class] hostFromSockaddr4:&sockaddr4];
-}
-
-- (NSString *)connectedHostFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
-	{
-		return nil;
-	}
-	return [[self class] hostFromSockaddr6:&sockaddr6];
-}
-
-- (uint16_t)connectedPortFromSocket4:(int)socketFD
-{
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
+	// Check to see if we're done, or if we've made progress
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	if (done)
 	{
-		return 0;
+		[self completeCurrentRead];
+		
+		if (!error && (!socketEOF || [preBuffer availableBytes] > 0))
+		{
+			[self maybeDequeueRead];
+		}
 	}
-	return [[self class] portFromSockaddr4:&sockaddr4];
-}
-
-- (uint16_t)connectedPortFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
-	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	else if (totalBytesReadForCurrentRead > 0)
 	{
-		return 0;
-	}
-	return [[self class] portFromSockaddr6:&sockaddr6];
-}
+		// We're not done read type #2 or #3 yet, but we have read in some bytes
+		//
+		// We ensure that `waiting` is set in order to resume the readSource (if it is suspended). It is
+		// possible to reach this point and `waiting` not be set, if the current read's length is
+		// sufficiently large. In that case, we may have read to some upperbound successfully, but
+		// that upperbound could be smaller than the desired length.
+		waiting = YES;
 
-- (NSURL *)connectedUrlFromSocketUN:(int)socketFD
-{
-	struct sockaddr_un sockaddr;
-	socklen_t sockaddrlen = sizeof(sockaddr);
-	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr, &sockaddrlen) < 0)
-	{
-		return 0;
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+		
+		if (delegateQueue && !currentRead->completion && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidReadPartialData))
+		{
+			long theReadTag = currentRead->tag;
+			
+			[self invokeDataDelegateBlock:^{
+				
+				[theDelegate socket:self didReadPartialDataOfLength:totalBytesReadForCurrentRead tag:theReadTag];
+			}];
+		}
 	}
-	return [[self class] urlFromSockaddrUN:&sockaddr];
-}
-
-- (NSString *)localHostFromSocket4:(int)socketFD
-{
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
-	{
-		return nil;
-	}
-	return [[self class] hostFromSockaddr4:&sockaddr4];
-}
-
-- (NSString *)localHostFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
+	// Check for errors
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	if (error)
 	{
-		return nil;
+		[self closeWithError:error];
 	}
-	return [[self class] hostFromSockaddr6:&sockaddr6];
-}
-
-- (uint16_t)localPortFromSocket4:(int)socketFD
-{
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
-	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	else if (windowFilled && (!socketEOF || [preBuffer availableBytes] > 0))
 	{
-		return 0;
+		// The rest of the file may already be buffered (in the preBuffer, or by SecureTransport),
+		// in which case the readSource won't fire again for it.
+		// So map the next window and keep reading within this wakeup.
+		return YES;
 	}
-	return [[self class] portFromSockaddr4:&sockaddr4];
-}
-
-- (uint16_t)localPortFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
-	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	else if (socketEOF)
 	{
-		return 0;
+		[self doReadEOF];
 	}
-	return [[self class] portFromSockaddr6:&sockaddr6];
-}
-
-- (NSData *)connectedAddress
-{
-	__block NSData *result = nil;
-	
-	dispatch_block_t block = ^{
-        if (self->socket4FD != SOCKET_NULL)
+	else if (waiting)
+	{
+		if (!done && [self shouldContinueDrainingReads])
 		{
-			struct sockaddr_in sockaddr4;
-			socklen_t sockaddr4len = sizeof(sockaddr4);
-			
-            if (getpeername(self->socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
-			{
-				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
-			}
+			// More data arrived on the socket while we were reading it.
+			// Keep reading within this wakeup, rather than waiting for the readSource to fire again.
+			return YES;
 		}
-		
-        if (self->socket6FD != SOCKET_NULL)
+		else if (![self usingCFStreamForTLS])
 		{
-			struct sockaddr_in6 sockaddr6;
-			socklen_t sockaddr6len = sizeof(sockaddr6);
+			// Don't wake us up until there's enough data to make progress on the current read
+			[self updateReceiveLowWaterMark];
 			
-            if (getpeername(self->socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
-			{
-				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
-			}
+			// Monitor the socket for readability (if we're not already doing so)
+			[self resumeReadSource];
 		}
-	};
+	}
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	// Do not add any code here without first adding return statements in the error cases above.
 	
-	return result;
+	return NO;
 }
 
-- (NSData *)localAddress
+- (BOOL)isReadDrainBudgetExhausted
 {
-	__block NSData *result = nil;
-	
-	dispatch_block_t block = ^{
-        if (self->socket4FD != SOCKET_NULL)
-		{
-			struct sockaddr_in sockaddr4;
-			socklen_t sockaddr4len = sizeof(sockaddr4);
-			
-            if (getsockname(self->socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
-			{
-				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
-			}
-		}
-		
-        if (self->socket6FD != SOCKET_NULL)
-		{
-			struct sockaddr_in6 sockaddr6;
-			socklen_t sockaddr6len = sizeof(sockaddr6);
-			
-            if (getsockname(self->socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
-			{
-				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
-			}
-		}
-	};
+	// Both budgets are always nonzero (see setReadDrainByteBudget: & setReadDrainOperationBudget:)
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	if (readDrainBytes >= readDrainByteBudget) return YES;
+	if (readDrainOperations >= readDrainOperationBudget) return YES;
 	
-	return result;
+	return NO;
 }
 
-- (BOOL)isIPv4
+/**
+ * Invoked when the current read is waiting for more data.
+ * 
+ * If draining is enabled, and the wakeup's budget allows it, this asks the kernel how much data is
+ * available right now (which may be more than the readSource reported when it fired).
+ * If there is any, socketFDBytesAvailable is refreshed and YES is returned.
+**/
+- (BOOL)shouldContinueDrainingReads
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (!(config & kDrainReads)) return NO;
+	if ((currentRead == nil) || (flags & kReadsPaused)) return NO;
+	if ([self usingCFStreamForTLS]) return NO;
+	if ([self isReadDrainBudgetExhausted]) return NO;
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	int bytesAvailable = 0;
+	
+	if ((ioctl(socketFD, FIONREAD, &bytesAvailable) != 0) || (bytesAvailable <= 0))
 	{
-		return (socket4FD != SOCKET_NULL);
+		return NO;
 	}
-	else
-	{
-		__block BOOL result = NO;
+	
+	LogVerbose(@"Continuing to drain socket: FIONREAD = %i", bytesAvailable);
+	
+	socketFDBytesAvailable = (unsigned long)bytesAvailable;
+	return YES;
+}
+
+/**
+ * Defers the current read to a new block on the socketQueue, with a fresh budget.
+**/
+- (void)yieldReadDrain
+{
+	if (flags & kReadDrainYieldPending) return;
+	
+	flags |= kReadDrainYieldPending;
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		dispatch_sync(socketQueue, ^{
-            result = (self->socket4FD != SOCKET_NULL);
-		});
+		if (!(self->flags & kReadDrainYieldPending)) return_from_block; // Socket was closed
 		
-		return result;
-	}
+		self->flags &= ~kReadDrainYieldPending;
+		
+		self->readDrainBytes = 0;
+		self->readDrainOperations = 0;
+		
+		[self doReadData];
+	}});
 }
 
-- (BOOL)isIPv6
+/**
+ * Sets the socket's SO_RCVLOWAT for the current read, if enabled via maxReceiveLowWaterMark.
+ * 
+ * For a fixed-length read (over a plain connection), the readSource need not fire
+ * until all of the remaining bytes have arrived, so we set the low water mark to that amount (within limits).
+ * For every other kind of read, any amount of data is useful, and the low water mark is reset to 1.
+**/
+- (void)updateReceiveLowWaterMark
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return (socket6FD != SOCKET_NULL);
-	}
-	else
+	int lowWaterMark = 1;
+	
+	if ((maxReceiveLowWaterMark > 0) && currentRead && (currentRead->readLength > 0) && !(flags & kSocketSecure))
 	{
-		__block BOOL result = NO;
+		NSUInteger bytesRemaining = currentRead->readLength - currentRead->bytesDone;
+		NSUInteger cap = MIN(maxReceiveLowWaterMark, (NSUInteger)INT_MAX);
 		
-		dispatch_sync(socketQueue, ^{
-            result = (self->socket6FD != SOCKET_NULL);
-		});
+		// The socket's receive buffer must be able to hold the low water mark (with room to spare),
+		// or the kernel would never wake us up.
+		// Its size is looked up once per connection.
 		
-		return result;
+		if (receiveBufferSize == 0)
+		{
+			int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+			int size = 0;
+			socklen_t optlen = sizeof(size);
+			
+			if ((getsockopt(socketFD, SOL_SOCKET, SO_RCVBUF, &size, &optlen) == 0) && (size > 0))
+				receiveBufferSize = size;
+			else
+				receiveBufferSize = -1;
+		}
+		
+		if (receiveBufferSize > 1)
+		{
+			cap = MIN(cap, (NSUInteger)(receiveBufferSize / 2));
+		}
+		else
+		{
+			cap = 1;
+		}
+		
+		lowWaterMark = (int)MAX(MIN(bytesRemaining, cap), (NSUInteger)1);
+	}
+	
+	if (lowWaterMark != receiveLowWaterMark)
+	{
+		[self setReceiveLowWaterMark:lowWaterMark];
 	}
 }
 
-- (BOOL)isSecure
+- (void)setReceiveLowWaterMark:(int)lowWaterMark
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	if (socketFD == SOCKET_NULL) return;
+	
+	if (setsockopt(socketFD, SOL_SOCKET, SO_RCVLOWAT, &lowWaterMark, sizeof(lowWaterMark)) == 0)
 	{
-		return (flags & kSocketSecure) ? YES : NO;
+		LogVerbose(@"SO_RCVLOWAT = %i", lowWaterMark);
+		
+		receiveLowWaterMark = lowWaterMark;
 	}
 	else
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-            result = (self->flags & kSocketSecure) ? YES : NO;
-		});
-		
-		return result;
+		LogWarn(@"Error setting SO_RCVLOWAT: %@", [self errnoError]);
 	}
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Utilities
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * Finds the address of an interface description.
- * An inteface description may be an interface name (en0, en1, lo0) or corresponding IP (192.168.4.34).
+ * Feeds the result of a read into the adaptive read length.
  * 
- * The interface description may optionally contain a port number at the end, separated by a colon.
- * If a non-zero port parameter is provided, any port number in the interface description is ignored.
+ * The read length is the default amount we ask for when we don't know exactly how much data is available
+ * (i.e. when using TLS). It tracks an exponentially weighted moving average of the traffic we see per read:
+ * the bytes we just read, plus those the kernel still reports as available on the socket.
  * 
- * The returned value is a 'struct sockaddr' wrapped in an NSMutableData object.
+ * So a chatty connection settles on small reads (and small buffers),
+ * while a bulk transfer quickly grows its reads up to maxReadLength, saving syscalls.
 **/
-- (void)getInterfaceAddress4:(NSMutableData **)interfaceAddr4Ptr
-                    address6:(NSMutableData **)interfaceAddr6Ptr
-             fromDescription:(NSString *)interfaceDescription
-                        port:(uint16_t)port
+- (void)updateReadLengthWithBytesRead:(size_t)bytesRead
 {
-	NSMutableData *addr4 = nil;
-	NSMutableData *addr6 = nil;
+	NSUInteger sample = (NSUInteger)bytesRead + (NSUInteger)socketFDBytesAvailable;
+	NSUInteger estimate = readLengthEstimate;
 	
-	NSString *interface = nil;
+	// Each sample has a weight of 1/4
+	if (sample > estimate)
+		estimate += (sample - estimate) / 4;
+	else
+		estimate -= (estimate - sample) / 4;
 	
-	NSArray *components = [interfaceDescription componentsSeparatedByString:@":"];
-	if ([components count] > 0)
+	readLengthEstimate = MIN(MAX(estimate, (NSUInteger)ADAPTIVE_READ_LENGTH_MIN), maxReadLength);
+}
+
+- (void)doReadEOF
+{
+	LogTrace();
+	
+	// This method may be called more than once.
+	// If the EOF is read while there is still data in the preBuffer,
+	// then this method may be called continually after invocations of doReadData to see if it's time to disconnect.
+	
+	flags |= kSocketHasReadEOF;
+	
+	if (flags & kSocketSecure)
 	{
-		NSString *temp = [components objectAtIndex:0];
-		if ([temp length] > 0)
-		{
-			interface = temp;
-		}
+		// If the SSL layer has any buffered data, flush it into the preBuffer now.
+		
+		[self flushSSLBuffers];
 	}
-	if ([components count] > 1 && port == 0)
+	
+	BOOL shouldDisconnect = NO;
+	NSError *error = nil;
+	
+	if ((flags & kStartingReadTLS) || (flags & kStartingWriteTLS))
 	{
-		NSString *temp = [components objectAtIndex:1];
-		long portL = strtol([temp UTF8String], NULL, 10);
+		// We received an EOF during or prior to startTLS.
+		// The SSL/TLS handshake is now impossible, so this is an unrecoverable situation.
 		
-		if (portL > 0 && portL <= UINT16_MAX)
+		shouldDisconnect = YES;
+		
+		if ([self usingSecureTransportForTLS])
 		{
-			port = (uint16_t)portL;
+			error = [self sslError:errSSLClosedAbort];
 		}
 	}
-	
-	if (interface == nil)
+	else if (flags & kReadStreamClosed)
 	{
-		// ANY address
-		
-		struct sockaddr_in sockaddr4;
-		memset(&sockaddr4, 0, sizeof(sockaddr4));
-		
-		sockaddr4.sin_len         = sizeof(sockaddr4);
-		sockaddr4.sin_family      = AF_INET;
-		sockaddr4.sin_port        = htons(port);
-		sockaddr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		// The preBuffer has already been drained.
+		// The config allows half-duplex connections.
+		// We've previously checked the socket, and it appeared writeable.
+		// So we marked the read stream as closed and notified the delegate.
+		// 
+		// As per the half-duplex contract, the socket will be closed when a write fails,
+		// or when the socket is manually closed.
 		
-		struct sockaddr_in6 sockaddr6;
-		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		shouldDisconnect = NO;
+	}
+	else if ([preBuffer availableBytes] > 0)
+	{
+		LogVerbose(@"Socket reached EOF, but there is still data available in prebuffer");
 		
-		sockaddr6.sin6_len       = sizeof(sockaddr6);
-		sockaddr6.sin6_family    = AF_INET6;
-		sockaddr6.sin6_port      = htons(port);
-		sockaddr6.sin6_addr      = in6addr_any;
+		// Although we won't be able to read any more data from the socket,
+		// there is existing data that has been prebuffered that we can read.
 		
-		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
-		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+		shouldDisconnect = NO;
 	}
-	else if ([interface isEqualToString:@"localhost"] || [interface isEqualToString:@"loopback"])
+	else if (config & kAllowHalfDuplexConnection)
 	{
-		// LOOPBACK address
-		
-		struct sockaddr_in sockaddr4;
-		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		// We just received an EOF (end of file) from the socket's read stream.
+		// This means the remote end of the socket (the peer we're connected to)
+		// has explicitly stated that it will not be sending us any more data.
+		// 
+		// Query the socket to see if it is still writeable. (Perhaps the peer will continue reading data from us)
 		
-		sockaddr4.sin_len         = sizeof(sockaddr4);
-		sockaddr4.sin_family      = AF_INET;
-		sockaddr4.sin_port        = htons(port);
-		sockaddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
 		
-		struct sockaddr_in6 sockaddr6;
-		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		struct pollfd pfd[1];
+		pfd[0].fd = socketFD;
+		pfd[0].events = POLLOUT;
+		pfd[0].revents = 0;
 		
-		sockaddr6.sin6_len       = sizeof(sockaddr6);
-		sockaddr6.sin6_family    = AF_INET6;
-		sockaddr6.sin6_port      = htons(port);
-		sockaddr6.sin6_addr      = in6addr_loopback;
+		poll(pfd, 1, 0);
 		
-		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
-		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+		if (pfd[0].revents & POLLOUT)
+		{
+			// Socket appears to still be writeable
+			
+			shouldDisconnect = NO;
+			flags |= kReadStreamClosed;
+			
+			if (outgoingRelay)
+			{
+				// The relay's pending read will never complete
+				[self relay:outgoingRelay didReadData:nil error:nil];
+			}
+			
+			// Notify the delegate that we're going half-duplex
+			
+			__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+			if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidCloseReadStream:)])
+			{
+				dispatch_async(delegateQueue, ^{ @autoreleasepool {
+					
+					[theDelegate socketDidCloseReadStream:self];
+				}});
+			}
+		}
+		else
+		{
+			shouldDisconnect = YES;
+		}
 	}
 	else
 	{
-		const char *iface = [interface UTF8String];
-		
-		struct ifaddrs *addrs;
-		const struct ifaddrs *cursor;
-		
-		if ((getifaddrs(&addrs) == 0))
+		shouldDisconnect = YES;
+	}
+	
+	
+	if (shouldDisconnect)
+	{
+		if (error == nil)
 		{
-			cursor = addrs;
-			while (cursor != NULL)
+			if ([self usingSecureTransportForTLS])
 			{
-				if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET))
+				if (sslErrCode != noErr && sslErrCode != errSSLClosedGraceful)
 				{
-					// IPv4
-					
-					struct sockaddr_in nativeAddr4;
-					memcpy(&nativeAddr4, cursor->ifa_addr, sizeof(nativeAddr4));
-					
-					if (strcmp(cursor->ifa_name, iface) == 0)
-					{
-						// Name match
-						
-						nativeAddr4.sin_port = htons(port);
-						
-						addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
-					}
-					else
-					{
-						char ip[INET_ADDRSTRLEN];
-						
-						const char *conversion = inet_ntop(AF_INET, &nativeAddr4.sin_addr, ip, sizeof(ip));
-						
-						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
-						{
-							// IP match
-							
-							nativeAddr4.sin_port = htons(port);
-							
-							addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
-						}
-					}
+					error = [self sslError:sslErrCode];
 				}
-				else if ((addr6 == nil) && (cursor->ifa_addr->sa_family == AF_INET6))
+				else
 				{
-					// IPv6
-					
-					struct sockaddr_in6 nativeAddr6;
-					memcpy(&nativeAddr6, cursor->ifa_addr, sizeof(nativeAddr6));
-					
-					if (strcmp(cursor->ifa_name, iface) == 0)
-					{
-						// Name match
-						
-						nativeAddr6.sin6_port = htons(port);
-						
-						addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
-					}
-					else
-					{
-						char ip[INET6_ADDRSTRLEN];
-						
-						const char *conversion = inet_ntop(AF_INET6, &nativeAddr6.sin6_addr, ip, sizeof(ip));
-						
-						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
-						{
-							// IP match
-							
-							nativeAddr6.sin6_port = htons(port);
-							
-							addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
-						}
-					}
+					error = [self connectionClosedError];
 				}
-				
-				cursor = cursor->ifa_next;
 			}
+			else
+			{
+				error = [self connectionClosedError];
+			}
+		}
+		[self closeWithError:error];
+	}
+	else
+	{
+		if (![self usingCFStreamForTLS])
+		{
+			// Suspend the read source (if needed)
 			
-			freeifaddrs(addrs);
+			[self suspendReadSource];
 		}
 	}
-	
-	if (interfaceAddr4Ptr) *interfaceAddr4Ptr = addr4;
-	if (interfaceAddr6Ptr) *interfaceAddr6Ptr = addr6;
 }
 
-- (NSData *)getInterfaceAddressFromUrl:(NSURL *)url
+- (void)completeCurrentRead
 {
-	NSString *path = url.path;
-	if (path.length == 0) {
-		return nil;
-	}
-	
-    struct sockaddr_un nativeAddr;
-    nativeAddr.sun_family = AF_UNIX;
-    strlcpy(nativeAddr.sun_path, path.fileSystemRepresentation, sizeof(nativeAddr.sun_path));
-    nativeAddr.sun_len = (unsigned char)SUN_LEN(&nativeAddr);
-    NSData *interface = [NSData dataWithBytes:&nativeAddr length:sizeof(struct sockaddr_un)];
+	LogTrace();
 	
-	return interface;
-}
-
-- (void)setupReadAndWriteSourcesForNewlyConnectedSocket:(int)socketFD
-{
-	readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socketFD, 0, socketQueue);
-	writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, socketFD, 0, socketQueue);
+	NSAssert(currentRead, @"Trying to complete current read when there is no current read.");
 	
-	// Setup event handlers
 	
-	__weak GCDAsyncSocket *weakSelf = self;
+	NSData *result = nil;
 	
-	dispatch_source_set_event_handler(readSource, ^{ @autoreleasepool {
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
-		__strong GCDAsyncSocket *strongSelf = weakSelf;
-		if (strongSelf == nil) return_from_block;
-		
-		LogVerbose(@"readEventBlock");
-		
-		strongSelf->socketFDBytesAvailable = dispatch_source_get_data(strongSelf->readSource);
-		LogVerbose(@"socketFDBytesAvailable: %lu", strongSelf->socketFDBytesAvailable);
-		
-		if (strongSelf->socketFDBytesAvailable > 0)
-			[strongSelf doReadData];
-		else
-			[strongSelf doReadEOF];
+	if ([currentRead isKindOfClass:[GCDAsyncFileReadPacket class]])
+	{
+		// The data is in the file
+		[(GCDAsyncFileReadPacket *)currentRead unmapWindow];
 		
-	#pragma clang diagnostic pop
-	}});
-	
-	dispatch_source_set_event_handler(writeSource, ^{ @autoreleasepool {
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		result = [NSData data];
+	}
+	else if (currentRead->bufferOwner)
+	{
+		// We created the buffer on behalf of the user.
+		// Trim our buffer to be the proper size.
+		[currentRead->buffer setLength:currentRead->bytesDone];
 		
-		__strong GCDAsyncSocket *strongSelf = weakSelf;
-		if (strongSelf == nil) return_from_block;
+		result = currentRead->buffer;
+	}
+	else
+	{
+		// We did NOT create the buffer.
+		// The buffer is owned by the caller.
+		// Only trim the buffer if we had to increase its size.
 		
-		LogVerbose(@"writeEventBlock");
+		if ([currentRead->buffer length] > currentRead->originalBufferLength)
+		{
+			NSUInteger readSize = currentRead->startOffset + currentRead->bytesDone;
+			NSUInteger origSize = currentRead->originalBufferLength;
+			
+			NSUInteger buffSize = MAX(readSize, origSize);
+			
+			[currentRead->buffer setLength:buffSize];
+		}
 		
-		strongSelf->flags |= kSocketCanAcceptBytes;
-		[strongSelf doWriteData];
+		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset;
 		
-	#pragma clang diagnostic pop
-	}});
-	
-	// Setup cancel handlers
+		result = [NSData dataWithBytesNoCopy:buffer length:currentRead->bytesDone freeWhenDone:NO];
+	}
 	
-	__block int socketFDRefCount = 2;
+	[self recordCompletionOfPacketQueuedAt:currentRead->enqueueTime isRead:YES];
 	
-	#if !OS_OBJECT_USE_OBJC
-	dispatch_source_t theReadSource = readSource;
-	dispatch_source_t theWriteSource = writeSource;
-	#endif
+	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+	// If we own the buffer, the result owns its bytes, and the blocks below need only the result.
+	// Otherwise the blocks retain the packet (and thus the caller's buffer), so it can't be reused.
+	GCDAsyncReadPacket *theRead = currentRead;
+	BOOL canRecycle = currentRead->bufferOwner;
 	
-	dispatch_source_set_cancel_handler(readSource, ^{
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
-		LogVerbose(@"readCancelBlock");
-		
-		#if !OS_OBJECT_USE_OBJC
-		LogVerbose(@"dispatch_release(readSource)");
-		dispatch_release(theReadSource);
-		#endif
+	if (currentRead->completion)
+	{
+		GCDAsyncSocketReadCompletionBlock completion = currentRead->completion;
 		
-		if (--socketFDRefCount == 0)
+		if (canRecycle)
 		{
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
+			[self invokeCompletionBlock:^{
+				
+				completion(result, nil);
+			} onSocketQueue:theRead->completesOnSocketQueue];
 		}
-		
-	#pragma clang diagnostic pop
-	});
-	
-	dispatch_source_set_cancel_handler(writeSource, ^{
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
-		LogVerbose(@"writeCancelBlock");
-		
-		#if !OS_OBJECT_USE_OBJC
-		LogVerbose(@"dispatch_release(writeSource)");
-		dispatch_release(theWriteSource);
-		#endif
-		
-		if (--socketFDRefCount == 0)
+		else
 		{
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
+			[self invokeCompletionBlock:^{
+				
+				theRead->completion(result, nil);
+			} onSocketQueue:theRead->completesOnSocketQueue];
 		}
+	}
+	else if (delegateQueue && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidReadData))
+	{
+		GCDAsyncSocketDidReadDataIMP didReadData = delegateDidReadData;
 		
-	#pragma clang diagnostic pop
-	});
-	
-	// We will not be able to read until data arrives.
-	// But we should be able to write immediately.
-	
-	socketFDBytesAvailable = 0;
-	flags &= ~kReadSourceSuspended;
-	
-	LogVerbose(@"dispatch_resume(readSource)");
-	dispatch_resume(readSource);
+		if (canRecycle)
+		{
+			long theReadTag = currentRead->tag;
+			
+			[self invokeDataDelegateBlock:^{
+				
+				didReadData(theDelegate, @selector(socket:didReadData:withTag:), self, result, theReadTag);
+			}];
+		}
+		else
+		{
+			[self invokeDataDelegateBlock:^{
+				
+				didReadData(theDelegate, @selector(socket:didReadData:withTag:), self, result, theRead->tag);
+			}];
+		}
+	}
 	
-	flags |= kSocketCanAcceptBytes;
-	flags |= kWriteSourceSuspended;
-}
-
-- (BOOL)usingCFStreamForTLS
-{
-	#if TARGET_OS_IPHONE
+	[self endCurrentRead];
 	
-	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	if (canRecycle)
 	{
-		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
-		
-		return YES;
+		[self recycleReadPacket:theRead];
 	}
 	
-	#endif
-	
-	return NO;
+	// The low water mark is left as is for now.
+	// It's adjusted (if need be) when the next read is dequeued, which is often another fixed-length read.
 }
 
-- (BOOL)usingSecureTransportForTLS
+- (void)endCurrentRead
 {
-	// Invoking this method is equivalent to ![self usingCFStreamForTLS] (just more readable)
-	
-	#if TARGET_OS_IPHONE
-	
-	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	if (readTimer)
 	{
-		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
-		
-		return NO;
+		dispatch_source_cancel(readTimer);
+		readTimer = NULL;
 	}
 	
-	#endif
-	
-	return YES;
+	currentRead = nil;
 }
 
-- (void)suspendReadSource
+- (void)setupReadTimerWithTimeout:(NSTimeInterval)timeout
 {
-	if (!(flags & kReadSourceSuspended))
+	if (timeout >= 0.0)
 	{
-		LogVerbose(@"dispatch_suspend(readSource)");
+		readTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
 		
-		dispatch_suspend(readSource);
-		flags |= kReadSourceSuspended;
+		__weak GCDAsyncSocket *weakSelf = self;
+		
+		dispatch_source_set_event_handler(readTimer, ^{ @autoreleasepool {
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+			__strong GCDAsyncSocket *strongSelf = weakSelf;
+			if (strongSelf == nil) return_from_block;
+			
+			[strongSelf doReadTimeout];
+			
+		#pragma clang diagnostic pop
+		}});
+		
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_source_t theReadTimer = readTimer;
+		dispatch_source_set_cancel_handler(readTimer, ^{
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+			LogVerbose(@"dispatch_release(readTimer)");
+			dispatch_release(theReadTimer);
+			
+		#pragma clang diagnostic pop
+		});
+		#endif
+		
+		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		
+		dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
+		dispatch_resume(readTimer);
 	}
 }
 
-- (void)resumeReadSource
+- (void)doReadTimeout
 {
-	if (flags & kReadSourceSuspended)
+	// This is a little bit tricky.
+	// Ideally we'd like to synchronously query the delegate about a timeout extension.
+	// But if we do so synchronously we risk a possible deadlock.
+	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
+	
+	flags |= kReadsPaused;
+	
+	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+	if (delegateQueue && !currentRead->completion &&
+	    [theDelegate respondsToSelector:@selector(socket:shouldTimeoutReadWithTag:elapsed:bytesDone:)])
 	{
-		LogVerbose(@"dispatch_resume(readSource)");
+		// Capture the values rather than the packet, as the packet may be reused once it's finished
+		long theReadTag = currentRead->tag;
+		NSTimeInterval theReadTimeout = currentRead->timeout;
+		NSUInteger theReadBytesDone = currentRead->bytesDone;
 		
-		dispatch_resume(readSource);
-		flags &= ~kReadSourceSuspended;
+		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			
+			NSTimeInterval timeoutExtension = 0.0;
+			
+			timeoutExtension = [theDelegate socket:self shouldTimeoutReadWithTag:theReadTag
+			                                                             elapsed:theReadTimeout
+			                                                           bytesDone:theReadBytesDone];
+			
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self doReadTimeoutWithExtension:timeoutExtension];
+			}});
+		}});
 	}
-}
-
-- (void)suspendWriteSource
-{
-	if (!(flags & kWriteSourceSuspended))
+	else
 	{
-		LogVerbose(@"dispatch_suspend(writeSource)");
-		
-		dispatch_suspend(writeSource);
-		flags |= kWriteSourceSuspended;
+		[self doReadTimeoutWithExtension:0.0];
 	}
 }
 
-- (void)resumeWriteSource
+- (void)doReadTimeoutWithExtension:(NSTimeInterval)timeoutExtension
 {
-	if (flags & kWriteSourceSuspended)
+	if (currentRead)
 	{
-		LogVerbose(@"dispatch_resume(writeSource)");
-		
-		dispatch_resume(writeSource);
-		flags &= ~kWriteSourceSuspended;
+		if (timeoutExtension > 0.0)
+		{
+			currentRead->timeout += timeoutExtension;
+			
+			// Reschedule the timer
+			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
+			dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
+			
+			// Unpause reads, and continue
+			flags &= ~kReadsPaused;
+			[self doReadData];
+		}
+		else
+		{
+			LogVerbose(@"ReadTimeout");
+			
+			[self closeWithError:[self readTimeoutError]];
+		}
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Reading
+#pragma mark Writing
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-- (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag
-{
-	[self readDataWithTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
-}
-
-- (void)readDataWithTimeout:(NSTimeInterval)timeout
-                     buffer:(NSMutableData *)buffer
-               bufferOffset:(NSUInteger)offset
-                        tag:(long)tag
+/**
+ * Returns a write packet configured with the given parameters.
+ * Packets are taken from the socket's packet pool if possible, saving an allocation per write.
+**/
+- (GCDAsyncWritePacket *)writePacketWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
 {
-	[self readDataWithTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
+	pthread_mutex_lock(&packetPoolLock);
+	GCDAsyncWritePacket *packet = [writePacketPool removeFirstObject];
+	if (packet == nil) packetAllocationCount++;
+	pthread_mutex_unlock(&packetPoolLock);
+	
+	if (packet)
+	{
+		[packet reuseWithData:d timeout:t tag:i];
+		return packet;
+	}
+	
+	return [[GCDAsyncWritePacket alloc] initWithData:d timeout:t tag:i];
 }
 
-- (void)readDataWithTimeout:(NSTimeInterval)timeout
-                     buffer:(NSMutableData *)buffer
-               bufferOffset:(NSUInteger)offset
-                  maxLength:(NSUInteger)length
-                        tag:(long)tag
+/**
+ * Returns a finished write packet to the socket's packet pool.
+**/
+- (void)recycleWritePacket:(GCDAsyncWritePacket *)packet
 {
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
+	if ([packet isKindOfClass:[GCDAsyncFileWritePacket class]])
+	{
+		// File packets own a file descriptor (and possibly a mapping), which they release when deallocated.
 		return;
 	}
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:length
-	                                                              timeout:timeout
-	                                                           readLength:0
-	                                                           terminator:nil
-	                                                                  tag:tag];
-	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-		LogTrace();
-		
-        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
-		{
-            [self->readQueue addObject:packet];
-			[self maybeDequeueRead];
-		}
-	}});
+	[packet prepareForReuse];
 	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
+	pthread_mutex_lock(&packetPoolLock);
+	if ([writePacketPool count] < PACKET_POOL_CAPACITY)
+	{
+		[writePacketPool addObject:packet];
+	}
+	pthread_mutex_unlock(&packetPoolLock);
 }
 
-- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag
+/**
+ * The number of packets this socket has allocated, rather than taken from its pools.
+ * Not part of the public API. It's there for the tests, to verify that packets are reused.
+**/
+- (NSUInteger)packetAllocationCount
 {
-	[self readDataToLength:length withTimeout:timeout buffer:nil bufferOffset:0 tag:tag];
+	pthread_mutex_lock(&packetPoolLock);
+	NSUInteger result = packetAllocationCount;
+	pthread_mutex_unlock(&packetPoolLock);
+	
+	return result;
 }
 
-- (void)readDataToLength:(NSUInteger)length
-             withTimeout:(NSTimeInterval)timeout
-                  buffer:(NSMutableData *)buffer
-            bufferOffset:(NSUInteger)offset
-                     tag:(long)tag
+- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	if (length == 0) {
-		LogWarn(@"Cannot read: length == 0");
-		return;
-	}
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
-		return;
-	}
+	if ([data length] == 0) return;
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:0
-	                                                              timeout:timeout
-	                                                           readLength:length
-	                                                           terminator:nil
-	                                                                  tag:tag];
+	if ([self writeDataInline:data timeout:timeout tag:tag completion:nil]) return;
 	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-		LogTrace();
-		
-        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
-		{
-            [self->readQueue addObject:packet];
-			[self maybeDequeueRead];
-		}
-	}});
+	[self addQueuedWriteBytes:[data length] cap:0];
+	
+	GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+	packet->queuedLength = [data length];
+	
+	[self enqueueWrite:packet];
 	
 	// Do not rely on the block being run in order to release the packet,
 	// as the queue might get released without the block completing.
 }
 
-- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
-{
-	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
-}
-
-- (void)readDataToData:(NSData *)data
-           withTimeout:(NSTimeInterval)timeout
-                buffer:(NSMutableData *)buffer
-          bufferOffset:(NSUInteger)offset
-                   tag:(long)tag
+- (void)writeData:(NSData *)data priority:(GCDAsyncSocketWritePriority)priority withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	[self readDataToData:data withTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
+	if ([data length] == 0) return;
+	
+	[self addQueuedWriteBytes:[data length] cap:0];
+	
+	GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+	packet->queuedLength = [data length];
+	packet->priority = priority;
+	
+	[self enqueueWrite:packet];
 }
 
-- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag
+- (BOOL)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag error:(NSError **)errPtr
 {
-	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:length tag:tag];
+	if ([data length] == 0) return YES;
+	
+	if (![self addQueuedWriteBytes:[data length] cap:(NSUInteger)atomic_load(&maxQueuedWriteBytes)])
+	{
+		if (errPtr) *errPtr = [self writeQueueFullError];
+		return NO;
+	}
+	
+	GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+	packet->queuedLength = [data length];
+	
+	[self enqueueWrite:packet];
+	return YES;
 }
 
-- (void)readDataToData:(NSData *)data
-           withTimeout:(NSTimeInterval)timeout
-                buffer:(NSMutableData *)buffer
-          bufferOffset:(NSUInteger)offset
-             maxLength:(NSUInteger)maxLength
-                   tag:(long)tag
+- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketWriteCompletionBlock)completion
 {
-	if ([data length] == 0) {
-		LogWarn(@"Cannot read: [data length] == 0");
-		return;
-	}
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
-		return;
-	}
-	if (maxLength > 0 && maxLength < [data length]) {
-		LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
+	if ([data length] == 0)
+	{
+		if (completion)
+		{
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self invokeCompletionBlock:^{
+					completion(nil);
+				}];
+			}});
+		}
 		return;
 	}
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:maxLength
-	                                                              timeout:timeout
-	                                                           readLength:0
-	                                                           terminator:data
-	                                                                  tag:tag];
+	if ([self writeDataInline:data timeout:timeout tag:0 completion:completion]) return;
 	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-		LogTrace();
-		
-        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
-		{
-            [self->readQueue addObject:packet];
-			[self maybeDequeueRead];
-		}
-	}});
+	[self addQueuedWriteBytes:[data length] cap:0];
 	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
+	GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:0];
+	packet->completion = [completion copy];
+	packet->queuedLength = [data length];
+	
+	[self enqueueWrite:packet];
 }
 
-- (float)progressOfReadReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
+/**
+ * The write fast path.
+ * 
+ * If the caller is on the socketQueue (or synchronousWrites is enabled),
+ * and the socket is idle (nothing queued or about to be queued, nothing in progress, socket known to accept bytes),
+ * the data is written immediately, without allocating a packet or hopping to the socketQueue.
+ * Only the part the kernel didn't accept is queued (as a partially written packet).
+ * 
+ * Returns YES if the write was handled here, NO if it must be queued as usual.
+**/
+- (BOOL)writeDataInline:(NSData *)data
+                timeout:(NSTimeInterval)timeout
+                    tag:(long)tag
+             completion:(GCDAsyncSocketWriteCompletionBlock)completion
 {
-	__block float result = 0.0F;
+	BOOL isOnSocketQueue = (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) != NULL);
+	
+	if (!isOnSocketQueue && !atomic_load(&synchronousWrites)) return NO;
+	
+	__block BOOL handled = NO;
 	
 	dispatch_block_t block = ^{
 		
-        if (!self->currentRead || ![self->currentRead isKindOfClass:[GCDAsyncReadPacket class]])
+		NSUInteger length = [data length];
+		
+		if (!(self->flags & kConnected) || (self->flags & kForbidReadsWrites)) return_from_block;
+		if (!(self->flags & kSocketCanAcceptBytes)) return_from_block;
+		if (self->flags & (kWritesPaused | kQueuedTLS | kStartingWriteTLS | kSocketSecure)) return_from_block;
+		if ((self->currentWrite != nil) || ([self->writeQueue count] > 0)) return_from_block;
+		
+		// Writes (or startTLS) issued earlier, but still on their way to the socketQueue, go first
+		if (atomic_load(&self->pendingWriteEnqueueCount) > 0) return_from_block;
+		if ((self->largeWriteThreshold > 0) && (length >= self->largeWriteThreshold) && !(self->flags & kSendBufferRaised))
 		{
-			// We're not reading anything right now.
+			// Let doWriteData raise the send buffer first
+			return_from_block;
+		}
+		
+		handled = YES;
+		
+		int socketFD = (self->socket4FD != SOCKET_NULL) ? self->socket4FD :
+		               (self->socket6FD != SOCKET_NULL) ? self->socket6FD : self->socketUN;
+		
+		TRACE_SYSCALL_BEGIN();
+		ssize_t result = write(socketFD, [data bytes], (size_t)MIN(length, (NSUInteger)SSIZE_MAX));
+		TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, result, result < 0);
+		
+		NSUInteger bytesWritten = (result > 0) ? (NSUInteger)result : 0;
+		
+		STATISTICS_ADD(writeSyscalls, 1);
+		STATISTICS_ADD(bytesWritten, bytesWritten);
+		
+		LogVerbose(@"inline write: %lu of %lu", (unsigned long)bytesWritten, (unsigned long)length);
+		
+		if (bytesWritten < length)
+		{
+			// The socket is full (or failed, in which case doWriteData will run into the error and report it).
+			// Queue the remainder, so it's written ahead of anything queued after this call.
 			
-			if (tagPtr != NULL)   *tagPtr = 0;
-			if (donePtr != NULL)  *donePtr = 0;
-			if (totalPtr != NULL) *totalPtr = 0;
+			self->flags &= ~kSocketCanAcceptBytes;
 			
-			result = NAN;
+			NSUInteger remaining = length - bytesWritten;
+			[self addQueuedWriteBytes:remaining cap:0];
+			
+			GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+			packet->completion = [completion copy];
+			packet->bytesDone = bytesWritten;
+			packet->queuedLength = remaining;
+			
+			[self addToWriteQueue:packet];
+			
+			dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self maybeDequeueWrite];
+			}});
+			
+			return_from_block;
+		}
+		
+		if (self->statistics) [self recordCompletionOfPacketQueuedAt:GCDAsyncSocketMonotonicTime() isRead:NO];
+		
+		if (completion)
+		{
+			[self invokeCompletionBlock:^{
+				
+				completion(nil);
+			}];
 		}
 		else
 		{
-			// It's only possible to know the progress of our read if we're reading to a certain length.
-			// If we're reading to data, we of course have no idea when the data will arrive.
-			// If we're reading to timeout, then we have no idea when the next chunk of data will arrive.
-			
-            NSUInteger done = self->currentRead->bytesDone;
-            NSUInteger total = self->currentRead->readLength;
+			__strong id<GCDAsyncSocketDelegate> theDelegate = self->delegate;
 			
-            if (tagPtr != NULL)   *tagPtr = self->currentRead->tag;
-			if (donePtr != NULL)  *donePtr = done;
-			if (totalPtr != NULL) *totalPtr = total;
-			
-			if (total > 0)
-				result = (float)done / (float)total;
-			else
-				result = 1.0F;
+			if (self->delegateQueue && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidWriteData))
+			{
+				GCDAsyncSocketDidWriteDataIMP didWriteData = self->delegateDidWriteData;
+				
+				[self invokeDataDelegateBlock:^{
+					
+					didWriteData(theDelegate, @selector(socket:didWriteDataWithTag:), self, tag);
+				}];
+			}
 		}
 	};
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (isOnSocketQueue)
 		block();
 	else
 		dispatch_sync(socketQueue, block);
 	
-	return result;
+	return handled;
 }
 
 /**
- * This method starts a new read, if needed.
- * 
- * It is called when:
- * - a user requests a read
- * - after a read request has finished (to handle the next request)
- * - immediately after the socket opens to handle any pending requests
+ * Queues one write packet per region of the given data, so the regions are written without being flattened.
+ * The packets are handed to the kernel together by the writev() call in doWriteData.
  * 
- * This method also handles auto-disconnect post read/write completion.
+ * All but the last packet are marked continuedByNext:
+ * they're never reported individually, and nothing may be queued between them.
 **/
-- (void)maybeDequeueRead
+- (void)writeDispatchData:(dispatch_data_t)data
+                  timeout:(NSTimeInterval)timeout
+                      tag:(long)tag
+               completion:(GCDAsyncSocketWriteCompletionBlock)completion
 {
-	LogTrace();
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSMutableArray *packets = [NSMutableArray array];
 	
-	// If we're not currently processing a read AND we have an available read stream
-	if ((currentRead == nil) && (flags & kConnected))
-	{
-		if ([readQueue count] > 0)
+	dispatch_data_apply(data, ^bool(dispatch_data_t region, size_t offset, const void *bytes, size_t size) {
+		
+		if (size > 0)
 		{
-			// Dequeue the next object in the write queue
-			currentRead = [readQueue objectAtIndex:0];
-			[readQueue removeObjectAtIndex:0];
+			NSData *regionData = [[GCDAsyncDispatchDataRegion alloc] initWithRegion:region bytes:bytes length:size];
 			
+			GCDAsyncWritePacket *packet = [self writePacketWithData:regionData timeout:timeout tag:tag];
+			packet->queuedLength = size;
+			packet->continuedByNext = YES;
 			
-			if ([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]])
-			{
-				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
-				
-				// Attempt to start TLS
-				flags |= kStartingReadTLS;
-				
-				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
-				[self maybeStartTLS];
-			}
-			else
-			{
-				LogVerbose(@"Dequeued GCDAsyncReadPacket");
-				
-				// Setup read timer (if needed)
-				[self setupReadTimerWithTimeout:currentRead->timeout];
-				
-				// Immediately read, if possible
-				[self doReadData];
-			}
+			[packets addObject:packet];
 		}
-		else if (flags & kDisconnectAfterReads)
+		return true;
+	});
+	
+	GCDAsyncWritePacket *lastPacket = [packets lastObject];
+	lastPacket->continuedByNext = NO;
+	lastPacket->completion = [completion copy];
+	
+	[self addQueuedWriteBytes:dispatch_data_get_size(data) cap:0];
+	
+	BOOL isOnSocketQueue = (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) != NULL);
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if (!isOnSocketQueue) atomic_fetch_sub(&self->pendingWriteEnqueueCount, 1);
+		
+		if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
 		{
-			if (flags & kDisconnectAfterWrites)
-			{
-				if (([writeQueue count] == 0) && (currentWrite == nil))
-				{
-					[self closeWithError:nil];
-				}
-			}
-			else
+			for (GCDAsyncWritePacket *packet in packets)
 			{
-				[self closeWithError:nil];
+				[self addToWriteQueue:packet];
 			}
+			
+			dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self maybeDequeueWrite];
+			}});
 		}
-		else if (flags & kSocketSecure)
+		else
 		{
-			[self flushSSLBuffers];
-			
-			// Edge case:
-			// 
-			// We just drained all data from the ssl buffers,
-			// and all known data from the socket (socketFDBytesAvailable).
-			// 
-			// If we didn't get any data from this process,
-			// then we may have reached the end of the TCP stream.
-			// 
-			// Be sure callbacks are enabled so we're notified about a disconnection.
-			
-			if ([preBuffer availableBytes] == 0)
-			{
-				if ([self usingCFStreamForTLS]) {
-					// Callbacks never disabled
-				}
-				else {
-					[self resumeReadSource];
-				}
-			}
+			[self removeQueuedWriteBytes:dispatch_data_get_size(data)];
+			[self failDroppedPacket:lastPacket];
 		}
+	}};
+	
+	if (isOnSocketQueue)
+	{
+		block();
+	}
+	else
+	{
+		atomic_fetch_add(&pendingWriteEnqueueCount, 1);
+		dispatch_async(socketQueue, block);
 	}
 }
 
-- (void)flushSSLBuffers
+- (void)writeDispatchData:(dispatch_data_t)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	LogTrace();
-	
-	NSAssert((flags & kSocketSecure), @"Cannot flush ssl buffers on non-secure socket");
-	
-	if ([preBuffer availableBytes] > 0)
-	{
-		// Only flush the ssl buffers if the prebuffer is empty.
-		// This is to avoid growing the prebuffer inifinitely large.
-		
-		return;
-	}
+	if ((data == NULL) || (dispatch_data_get_size(data) == 0)) return;
 	
-	#if TARGET_OS_IPHONE
-	
-	if ([self usingCFStreamForTLS])
+	[self writeDispatchData:data timeout:timeout tag:tag completion:nil];
+}
+
+- (void)writeDispatchData:(dispatch_data_t)data withTimeout:(NSTimeInterval)timeout completion:(GCDAsyncSocketWriteCompletionBlock)completion
+{
+	if ((data == NULL) || (dispatch_data_get_size(data) == 0))
 	{
-		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
+		if (completion)
 		{
-			LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
-			
-			CFIndex defaultBytesToRead = (1024 * 4);
-			
-			[preBuffer ensureCapacityForWrite:defaultBytesToRead];
-			
-			uint8_t *buffer = [preBuffer writeBuffer];
-			
-			CFIndex result = CFReadStreamRead(readStream, buffer, defaultBytesToRead);
-			LogVerbose(@"%@ - CFReadStreamRead(): result = %i", THIS_METHOD, (int)result);
-			
-			if (result > 0)
-			{
-				[preBuffer didWrite:result];
-			}
-			
-			flags &= ~kSecureSocketHasBytesAvailable;
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self invokeCompletionBlock:^{
+					completion(nil);
+				}];
+			}});
 		}
-		
 		return;
 	}
 	
-	#endif
-	
-	__block NSUInteger estimatedBytesAvailable = 0;
-	
-	dispatch_block_t updateEstimatedBytesAvailable = ^{
-		
-		// Figure out if there is any data available to be read
-		// 
-		// socketFDBytesAvailable        <- Number of encrypted bytes we haven't read from the bsd socket
-		// [sslPreBuffer availableBytes] <- Number of encrypted bytes we've buffered from bsd socket
-		// sslInternalBufSize            <- Number of decrypted bytes SecureTransport has buffered
-		// 
-		// We call the variable "estimated" because we don't know how many decrypted bytes we'll get
-		// from the encrypted bytes in the sslPreBuffer.
-		// However, we do know this is an upper bound on the estimation.
-		
-        estimatedBytesAvailable = self->socketFDBytesAvailable + [self->sslPreBuffer availableBytes];
-		
-		size_t sslInternalBufSize = 0;
-        SSLGetBufferedReadSize(self->sslContext, &sslInternalBufSize);
-		
-		estimatedBytesAvailable += sslInternalBufSize;
-	};
-	
-	updateEstimatedBytesAvailable();
-	
-	if (estimatedBytesAvailable > 0)
-	{
-		LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
-		
-		BOOL done = NO;
-		do
-		{
-			LogVerbose(@"%@ - estimatedBytesAvailable = %lu", THIS_METHOD, (unsigned long)estimatedBytesAvailable);
-			
-			// Make sure there's enough room in the prebuffer
-			
-			[preBuffer ensureCapacityForWrite:estimatedBytesAvailable];
-			
-			// Read data into prebuffer
-			
-			uint8_t *buffer = [preBuffer writeBuffer];
-			size_t bytesRead = 0;
-			
-			OSStatus result = SSLRead(sslContext, buffer, (size_t)estimatedBytesAvailable, &bytesRead);
-			LogVerbose(@"%@ - read from secure socket = %u", THIS_METHOD, (unsigned)bytesRead);
-			
-			if (bytesRead > 0)
-			{
-				[preBuffer didWrite:bytesRead];
-			}
-			
-			LogVerbose(@"%@ - prebuffer.length = %zu", THIS_METHOD, [preBuffer availableBytes]);
-			
-			if (result != noErr)
-			{
-				done = YES;
-			}
-			else
-			{
-				updateEstimatedBytesAvailable();
-			}
-			
-		} while (!done && estimatedBytesAvailable > 0);
-	}
+	[self writeDispatchData:data timeout:timeout tag:0 completion:completion];
 }
 
-- (void)doReadData
+/**
+ * Queues a file packet for the given range of the file.
+ * Errors (an unusable file or range) are stored in the packet, and reported when it's dequeued.
+**/
+- (void)writeFileDescriptor:(int)fd
+              closeWhenDone:(BOOL)closeWhenDone
+                      range:(NSRange)range
+                    timeout:(NSTimeInterval)timeout
+                        tag:(long)tag
+                  openError:(NSError *)openError
 {
-	LogTrace();
-	
-	// This method is called on the socketQueue.
-	// It might be called directly, or via the readSource when data is available to be read.
+	NSError *error = openError;
+	off_t offset = 0;
+	off_t length = 0;
 	
-	if ((currentRead == nil) || (flags & kReadsPaused))
+	if (error == nil)
 	{
-		LogVerbose(@"No currentRead or kReadsPaused");
+		struct stat st;
 		
-		// Unable to read at this time
-		
-		if (flags & kSocketSecure)
+		if (fstat(fd, &st) < 0)
 		{
-			// Here's the situation:
-			// 
-			// We have an established secure connection.
-			// There may not be a currentRead, but there might be encrypted data sitting around for us.
-			// When the user does get around to issuing a read, that encrypted data will need to be decrypted.
-			// 
-			// So why make the user wait?
-			// We might as well get a head start on decrypting some data now.
-			// 
-			// The other reason we do this has to do with detecting a socket disconnection.
-			// The SSL/TLS protocol has it's own disconnection handshake.
-			// So when a secure socket is closed, a "goodbye" packet comes across the wire.
-			// We want to make sure we read the "goodbye" packet so we can properly detect the TCP disconnection.
-			
-			[self flushSSLBuffers];
+			error = [self errorWithErrno:errno reason:@"Error in fstat() function"];
 		}
-		
-		if ([self usingCFStreamForTLS])
+		else if (range.location > (NSUInteger)st.st_size)
 		{
-			// CFReadStream only fires once when there is available data.
-			// It won't fire again until we've invoked CFReadStreamRead.
+			error = [self errorWithErrno:EINVAL reason:@"Write range starts beyond the end of the file"];
 		}
 		else
 		{
-			// If the readSource is firing, we need to pause it
-			// or else it will continue to fire over and over again.
-			// 
-			// If the readSource is not firing,
-			// we want it to continue monitoring the socket.
-			
-			if (socketFDBytesAvailable > 0)
-			{
-				[self suspendReadSource];
-			}
+			offset = (off_t)range.location;
+			length = (off_t)MIN(range.length, (NSUInteger)(st.st_size - offset));
 		}
+	}
+	
+	if (error == nil && length == 0)
+	{
+		if (closeWhenDone) close(fd);
 		return;
 	}
 	
-	BOOL hasBytesAvailable = NO;
-	unsigned long estimatedBytesAvailable = 0;
+	GCDAsyncFileWritePacket *packet = [[GCDAsyncFileWritePacket alloc] initWithFileDescriptor:fd
+	                                                                            closeWhenDone:closeWhenDone
+	                                                                                   offset:offset
+	                                                                                   length:length
+	                                                                                  timeout:timeout
+	                                                                                      tag:tag];
+	packet->fileError = error;
 	
-	if ([self usingCFStreamForTLS])
+	[self enqueueWrite:packet];
+}
+
+- (void)writeFileAtPath:(NSString *)path range:(NSRange)range withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	NSError *error = nil;
+	
+	int fd = open([path fileSystemRepresentation], O_RDONLY);
+	if (fd < 0)
 	{
-		#if TARGET_OS_IPHONE
-		
-		// Requested CFStream, rather than SecureTransport, for TLS (via GCDAsyncSocketUseCFStreamForTLS)
-		
-		estimatedBytesAvailable = 0;
-		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
-			hasBytesAvailable = YES;
-		else
-			hasBytesAvailable = NO;
-		
-		#endif
+		error = [self errorWithErrno:errno reason:@"Error in open() function"];
 	}
 	else
 	{
-		estimatedBytesAvailable = socketFDBytesAvailable;
-		
-		if (flags & kSocketSecure)
+		int result = fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (result == -1)
 		{
-			// There are 2 buffers to be aware of here.
-			// 
-			// We are using SecureTransport, a TLS/SSL security layer which sits atop TCP.
-			// We issue a read to the SecureTranport API, which in turn issues a read to our SSLReadFunction.
-			// Our SSLReadFunction then reads from the BSD socket and returns the encrypted data to SecureTransport.
-			// SecureTransport then decrypts the data, and finally returns the decrypted data back to us.
-			// 
-			// The first buffer is one we create.
-			// SecureTransport often requests small amounts of data.
-			// This has to do with the encypted packets that are coming across the TCP stream.
-			// But it's non-optimal to do a bunch of small reads from the BSD socket.
-			// So our SSLReadFunction reads all available data from the socket (optimizing the sys call)
-			// and may store excess in the sslPreBuffer.
-			
-			estimatedBytesAvailable += [sslPreBuffer availableBytes];
-			
-			// The second buffer is within SecureTransport.
-			// As mentioned earlier, there are encrypted packets coming across the TCP stream.
-			// SecureTransport needs the entire packet to decrypt it.
-			// But if the entire packet produces X bytes of decrypted data,
-			// and we only asked SecureTransport for X/2 bytes of data,
-			// it must store the extra X/2 bytes of decrypted data for the next read.
-			// 
-			// The SSLGetBufferedReadSize function will tell us the size of this internal buffer.
-			// From the documentation:
-			// 
-			// "This function does not block or cause any low-level read operations to occur."
-			
-			size_t sslInternalBufSize = 0;
-			SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
-			
-			estimatedBytesAvailable += sslInternalBufSize;
+			LogWarn(@"Error enabling close-on-exec for file (%d)", fd);
 		}
-		
-		hasBytesAvailable = (estimatedBytesAvailable > 0);
 	}
 	
-	if ((hasBytesAvailable == NO) && ([preBuffer availableBytes] == 0))
-	{
-		LogVerbose(@"No data available to read...");
-		
-		// No data available to read.
-		
-		if (![self usingCFStreamForTLS])
-		{
-			// Need to wait for readSource to fire and notify us of
-			// available data in the socket's internal read buffer.
-			
-			[self resumeReadSource];
-		}
-		return;
-	}
+	[self writeFileDescriptor:fd closeWhenDone:YES range:range timeout:timeout tag:tag openError:error];
+}
+
+- (void)writeFileDescriptor:(int)fd range:(NSRange)range withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	[self writeFileDescriptor:fd closeWhenDone:NO range:range timeout:timeout tag:tag openError:nil];
+}
+
+- (float)progressOfWriteReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
+{
+	__block float result = 0.0F;
 	
-	if (flags & kStartingReadTLS)
-	{
-		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
-		
-		// The readQueue is waiting for SSL/TLS handshake to complete.
+	dispatch_block_t block = ^{
 		
-		if (flags & kStartingWriteTLS)
+        if (!self->currentWrite || ![self->currentWrite isKindOfClass:[GCDAsyncWritePacket class]])
 		{
-			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
-			{
-				// We are in the process of a SSL Handshake.
-				// We were waiting for incoming data which has just arrived.
-				
-				[self ssl_continueSSLHandshake];
-			}
+			// We're not writing anything right now.
+			
+			if (tagPtr != NULL)   *tagPtr = 0;
+			if (donePtr != NULL)  *donePtr = 0;
+			if (totalPtr != NULL) *totalPtr = 0;
+			
+			result = NAN;
 		}
 		else
 		{
-			// We are still waiting for the writeQueue to drain and start the SSL/TLS process.
-			// We now know data is available to read.
+            NSUInteger done = self->currentWrite->bytesDone;
+            NSUInteger total = [self->currentWrite->buffer length];
 			
-			if (![self usingCFStreamForTLS])
+			if ([self->currentWrite isKindOfClass:[GCDAsyncFileWritePacket class]])
 			{
-				// Suspend the read source or else it will continue to fire nonstop.
+				GCDAsyncFileWritePacket *fileWrite = (GCDAsyncFileWritePacket *)self->currentWrite;
 				
-				[self suspendReadSource];
+				done = (NSUInteger)[fileWrite fileBytesDone];
+				total = (NSUInteger)fileWrite->fileLength;
 			}
+			
+            if (tagPtr != NULL)   *tagPtr = self->currentWrite->tag;
+			if (donePtr != NULL)  *donePtr = done;
+			if (totalPtr != NULL) *totalPtr = total;
+			
+			result = (float)done / (float)total;
 		}
-		
-		return;
-	}
-	
-	BOOL done        = NO;  // Completed read operation
-	NSError *error   = nil; // Error occurred
-	
-	NSUInteger totalBytesReadForCurrentRead = 0;
+	};
 	
-	// 
-	// STEP 1 - READ FROM PREBUFFER
-	// 
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
 	
-	if ([preBuffer availableBytes] > 0)
+	return result;
+}
+
+/**
+ * Adds the given packet to the write queue.
+ * See enqueueRead: for a discussion of synchronous delegate callouts.
+**/
+- (void)enqueueWrite:(GCDAsyncWritePacket *)packet
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) && (delegateCalloutDepth > 0))
 	{
-		// There are 3 types of read packets:
-		// 
-		// 1) Read all available data.
-		// 2) Read a specific length of data.
-		// 3) Read up to a particular terminator.
-		
-		NSUInteger bytesToCopy;
+		LogTrace();
 		
-		if (currentRead->term != nil)
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
 		{
-			// Read type #3 - read up to a terminator
+			[self addToWriteQueue:packet];
 			
-			bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				[self maybeDequeueWrite];
+			}});
 		}
 		else
 		{
-			// Read type #1 or #2
-			
-			bytesToCopy = [currentRead readLengthForNonTermWithHint:[preBuffer availableBytes]];
+			[self removeQueuedWriteBytes:packet->queuedLength];
+			[self failDroppedPacket:packet];
 		}
+		return;
+	}
+	
+	atomic_fetch_add(&pendingWriteEnqueueCount, 1);
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		// Make sure we have enough room in the buffer for our read.
-		
-		[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
-		
-		// Copy bytes from prebuffer into packet buffer
-		
-		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset +
-		                                                                  currentRead->bytesDone;
-		
-		memcpy(buffer, [preBuffer readBuffer], bytesToCopy);
-		
-		// Remove the copied bytes from the preBuffer
-		[preBuffer didRead:bytesToCopy];
-		
-		LogVerbose(@"copied(%lu) preBufferLength(%zu)", (unsigned long)bytesToCopy, [preBuffer availableBytes]);
-		
-		// Update totals
-		
-		currentRead->bytesDone += bytesToCopy;
-		totalBytesReadForCurrentRead += bytesToCopy;
+		LogTrace();
 		
-		// Check to see if the read operation is done
+		atomic_fetch_sub(&self->pendingWriteEnqueueCount, 1);
 		
-		if (currentRead->readLength > 0)
-		{
-			// Read type #2 - read a specific length of data
-			
-			done = (currentRead->bytesDone == currentRead->readLength);
-		}
-		else if (currentRead->term != nil)
+        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
 		{
-			// Read type #3 - read up to a terminator
-			
-			// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method
-			
-			if (!done && currentRead->maxLength > 0)
-			{
-				// We're not done and there's a set maxLength.
-				// Have we reached that maxLength yet?
-				
-				if (currentRead->bytesDone >= currentRead->maxLength)
-				{
-					error = [self readMaxedOutError];
-				}
-			}
+            [self addToWriteQueue:packet];
+			[self maybeDequeueWrite];
 		}
 		else
 		{
-			// Read type #1 - read all available data
-			// 
-			// We're done as soon as
-			// - we've read all available data (in prebuffer and socket)
-			// - we've read the maxLength of read packet.
-			
-			done = ((currentRead->maxLength > 0) && (currentRead->bytesDone == currentRead->maxLength));
+			[self removeQueuedWriteBytes:packet->queuedLength];
+			[self failDroppedPacket:packet];
 		}
+	}});
+}
+
+/**
+ * Adds the packet to the writeQueue, ahead of any queued packets of lower priority.
+ * 
+ * The queue is thus ordered by priority (and FIFO within each priority),
+ * so the next packet dequeued is always the head of the highest priority lane that has packets.
+ * The packet in progress (currentWrite) is never interrupted.
+ * 
+ * A packet won't be moved ahead of a special packet (i.e. startTLS), nor ahead of a partially written packet,
+ * nor ahead of a packet that has already been overtaken WRITE_PRIORITY_MAX_BYPASS times,
+ * which keeps the lower priority lanes moving.
+ * Nor is it ever placed between the regions of a dispatch_data write.
+**/
+- (void)addToWriteQueue:(GCDAsyncWritePacket *)packet
+{
+	NSUInteger count = [writeQueue count];
+	NSUInteger index = count;
+	
+	while (index > 0)
+	{
+		id queuedPacket = [writeQueue objectAtIndex:(index - 1)];
 		
+		if (![queuedPacket isKindOfClass:[GCDAsyncWritePacket class]]) break;
+		
+		GCDAsyncWritePacket *queuedWrite = (GCDAsyncWritePacket *)queuedPacket;
+		
+		if ((queuedWrite->priority <= packet->priority) || (queuedWrite->bypassCount >= WRITE_PRIORITY_MAX_BYPASS)) break;
+		
+		// A packet that has been partially written (gathered into a writev() call) must be finished first
+		if (queuedWrite->bytesDone > 0) break;
+		
+		index--;
 	}
 	
-	// 
-	// STEP 2 - READ FROM SOCKET
-	// 
-	
-	BOOL socketEOF = (flags & kSocketHasReadEOF) ? YES : NO;  // Nothing more to read via socket (end of file)
-	BOOL waiting   = !done && !error && !socketEOF && !hasBytesAvailable; // Ran out of data, waiting for more
-	
-	if (!done && !error && !socketEOF && hasBytesAvailable)
+	while (index < count)
 	{
-		NSAssert(([preBuffer availableBytes] == 0), @"Invalid logic");
+		GCDAsyncWritePacket *previousWrite = nil;
 		
-		BOOL readIntoPreBuffer = NO;
-		uint8_t *buffer = NULL;
-		size_t bytesRead = 0;
+		if (index > 0)
+			previousWrite = [writeQueue objectAtIndex:(index - 1)];
+		else if ([currentWrite isKindOfClass:[GCDAsyncWritePacket class]])
+			previousWrite = currentWrite;
 		
-		if (flags & kSocketSecure)
+		if (![previousWrite isKindOfClass:[GCDAsyncWritePacket class]] || !previousWrite->continuedByNext) break;
+		
+		index++;
+	}
+	
+	for (NSUInteger i = index; i < count; i++)
+	{
+		GCDAsyncWritePacket *overtakenWrite = [writeQueue objectAtIndex:i];
+		overtakenWrite->bypassCount++;
+	}
+	
+	if (statistics) packet->enqueueTime = GCDAsyncSocketMonotonicTime();
+	
+	if (index == count)
+		[writeQueue addObject:packet];
+	else
+		[writeQueue insertObject:packet atIndex:index];
+	
+	[self updateQueueDepthStatistics];
+	
+	TRACE_EVENT(GCDAsyncSocketTraceWriteEnqueue, packet->tag);
+}
+
+/**
+ * Conditionally starts a new write.
+ * 
+ * It is called when:
+ * - a user requests a write
+ * - after a write request has finished (to handle the next request)
+ * - immediately after the socket opens to handle any pending requests
+ * 
+ * This method also handles auto-disconnect post read/write completion.
+**/
+- (void)maybeDequeueWrite
+{
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	// If we're not currently processing a write AND we have an available write stream
+	if ((currentWrite == nil) && (flags & kConnected))
+	{
+		if ([writeQueue count] > 0)
 		{
-			if ([self usingCFStreamForTLS])
+			// Dequeue the next object in the write queue
+			currentWrite = [writeQueue removeFirstObject];
+			[self updateQueueDepthStatistics];
+			
+			TRACE_EVENT(GCDAsyncSocketTraceWriteDequeue,
+			            [currentWrite isKindOfClass:[GCDAsyncWritePacket class]] ? currentWrite->tag : -1);
+			
+			
+			if ([currentWrite isKindOfClass:[GCDAsyncSpecialPacket class]])
 			{
-				#if TARGET_OS_IPHONE
-				
-				// Using CFStream, rather than SecureTransport, for TLS
-				
-				NSUInteger defaultReadLength = (1024 * 32);
-				
-				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
-				                                                   shouldPreBuffer:&readIntoPreBuffer];
-				
-				// Make sure we have enough room in the buffer for our read.
-				//
-				// We are either reading directly into the currentRead->buffer,
-				// or we're reading into the temporary preBuffer.
-				
-				if (readIntoPreBuffer)
-				{
-					[preBuffer ensureCapacityForWrite:bytesToRead];
-					
-					buffer = [preBuffer writeBuffer];
-				}
-				else
-				{
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
-					
-					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-					       + currentRead->startOffset
-					       + currentRead->bytesDone;
-				}
-				
-				// Read data into buffer
-				
-				CFIndex result = CFReadStreamRead(readStream, buffer, (CFIndex)bytesToRead);
-				LogVerbose(@"CFReadStreamRead(): result = %i", (int)result);
-				
-				if (result < 0)
-				{
-					error = (__bridge_transfer NSError *)CFReadStreamCopyError(readStream);
-				}
-				else if (result == 0)
-				{
-					socketEOF = YES;
-				}
-				else
-				{
-					waiting = YES;
-					bytesRead = (size_t)result;
-				}
+				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
 				
-				// We only know how many decrypted bytes were read.
-				// The actual number of bytes read was likely more due to the overhead of the encryption.
-				// So we reset our flag, and rely on the next callback to alert us of more data.
-				flags &= ~kSecureSocketHasBytesAvailable;
+				// Attempt to start TLS
+				flags |= kStartingWriteTLS;
 				
-				#endif
+				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
+				[self maybeStartTLS];
 			}
 			else
 			{
-				// Using SecureTransport for TLS
-				//
-				// We know:
-				// - how many bytes are available on the socket
-				// - how many encrypted bytes are sitting in the sslPreBuffer
-				// - how many decypted bytes are sitting in the sslContext
-				//
-				// But we do NOT know:
-				// - how many encypted bytes are sitting in the sslContext
-				//
-				// So we play the regular game of using an upper bound instead.
-				
-				NSUInteger defaultReadLength = (1024 * 32);
-				
-				if (defaultReadLength < estimatedBytesAvailable) {
-					defaultReadLength = estimatedBytesAvailable + (1024 * 16);
-				}
-				
-				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
-				                                                   shouldPreBuffer:&readIntoPreBuffer];
-				
-				if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t
-					bytesToRead = SIZE_MAX;
-				}
-				
-				// Make sure we have enough room in the buffer for our read.
-				//
-				// We are either reading directly into the currentRead->buffer,
-				// or we're reading into the temporary preBuffer.
-				
-				if (readIntoPreBuffer)
-				{
-					[preBuffer ensureCapacityForWrite:bytesToRead];
-					
-					buffer = [preBuffer writeBuffer];
-				}
-				else
-				{
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
-					
-					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-					       + currentRead->startOffset
-					       + currentRead->bytesDone;
-				}
-				
-				// The documentation from Apple states:
-				// 
-				//     "a read operation might return errSSLWouldBlock,
-				//      indicating that less data than requested was actually transferred"
-				// 
-				// However, starting around 10.7, the function will sometimes return noErr,
-				// even if it didn't read as much data as requested. So we need to watch out for that.
-				
-				OSStatus result;
-				do
-				{
-					void *loop_buffer = buffer + bytesRead;
-					size_t loop_bytesToRead = (size_t)bytesToRead - bytesRead;
-					size_t loop_bytesRead = 0;
-					
-					result = SSLRead(sslContext, loop_buffer, loop_bytesToRead, &loop_bytesRead);
-					LogVerbose(@"read from secure socket = %u", (unsigned)loop_bytesRead);
-					
-					bytesRead += loop_bytesRead;
-					
-				} while ((result == noErr) && (bytesRead < bytesToRead));
+				LogVerbose(@"Dequeued GCDAsyncWritePacket");
 				
+				// Setup write timer (if needed)
+				[self setupWriteTimerWithTimeout:currentWrite->timeout];
 				
-				if (result != noErr)
+				// Immediately write, if possible
+				[self doWriteData];
+			}
+		}
+		else if (flags & kDisconnectAfterWrites)
+		{
+			if (flags & kDisconnectAfterReads)
+			{
+				if (([readQueue count] == 0) && (currentRead == nil))
 				{
-					if (result == errSSLWouldBlock)
-						waiting = YES;
-					else
-					{
-						if (result == errSSLClosedGraceful || result == errSSLClosedAbort)
-						{
-							// We've reached the end of the stream.
-							// Handle this the same way we would an EOF from the socket.
-							socketEOF = YES;
-							sslErrCode = result;
-						}
-						else
-						{
-							error = [self sslError:result];
-						}
-					}
-					// It's possible that bytesRead > 0, even if the result was errSSLWouldBlock.
-					// This happens when the SSLRead function is able to read some data,
-					// but not the entire amount we requested.
-					
-					if (bytesRead <= 0)
-					{
-						bytesRead = 0;
-					}
+					[self closeWithError:nil];
 				}
-				
-				// Do not modify socketFDBytesAvailable.
-				// It will be updated via the SSLReadFunction().
+			}
+			else
+			{
+				[self closeWithError:nil];
 			}
 		}
-		else
+	}
+}
+
+- (void)doWriteData
+{
+	LogTrace();
+	
+	// This method is called by the writeSource via the socketQueue
+	
+	if ((currentWrite == nil) || (flags & kWritesPaused))
+	{
+		LogVerbose(@"No currentWrite or kWritesPaused");
+		
+		// Unable to write at this time
+		
+		if ([self usingCFStreamForTLS])
 		{
-			// Normal socket operation
-			
-			NSUInteger bytesToRead;
-			
-			// There are 3 types of read packets:
-			//
-			// 1) Read all available data.
-			// 2) Read a specific length of data.
-			// 3) Read up to a particular terminator.
+			// CFWriteStream only fires once when there is available data.
+			// It won't fire again until we've invoked CFWriteStreamWrite.
+		}
+		else
+		{
+			// If the writeSource is firing, we need to pause it
+			// or else it will continue to fire over and over again.
 			
-			if (currentRead->term != nil)
+			if (flags & kSocketCanAcceptBytes)
 			{
-				// Read type #3 - read up to a terminator
-				
-				bytesToRead = [currentRead readLengthForTermWithHint:estimatedBytesAvailable
-				                                     shouldPreBuffer:&readIntoPreBuffer];
+				[self suspendWriteSource];
 			}
-			else
+		}
+		return;
+	}
+	
+	if (!(flags & kSocketCanAcceptBytes))
+	{
+		LogVerbose(@"No space available to write...");
+		
+		// No space available to write.
+		
+		if (![self usingCFStreamForTLS])
+		{
+			// Need to wait for writeSource to fire and notify us of
+			// available space in the socket's internal write buffer.
+			
+			[self resumeWriteSource];
+		}
+		return;
+	}
+	
+	if (flags & kStartingWriteTLS)
+	{
+		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
+		
+		// The writeQueue is waiting for SSL/TLS handshake to complete.
+		
+		if (flags & kStartingReadTLS)
+		{
+			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
 			{
-				// Read type #1 or #2
-				
-				bytesToRead = [currentRead readLengthForNonTermWithHint:estimatedBytesAvailable];
-			}
+				// We are in the process of a SSL Handshake.
+				// We were waiting for available space in the socket's internal OS buffer to continue writing.
 			
-			if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t (read param 3)
-				bytesToRead = SIZE_MAX;
+				[self ssl_continueSSLHandshake];
 			}
+		}
+		else
+		{
+			// We are still waiting for the readQueue to drain and start the SSL/TLS process.
+			// We now know we can write to the socket.
 			
-			// Make sure we have enough room in the buffer for our read.
-			//
-			// We are either reading directly into the currentRead->buffer,
-			// or we're reading into the temporary preBuffer.
-			
-			if (readIntoPreBuffer)
-			{
-				[preBuffer ensureCapacityForWrite:bytesToRead];
-				
-				buffer = [preBuffer writeBuffer];
-			}
-			else
+			if (![self usingCFStreamForTLS])
 			{
-				[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+				// Suspend the write source or else it will continue to fire nonstop.
 				
-				buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-				       + currentRead->startOffset
-				       + currentRead->bytesDone;
+				[self suspendWriteSource];
 			}
+		}
+		
+		return;
+	}
+	
+	// Note: This method is not called if currentWrite is a GCDAsyncSpecialPacket (startTLS packet)
+	
+	BOOL waiting = NO;
+	NSError *error = nil;
+	size_t bytesWritten = 0;
+	size_t queuedBytesWritten = 0;
+	
+	GCDAsyncFileWritePacket *fileWrite = nil;
+	
+	if ([currentWrite isKindOfClass:[GCDAsyncFileWritePacket class]])
+	{
+		// File writes either go through sendfile() below,
+		// or have the next window of the file mapped into their buffer, and are written like any other packet.
+		
+		fileWrite = (GCDAsyncFileWritePacket *)currentWrite;
+		
+		if (flags & kSocketSecure)
+		{
+			// The bytes must pass through the TLS layer
+			fileWrite->usesSendfile = NO;
+		}
+		
+		if (![fileWrite prepareWindow:&error])
+		{
+			[self closeWithError:error];
+			return;
+		}
+	}
+	
+	if (flags & kSocketSecure)
+	{
+		if ([self usingCFStreamForTLS])
+		{
+			#if TARGET_OS_IPHONE
 			
-			// Read data into buffer
+			// 
+			// Writing data using CFStream (over internal TLS)
+			// 
 			
-			int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+			const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
 			
-			ssize_t result = read(socketFD, buffer, (size_t)bytesToRead);
-			LogVerbose(@"read from socket = %i", (int)result);
+			NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
 			
-			if (result < 0)
+			if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
 			{
-				if (errno == EWOULDBLOCK)
-					waiting = YES;
-				else
-					error = [self errorWithErrno:errno reason:@"Error in read() function"];
-				
-				socketFDBytesAvailable = 0;
+				bytesToWrite = SIZE_MAX;
 			}
-			else if (result == 0)
+		
+			TRACE_SYSCALL_BEGIN();
+			CFIndex result = CFWriteStreamWrite(writeStream, buffer, (CFIndex)bytesToWrite);
+			TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, result, NO);
+			LogVerbose(@"CFWriteStreamWrite(%lu) = %li", (unsigned long)bytesToWrite, result);
+			
+			STATISTICS_ADD(writeSyscalls, 1);
+			if (result > 0) STATISTICS_ADD(bytesWritten, result);
+		
+			if (result < 0)
 			{
-				socketEOF = YES;
-				socketFDBytesAvailable = 0;
+				error = (__bridge_transfer NSError *)CFWriteStreamCopyError(writeStream);
 			}
 			else
 			{
-				bytesRead = result;
-				
-				if (bytesRead < bytesToRead)
-				{
-					// The read returned less data than requested.
-					// This means socketFDBytesAvailable was a bit off due to timing,
-					// because we read from the socket right when the readSource event was firing.
-					socketFDBytesAvailable = 0;
-				}
-				else
-				{
-					if (socketFDBytesAvailable <= bytesRead)
-						socketFDBytesAvailable = 0;
-					else
-						socketFDBytesAvailable -= bytesRead;
-				}
+				bytesWritten = (size_t)result;
 				
-				if (socketFDBytesAvailable == 0)
-				{
-					waiting = YES;
-				}
+				// We always set waiting to true in this scenario.
+				// CFStream may have altered our underlying socket to non-blocking.
+				// Thus if we attempt to write without a callback, we may end up blocking our queue.
+				waiting = YES;
 			}
+			
+			#endif
 		}
-		
-		if (bytesRead > 0)
+		else
 		{
-			// Check to see if the read operation is done
-			
-			if (currentRead->readLength > 0)
-			{
-				// Read type #2 - read a specific length of data
-				// 
-				// Note: We should never be using a prebuffer when we're reading a specific length of data.
-				
-				NSAssert(readIntoPreBuffer == NO, @"Invalid logic");
-				
-				currentRead->bytesDone += bytesRead;
-				totalBytesReadForCurrentRead += bytesRead;
-				
-				done = (currentRead->bytesDone == currentRead->readLength);
-			}
-			else if (currentRead->term != nil)
-			{
-				// Read type #3 - read up to a terminator
-				
-				if (readIntoPreBuffer)
-				{
-					// We just read a big chunk of data into the preBuffer
-					
-					[preBuffer didWrite:bytesRead];
-					LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
-					
-					// Search for the terminating sequence
-					
-					NSUInteger bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
-					LogVerbose(@"copying %lu bytes from preBuffer", (unsigned long)bytesToCopy);
-					
-					// Ensure there's room on the read packet's buffer
-					
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
-					
-					// Copy bytes from prebuffer into read buffer
-					
-					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
-					                                                                 + currentRead->bytesDone;
-					
-					memcpy(readBuf, [preBuffer readBuffer], bytesToCopy);
-					
-					// Remove the copied bytes from the prebuffer
-					[preBuffer didRead:bytesToCopy];
-					LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
-					
-					// Update totals
-					currentRead->bytesDone += bytesToCopy;
-					totalBytesReadForCurrentRead += bytesToCopy;
-					
-					// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method above
-				}
-				else
+			// We're going to use the SSLWrite function.
+			// 
+			// OSStatus SSLWrite(SSLContextRef context, const void *data, size_t dataLength, size_t *processed)
+			// 
+			// Parameters:
+			// context     - An SSL session context reference.
+			// data        - A pointer to the buffer of data to write.
+			// dataLength  - The amount, in bytes, of data to write.
+			// processed   - On return, the length, in bytes, of the data actually written.
+			// 
+			// It sounds pretty straight-forward,
+			// but there are a few caveats you should be aware of.
+			// 
+			// The SSLWrite method operates in a non-obvious (and rather annoying) manner.
+			// According to the documentation:
+			// 
+			//   Because you may configure the underlying connection to operate in a non-blocking manner,
+			//   a write operation might return errSSLWouldBlock, indicating that less data than requested
+			//   was actually transferred. In this case, you should repeat the call to SSLWrite until some
+			//   other result is returned.
+			// 
+			// This sounds perfect, but when our SSLWriteFunction returns errSSLWouldBlock,
+			// then the SSLWrite method returns (with the proper errSSLWouldBlock return value),
+			// but it sets processed to dataLength !!
+			// 
+			// In other words, if the SSLWrite function doesn't completely write all the data we tell it to,
+			// then it doesn't tell us how many bytes were actually written. So, for example, if we tell it to
+			// write 256 bytes then it might actually write 128 bytes, but then report 0 bytes written.
+			// 
+			// You might be wondering:
+			// If the SSLWrite function doesn't tell us how many bytes were written,
+			// then how in the world are we supposed to update our parameters (buffer & bytesToWrite)
+			// for the next time we invoke SSLWrite?
+			// 
+			// The answer is that SSLWrite cached all the data we told it to write,
+			// and it will push out that data next time we call SSLWrite.
+			// If we call SSLWrite with new data, it will push out the cached data first, and then the new data.
+			// If we call SSLWrite with empty data, then it will simply push out the cached data.
+			// 
+			// For this purpose we're going to break large writes into a series of smaller writes.
+			// This allows us to report progress back to the delegate.
+			
+			OSStatus result;
+			
+			BOOL hasCachedDataToWrite = (sslWriteCachedLength > 0);
+			BOOL hasNewDataToWrite = YES;
+			
+			if (hasCachedDataToWrite)
+			{
+				size_t processed = 0;
+				
+				result = SSLWrite(sslContext, NULL, 0, &processed);
+				
+				if (result == noErr)
 				{
-					// We just read a big chunk of data directly into the packet's buffer.
-					// We need to move any overflow into the prebuffer.
+					bytesWritten = sslWriteCachedLength;
+					sslWriteCachedLength = 0;
 					
-					NSInteger overflow = [currentRead searchForTermAfterPreBuffering:bytesRead];
+					[self ssl_didWriteBytes:bytesWritten];
 					
-					if (overflow == 0)
+					if ([currentWrite->buffer length] == (currentWrite->bytesDone + bytesWritten))
 					{
-						// Perfect match!
-						// Every byte we read stays in the read buffer,
-						// and the last byte we read was the last byte of the term.
-						
-						currentRead->bytesDone += bytesRead;
-						totalBytesReadForCurrentRead += bytesRead;
-						done = YES;
+						// We've written all data for the current write.
+						hasNewDataToWrite = NO;
 					}
-					else if (overflow > 0)
+				}
+				else
+				{
+					if (result == errSSLWouldBlock)
 					{
-						// The term was found within the data that we read,
-						// and there are extra bytes that extend past the end of the term.
-						// We need to move these excess bytes out of the read packet and into the prebuffer.
-						
-						NSInteger underflow = bytesRead - overflow;
-						
-						// Copy excess data into preBuffer
-						
-						LogVerbose(@"copying %ld overflow bytes into preBuffer", (long)overflow);
-						[preBuffer ensureCapacityForWrite:overflow];
-						
-						uint8_t *overflowBuffer = buffer + underflow;
-						memcpy([preBuffer writeBuffer], overflowBuffer, overflow);
-						
-						[preBuffer didWrite:overflow];
-						LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
-						
-						// Note: The completeCurrentRead method will trim the buffer for us.
-						
-						currentRead->bytesDone += underflow;
-						totalBytesReadForCurrentRead += underflow;
-						done = YES;
+						waiting = YES;
 					}
 					else
 					{
-						// The term was not found within the data that we read.
-						
-						currentRead->bytesDone += bytesRead;
-						totalBytesReadForCurrentRead += bytesRead;
-						done = NO;
+						error = [self sslError:result];
 					}
-				}
-				
-				if (!done && currentRead->maxLength > 0)
-				{
-					// We're not done and there's a set maxLength.
-					// Have we reached that maxLength yet?
 					
-					if (currentRead->bytesDone >= currentRead->maxLength)
-					{
-						error = [self readMaxedOutError];
-					}
+					// Can't write any new data since we were unable to write the cached data.
+					hasNewDataToWrite = NO;
 				}
 			}
-			else
+			
+			if (hasNewDataToWrite)
 			{
-				// Read type #1 - read all available data
+				const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes]
+				                                        + currentWrite->bytesDone
+				                                        + bytesWritten;
 				
-				if (readIntoPreBuffer)
+				NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone - bytesWritten;
+				
+				if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
 				{
-					// We just read a chunk of data into the preBuffer
-					
-					[preBuffer didWrite:bytesRead];
-					
-					// Now copy the data into the read packet.
-					// 
-					// Recall that we didn't read directly into the packet's buffer to avoid
-					// over-allocating memory since we had no clue how much data was available to be read.
-					// 
-					// Ensure there's room on the read packet's buffer
-					
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesRead];
-					
-					// Copy bytes from prebuffer into read buffer
-					
-					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
-					                                                                 + currentRead->bytesDone;
+					bytesToWrite = SIZE_MAX;
+				}
+				
+				size_t bytesRemaining = bytesToWrite;
+				
+				BOOL keepLooping = YES;
+				while (keepLooping)
+				{
+					const size_t sslMaxBytesToWrite = [self ssl_maxBytesToWrite];
+					size_t sslBytesToWrite = MIN(bytesRemaining, sslMaxBytesToWrite);
+					size_t sslBytesWritten = 0;
 					
-					memcpy(readBuf, [preBuffer readBuffer], bytesRead);
+					result = SSLWrite(sslContext, buffer, sslBytesToWrite, &sslBytesWritten);
 					
-					// Remove the copied bytes from the prebuffer
-					[preBuffer didRead:bytesRead];
+					if (result == noErr)
+					{
+						buffer += sslBytesWritten;
+						bytesWritten += sslBytesWritten;
+						bytesRemaining -= sslBytesWritten;
+						
+						[self ssl_didWriteBytes:sslBytesWritten];
+						
+						keepLooping = (bytesRemaining > 0);
+					}
+					else
+					{
+						if (result == errSSLWouldBlock)
+						{
+							waiting = YES;
+							sslWriteCachedLength = sslBytesToWrite;
+						}
+						else
+						{
+							error = [self sslError:result];
+						}
+						
+						keepLooping = NO;
+					}
 					
-					// Update totals
-					currentRead->bytesDone += bytesRead;
-					totalBytesReadForCurrentRead += bytesRead;
-				}
-				else
-				{
-					currentRead->bytesDone += bytesRead;
-					totalBytesReadForCurrentRead += bytesRead;
-				}
+				} // while (keepLooping)
 				
-				done = YES;
+			} // if (hasNewDataToWrite)
+		}
+	}
+	else if (fileWrite && fileWrite->usesSendfile)
+	{
+		// 
+		// Writing a file directly over raw socket, without copying it through userspace
+		// 
+		
+		#if !TARGET_OS_IPHONE
+		
+		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+		
+		off_t length = fileWrite->fileLength - [fileWrite fileBytesDone];
+		
+		if (length > SSIZE_MAX) // Keep bytesWritten within size_t
+		{
+			length = SSIZE_MAX;
+		}
+		
+		// On return, length is set to the number of bytes sent, even if an error (e.g. EAGAIN) is returned.
+		
+		TRACE_SYSCALL_BEGIN();
+		int result = sendfile(fileWrite->fileFD, socketFD,
+		                      fileWrite->fileOffset + [fileWrite fileBytesDone], &length, NULL, 0);
+		TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, length, result < 0);
+		
+		LogVerbose(@"sendfile(%lld) = %d", (long long)length, result);
+		
+		STATISTICS_ADD(writeSyscalls, 1);
+		STATISTICS_ADD(bytesWritten, length);
+		
+		if (result < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				waiting = YES;
+			}
+			else if (errno == ENOTSUP || errno == EOPNOTSUPP || errno == ENOTSOCK || errno == EINVAL)
+			{
+				// The socket (e.g. a unix domain socket) or the file doesn't support sendfile.
+				// Fall back to writing mapped windows of the file, starting with the next callback.
+				
+				fileWrite->usesSendfile = NO;
+			}
+			else if (errno != EINTR)
+			{
+				error = [self errorWithErrno:errno reason:@"Error in sendfile() function"];
+			}
+		}
+		
+		bytesWritten = (size_t)length;
+		
+		#endif
+	}
+	else
+	{
+		// 
+		// Writing data directly over raw socket
+		// 
+		
+		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+		
+		const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
+		
+		NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
+		BOOL canGatherQueuedWrites = (fileWrite == nil); // Only the current window of the file is in memory
+		
+		if ((largeWriteThreshold > 0) && (bytesToWrite >= largeWriteThreshold) && !(flags & kSendBufferRaised))
+		{
+			[self raiseSendBufferForLargeWrites];
+		}
+		
+		if (bytesToWrite > SSIZE_MAX) // NSUInteger may be bigger than ssize_t (total of writev iovecs)
+		{
+			bytesToWrite = SSIZE_MAX;
+			canGatherQueuedWrites = NO;
+		}
+		
+		// If there are more writes queued up behind the current write,
+		// we hand them to the kernel along with the current write via a single writev() call.
+		// This saves us a sys call (and possibly a trip through the writeSource) for each of them.
+		// 
+		// We stop at special packets (e.g. startTLS), as everything after them must go through the TLS layer.
+		
+		struct iovec iov[64];
+		int iovcnt = 0;
+		
+		iov[iovcnt].iov_base = (void *)buffer;
+		iov[iovcnt].iov_len = (size_t)bytesToWrite;
+		iovcnt++;
+		
+		size_t totalBytesToWrite = (size_t)bytesToWrite;
+		
+		NSUInteger queuedWriteCount = [writeQueue count];
+		
+		for (NSUInteger i = 0; i < queuedWriteCount; i++)
+		{
+			if (!canGatherQueuedWrites) break;
+			
+			id packet = [writeQueue objectAtIndex:i];
+			
+			if ((iovcnt >= (int)(sizeof(iov) / sizeof(iov[0]))) ||
+			    ![packet isKindOfClass:[GCDAsyncWritePacket class]] ||
+			     [packet isKindOfClass:[GCDAsyncFileWritePacket class]])
+			{
+				break;
 			}
 			
-		} // if (bytesRead > 0)
+			GCDAsyncWritePacket *queuedWrite = (GCDAsyncWritePacket *)packet;
+			
+			NSUInteger queuedBytesToWrite = [queuedWrite->buffer length] - queuedWrite->bytesDone;
+			
+			if (queuedBytesToWrite > (SSIZE_MAX - totalBytesToWrite))
+			{
+				break;
+			}
+			
+			iov[iovcnt].iov_base = (uint8_t *)[queuedWrite->buffer bytes] + queuedWrite->bytesDone;
+			iov[iovcnt].iov_len = (size_t)queuedBytesToWrite;
+			iovcnt++;
+			
+			totalBytesToWrite += (size_t)queuedBytesToWrite;
+		}
+		
+		TRACE_SYSCALL_BEGIN();
+		ssize_t result;
+		if (iovcnt == 1)
+			result = write(socketFD, buffer, (size_t)bytesToWrite);
+		else
+			result = writev(socketFD, iov, iovcnt);
+		TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, result, result < 0);
+		
+		LogVerbose(@"wrote to socket = %zd", result);
+		
+		STATISTICS_ADD(writeSyscalls, 1);
+		if (result > 0) STATISTICS_ADD(bytesWritten, result);
+		
+		// Check results
+		if (result < 0)
+		{
+			if (errno == EWOULDBLOCK)
+			{
+				waiting = YES;
+			}
+			else
+			{
+				error = [self errorWithErrno:errno reason:@"Error in write() function"];
+			}
+		}
+		else if ((size_t)result > (size_t)bytesToWrite)
+		{
+			bytesWritten = (size_t)bytesToWrite;
+			queuedBytesWritten = (size_t)result - bytesWritten;
+		}
+		else
+		{
+			bytesWritten = result;
+		}
+	}
+	
+	// We're done with our writing.
+	// If we explictly ran into a situation where the socket told us there was no room in the buffer,
+	// then we immediately resume listening for notifications.
+	// 
+	// We must do this before we dequeue another write,
+	// as that may in turn invoke this method again.
+	// 
+	// Note that if CFStream is involved, it may have maliciously put our socket in blocking mode.
+	
+	if (waiting)
+	{
+		flags &= ~kSocketCanAcceptBytes;
 		
-	} // if (!done && !error && !socketEOF && hasBytesAvailable)
+		if (![self usingCFStreamForTLS])
+		{
+			[self resumeWriteSource];
+		}
+	}
+	
+	// Check our results
 	
+	BOOL done = NO;
 	
-	if (!done && currentRead->readLength == 0 && currentRead->term == nil)
+	if (bytesWritten > 0)
 	{
-		// Read type #1 - read all available data
-		// 
-		// We might arrive here if we read data from the prebuffer but not from the socket.
+		// Update total amount read for the current write
+		currentWrite->bytesDone += bytesWritten;
+		LogVerbose(@"currentWrite->bytesDone = %lu", (unsigned long)currentWrite->bytesDone);
 		
-		done = (totalBytesReadForCurrentRead > 0);
+		// Is packet done?
+		if (fileWrite)
+			done = [fileWrite isDone];
+		else
+			done = (currentWrite->bytesDone == [currentWrite->buffer length]);
 	}
 	
-	// Check to see if we're done, or if we've made progress
-	
 	if (done)
 	{
-		[self completeCurrentRead];
+		[self completeCurrentWrite];
 		
-		if (!error && (!socketEOF || [preBuffer availableBytes] > 0))
+		if (queuedBytesWritten > 0)
 		{
-			[self maybeDequeueRead];
+			[self didWriteQueuedBytes:queuedBytesWritten];
+		}
+		
+		if (!error)
+		{
+			dispatch_async(socketQueue, ^{ @autoreleasepool{
+				
+				[self maybeDequeueWrite];
+			}});
 		}
 	}
-	else if (totalBytesReadForCurrentRead > 0)
+	else
 	{
-		// We're not done read type #2 or #3 yet, but we have read in some bytes
-		//
-		// We ensure that `waiting` is set in order to resume the readSource (if it is suspended). It is
-		// possible to reach this point and `waiting` not be set, if the current read's length is
-		// sufficiently large. In that case, we may have read to some upperbound successfully, but
-		// that upperbound could be smaller than the desired length.
-		waiting = YES;
-
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+		// We were unable to finish writing the data,
+		// so we're waiting for another callback to notify us of available space in the lower-level output buffer.
 		
-		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadPartialDataOfLength:tag:)])
+		if (!waiting && !error)
 		{
-			long theReadTag = currentRead->tag;
+			// This would be the case if our write was able to accept some data, but not all of it.
 			
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			flags &= ~kSocketCanAcceptBytes;
+			
+			if (![self usingCFStreamForTLS])
+			{
+				[self resumeWriteSource];
+			}
+		}
+		
+		if (bytesWritten > 0)
+		{
+			// We're not done with the entire write, but we have written some bytes
+			
+			__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+			if (delegateQueue && !currentWrite->completion && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidWritePartialData))
+			{
+				long theWriteTag = currentWrite->tag;
 				
-				[theDelegate socket:self didReadPartialDataOfLength:totalBytesReadForCurrentRead tag:theReadTag];
-			}});
+				[self invokeDataDelegateBlock:^{
+					
+					[theDelegate socket:self didWritePartialDataOfLength:bytesWritten tag:theWriteTag];
+				}];
+			}
 		}
 	}
 	
@@ -5570,2960 +10323,3947 @@ enum GCDAsyncSocketConfig
 	
 	if (error)
 	{
-		[self closeWithError:error];
-	}
-	else if (socketEOF)
-	{
-		[self doReadEOF];
-	}
-	else if (waiting)
-	{
-		if (![self usingCFStreamForTLS])
-		{
-			// Monitor the socket for readability (if we're not already doing so)
-			[self resumeReadSource];
-		}
+		[self closeWithError:[self errorWithErrno:errno reason:@"Error in write() function"]];
 	}
 	
-	// Do not add any code here without first adding return statements in the error cases above.
+	// Do not add any code here without first adding a return statement in the error case above.
 }
 
-- (void)doReadEOF
+/**
+ * Accounts for data that's about to be queued for writing (see queuedWriteBytes).
+ * If the cap is non-zero, and the data would exceed it, nothing is accounted for, and NO is returned.
+ * 
+ * May be called on any thread.
+**/
+- (BOOL)addQueuedWriteBytes:(NSUInteger)length cap:(NSUInteger)cap
 {
-	LogTrace();
-	
-	// This method may be called more than once.
-	// If the EOF is read while there is still data in the preBuffer,
-	// then this method may be called continually after invocations of doReadData to see if it's time to disconnect.
-	
-	flags |= kSocketHasReadEOF;
+	uint_fast64_t queued = atomic_load(&queuedWriteByteCount);
 	
-	if (flags & kSocketSecure)
+	do
 	{
-		// If the SSL layer has any buffered data, flush it into the preBuffer now.
+		if ((cap > 0) && (queued + length > cap)) return NO;
 		
-		[self flushSSLBuffers];
-	}
+	} while (!atomic_compare_exchange_weak(&queuedWriteByteCount, &queued, queued + length));
 	
-	BOOL shouldDisconnect = NO;
-	NSError *error = nil;
+	uint_fast64_t highWatermark = atomic_load(&writeQueueHighWatermark);
 	
-	if ((flags & kStartingReadTLS) || (flags & kStartingWriteTLS))
-	{
-		// We received an EOF during or prior to startTLS.
-		// The SSL/TLS handshake is now impossible, so this is an unrecoverable situation.
-		
-		shouldDisconnect = YES;
-		
-		if ([self usingSecureTransportForTLS])
-		{
-			error = [self sslError:errSSLClosedAbort];
-		}
-	}
-	else if (flags & kReadStreamClosed)
-	{
-		// The preBuffer has already been drained.
-		// The config allows half-duplex connections.
-		// We've previously checked the socket, and it appeared writeable.
-		// So we marked the read stream as closed and notified the delegate.
-		// 
-		// As per the half-duplex contract, the socket will be closed when a write fails,
-		// or when the socket is manually closed.
-		
-		shouldDisconnect = NO;
-	}
-	else if ([preBuffer availableBytes] > 0)
+	if ((highWatermark > 0) && (queued + length >= highWatermark) && !atomic_exchange(&writeQueueAboveHighWatermark, true))
 	{
-		LogVerbose(@"Socket reached EOF, but there is still data available in prebuffer");
+		// Notify via the socketQueue, so this is ordered with respect to the (later) drain notification.
 		
-		// Although we won't be able to read any more data from the socket,
-		// there is existing data that has been prebuffered that we can read.
-		
-		shouldDisconnect = NO;
+		dispatch_async(socketQueue, ^{ @autoreleasepool {
+			
+			__strong id<GCDAsyncSocketDelegate> theDelegate = self->delegate;
+			
+			if (self->delegateQueue && [theDelegate respondsToSelector:@selector(socketWriteQueueDidExceedHighWatermark:)])
+			{
+				dispatch_async(self->delegateQueue, ^{ @autoreleasepool {
+					
+					[theDelegate socketWriteQueueDidExceedHighWatermark:self];
+				}});
+			}
+		}});
 	}
-	else if (config & kAllowHalfDuplexConnection)
+	
+	return YES;
+}
+
+/**
+ * Accounts for queued data that has been written (or dropped).
+**/
+- (void)removeQueuedWriteBytes:(NSUInteger)length
+{
+	if (length == 0) return;
+	
+	uint_fast64_t queued = atomic_fetch_sub(&queuedWriteByteCount, length) - length;
+	
+	if ((queued <= atomic_load(&writeQueueLowWatermark)) && atomic_exchange(&writeQueueAboveHighWatermark, false))
 	{
-		// We just received an EOF (end of file) from the socket's read stream.
-		// This means the remote end of the socket (the peer we're connected to)
-		// has explicitly stated that it will not be sending us any more data.
-		// 
-		// Query the socket to see if it is still writeable. (Perhaps the peer will continue reading data from us)
-		
-		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
-		
-		struct pollfd pfd[1];
-		pfd[0].fd = socketFD;
-		pfd[0].events = POLLOUT;
-		pfd[0].revents = 0;
-		
-		poll(pfd, 1, 0);
-		
-		if (pfd[0].revents & POLLOUT)
-		{
-			// Socket appears to still be writeable
-			
-			shouldDisconnect = NO;
-			flags |= kReadStreamClosed;
+		dispatch_async(socketQueue, ^{ @autoreleasepool {
 			
-			// Notify the delegate that we're going half-duplex
+			__strong id<GCDAsyncSocketDelegate> theDelegate = self->delegate;
 			
-			__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-			if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidCloseReadStream:)])
+			if (self->delegateQueue && [theDelegate respondsToSelector:@selector(socketWriteQueueDidDrainBelowLowWatermark:)])
 			{
-				dispatch_async(delegateQueue, ^{ @autoreleasepool {
+				dispatch_async(self->delegateQueue, ^{ @autoreleasepool {
 					
-					[theDelegate socketDidCloseReadStream:self];
+					[theDelegate socketWriteQueueDidDrainBelowLowWatermark:self];
 				}});
 			}
-		}
-		else
+		}});
+	}
+}
+
+/**
+ * Drops the accounting for all queued writes, when the socket is closed.
+ * The delegate isn't told about the queue draining, as it's told about the disconnection.
+**/
+- (void)discardQueuedWriteBytes
+{
+	NSUInteger length = 0;
+	
+	if ([currentWrite isKindOfClass:[GCDAsyncWritePacket class]])
+	{
+		length += currentWrite->queuedLength;
+	}
+	
+	for (NSUInteger i = 0; i < [writeQueue count]; i++)
+	{
+		id packet = [writeQueue objectAtIndex:i];
+		
+		if ([packet isKindOfClass:[GCDAsyncWritePacket class]])
 		{
-			shouldDisconnect = YES;
+			length += ((GCDAsyncWritePacket *)packet)->queuedLength;
 		}
 	}
-	else
+	
+	atomic_fetch_sub(&queuedWriteByteCount, length);
+	atomic_store(&writeQueueAboveHighWatermark, false);
+}
+
+/**
+ * Raises the socket's SO_SNDBUF to largeWriteSendBufferSize (never lowering it).
+ * 
+ * Each write() then hands the kernel more of a large buffer at once,
+ * saving syscalls and writeSource wakeups for the rest of the connection.
+ * 
+ * Setting SO_SNDBUF disables the kernel's send buffer autosizing (SB_AUTOSIZE on Darwin) for this socket,
+ * which is why this is opt-in (see largeWriteThreshold).
+ * If autosizing has already grown the buffer to the target size, we leave it (and autosizing) alone.
+**/
+- (void)raiseSendBufferForLargeWrites
+{
+	flags |= kSendBufferRaised; // Only try once per connection
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	int sendBufferSize = 0;
+	socklen_t optlen = sizeof(sendBufferSize);
+	
+	if (getsockopt(socketFD, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, &optlen) < 0)
 	{
-		shouldDisconnect = YES;
+		LogWarn(@"Error getting SO_SNDBUF: %@", [self errnoError]);
+		return;
 	}
 	
+	int targetSize = (int)MIN(largeWriteSendBufferSize, (NSUInteger)INT_MAX);
 	
-	if (shouldDisconnect)
+	if (sendBufferSize >= targetSize) return;
+	
+	// From here on, the send buffer has a fixed size (no more autosizing)
+	if (setsockopt(socketFD, SOL_SOCKET, SO_SNDBUF, &targetSize, sizeof(targetSize)) == 0)
 	{
-		if (error == nil)
+		LogVerbose(@"SO_SNDBUF = %i (was %i)", targetSize, sendBufferSize);
+	}
+	else
+	{
+		// The size is limited by the kern.ipc.maxsockbuf sysctl
+		LogWarn(@"Error setting SO_SNDBUF: %@", [self errnoError]);
+	}
+}
+
+/**
+ * Accounts for bytes that were written on behalf of the packets queued behind the current write.
+ * (See the writev() call in doWriteData.)
+ * 
+ * Packets that have been written entirely are removed from the queue and completed.
+ * A partially written packet stays at the head of the queue, and will pick up where it left off once dequeued.
+**/
+- (void)didWriteQueuedBytes:(size_t)byteCount
+{
+	LogTrace();
+	
+	while ((byteCount > 0) && ([writeQueue count] > 0))
+	{
+		GCDAsyncWritePacket *packet = [writeQueue objectAtIndex:0];
+		
+		NSUInteger bytesRemaining = [packet->buffer length] - packet->bytesDone;
+		
+		if (byteCount < bytesRemaining)
 		{
-			if ([self usingSecureTransportForTLS])
-			{
-				if (sslErrCode != noErr && sslErrCode != errSSLClosedGraceful)
-				{
-					error = [self sslError:sslErrCode];
-				}
-				else
-				{
-					error = [self connectionClosedError];
-				}
-			}
-			else
-			{
-				error = [self connectionClosedError];
-			}
+			packet->bytesDone += byteCount;
+			break;
+		}
+		
+		packet->bytesDone += bytesRemaining;
+		byteCount -= bytesRemaining;
+		
+		[writeQueue removeFirstObject];
+		[self updateQueueDepthStatistics];
+		[self removeQueuedWriteBytes:packet->queuedLength];
+		
+		if (!packet->continuedByNext) [self recordCompletionOfPacketQueuedAt:packet->enqueueTime isRead:NO];
+		
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+		
+		if (packet->continuedByNext)
+		{
+			// Not the last region of a dispatch_data write, which is reported as a whole
 		}
-		[self closeWithError:error];
-	}
-	else
-	{
-		if (![self usingCFStreamForTLS])
+		else if (packet->completion)
 		{
-			// Suspend the read source (if needed)
+			GCDAsyncSocketWriteCompletionBlock completion = packet->completion;
 			
-			[self suspendReadSource];
+			[self invokeCompletionBlock:^{
+				
+				completion(nil);
+			} onSocketQueue:packet->completesOnSocketQueue];
+		}
+		else if (delegateQueue && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidWriteData))
+		{
+			long theWriteTag = packet->tag;
+			GCDAsyncSocketDidWriteDataIMP didWriteData = delegateDidWriteData;
+			
+			[self invokeDataDelegateBlock:^{
+				
+				didWriteData(theDelegate, @selector(socket:didWriteDataWithTag:), self, theWriteTag);
+			}];
 		}
+		
+		[self recycleWritePacket:packet];
 	}
 }
 
-- (void)completeCurrentRead
+- (void)completeCurrentWrite
 {
 	LogTrace();
 	
-	NSAssert(currentRead, @"Trying to complete current read when there is no current read.");
-	
+	NSAssert(currentWrite, @"Trying to complete current write when there is no current write.");
 	
-	NSData *result = nil;
+	if (!currentWrite->continuedByNext) [self recordCompletionOfPacketQueuedAt:currentWrite->enqueueTime isRead:NO];
+
+	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
 	
-	if (currentRead->bufferOwner)
+	if (currentWrite->continuedByNext)
 	{
-		// We created the buffer on behalf of the user.
-		// Trim our buffer to be the proper size.
-		[currentRead->buffer setLength:currentRead->bytesDone];
-		
-		result = currentRead->buffer;
+		// Not the last region of a dispatch_data write, which is reported as a whole
 	}
-	else
+	else if (currentWrite->completion)
 	{
-		// We did NOT create the buffer.
-		// The buffer is owned by the caller.
-		// Only trim the buffer if we had to increase its size.
+		GCDAsyncSocketWriteCompletionBlock completion = currentWrite->completion;
 		
-		if ([currentRead->buffer length] > currentRead->originalBufferLength)
-		{
-			NSUInteger readSize = currentRead->startOffset + currentRead->bytesDone;
-			NSUInteger origSize = currentRead->originalBufferLength;
-			
-			NSUInteger buffSize = MAX(readSize, origSize);
+		[self invokeCompletionBlock:^{
 			
-			[currentRead->buffer setLength:buffSize];
-		}
-		
-		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset;
-		
-		result = [NSData dataWithBytesNoCopy:buffer length:currentRead->bytesDone freeWhenDone:NO];
+			completion(nil);
+		} onSocketQueue:currentWrite->completesOnSocketQueue];
 	}
-	
-	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadData:withTag:)])
+	else if (delegateQueue && ([self capabilitiesOfDelegate:theDelegate] & kDelegateDidWriteData))
 	{
-		GCDAsyncReadPacket *theRead = currentRead; // Ensure currentRead retained since result may not own buffer
+		long theWriteTag = currentWrite->tag;
+		GCDAsyncSocketDidWriteDataIMP didWriteData = delegateDidWriteData;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self invokeDataDelegateBlock:^{
 			
-			[theDelegate socket:self didReadData:result withTag:theRead->tag];
-		}});
+			didWriteData(theDelegate, @selector(socket:didWriteDataWithTag:), self, theWriteTag);
+		}];
 	}
 	
-	[self endCurrentRead];
+	GCDAsyncWritePacket *theWrite = currentWrite;
+	
+	[self endCurrentWrite];
+	[self removeQueuedWriteBytes:theWrite->queuedLength];
+	[self recycleWritePacket:theWrite];
 }
 
-- (void)endCurrentRead
+- (void)endCurrentWrite
 {
-	if (readTimer)
+	if (writeTimer)
 	{
-		dispatch_source_cancel(readTimer);
-		readTimer = NULL;
+		dispatch_source_cancel(writeTimer);
+		writeTimer = NULL;
 	}
 	
-	currentRead = nil;
+	currentWrite = nil;
 }
 
-- (void)setupReadTimerWithTimeout:(NSTimeInterval)timeout
+- (void)setupWriteTimerWithTimeout:(NSTimeInterval)timeout
 {
 	if (timeout >= 0.0)
 	{
-		readTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
+		writeTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
 		
 		__weak GCDAsyncSocket *weakSelf = self;
 		
-		dispatch_source_set_event_handler(readTimer, ^{ @autoreleasepool {
+		dispatch_source_set_event_handler(writeTimer, ^{ @autoreleasepool {
 		#pragma clang diagnostic push
 		#pragma clang diagnostic warning "-Wimplicit-retain-self"
 			
 			__strong GCDAsyncSocket *strongSelf = weakSelf;
 			if (strongSelf == nil) return_from_block;
 			
-			[strongSelf doReadTimeout];
+			[strongSelf doWriteTimeout];
 			
 		#pragma clang diagnostic pop
 		}});
 		
 		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theReadTimer = readTimer;
-		dispatch_source_set_cancel_handler(readTimer, ^{
+		dispatch_source_t theWriteTimer = writeTimer;
+		dispatch_source_set_cancel_handler(writeTimer, ^{
 		#pragma clang diagnostic push
 		#pragma clang diagnostic warning "-Wimplicit-retain-self"
 			
-			LogVerbose(@"dispatch_release(readTimer)");
-			dispatch_release(theReadTimer);
+			LogVerbose(@"dispatch_release(writeTimer)");
+			dispatch_release(theWriteTimer);
 			
 		#pragma clang diagnostic pop
 		});
 		#endif
 		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		
+		dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
+		dispatch_resume(writeTimer);
+	}
+}
+
+- (void)doWriteTimeout
+{
+	// This is a little bit tricky.
+	// Ideally we'd like to synchronously query the delegate about a timeout extension.
+	// But if we do so synchronously we risk a possible deadlock.
+	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
+	
+	flags |= kWritesPaused;
+	
+	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+	if (delegateQueue && !currentWrite->completion &&
+	    [theDelegate respondsToSelector:@selector(socket:shouldTimeoutWriteWithTag:elapsed:bytesDone:)])
+	{
+		// Capture the values rather than the packet, as the packet may be reused once it's finished
+		long theWriteTag = currentWrite->tag;
+		NSTimeInterval theWriteTimeout = currentWrite->timeout;
+		NSUInteger theWriteBytesDone = currentWrite->bytesDone;
+		
+		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			
+			NSTimeInterval timeoutExtension = 0.0;
+			
+			timeoutExtension = [theDelegate socket:self shouldTimeoutWriteWithTag:theWriteTag
+			                                                              elapsed:theWriteTimeout
+			                                                            bytesDone:theWriteBytesDone];
+			
+            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+				
+				[self doWriteTimeoutWithExtension:timeoutExtension];
+			}});
+		}});
+	}
+	else
+	{
+		[self doWriteTimeoutWithExtension:0.0];
+	}
+}
+
+- (void)doWriteTimeoutWithExtension:(NSTimeInterval)timeoutExtension
+{
+	if (currentWrite)
+	{
+		if (timeoutExtension > 0.0)
+		{
+			currentWrite->timeout += timeoutExtension;
+			
+			// Reschedule the timer
+			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
+			dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
+			
+			// Unpause writes, and continue
+			flags &= ~kWritesPaused;
+			[self doWriteData];
+		}
+		else
+		{
+			LogVerbose(@"WriteTimeout");
+			
+			[self closeWithError:[self writeTimeoutError]];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Relaying
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)relayTo:(GCDAsyncSocket *)destination
+  bidirectional:(BOOL)bidirectional
+     completion:(GCDAsyncSocketRelayCompletionBlock)completion
+{
+	if (destination == nil || destination == self)
+	{
+		LogWarn(@"Cannot relay: invalid destination");
+		return;
+	}
+	
+	[self startRelayTo:destination completion:completion];
+	
+	if (bidirectional)
+	{
+		[destination startRelayTo:self completion:completion];
+	}
+}
+
+- (void)startRelayTo:(GCDAsyncSocket *)destination completion:(GCDAsyncSocketRelayCompletionBlock)completion
+{
+	GCDAsyncSocketRelay *relay = [[GCDAsyncSocketRelay alloc] initWithSource:self
+	                                                             destination:destination
+	                                                              completion:completion];
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		if (self->outgoingRelay)
+		{
+			LogWarn(@"Cannot relay: socket is already relaying");
+			return_from_block;
+		}
+		
+		self->outgoingRelay = relay;
+		
+		pthread_mutex_lock(&relay->lock);
+		relay->readPending = YES;
+		pthread_mutex_unlock(&relay->lock);
+		
+		[self relayReadNext:relay];
+	}});
+}
+
+- (uint64_t)relayedByteCount
+{
+	return (uint64_t)atomic_load(&relayedByteCount);
+}
+
+/**
+ * Queues the relay's next read on the source (i.e. this socket).
+ * The caller must have set readPending.
+ * 
+ * The read completes on the socketQueue, without a hop through the completionQueue.
+**/
+- (void)relayReadNext:(GCDAsyncSocketRelay *)relay
+{
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		if (!(self->flags & kSocketStarted) || (self->flags & kForbidReadsWrites))
+		{
+			[self relay:relay didFinishWithError:[self otherError:@"Relay source is not connected"]];
+			return_from_block;
+		}
+		
+		if (self->flags & kReadStreamClosed)
+		{
+			// Half-duplex source that has already reached the end of the stream
+			[self relay:relay didReadData:nil error:nil];
+			return_from_block;
+		}
+		
+		GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+		                                          startOffset:0
+		                                            maxLength:RELAY_READ_LENGTH
+		                                              timeout:-1
+		                                           readLength:0
+		                                           terminator:nil
+		                                                  tag:0];
+		packet->completion = ^(NSData *data, NSError *error) {
+			
+			[self relay:relay didReadData:data error:error];
+		};
+		packet->completesOnSocketQueue = YES;
+		
+		pthread_mutex_lock(&relay->lock);
+		if (relay->finished)
+		{
+			// E.g. the destination failed while this block was pending
+			pthread_mutex_unlock(&relay->lock);
+			
+			[self recycleReadPacket:packet];
+			return_from_block;
+		}
+		relay->pendingRead = packet;
+		pthread_mutex_unlock(&relay->lock);
+		
+		[self addToReadQueue:packet];
+		
+		dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+			
+			[self maybeDequeueRead];
+		}});
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+/**
+ * Invoked when one of the relay's reads completes (or fails), and when a half-duplex source reaches EOF.
+ * A nil data & error signals the end of the stream.
+ * 
+ * Normally invoked on the source's socketQueue. If the source is closed, failed reads are reported on its completionQueue.
+**/
+- (void)relay:(GCDAsyncSocketRelay *)relay didReadData:(NSData *)data error:(NSError *)error
+{
+	BOOL readMore = NO;
+	BOOL endOfStream = NO;
+	BOOL shutdownNow = NO;
+	
+	if (data == nil && error != nil)
+	{
+		// When the peer closes a (full-duplex) socket, the socket is closed with a "closed" error.
+		// For the relay, that's the regular end of the stream.
+		
+		endOfStream = [error.domain isEqualToString:GCDAsyncSocketErrorDomain] && (error.code == GCDAsyncSocketClosedError);
+	}
+	else if (data == nil)
+	{
+		endOfStream = YES;
+	}
+	
+	pthread_mutex_lock(&relay->lock);
+	{
+		relay->readPending = NO;
+		relay->pendingRead = nil;
+		
+		if (relay->finished || relay->sourceDidEnd)
+		{
+			// E.g. the pending read of a half-duplex source failing after we've seen the end of the stream
+			pthread_mutex_unlock(&relay->lock);
+			return;
+		}
+		
+		if (data == nil && !endOfStream)
+		{
+			pthread_mutex_unlock(&relay->lock);
+			
+			[self relay:relay didFinishWithError:error];
+			return;
+		}
+		
+		if (data)
+		{
+			relay->bytesInFlight += [data length];
+			relay->writesInFlight++;
+			
+			// Keep reading, unless the destination is falling behind
+			readMore = (relay->bytesInFlight < RELAY_MAX_BYTES_IN_FLIGHT);
+			relay->readPending = readMore;
+		}
+		else
+		{
+			relay->sourceDidEnd = YES;
+			shutdownNow = (relay->writesInFlight == 0);
+		}
+	}
+	pthread_mutex_unlock(&relay->lock);
+	
+	if (data)
+	{
+		[relay->destination relayWriteData:data forRelay:relay];
+	}
+	
+	if (readMore)
+	{
+		[self relayReadNext:relay];
+	}
+	
+	if (shutdownNow)
+	{
+		[relay->destination relayShutdownWriteForRelay:relay];
+	}
+}
+
+/**
+ * Queues a write of relayed data on the destination (i.e. this socket).
+ * The write completes on the socketQueue, without a hop through the completionQueue.
+**/
+- (void)relayWriteData:(NSData *)data forRelay:(GCDAsyncSocketRelay *)relay
+{
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		if (!(self->flags & kSocketStarted) || (self->flags & kForbidReadsWrites))
+		{
+			[self relay:relay didFinishWithError:[self otherError:@"Relay destination is not connected"]];
+			return_from_block;
+		}
+		
+		NSUInteger length = [data length];
+		
+		[self addQueuedWriteBytes:length cap:0];
+		
+		GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:-1 tag:0];
+		packet->queuedLength = length;
+		packet->completion = ^(NSError *error) {
+			
+			[self relay:relay didWriteDataOfLength:length error:error];
+		};
+		packet->completesOnSocketQueue = YES;
+		
+		[self addToWriteQueue:packet];
 		
-		dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
-		dispatch_resume(readTimer);
-	}
+		dispatch_async(self->socketQueue, ^{ @autoreleasepool {
+			
+			[self maybeDequeueWrite];
+		}});
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (void)doReadTimeout
+/**
+ * Invoked when one of the relay's writes completes (or fails).
+ * 
+ * Normally invoked on the destination's socketQueue.
+ * If the destination is closed, failed writes are reported on its completionQueue.
+**/
+- (void)relay:(GCDAsyncSocketRelay *)relay didWriteDataOfLength:(NSUInteger)length error:(NSError *)error
 {
-	// This is a little bit tricky.
-	// Ideally we'd like to synchronously query the delegate about a timeout extension.
-	// But if we do so synchronously we risk a possible deadlock.
-	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
+	if (error)
+	{
+		[self relay:relay didFinishWithError:error];
+		return;
+	}
 	
-	flags |= kReadsPaused;
+	BOOL readMore = NO;
+	BOOL shutdownNow = NO;
 	
-	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:shouldTimeoutReadWithTag:elapsed:bytesDone:)])
+	pthread_mutex_lock(&relay->lock);
 	{
-		GCDAsyncReadPacket *theRead = currentRead;
+		if (relay->finished)
+		{
+			pthread_mutex_unlock(&relay->lock);
+			return;
+		}
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			NSTimeInterval timeoutExtension = 0.0;
-			
-			timeoutExtension = [theDelegate socket:self shouldTimeoutReadWithTag:theRead->tag
-			                                                             elapsed:theRead->timeout
-			                                                           bytesDone:theRead->bytesDone];
-			
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
-				
-				[self doReadTimeoutWithExtension:timeoutExtension];
-			}});
-		}});
+		relay->bytesInFlight -= length;
+		relay->writesInFlight--;
+		relay->bytesRelayed += length;
+		
+		atomic_fetch_add(&relay->source->relayedByteCount, (uint_fast64_t)length);
+		
+		if (relay->sourceDidEnd)
+		{
+			shutdownNow = (relay->writesInFlight == 0);
+		}
+		else if (!relay->readPending && (relay->bytesInFlight < RELAY_MAX_BYTES_IN_FLIGHT))
+		{
+			readMore = YES;
+			relay->readPending = YES;
+		}
 	}
-	else
+	pthread_mutex_unlock(&relay->lock);
+	
+	if (readMore)
 	{
-		[self doReadTimeoutWithExtension:0.0];
+		[relay->source relayReadNext:relay];
+	}
+	
+	if (shutdownNow)
+	{
+		[self relayShutdownWriteForRelay:relay];
 	}
 }
 
-- (void)doReadTimeoutWithExtension:(NSTimeInterval)timeoutExtension
+/**
+ * Signals the end of the relayed stream to the destination's peer (i.e. this socket's peer),
+ * once all relayed data has been written.
+**/
+- (void)relayShutdownWriteForRelay:(GCDAsyncSocketRelay *)relay
 {
-	if (currentRead)
-	{
-		if (timeoutExtension > 0.0)
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		if (self->flags & kSocketSecure)
 		{
-			currentRead->timeout += timeoutExtension;
-			
-			// Reschedule the timer
-			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
-			dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
+			// TLS has no half-close.
+			// The close_notify alert ends the TLS session in both directions.
 			
-			// Unpause reads, and continue
-			flags &= ~kReadsPaused;
-			[self doReadData];
+			[self disconnectAfterWriting];
 		}
 		else
 		{
-			LogVerbose(@"ReadTimeout");
+			int socketFD = (self->socket4FD != SOCKET_NULL) ? self->socket4FD :
+			               (self->socket6FD != SOCKET_NULL) ? self->socket6FD : self->socketUN;
 			
-			[self closeWithError:[self readTimeoutError]];
+			if (socketFD != SOCKET_NULL)
+			{
+				shutdown(socketFD, SHUT_WR);
+			}
 		}
-	}
+		
+		[self relay:relay didFinishWithError:nil];
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Writing
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
+- (void)relay:(GCDAsyncSocketRelay *)relay didFinishWithError:(NSError *)error
 {
-	if ([data length] == 0) return;
+	pthread_mutex_lock(&relay->lock);
+	
+	if (relay->finished)
+	{
+		pthread_mutex_unlock(&relay->lock);
+		return;
+	}
 	
-	GCDAsyncWritePacket *packet = [[GCDAsyncWritePacket alloc] initWithData:data timeout:timeout tag:tag];
+	relay->finished = YES;
 	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	uint64_t bytesRelayed = relay->bytesRelayed;
+	GCDAsyncSocketRelayCompletionBlock completion = relay->completion;
+	GCDAsyncSocket *source = relay->source;
+	
+	pthread_mutex_unlock(&relay->lock);
+	
+	LogVerbose(@"Relay finished: %llu bytes, error: %@", (unsigned long long)bytesRelayed, error);
+	
+	dispatch_async(source->socketQueue, ^{ @autoreleasepool {
 		
-		LogTrace();
+		if (source->outgoingRelay == relay)
+		{
+			source->outgoingRelay = nil;
+		}
 		
-        if ((self->flags & kSocketStarted) && !(self->flags & kForbidReadsWrites))
+		// If the relay failed on the destination's side, its read is still queued on the source.
+		// Left there, it would swallow the next chunk of data, and drop it.
+		
+		pthread_mutex_lock(&relay->lock);
+		GCDAsyncReadPacket *pendingRead = relay->pendingRead;
+		relay->pendingRead = nil;
+		pthread_mutex_unlock(&relay->lock);
+		
+		if (pendingRead)
 		{
-            [self->writeQueue addObject:packet];
-			[self maybeDequeueWrite];
+			[source cancelRelayRead:pendingRead];
+		}
+		
+		if (completion)
+		{
+			[source invokeCompletionBlock:^{
+				
+				completion(source, bytesRelayed, error);
+			}];
 		}
 	}});
-	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
 }
 
-- (float)progressOfWriteReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
+/**
+ * Removes a finished relay's outstanding read from the read queue (or ends it, if it's the current read).
+ * Any data that has arrived remains in the socket (or its preBuffer), for whatever is read next.
+**/
+- (void)cancelRelayRead:(GCDAsyncReadPacket *)packet
 {
-	__block float result = 0.0F;
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	dispatch_block_t block = ^{
+	if (packet == currentRead)
+	{
+		// A relay read completes as soon as any data is available, so it hasn't read anything yet
+		NSAssert(packet->bytesDone == 0, @"Invalid logic");
 		
-        if (!self->currentWrite || ![self->currentWrite isKindOfClass:[GCDAsyncWritePacket class]])
-		{
-			// We're not writing anything right now.
-			
-			if (tagPtr != NULL)   *tagPtr = 0;
-			if (donePtr != NULL)  *donePtr = 0;
-			if (totalPtr != NULL) *totalPtr = 0;
-			
-			result = NAN;
-		}
-		else
-		{
-            NSUInteger done = self->currentWrite->bytesDone;
-            NSUInteger total = [self->currentWrite->buffer length];
-			
-            if (tagPtr != NULL)   *tagPtr = self->currentWrite->tag;
-			if (donePtr != NULL)  *donePtr = done;
-			if (totalPtr != NULL) *totalPtr = total;
-			
-			result = (float)done / (float)total;
-		}
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	return result;
+		[self endCurrentRead];
+		[self recycleReadPacket:packet];
+		[self maybeDequeueRead];
+	}
+	else if ([readQueue indexOfObjectIdenticalTo:packet] != NSNotFound)
+	{
+		[readQueue removeObjectIdenticalTo:packet];
+		[self updateQueueDepthStatistics];
+		[self recycleReadPacket:packet];
+	}
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Broadcasting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
- * Conditionally starts a new write.
- * 
- * It is called when:
- * - a user requests a write
- * - after a write request has finished (to handle the next request)
- * - immediately after the socket opens to handle any pending requests
+ * The queue a GCDAsyncSocketBroadcastGroup dispatches to, in order to invoke enqueueBroadcastData:...
+ * Sockets sharing a socketQueue are handled in a single block.
+**/
+- (dispatch_queue_t)broadcastQueue
+{
+	return socketQueue;
+}
+
+/**
+ * Queues a write on behalf of a GCDAsyncSocketBroadcastGroup. Must be invoked on the socketQueue.
  * 
- * This method also handles auto-disconnect post read/write completion.
+ * Nothing is queued if the socket isn't connected, or is lagging:
+ * it has more than maxLag bytes queued (or more than writeQueueHighWatermark, if maxLag is zero).
+ * The number of bytes queued before this write is returned via lagPtr (zero if the socket isn't connected).
 **/
-- (void)maybeDequeueWrite
+- (BOOL)enqueueBroadcastData:(NSData *)data
+                     timeout:(NSTimeInterval)timeout
+                         tag:(long)tag
+                      maxLag:(NSUInteger)maxLag
+                         lag:(NSUInteger *)lagPtr
 {
-	LogTrace();
 	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
+	if (lagPtr) *lagPtr = 0;
 	
-	// If we're not currently processing a write AND we have an available write stream
-	if ((currentWrite == nil) && (flags & kConnected))
+	if (!(flags & kSocketStarted) || (flags & kForbidReadsWrites)) return NO;
+	
+	NSUInteger lag = (NSUInteger)atomic_load(&queuedWriteByteCount);
+	NSUInteger limit = (maxLag > 0) ? maxLag : (NSUInteger)atomic_load(&writeQueueHighWatermark);
+	
+	if ((limit > 0) && (lag > limit))
 	{
-		if ([writeQueue count] > 0)
-		{
-			// Dequeue the next object in the write queue
-			currentWrite = [writeQueue objectAtIndex:0];
-			[writeQueue removeObjectAtIndex:0];
-			
+		if (lagPtr) *lagPtr = lag;
+		return NO;
+	}
+	
+	[self addQueuedWriteBytes:[data length] cap:0];
+	
+	GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+	packet->queuedLength = [data length];
+	
+	[self addToWriteQueue:packet];
+	
+	if (delegateCalloutDepth > 0)
+	{
+		dispatch_async(socketQueue, ^{ @autoreleasepool {
 			
-			if ([currentWrite isKindOfClass:[GCDAsyncSpecialPacket class]])
-			{
-				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
-				
-				// Attempt to start TLS
-				flags |= kStartingWriteTLS;
-				
-				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
-				[self maybeStartTLS];
-			}
-			else
-			{
-				LogVerbose(@"Dequeued GCDAsyncWritePacket");
-				
-				// Setup write timer (if needed)
-				[self setupWriteTimerWithTimeout:currentWrite->timeout];
-				
-				// Immediately write, if possible
-				[self doWriteData];
-			}
-		}
-		else if (flags & kDisconnectAfterWrites)
-		{
-			if (flags & kDisconnectAfterReads)
-			{
-				if (([readQueue count] == 0) && (currentRead == nil))
-				{
-					[self closeWithError:nil];
-				}
-			}
-			else
-			{
-				[self closeWithError:nil];
-			}
+			[self maybeDequeueWrite];
+		}});
+	}
+	else
+	{
+		[self maybeDequeueWrite];
+	}
+	
+	return YES;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Security
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)startTLS:(NSDictionary *)tlsSettings
+{
+	LogTrace();
+	
+	if (tlsSettings == nil)
+    {
+        // Passing nil/NULL to CFReadStreamSetProperty will appear to work the same as passing an empty dictionary,
+        // but causes problems if we later try to fetch the remote host's certificate.
+        // 
+        // To be exact, it causes the following to return NULL instead of the normal result:
+        // CFReadStreamCopyProperty(readStream, kCFStreamPropertySSLPeerCertificates)
+        // 
+        // So we use an empty dictionary instead, which works perfectly.
+        
+        tlsSettings = [NSDictionary dictionary];
+    }
+	
+	GCDAsyncSpecialPacket *packet = [[GCDAsyncSpecialPacket alloc] initWithTLSSettings:tlsSettings];
+	
+	// Keeps the write fast path (writeDataInline:...) from sending data queued after this call before the handshake
+	atomic_fetch_add(&pendingWriteEnqueueCount, 1);
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		atomic_fetch_sub(&self->pendingWriteEnqueueCount, 1);
+		
+        if ((self->flags & kSocketStarted) && !(self->flags & kQueuedTLS) && !(self->flags & kForbidReadsWrites))
+		{
+            [self->readQueue addObject:packet];
+            [self->writeQueue addObject:packet];
+			
+            self->flags |= kQueuedTLS;
+			
+			[self maybeDequeueRead];
+			[self maybeDequeueWrite];
 		}
-	}
+	}});
+	
 }
 
-- (void)doWriteData
+- (void)maybeStartTLS
 {
-	LogTrace();
-	
-	// This method is called by the writeSource via the socketQueue
+	// We can't start TLS until:
+	// - All queued reads prior to the user calling startTLS are complete
+	// - All queued writes prior to the user calling startTLS are complete
+	// 
+	// We'll know these conditions are met when both kStartingReadTLS and kStartingWriteTLS are set
 	
-	if ((currentWrite == nil) || (flags & kWritesPaused))
+	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
 	{
-		LogVerbose(@"No currentWrite or kWritesPaused");
+		TRACE_EVENT(GCDAsyncSocketTraceTLSStart, 0);
 		
-		// Unable to write at this time
+		BOOL useSecureTransport = YES;
 		
-		if ([self usingCFStreamForTLS])
+		#if TARGET_OS_IPHONE
 		{
-			// CFWriteStream only fires once when there is available data.
-			// It won't fire again until we've invoked CFWriteStreamWrite.
+			GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
+            NSDictionary *tlsSettings = @{};
+            if (tlsPacket) {
+                tlsSettings = tlsPacket->tlsSettings;
+            }
+			NSNumber *value = [tlsSettings objectForKey:GCDAsyncSocketUseCFStreamForTLS];
+			if (value && [value boolValue])
+				useSecureTransport = NO;
+		}
+		#endif
+		
+		if (useSecureTransport)
+		{
+			[self ssl_startTLS];
 		}
 		else
 		{
-			// If the writeSource is firing, we need to pause it
-			// or else it will continue to fire over and over again.
-			
-			if (flags & kSocketCanAcceptBytes)
-			{
-				[self suspendWriteSource];
-			}
+		#if TARGET_OS_IPHONE
+			[self cf_startTLS];
+		#endif
 		}
-		return;
 	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Security via SecureTransport
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (OSStatus)sslReadWithBuffer:(void *)buffer length:(size_t *)bufferLength
+{
+	LogVerbose(@"sslReadWithBuffer:%p length:%lu", buffer, (unsigned long)*bufferLength);
 	
-	if (!(flags & kSocketCanAcceptBytes))
+	if ((socketFDBytesAvailable == 0) && ([sslPreBuffer availableBytes] == 0))
 	{
-		LogVerbose(@"No space available to write...");
+		LogVerbose(@"%@ - No data available to read...", THIS_METHOD);
 		
-		// No space available to write.
+		// No data available to read.
+		// 
+		// Need to wait for readSource to fire and notify us of
+		// available data in the socket's internal read buffer.
 		
-		if (![self usingCFStreamForTLS])
-		{
-			// Need to wait for writeSource to fire and notify us of
-			// available space in the socket's internal write buffer.
-			
-			[self resumeWriteSource];
-		}
-		return;
+		[self resumeReadSource];
+		
+		*bufferLength = 0;
+		return errSSLWouldBlock;
 	}
 	
-	if (flags & kStartingWriteTLS)
+	size_t totalBytesRead = 0;
+	size_t totalBytesLeftToBeRead = *bufferLength;
+	
+	BOOL done = NO;
+	BOOL socketError = NO;
+	
+	// 
+	// STEP 1 : READ FROM SSL PRE BUFFER
+	// 
+	
+	size_t sslPreBufferLength = [sslPreBuffer availableBytes];
+	
+	if (sslPreBufferLength > 0)
 	{
-		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
-		
-		// The writeQueue is waiting for SSL/TLS handshake to complete.
+		LogVerbose(@"%@: Reading from SSL pre buffer...", THIS_METHOD);
 		
-		if (flags & kStartingReadTLS)
-		{
-			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
-			{
-				// We are in the process of a SSL Handshake.
-				// We were waiting for available space in the socket's internal OS buffer to continue writing.
-			
-				[self ssl_continueSSLHandshake];
-			}
-		}
+		size_t bytesToCopy;
+		if (sslPreBufferLength > totalBytesLeftToBeRead)
+			bytesToCopy = totalBytesLeftToBeRead;
 		else
-		{
-			// We are still waiting for the readQueue to drain and start the SSL/TLS process.
-			// We now know we can write to the socket.
-			
-			if (![self usingCFStreamForTLS])
-			{
-				// Suspend the write source or else it will continue to fire nonstop.
-				
-				[self suspendWriteSource];
-			}
-		}
+			bytesToCopy = sslPreBufferLength;
 		
-		return;
+		LogVerbose(@"%@: Copying %zu bytes from sslPreBuffer", THIS_METHOD, bytesToCopy);
+		
+		memcpy(buffer, [sslPreBuffer readBuffer], bytesToCopy);
+		[sslPreBuffer didRead:bytesToCopy];
+		
+		LogVerbose(@"%@: sslPreBuffer.length = %zu", THIS_METHOD, [sslPreBuffer availableBytes]);
+		
+		totalBytesRead += bytesToCopy;
+		totalBytesLeftToBeRead -= bytesToCopy;
+		
+		done = (totalBytesLeftToBeRead == 0);
+		
+		if (done) LogVerbose(@"%@: Complete", THIS_METHOD);
 	}
 	
-	// Note: This method is not called if currentWrite is a GCDAsyncSpecialPacket (startTLS packet)
-	
-	BOOL waiting = NO;
-	NSError *error = nil;
-	size_t bytesWritten = 0;
+	// 
+	// STEP 2 : READ FROM SOCKET
+	// 
 	
-	if (flags & kSocketSecure)
+	if (!done && (socketFDBytesAvailable > 0))
 	{
-		if ([self usingCFStreamForTLS])
+		LogVerbose(@"%@: Reading from socket...", THIS_METHOD);
+		
+		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+		
+		BOOL readIntoPreBuffer;
+		size_t bytesToRead;
+		uint8_t *buf;
+		
+		// We can only buffer a limited amount of encrypted data.
+		// Anything beyond that is left in the kernel's buffer until SecureTransport asks for it.
+		
+		size_t allowance = GCDAsyncSocketPreBufferAllowance([sslPreBuffer availableBytes], maxEncryptedPreBufferSize,
+		                                                    &globalEncryptedPreBufferSize,
+		                                                    &globalMaxEncryptedPreBufferSize);
+		
+		size_t bytesToBuffer = (size_t)MIN(socketFDBytesAvailable, allowance);
+		
+		if (bytesToBuffer < socketFDBytesAvailable)
 		{
-			#if TARGET_OS_IPHONE
-			
-			// 
-			// Writing data using CFStream (over internal TLS)
-			// 
-			
-			const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
+			encryptedPreBufferCapHitCount++;
+			atomic_fetch_add_explicit(&globalEncryptedPreBufferCapHitCount, 1, memory_order_relaxed);
+		}
+		
+		if (bytesToBuffer > totalBytesLeftToBeRead)
+		{
+			// Read all available data from socket into sslPreBuffer.
+			// Then copy requested amount into dataBuffer.
 			
-			NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
+			LogVerbose(@"%@: Reading into sslPreBuffer...", THIS_METHOD);
 			
-			if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
-			{
-				bytesToWrite = SIZE_MAX;
-			}
-		
-			CFIndex result = CFWriteStreamWrite(writeStream, buffer, (CFIndex)bytesToWrite);
-			LogVerbose(@"CFWriteStreamWrite(%lu) = %li", (unsigned long)bytesToWrite, result);
-		
-			if (result < 0)
-			{
-				error = (__bridge_transfer NSError *)CFWriteStreamCopyError(writeStream);
-			}
-			else
-			{
-				bytesWritten = (size_t)result;
-				
-				// We always set waiting to true in this scenario.
-				// CFStream may have altered our underlying socket to non-blocking.
-				// Thus if we attempt to write without a callback, we may end up blocking our queue.
-				waiting = YES;
-			}
+			[sslPreBuffer ensureCapacityForWrite:bytesToBuffer];
 			
-			#endif
+			readIntoPreBuffer = YES;
+			bytesToRead = bytesToBuffer;
+			buf = [sslPreBuffer writeBuffer];
 		}
 		else
 		{
-			// We're going to use the SSLWrite function.
-			// 
-			// OSStatus SSLWrite(SSLContextRef context, const void *data, size_t dataLength, size_t *processed)
-			// 
-			// Parameters:
-			// context     - An SSL session context reference.
-			// data        - A pointer to the buffer of data to write.
-			// dataLength  - The amount, in bytes, of data to write.
-			// processed   - On return, the length, in bytes, of the data actually written.
-			// 
-			// It sounds pretty straight-forward,
-			// but there are a few caveats you should be aware of.
-			// 
-			// The SSLWrite method operates in a non-obvious (and rather annoying) manner.
-			// According to the documentation:
-			// 
-			//   Because you may configure the underlying connection to operate in a non-blocking manner,
-			//   a write operation might return errSSLWouldBlock, indicating that less data than requested
-			//   was actually transferred. In this case, you should repeat the call to SSLWrite until some
-			//   other result is returned.
-			// 
-			// This sounds perfect, but when our SSLWriteFunction returns errSSLWouldBlock,
-			// then the SSLWrite method returns (with the proper errSSLWouldBlock return value),
-			// but it sets processed to dataLength !!
-			// 
-			// In other words, if the SSLWrite function doesn't completely write all the data we tell it to,
-			// then it doesn't tell us how many bytes were actually written. So, for example, if we tell it to
-			// write 256 bytes then it might actually write 128 bytes, but then report 0 bytes written.
-			// 
-			// You might be wondering:
-			// If the SSLWrite function doesn't tell us how many bytes were written,
-			// then how in the world are we supposed to update our parameters (buffer & bytesToWrite)
-			// for the next time we invoke SSLWrite?
-			// 
-			// The answer is that SSLWrite cached all the data we told it to write,
-			// and it will push out that data next time we call SSLWrite.
-			// If we call SSLWrite with new data, it will push out the cached data first, and then the new data.
-			// If we call SSLWrite with empty data, then it will simply push out the cached data.
-			// 
-			// For this purpose we're going to break large writes into a series of smaller writes.
-			// This allows us to report progress back to the delegate.
+			// Read available data from socket directly into dataBuffer.
 			
-			OSStatus result;
+			LogVerbose(@"%@: Reading directly into dataBuffer...", THIS_METHOD);
 			
-			BOOL hasCachedDataToWrite = (sslWriteCachedLength > 0);
-			BOOL hasNewDataToWrite = YES;
+			readIntoPreBuffer = NO;
+			bytesToRead = totalBytesLeftToBeRead;
+			buf = (uint8_t *)buffer + totalBytesRead;
+		}
+		
+		TRACE_SYSCALL_BEGIN();
+		ssize_t result = read(socketFD, buf, bytesToRead);
+		TRACE_SYSCALL(GCDAsyncSocketTraceReadSyscall, result, result < 0);
+		LogVerbose(@"%@: read from socket = %zd", THIS_METHOD, result);
+		
+		STATISTICS_ADD(readSyscalls, 1);
+		if (result > 0) STATISTICS_ADD(bytesRead, result);
+		
+		if (result < 0)
+		{
+			LogVerbose(@"%@: read errno = %i", THIS_METHOD, errno);
 			
-			if (hasCachedDataToWrite)
+			if (errno != EWOULDBLOCK)
 			{
-				size_t processed = 0;
-				
-				result = SSLWrite(sslContext, NULL, 0, &processed);
-				
-				if (result == noErr)
-				{
-					bytesWritten = sslWriteCachedLength;
-					sslWriteCachedLength = 0;
-					
-					if ([currentWrite->buffer length] == (currentWrite->bytesDone + bytesWritten))
-					{
-						// We've written all data for the current write.
-						hasNewDataToWrite = NO;
-					}
-				}
-				else
-				{
-					if (result == errSSLWouldBlock)
-					{
-						waiting = YES;
-					}
-					else
-					{
-						error = [self sslError:result];
-					}
-					
-					// Can't write any new data since we were unable to write the cached data.
-					hasNewDataToWrite = NO;
-				}
+				socketError = YES;
 			}
 			
-			if (hasNewDataToWrite)
+			socketFDBytesAvailable = 0;
+		}
+		else if (result == 0)
+		{
+			LogVerbose(@"%@: read EOF", THIS_METHOD);
+			
+			socketError = YES;
+			socketFDBytesAvailable = 0;
+		}
+		else
+		{
+			size_t bytesReadFromSocket = result;
+			
+			if (socketFDBytesAvailable > bytesReadFromSocket)
+				socketFDBytesAvailable -= bytesReadFromSocket;
+			else
+				socketFDBytesAvailable = 0;
+			
+			if (readIntoPreBuffer)
 			{
-				const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes]
-				                                        + currentWrite->bytesDone
-				                                        + bytesWritten;
+				[sslPreBuffer didWrite:bytesReadFromSocket];
 				
-				NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone - bytesWritten;
+				size_t bytesToCopy = MIN(totalBytesLeftToBeRead, bytesReadFromSocket);
 				
-				if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
-				{
-					bytesToWrite = SIZE_MAX;
-				}
+				LogVerbose(@"%@: Copying %zu bytes out of sslPreBuffer", THIS_METHOD, bytesToCopy);
 				
-				size_t bytesRemaining = bytesToWrite;
+				memcpy((uint8_t *)buffer + totalBytesRead, [sslPreBuffer readBuffer], bytesToCopy);
+				[sslPreBuffer didRead:bytesToCopy];
 				
-				BOOL keepLooping = YES;
-				while (keepLooping)
-				{
-					const size_t sslMaxBytesToWrite = 32768;
-					size_t sslBytesToWrite = MIN(bytesRemaining, sslMaxBytesToWrite);
-					size_t sslBytesWritten = 0;
-					
-					result = SSLWrite(sslContext, buffer, sslBytesToWrite, &sslBytesWritten);
-					
-					if (result == noErr)
-					{
-						buffer += sslBytesWritten;
-						bytesWritten += sslBytesWritten;
-						bytesRemaining -= sslBytesWritten;
-						
-						keepLooping = (bytesRemaining > 0);
-					}
-					else
-					{
-						if (result == errSSLWouldBlock)
-						{
-							waiting = YES;
-							sslWriteCachedLength = sslBytesToWrite;
-						}
-						else
-						{
-							error = [self sslError:result];
-						}
-						
-						keepLooping = NO;
-					}
-					
-				} // while (keepLooping)
+				totalBytesRead += bytesToCopy;
+				totalBytesLeftToBeRead -= bytesToCopy;
 				
-			} // if (hasNewDataToWrite)
+				LogVerbose(@"%@: sslPreBuffer.length = %zu", THIS_METHOD, [sslPreBuffer availableBytes]);
+			}
+			else
+			{
+				totalBytesRead += bytesReadFromSocket;
+				totalBytesLeftToBeRead -= bytesReadFromSocket;
+			}
+			
+			done = (totalBytesLeftToBeRead == 0);
+			
+			if (done) LogVerbose(@"%@: Complete", THIS_METHOD);
+		}
+	}
+	
+	*bufferLength = totalBytesRead;
+	
+	if (done)
+		return noErr;
+	
+	if (socketError)
+		return errSSLClosedAbort;
+	
+	return errSSLWouldBlock;
+}
+
+- (OSStatus)sslWriteWithBuffer:(const void *)buffer length:(size_t *)bufferLength
+{
+	if (!(flags & kSocketCanAcceptBytes))
+	{
+		// Unable to write.
+		// 
+		// Need to wait for writeSource to fire and notify us of
+		// available space in the socket's internal write buffer.
+		
+		[self resumeWriteSource];
+		
+		*bufferLength = 0;
+		return errSSLWouldBlock;
+	}
+	
+	size_t bytesToWrite = *bufferLength;
+	size_t bytesWritten = 0;
+	
+	BOOL done = NO;
+	BOOL socketError = NO;
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	TRACE_SYSCALL_BEGIN();
+	ssize_t result = write(socketFD, buffer, bytesToWrite);
+	TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, result, result < 0);
+	
+	STATISTICS_ADD(writeSyscalls, 1);
+	if (result > 0) STATISTICS_ADD(bytesWritten, result);
+	
+	if (result < 0)
+	{
+		if (errno != EWOULDBLOCK)
+		{
+			socketError = YES;
 		}
+		
+		flags &= ~kSocketCanAcceptBytes;
+	}
+	else if (result == 0)
+	{
+		flags &= ~kSocketCanAcceptBytes;
 	}
 	else
 	{
-		// 
-		// Writing data directly over raw socket
-		// 
-		
-		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
-		
-		const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
-		
-		NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
-		
-		if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
-		{
-			bytesToWrite = SIZE_MAX;
-		}
-		
-		ssize_t result = write(socketFD, buffer, (size_t)bytesToWrite);
-		LogVerbose(@"wrote to socket = %zd", result);
+		bytesWritten = result;
+		
+		done = (bytesWritten == bytesToWrite);
+	}
+	
+	*bufferLength = bytesWritten;
+	
+	if (done)
+		return noErr;
+	
+	if (socketError)
+		return errSSLClosedAbort;
+	
+	return errSSLWouldBlock;
+}
+
+/**
+ * Returns the maximum number of bytes to pass to a single SSLWrite call.
+ * SecureTransport breaks the data passed to SSLWrite into records of at most 16 KB,
+ * so this effectively controls the size of the records we write.
+ * 
+ * If dynamic record sizing is enabled, we use small records right after the handshake and after idle periods,
+ * and then switch to full sized records once a sufficient amount of data has been written.
+**/
+- (size_t)ssl_maxBytesToWrite
+{
+	if (sslSmallRecordSize == 0)
+	{
+		return 32768;
+	}
+	
+	uint64_t now = GCDAsyncSocketMonotonicTime();
+	
+	if ((now - sslLastWriteTime) > sslRecordSizeIdleTimeout)
+	{
+		sslBytesWrittenSinceIdle = 0;
+	}
+	
+	if (sslBytesWrittenSinceIdle < sslRecordSizeBoostThreshold)
+	{
+		return sslSmallRecordSize;
+	}
+	
+	return (1024 * 16);
+}
+
+- (void)ssl_didWriteBytes:(size_t)byteCount
+{
+	if (sslSmallRecordSize > 0)
+	{
+		sslBytesWrittenSinceIdle += byteCount;
+		sslLastWriteTime = GCDAsyncSocketMonotonicTime();
+	}
+}
+
+static OSStatus SSLReadFunction(SSLConnectionRef connection, void *data, size_t *dataLength)
+{
+	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)connection;
+	
+	NSCAssert(dispatch_get_specific(asyncSocket->IsOnSocketQueueOrTargetQueueKey), @"What the deuce?");
+	
+	return [asyncSocket sslReadWithBuffer:data length:dataLength];
+}
+
+static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data, size_t *dataLength)
+{
+	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)connection;
+	
+	NSCAssert(dispatch_get_specific(asyncSocket->IsOnSocketQueueOrTargetQueueKey), @"What the deuce?");
+	
+	return [asyncSocket sslWriteWithBuffer:data length:dataLength];
+}
+
+static OSStatus SSLHandshakeIOReadFunction(SSLConnectionRef connection, void *data, size_t *dataLength)
+{
+	GCDAsyncSocketSSLHandshakeIO *io = (__bridge GCDAsyncSocketSSLHandshakeIO *)connection;
+	
+	if (!io->offSocketQueue)
+	{
+		return SSLReadFunction((__bridge SSLConnectionRef)io->socket, data, dataLength);
+	}
+	
+	// Executing on the handshake pool.
+	// We can only hand out the encrypted data the socket gave us before submitting the handshake step.
+	
+	size_t bytesRequested = *dataLength;
+	size_t bytesToCopy = MIN(bytesRequested, [io->inBuffer availableBytes]);
+	
+	if (bytesToCopy > 0)
+	{
+		memcpy(data, [io->inBuffer readBuffer], bytesToCopy);
+		[io->inBuffer didRead:bytesToCopy];
+	}
+	
+	*dataLength = bytesToCopy;
+	
+	if (bytesToCopy == bytesRequested)
+		return noErr;
+	
+	if (io->inputClosed)
+		return errSSLClosedAbort;
+	
+	return errSSLWouldBlock;
+}
+
+static OSStatus SSLHandshakeIOWriteFunction(SSLConnectionRef connection, const void *data, size_t *dataLength)
+{
+	GCDAsyncSocketSSLHandshakeIO *io = (__bridge GCDAsyncSocketSSLHandshakeIO *)connection;
+	
+	if (!io->offSocketQueue)
+	{
+		return SSLWriteFunction((__bridge SSLConnectionRef)io->socket, data, dataLength);
+	}
+	
+	// Executing on the handshake pool.
+	// Everything is buffered, and written to the socket once the handshake step completes.
+	
+	size_t bytesToWrite = *dataLength;
+	
+	[io->outBuffer ensureCapacityForWrite:bytesToWrite];
+	memcpy([io->outBuffer writeBuffer], data, bytesToWrite);
+	[io->outBuffer didWrite:bytesToWrite];
+	
+	return noErr;
+}
+
+- (void)ssl_startTLS
+{
+	LogTrace();
+	
+	LogVerbose(@"Starting TLS (via SecureTransport)...");
+	
+	OSStatus status;
+	
+	GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
+	if (tlsPacket == nil) // Code to quiet the analyzer
+	{
+		NSAssert(NO, @"Logic error");
 		
-		// Check results
-		if (result < 0)
-		{
-			if (errno == EWOULDBLOCK)
-			{
-				waiting = YES;
-			}
-			else
-			{
-				error = [self errorWithErrno:errno reason:@"Error in write() function"];
-			}
-		}
-		else
-		{
-			bytesWritten = result;
-		}
+		[self closeWithError:[self otherError:@"Logic error"]];
+		return;
 	}
+	NSDictionary *tlsSettings = tlsPacket->tlsSettings;
 	
-	// We're done with our writing.
-	// If we explictly ran into a situation where the socket told us there was no room in the buffer,
-	// then we immediately resume listening for notifications.
-	// 
-	// We must do this before we dequeue another write,
-	// as that may in turn invoke this method again.
-	// 
-	// Note that if CFStream is involved, it may have maliciously put our socket in blocking mode.
+	// Create SSLContext, and setup IO callbacks and connection ref
 	
-	if (waiting)
+	NSNumber *isServerNumber = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLIsServer];
+	BOOL isServer = [isServerNumber boolValue];
+	
+	#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
 	{
-		flags &= ~kSocketCanAcceptBytes;
+		if (isServer)
+			sslContext = SSLCreateContext(kCFAllocatorDefault, kSSLServerSide, kSSLStreamType);
+		else
+			sslContext = SSLCreateContext(kCFAllocatorDefault, kSSLClientSide, kSSLStreamType);
 		
-		if (![self usingCFStreamForTLS])
+		if (sslContext == NULL)
 		{
-			[self resumeWriteSource];
+			[self closeWithError:[self otherError:@"Error in SSLCreateContext"]];
+			return;
 		}
 	}
+	#else // (__MAC_OS_X_VERSION_MIN_REQUIRED < 1080)
+	{
+		status = SSLNewContext(isServer, &sslContext);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLNewContext"]];
+			return;
+		}
+	}
+	#endif
 	
-	// Check our results
-	
-	BOOL done = NO;
+	// Sockets using the handshake pool go through a GCDAsyncSocketSSLHandshakeIO,
+	// which redirects IO while a handshake step is executing on the pool.
 	
-	if (bytesWritten > 0)
+	NSObject *useHandshakePool = [tlsSettings objectForKey:GCDAsyncSocketSSLUseHandshakePool];
+	if (useHandshakePool && ![useHandshakePool isKindOfClass:[NSNumber class]])
 	{
-		// Update total amount read for the current write
-		currentWrite->bytesDone += bytesWritten;
-		LogVerbose(@"currentWrite->bytesDone = %lu", (unsigned long)currentWrite->bytesDone);
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLUseHandshakePool. Value must be of type NSNumber.");
 		
-		// Is packet done?
-		done = (currentWrite->bytesDone == [currentWrite->buffer length]);
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLUseHandshakePool."]];
+		return;
 	}
 	
-	if (done)
+	if ([(NSNumber *)useHandshakePool boolValue])
 	{
-		[self completeCurrentWrite];
+		sslHandshakeIO = [[GCDAsyncSocketSSLHandshakeIO alloc] initWithSocket:self sslContext:sslContext];
 		
-		if (!error)
+		status = SSLSetIOFuncs(sslContext, &SSLHandshakeIOReadFunction, &SSLHandshakeIOWriteFunction);
+		if (status != noErr)
 		{
-			dispatch_async(socketQueue, ^{ @autoreleasepool{
-				
-				[self maybeDequeueWrite];
-			}});
+			[self closeWithError:[self otherError:@"Error in SSLSetIOFuncs"]];
+			return;
+		}
+		
+		status = SSLSetConnection(sslContext, (__bridge SSLConnectionRef)sslHandshakeIO);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetConnection"]];
+			return;
 		}
 	}
 	else
 	{
-		// We were unable to finish writing the data,
-		// so we're waiting for another callback to notify us of available space in the lower-level output buffer.
-		
-		if (!waiting && !error)
+		status = SSLSetIOFuncs(sslContext, &SSLReadFunction, &SSLWriteFunction);
+		if (status != noErr)
 		{
-			// This would be the case if our write was able to accept some data, but not all of it.
-			
-			flags &= ~kSocketCanAcceptBytes;
-			
-			if (![self usingCFStreamForTLS])
-			{
-				[self resumeWriteSource];
-			}
+			[self closeWithError:[self otherError:@"Error in SSLSetIOFuncs"]];
+			return;
 		}
 		
-		if (bytesWritten > 0)
+		status = SSLSetConnection(sslContext, (__bridge SSLConnectionRef)self);
+		if (status != noErr)
 		{
-			// We're not done with the entire write, but we have written some bytes
-			
-			__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-			if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWritePartialDataOfLength:tag:)])
-			{
-				long theWriteTag = currentWrite->tag;
-				
-				dispatch_async(delegateQueue, ^{ @autoreleasepool {
-					
-					[theDelegate socket:self didWritePartialDataOfLength:bytesWritten tag:theWriteTag];
-				}});
-			}
+			[self closeWithError:[self otherError:@"Error in SSLSetConnection"]];
+			return;
 		}
 	}
-	
-	// Check for errors
-	
-	if (error)
-	{
-		[self closeWithError:[self errorWithErrno:errno reason:@"Error in write() function"]];
-	}
-	
-	// Do not add any code here without first adding a return statement in the error case above.
-}
 
-- (void)completeCurrentWrite
-{
-	LogTrace();
-	
-	NSAssert(currentWrite, @"Trying to complete current write when there is no current write.");
-	
 
-	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-	
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWriteDataWithTag:)])
+	NSNumber *shouldManuallyEvaluateTrust = [tlsSettings objectForKey:GCDAsyncSocketManuallyEvaluateTrust];
+	if ([shouldManuallyEvaluateTrust boolValue])
 	{
-		long theWriteTag = currentWrite->tag;
+		if (isServer)
+		{
+			[self closeWithError:[self otherError:@"Manual trust validation is not supported for server sockets"]];
+			return;
+		}
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			[theDelegate socket:self didWriteDataWithTag:theWriteTag];
-		}});
+		status = SSLSetSessionOption(sslContext, kSSLSessionOptionBreakOnServerAuth, true);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetSessionOption"]];
+			return;
+		}
+		
+		#if !TARGET_OS_IPHONE && (__MAC_OS_X_VERSION_MIN_REQUIRED < 1080)
+		
+		// Note from Apple's documentation:
+		//
+		// It is only necessary to call SSLSetEnableCertVerify on the Mac prior to OS X 10.8.
+		// On OS X 10.8 and later setting kSSLSessionOptionBreakOnServerAuth always disables the
+		// built-in trust evaluation. All versions of iOS behave like OS X 10.8 and thus
+		// SSLSetEnableCertVerify is not available on that platform at all.
+		
+		status = SSLSetEnableCertVerify(sslContext, NO);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetEnableCertVerify"]];
+			return;
+		}
+		
+		#endif
 	}
-	
-	[self endCurrentWrite];
-}
 
-- (void)endCurrentWrite
-{
-	if (writeTimer)
-	{
-		dispatch_source_cancel(writeTimer);
-		writeTimer = NULL;
-	}
+	// Configure SSLContext from given settings
+	// 
+	// Checklist:
+	//  1. kCFStreamSSLPeerName
+	//  2. kCFStreamSSLCertificates
+	//  3. GCDAsyncSocketSSLPeerID
+	//  4. GCDAsyncSocketSSLProtocolVersionMin
+	//  5. GCDAsyncSocketSSLProtocolVersionMax
+	//  6. GCDAsyncSocketSSLSessionOptionFalseStart
+	//  7. GCDAsyncSocketSSLSessionOptionSendOneByteRecord
+	//  8. GCDAsyncSocketSSLCipherSuites
+	//  9. GCDAsyncSocketSSLDiffieHellmanParameters (Mac)
+    // 10. GCDAsyncSocketSSLALPN
+	// 11. GCDAsyncSocketSSLDynamicRecordSizing
+	//     GCDAsyncSocketSSLSmallRecordSize
+	//     GCDAsyncSocketSSLRecordSizeBoostThreshold
+	//     GCDAsyncSocketSSLRecordSizeIdleTimeout
+	//
+	// Deprecated (throw error):
+	// 12. kCFStreamSSLAllowsAnyRoot
+	// 13. kCFStreamSSLAllowsExpiredRoots
+	// 14. kCFStreamSSLAllowsExpiredCertificates
+	// 15. kCFStreamSSLValidatesCertificateChain
+	// 16. kCFStreamSSLLevel
 	
-	currentWrite = nil;
-}
-
-- (void)setupWriteTimerWithTimeout:(NSTimeInterval)timeout
-{
-	if (timeout >= 0.0)
+	NSObject *value;
+	
+	// 1. kCFStreamSSLPeerName
+	
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLPeerName];
+	if ([value isKindOfClass:[NSString class]])
 	{
-		writeTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
-		
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-		dispatch_source_set_event_handler(writeTimer, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			[strongSelf doWriteTimeout];
-			
-		#pragma clang diagnostic pop
-		}});
+		NSString *peerName = (NSString *)value;
 		
-		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theWriteTimer = writeTimer;
-		dispatch_source_set_cancel_handler(writeTimer, ^{
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			LogVerbose(@"dispatch_release(writeTimer)");
-			dispatch_release(theWriteTimer);
-			
-		#pragma clang diagnostic pop
-		});
-		#endif
+		const char *peer = [peerName UTF8String];
+		size_t peerLen = strlen(peer);
 		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		status = SSLSetPeerDomainName(sslContext, peer, peerLen);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetPeerDomainName"]];
+			return;
+		}
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for kCFStreamSSLPeerName. Value must be of type NSString.");
 		
-		dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
-		dispatch_resume(writeTimer);
+		[self closeWithError:[self otherError:@"Invalid value for kCFStreamSSLPeerName."]];
+		return;
 	}
-}
-
-- (void)doWriteTimeout
-{
-	// This is a little bit tricky.
-	// Ideally we'd like to synchronously query the delegate about a timeout extension.
-	// But if we do so synchronously we risk a possible deadlock.
-	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
 	
-	flags |= kWritesPaused;
+	// 2. kCFStreamSSLCertificates
 	
-	__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:shouldTimeoutWriteWithTag:elapsed:bytesDone:)])
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLCertificates];
+	if ([value isKindOfClass:[NSArray class]])
 	{
-		GCDAsyncWritePacket *theWrite = currentWrite;
+		NSArray *certs = (NSArray *)value;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			NSTimeInterval timeoutExtension = 0.0;
-			
-			timeoutExtension = [theDelegate socket:self shouldTimeoutWriteWithTag:theWrite->tag
-			                                                              elapsed:theWrite->timeout
-			                                                            bytesDone:theWrite->bytesDone];
-			
-            dispatch_async(self->socketQueue, ^{ @autoreleasepool {
-				
-				[self doWriteTimeoutWithExtension:timeoutExtension];
-			}});
-		}});
+		status = SSLSetCertificate(sslContext, (__bridge CFArrayRef)certs);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetCertificate"]];
+			return;
+		}
 	}
-	else
+	else if (value)
 	{
-		[self doWriteTimeoutWithExtension:0.0];
+		NSAssert(NO, @"Invalid value for kCFStreamSSLCertificates. Value must be of type NSArray.");
+		
+		[self closeWithError:[self otherError:@"Invalid value for kCFStreamSSLCertificates."]];
+		return;
 	}
-}
-
-- (void)doWriteTimeoutWithExtension:(NSTimeInterval)timeoutExtension
-{
-	if (currentWrite)
+	
+	// 3. GCDAsyncSocketSSLPeerID
+	
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLPeerID];
+	if ([value isKindOfClass:[NSData class]])
 	{
-		if (timeoutExtension > 0.0)
-		{
-			currentWrite->timeout += timeoutExtension;
-			
-			// Reschedule the timer
-			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
-			dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
-			
-			// Unpause writes, and continue
-			flags &= ~kWritesPaused;
-			[self doWriteData];
-		}
-		else
+		NSData *peerIdData = (NSData *)value;
+		
+		status = SSLSetPeerID(sslContext, [peerIdData bytes], [peerIdData length]);
+		if (status != noErr)
 		{
-			LogVerbose(@"WriteTimeout");
-			
-			[self closeWithError:[self writeTimeoutError]];
+			[self closeWithError:[self otherError:@"Error in SSLSetPeerID"]];
+			return;
 		}
 	}
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Security
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (void)startTLS:(NSDictionary *)tlsSettings
-{
-	LogTrace();
-	
-	if (tlsSettings == nil)
-    {
-        // Passing nil/NULL to CFReadStreamSetProperty will appear to work the same as passing an empty dictionary,
-        // but causes problems if we later try to fetch the remote host's certificate.
-        // 
-        // To be exact, it causes the following to return NULL instead of the normal result:
-        // CFReadStreamCopyProperty(readStream, kCFStreamPropertySSLPeerCertificates)
-        // 
-        // So we use an empty dictionary instead, which works perfectly.
-        
-        tlsSettings = [NSDictionary dictionary];
-    }
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLPeerID. Value must be of type NSData."
+		             @" (You can convert strings to data using a method like"
+		             @" [string dataUsingEncoding:NSUTF8StringEncoding])");
+		
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLPeerID."]];
+		return;
+	}
 	
-	GCDAsyncSpecialPacket *packet = [[GCDAsyncSpecialPacket alloc] initWithTLSSettings:tlsSettings];
+	// 4. GCDAsyncSocketSSLProtocolVersionMin
 	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-        if ((self->flags & kSocketStarted) && !(self->flags & kQueuedTLS) && !(self->flags & kForbidReadsWrites))
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLProtocolVersionMin];
+	if ([value isKindOfClass:[NSNumber class]])
+	{
+		SSLProtocol minProtocol = (SSLProtocol)[(NSNumber *)value intValue];
+		if (minProtocol != kSSLProtocolUnknown)
 		{
-            [self->readQueue addObject:packet];
-            [self->writeQueue addObject:packet];
-			
-            self->flags |= kQueuedTLS;
-			
-			[self maybeDequeueRead];
-			[self maybeDequeueWrite];
+			status = SSLSetProtocolVersionMin(sslContext, minProtocol);
+			if (status != noErr)
+			{
+				[self closeWithError:[self otherError:@"Error in SSLSetProtocolVersionMin"]];
+				return;
+			}
 		}
-	}});
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLProtocolVersionMin. Value must be of type NSNumber.");
+		
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLProtocolVersionMin."]];
+		return;
+	}
 	
-}
-
-- (void)maybeStartTLS
-{
-	// We can't start TLS until:
-	// - All queued reads prior to the user calling startTLS are complete
-	// - All queued writes prior to the user calling startTLS are complete
-	// 
-	// We'll know these conditions are met when both kStartingReadTLS and kStartingWriteTLS are set
+	// 5. GCDAsyncSocketSSLProtocolVersionMax
 	
-	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLProtocolVersionMax];
+	if ([value isKindOfClass:[NSNumber class]])
 	{
-		BOOL useSecureTransport = YES;
-		
-		#if TARGET_OS_IPHONE
+		SSLProtocol maxProtocol = (SSLProtocol)[(NSNumber *)value intValue];
+		if (maxProtocol != kSSLProtocolUnknown)
 		{
-			GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
-            NSDictionary *tlsSettings = @{};
-            if (tlsPacket) {
-                tlsSettings = tlsPacket->tlsSettings;
-            }
-			NSNumber *value = [tlsSettings objectForKey:GCDAsyncSocketUseCFStreamForTLS];
-			if (value && [value boolValue])
-				useSecureTransport = NO;
+			status = SSLSetProtocolVersionMax(sslContext, maxProtocol);
+			if (status != noErr)
+			{
+				[self closeWithError:[self otherError:@"Error in SSLSetProtocolVersionMax"]];
+				return;
+			}
 		}
-		#endif
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLProtocolVersionMax. Value must be of type NSNumber.");
 		
-		if (useSecureTransport)
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLProtocolVersionMax."]];
+		return;
+	}
+	
+	// 6. GCDAsyncSocketSSLSessionOptionFalseStart
+	
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLSessionOptionFalseStart];
+	if ([value isKindOfClass:[NSNumber class]])
+	{
+		NSNumber *falseStart = (NSNumber *)value;
+		status = SSLSetSessionOption(sslContext, kSSLSessionOptionFalseStart, [falseStart boolValue]);
+		if (status != noErr)
 		{
-			[self ssl_startTLS];
+			[self closeWithError:[self otherError:@"Error in SSLSetSessionOption (kSSLSessionOptionFalseStart)"]];
+			return;
 		}
-		else
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLSessionOptionFalseStart. Value must be of type NSNumber.");
+		
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLSessionOptionFalseStart."]];
+		return;
+	}
+	
+	// 7. GCDAsyncSocketSSLSessionOptionSendOneByteRecord
+	
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLSessionOptionSendOneByteRecord];
+	if ([value isKindOfClass:[NSNumber class]])
+	{
+		NSNumber *oneByteRecord = (NSNumber *)value;
+		status = SSLSetSessionOption(sslContext, kSSLSessionOptionSendOneByteRecord, [oneByteRecord boolValue]);
+		if (status != noErr)
 		{
-		#if TARGET_OS_IPHONE
-			[self cf_startTLS];
-		#endif
+			[self closeWithError:
+			  [self otherError:@"Error in SSLSetSessionOption (kSSLSessionOptionSendOneByteRecord)"]];
+			return;
 		}
 	}
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Security via SecureTransport
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (OSStatus)sslReadWithBuffer:(void *)buffer length:(size_t *)bufferLength
-{
-	LogVerbose(@"sslReadWithBuffer:%p length:%lu", buffer, (unsigned long)*bufferLength);
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLSessionOptionSendOneByteRecord."
+		             @" Value must be of type NSNumber.");
+		
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLSessionOptionSendOneByteRecord."]];
+		return;
+	}
 	
-	if ((socketFDBytesAvailable == 0) && ([sslPreBuffer availableBytes] == 0))
+	// 8. GCDAsyncSocketSSLCipherSuites
+	
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLCipherSuites];
+	if ([value isKindOfClass:[NSArray class]])
 	{
-		LogVerbose(@"%@ - No data available to read...", THIS_METHOD);
+		NSArray *cipherSuites = (NSArray *)value;
+		NSUInteger numberCiphers = [cipherSuites count];
+		SSLCipherSuite ciphers[numberCiphers];
 		
-		// No data available to read.
-		// 
-		// Need to wait for readSource to fire and notify us of
-		// available data in the socket's internal read buffer.
+		NSUInteger cipherIndex;
+		for (cipherIndex = 0; cipherIndex < numberCiphers; cipherIndex++)
+		{
+			NSNumber *cipherObject = [cipherSuites objectAtIndex:cipherIndex];
+			ciphers[cipherIndex] = (SSLCipherSuite)[cipherObject unsignedIntValue];
+		}
 		
-		[self resumeReadSource];
+		status = SSLSetEnabledCiphers(sslContext, ciphers, numberCiphers);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetEnabledCiphers"]];
+			return;
+		}
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLCipherSuites. Value must be of type NSArray.");
 		
-		*bufferLength = 0;
-		return errSSLWouldBlock;
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLCipherSuites."]];
+		return;
 	}
 	
-	size_t totalBytesRead = 0;
-	size_t totalBytesLeftToBeRead = *bufferLength;
-	
-	BOOL done = NO;
-	BOOL socketError = NO;
-	
-	// 
-	// STEP 1 : READ FROM SSL PRE BUFFER
-	// 
-	
-	size_t sslPreBufferLength = [sslPreBuffer availableBytes];
+	// 9. GCDAsyncSocketSSLDiffieHellmanParameters
 	
-	if (sslPreBufferLength > 0)
+	#if !TARGET_OS_IPHONE
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLDiffieHellmanParameters];
+	if ([value isKindOfClass:[NSData class]])
 	{
-		LogVerbose(@"%@: Reading from SSL pre buffer...", THIS_METHOD);
-		
-		size_t bytesToCopy;
-		if (sslPreBufferLength > totalBytesLeftToBeRead)
-			bytesToCopy = totalBytesLeftToBeRead;
-		else
-			bytesToCopy = sslPreBufferLength;
-		
-		LogVerbose(@"%@: Copying %zu bytes from sslPreBuffer", THIS_METHOD, bytesToCopy);
-		
-		memcpy(buffer, [sslPreBuffer readBuffer], bytesToCopy);
-		[sslPreBuffer didRead:bytesToCopy];
-		
-		LogVerbose(@"%@: sslPreBuffer.length = %zu", THIS_METHOD, [sslPreBuffer availableBytes]);
-		
-		totalBytesRead += bytesToCopy;
-		totalBytesLeftToBeRead -= bytesToCopy;
+		NSData *diffieHellmanData = (NSData *)value;
 		
-		done = (totalBytesLeftToBeRead == 0);
+		status = SSLSetDiffieHellmanParams(sslContext, [diffieHellmanData bytes], [diffieHellmanData length]);
+		if (status != noErr)
+		{
+			[self closeWithError:[self otherError:@"Error in SSLSetDiffieHellmanParams"]];
+			return;
+		}
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLDiffieHellmanParameters. Value must be of type NSData.");
 		
-		if (done) LogVerbose(@"%@: Complete", THIS_METHOD);
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLDiffieHellmanParameters."]];
+		return;
 	}
+	#endif
+
+    // 10. kCFStreamSSLCertificates
+    value = [tlsSettings objectForKey:GCDAsyncSocketSSLALPN];
+    if ([value isKindOfClass:[NSArray class]])
+    {
+        if (@available(iOS 11.0, macOS 10.13, tvOS 11.0, *))
+        {
+            CFArrayRef protocols = (__bridge CFArrayRef)((NSArray *) value);
+            status = SSLSetALPNProtocols(sslContext, protocols);
+            if (status != noErr)
+            {
+                [self closeWithError:[self otherError:@"Error in SSLSetALPNProtocols"]];
+                return;
+            }
+        }
+        else
+        {
+            NSAssert(NO, @"Security option unavailable - GCDAsyncSocketSSLALPN"
+                     @" - iOS 11.0, macOS 10.13 required");
+            [self closeWithError:[self otherError:@"Security option unavailable - GCDAsyncSocketSSLALPN"]];
+        }
+    }
+    else if (value)
+    {
+        NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLALPN. Value must be of type NSArray.");
+        
+        [self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLALPN."]];
+        return;
+    }
+    
+	// 11. GCDAsyncSocketSSLDynamicRecordSizing
 	
-	// 
-	// STEP 2 : READ FROM SOCKET
-	// 
+	sslSmallRecordSize = 0;
+	sslRecordSizeBoostThreshold = 0;
+	sslRecordSizeIdleTimeout = 0;
 	
-	if (!done && (socketFDBytesAvailable > 0))
+	value = [tlsSettings objectForKey:GCDAsyncSocketSSLDynamicRecordSizing];
+	if ([value isKindOfClass:[NSNumber class]])
 	{
-		LogVerbose(@"%@: Reading from socket...", THIS_METHOD);
-		
-		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
-		
-		BOOL readIntoPreBuffer;
-		size_t bytesToRead;
-		uint8_t *buf;
+		if ([(NSNumber *)value boolValue])
+		{
+			sslSmallRecordSize = 1400;
+			sslRecordSizeBoostThreshold = (1024 * 1024);
+			sslRecordSizeIdleTimeout = NSEC_PER_SEC;
+		}
+	}
+	else if (value)
+	{
+		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLDynamicRecordSizing. Value must be of type NSNumber.");
 		
-		if (socketFDBytesAvailable > totalBytesLeftToBeRead)
+		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLDynamicRecordSizing."]];
+		return;
+	}
+	
+	if (sslSmallRecordSize > 0)
+	{
+		value = [tlsSettings objectForKey:GCDAsyncSocketSSLSmallRecordSize];
+		if ([value isKindOfClass:[NSNumber class]] && [(NSNumber *)value unsignedIntegerValue] > 0)
 		{
-			// Read all available data from socket into sslPreBuffer.
-			// Then copy requested amount into dataBuffer.
-			
-			LogVerbose(@"%@: Reading into sslPreBuffer...", THIS_METHOD);
-			
-			[sslPreBuffer ensureCapacityForWrite:socketFDBytesAvailable];
-			
-			readIntoPreBuffer = YES;
-			bytesToRead = (size_t)socketFDBytesAvailable;
-			buf = [sslPreBuffer writeBuffer];
+			sslSmallRecordSize = MIN([(NSNumber *)value unsignedIntegerValue], (NSUInteger)(1024 * 16));
 		}
-		else
+		else if (value)
 		{
-			// Read available data from socket directly into dataBuffer.
-			
-			LogVerbose(@"%@: Reading directly into dataBuffer...", THIS_METHOD);
+			NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLSmallRecordSize. Value must be a positive NSNumber.");
 			
-			readIntoPreBuffer = NO;
-			bytesToRead = totalBytesLeftToBeRead;
-			buf = (uint8_t *)buffer + totalBytesRead;
+			[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLSmallRecordSize."]];
+			return;
 		}
 		
-		ssize_t result = read(socketFD, buf, bytesToRead);
-		LogVerbose(@"%@: read from socket = %zd", THIS_METHOD, result);
-		
-		if (result < 0)
+		value = [tlsSettings objectForKey:GCDAsyncSocketSSLRecordSizeBoostThreshold];
+		if ([value isKindOfClass:[NSNumber class]])
 		{
-			LogVerbose(@"%@: read errno = %i", THIS_METHOD, errno);
-			
-			if (errno != EWOULDBLOCK)
-			{
-				socketError = YES;
-			}
-			
-			socketFDBytesAvailable = 0;
+			sslRecordSizeBoostThreshold = [(NSNumber *)value unsignedLongLongValue];
 		}
-		else if (result == 0)
+		else if (value)
 		{
-			LogVerbose(@"%@: read EOF", THIS_METHOD);
+			NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLRecordSizeBoostThreshold. Value must be of type NSNumber.");
 			
-			socketError = YES;
-			socketFDBytesAvailable = 0;
+			[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLRecordSizeBoostThreshold."]];
+			return;
 		}
-		else
+		
+		value = [tlsSettings objectForKey:GCDAsyncSocketSSLRecordSizeIdleTimeout];
+		if ([value isKindOfClass:[NSNumber class]] && [(NSNumber *)value doubleValue] >= 0.0)
 		{
-			size_t bytesReadFromSocket = result;
-			
-			if (socketFDBytesAvailable > bytesReadFromSocket)
-				socketFDBytesAvailable -= bytesReadFromSocket;
-			else
-				socketFDBytesAvailable = 0;
-			
-			if (readIntoPreBuffer)
-			{
-				[sslPreBuffer didWrite:bytesReadFromSocket];
-				
-				size_t bytesToCopy = MIN(totalBytesLeftToBeRead, bytesReadFromSocket);
-				
-				LogVerbose(@"%@: Copying %zu bytes out of sslPreBuffer", THIS_METHOD, bytesToCopy);
-				
-				memcpy((uint8_t *)buffer + totalBytesRead, [sslPreBuffer readBuffer], bytesToCopy);
-				[sslPreBuffer didRead:bytesToCopy];
-				
-				totalBytesRead += bytesToCopy;
-				totalBytesLeftToBeRead -= bytesToCopy;
-				
-				LogVerbose(@"%@: sslPreBuffer.length = %zu", THIS_METHOD, [sslPreBuffer availableBytes]);
-			}
-			else
-			{
-				totalBytesRead += bytesReadFromSocket;
-				totalBytesLeftToBeRead -= bytesReadFromSocket;
-			}
-			
-			done = (totalBytesLeftToBeRead == 0);
+			sslRecordSizeIdleTimeout = (uint64_t)([(NSNumber *)value doubleValue] * NSEC_PER_SEC);
+		}
+		else if (value)
+		{
+			NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLRecordSizeIdleTimeout. Value must be a non-negative NSNumber.");
 			
-			if (done) LogVerbose(@"%@: Complete", THIS_METHOD);
+			[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLRecordSizeIdleTimeout."]];
+			return;
 		}
 	}
 	
-	*bufferLength = totalBytesRead;
+	// Small records are used right after the handshake
 	
-	if (done)
-		return noErr;
+	sslBytesWrittenSinceIdle = 0;
+	sslLastWriteTime = 0;
 	
-	if (socketError)
-		return errSSLClosedAbort;
+	// DEPRECATED checks
 	
-	return errSSLWouldBlock;
-}
-
-- (OSStatus)sslWriteWithBuffer:(const void *)buffer length:(size_t *)bufferLength
-{
-	if (!(flags & kSocketCanAcceptBytes))
+	// 12. kCFStreamSSLAllowsAnyRoot
+	
+	#pragma clang diagnostic push
+	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsAnyRoot];
+	#pragma clang diagnostic pop
+	if (value)
 	{
-		// Unable to write.
-		// 
-		// Need to wait for writeSource to fire and notify us of
-		// available space in the socket's internal write buffer.
+		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsAnyRoot"
+		             @" - You must use manual trust evaluation");
 		
-		[self resumeWriteSource];
+		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsAnyRoot"]];
+		return;
+	}
+	
+	// 13. kCFStreamSSLAllowsExpiredRoots
+	
+	#pragma clang diagnostic push
+	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsExpiredRoots];
+	#pragma clang diagnostic pop
+	if (value)
+	{
+		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsExpiredRoots"
+		             @" - You must use manual trust evaluation");
+		
+		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsExpiredRoots"]];
+		return;
+	}
+	
+	// 15. kCFStreamSSLValidatesCertificateChain
+	
+	#pragma clang diagnostic push
+	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLValidatesCertificateChain];
+	#pragma clang diagnostic pop
+	if (value)
+	{
+		NSAssert(NO, @"Security option unavailable - kCFStreamSSLValidatesCertificateChain"
+		             @" - You must use manual trust evaluation");
+		
+		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLValidatesCertificateChain"]];
+		return;
+	}
+	
+	// 14. kCFStreamSSLAllowsExpiredCertificates
+	
+	#pragma clang diagnostic push
+	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsExpiredCertificates];
+	#pragma clang diagnostic pop
+	if (value)
+	{
+		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsExpiredCertificates"
+		             @" - You must use manual trust evaluation");
+		
+		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsExpiredCertificates"]];
+		return;
+	}
+	
+	// 16. kCFStreamSSLLevel
+	
+	#pragma clang diagnostic push
+	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLLevel];
+	#pragma clang diagnostic pop
+	if (value)
+	{
+		NSAssert(NO, @"Security option unavailable - kCFStreamSSLLevel"
+		             @" - You must use GCDAsyncSocketSSLProtocolVersionMin & GCDAsyncSocketSSLProtocolVersionMax");
 		
-		*bufferLength = 0;
-		return errSSLWouldBlock;
+		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLLevel"]];
+		return;
 	}
 	
-	size_t bytesToWrite = *bufferLength;
-	size_t bytesWritten = 0;
-	
-	BOOL done = NO;
-	BOOL socketError = NO;
+	// Setup the sslPreBuffer
+	// 
+	// Any data in the preBuffer needs to be moved into the sslPreBuffer,
+	// as this data is now part of the secure read stream.
 	
-	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	sslPreBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+	[sslPreBuffer setByteCounter:&globalEncryptedPreBufferSize];
 	
-	ssize_t result = write(socketFD, buffer, bytesToWrite);
+	size_t preBufferLength  = [preBuffer availableBytes];
 	
-	if (result < 0)
-	{
-		if (errno != EWOULDBLOCK)
-		{
-			socketError = YES;
-		}
-		
-		flags &= ~kSocketCanAcceptBytes;
-	}
-	else if (result == 0)
-	{
-		flags &= ~kSocketCanAcceptBytes;
-	}
-	else
+	if (preBufferLength > 0)
 	{
-		bytesWritten = result;
+		[sslPreBuffer ensureCapacityForWrite:preBufferLength];
 		
-		done = (bytesWritten == bytesToWrite);
+		memcpy([sslPreBuffer writeBuffer], [preBuffer readBuffer], preBufferLength);
+		[preBuffer didRead:preBufferLength];
+		[sslPreBuffer didWrite:preBufferLength];
 	}
 	
-	*bufferLength = bytesWritten;
-	
-	if (done)
-		return noErr;
+	// From now on the preBuffer contains decrypted data
 	
-	if (socketError)
-		return errSSLClosedAbort;
+	[preBuffer setByteCounter:&globalDecryptedPreBufferSize];
 	
-	return errSSLWouldBlock;
-}
-
-static OSStatus SSLReadFunction(SSLConnectionRef connection, void *data, size_t *dataLength)
-{
-	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)connection;
+	sslErrCode = lastSSLHandshakeError = noErr;
 	
-	NSCAssert(dispatch_get_specific(asyncSocket->IsOnSocketQueueOrTargetQueueKey), @"What the deuce?");
+	// Start the SSL Handshake process
 	
-	return [asyncSocket sslReadWithBuffer:data length:dataLength];
+	[self ssl_continueSSLHandshake];
 }
 
-static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data, size_t *dataLength)
+- (void)ssl_continueSSLHandshake
 {
-	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)connection;
+	LogTrace();
 	
-	NSCAssert(dispatch_get_specific(asyncSocket->IsOnSocketQueueOrTargetQueueKey), @"What the deuce?");
+	if (sslHandshakeIO)
+	{
+		[self ssl_continueSSLHandshakeOnPool];
+		return;
+	}
 	
-	return [asyncSocket sslWriteWithBuffer:data length:dataLength];
+	OSStatus status = SSLHandshake(sslContext);
+	
+	[self ssl_handleSSLHandshakeStatus:status];
 }
 
-- (void)ssl_startTLS
+- (void)ssl_handleSSLHandshakeStatus:(OSStatus)status
 {
 	LogTrace();
 	
-	LogVerbose(@"Starting TLS (via SecureTransport)...");
-	
-	OSStatus status;
-	
-	GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
-	if (tlsPacket == nil) // Code to quiet the analyzer
-	{
-		NSAssert(NO, @"Logic error");
-		
-		[self closeWithError:[self otherError:@"Logic error"]];
-		return;
-	}
-	NSDictionary *tlsSettings = tlsPacket->tlsSettings;
+	// If the return value is noErr, the session is ready for normal secure communication.
+	// If the return value is errSSLWouldBlock, the SSLHandshake function must be called again.
+	// If the return value is errSSLServerAuthCompleted, we ask delegate if we should trust the
+	// server and then call SSLHandshake again to resume the handshake or close the connection
+	// errSSLPeerBadCert SSL error.
+	// Otherwise, the return value indicates an error code.
 	
-	// Create SSLContext, and setup IO callbacks and connection ref
+	lastSSLHandshakeError = status;
 	
-	NSNumber *isServerNumber = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLIsServer];
-	BOOL isServer = [isServerNumber boolValue];
+	TRACE_EVENT(GCDAsyncSocketTraceTLSHandshakeStep, status);
 	
-	#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
+	if (status == noErr)
 	{
-		if (isServer)
-			sslContext = SSLCreateContext(kCFAllocatorDefault, kSSLServerSide, kSSLStreamType);
-		else
-			sslContext = SSLCreateContext(kCFAllocatorDefault, kSSLClientSide, kSSLStreamType);
+		LogVerbose(@"SSLHandshake complete");
 		
-		if (sslContext == NULL)
-		{
-			[self closeWithError:[self otherError:@"Error in SSLCreateContext"]];
-			return;
-		}
-	}
-	#else // (__MAC_OS_X_VERSION_MIN_REQUIRED < 1080)
-	{
-		status = SSLNewContext(isServer, &sslContext);
-		if (status != noErr)
+		flags &= ~kStartingReadTLS;
+		flags &= ~kStartingWriteTLS;
+		
+		flags |=  kSocketSecure;
+		
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
 		{
-			[self closeWithError:[self otherError:@"Error in SSLNewContext"]];
-			return;
+			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+				
+				[theDelegate socketDidSecure:self];
+			}});
 		}
+		
+		[self endCurrentRead];
+		[self endCurrentWrite];
+		
+		[self maybeDequeueRead];
+		[self maybeDequeueWrite];
 	}
-	#endif
-	
-	status = SSLSetIOFuncs(sslContext, &SSLReadFunction, &SSLWriteFunction);
-	if (status != noErr)
-	{
-		[self closeWithError:[self otherError:@"Error in SSLSetIOFuncs"]];
-		return;
-	}
-	
-	status = SSLSetConnection(sslContext, (__bridge SSLConnectionRef)self);
-	if (status != noErr)
-	{
-		[self closeWithError:[self otherError:@"Error in SSLSetConnection"]];
-		return;
-	}
-
-
-	NSNumber *shouldManuallyEvaluateTrust = [tlsSettings objectForKey:GCDAsyncSocketManuallyEvaluateTrust];
-	if ([shouldManuallyEvaluateTrust boolValue])
+	else if (status == errSSLPeerAuthCompleted)
 	{
-		if (isServer)
-		{
-			[self closeWithError:[self otherError:@"Manual trust validation is not supported for server sockets"]];
-			return;
-		}
+		LogVerbose(@"SSLHandshake peerAuthCompleted - awaiting delegate approval");
 		
-		status = SSLSetSessionOption(sslContext, kSSLSessionOptionBreakOnServerAuth, true);
+		__block SecTrustRef trust = NULL;
+		status = SSLCopyPeerTrust(sslContext, &trust);
 		if (status != noErr)
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetSessionOption"]];
+			[self closeWithError:[self sslError:status]];
 			return;
 		}
 		
-		#if !TARGET_OS_IPHONE && (__MAC_OS_X_VERSION_MIN_REQUIRED < 1080)
+		int aStateIndex = stateIndex;
+		dispatch_queue_t theSocketQueue = socketQueue;
 		
-		// Note from Apple's documentation:
-		//
-		// It is only necessary to call SSLSetEnableCertVerify on the Mac prior to OS X 10.8.
-		// On OS X 10.8 and later setting kSSLSessionOptionBreakOnServerAuth always disables the
-		// built-in trust evaluation. All versions of iOS behave like OS X 10.8 and thus
-		// SSLSetEnableCertVerify is not available on that platform at all.
+		__weak GCDAsyncSocket *weakSelf = self;
 		
-		status = SSLSetEnableCertVerify(sslContext, NO);
-		if (status != noErr)
+		void (^comletionHandler)(BOOL) = ^(BOOL shouldTrust){ @autoreleasepool {
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+			dispatch_async(theSocketQueue, ^{ @autoreleasepool {
+				
+				if (trust) {
+					CFRelease(trust);
+					trust = NULL;
+				}
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf)
+				{
+					[strongSelf ssl_shouldTrustPeer:shouldTrust stateIndex:aStateIndex];
+				}
+			}});
+			
+		#pragma clang diagnostic pop
+		}};
+		
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+		
+		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReceiveTrust:completionHandler:)])
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetEnableCertVerify"]];
+			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			
+				[theDelegate socket:self didReceiveTrust:trust completionHandler:comletionHandler];
+			}});
+		}
+		else
+		{
+			if (trust) {
+				CFRelease(trust);
+				trust = NULL;
+			}
+			
+			NSString *msg = @"GCDAsyncSocketManuallyEvaluateTrust specified in tlsSettings,"
+			                @" but delegate doesn't implement socket:shouldTrustPeer:";
+			
+			[self closeWithError:[self otherError:msg]];
 			return;
 		}
-		
-		#endif
 	}
-
-	// Configure SSLContext from given settings
-	// 
-	// Checklist:
-	//  1. kCFStreamSSLPeerName
-	//  2. kCFStreamSSLCertificates
-	//  3. GCDAsyncSocketSSLPeerID
-	//  4. GCDAsyncSocketSSLProtocolVersionMin
-	//  5. GCDAsyncSocketSSLProtocolVersionMax
-	//  6. GCDAsyncSocketSSLSessionOptionFalseStart
-	//  7. GCDAsyncSocketSSLSessionOptionSendOneByteRecord
-	//  8. GCDAsyncSocketSSLCipherSuites
-	//  9. GCDAsyncSocketSSLDiffieHellmanParameters (Mac)
-    // 10. GCDAsyncSocketSSLALPN
-	//
-	// Deprecated (throw error):
-	// 10. kCFStreamSSLAllowsAnyRoot
-	// 11. kCFStreamSSLAllowsExpiredRoots
-	// 12. kCFStreamSSLAllowsExpiredCertificates
-	// 13. kCFStreamSSLValidatesCertificateChain
-	// 14. kCFStreamSSLLevel
-	
-	NSObject *value;
-	
-	// 1. kCFStreamSSLPeerName
-	
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLPeerName];
-	if ([value isKindOfClass:[NSString class]])
+	else if (status == errSSLWouldBlock)
 	{
-		NSString *peerName = (NSString *)value;
-		
-		const char *peer = [peerName UTF8String];
-		size_t peerLen = strlen(peer);
+		LogVerbose(@"SSLHandshake continues...");
 		
-		status = SSLSetPeerDomainName(sslContext, peer, peerLen);
-		if (status != noErr)
-		{
-			[self closeWithError:[self otherError:@"Error in SSLSetPeerDomainName"]];
-			return;
-		}
+		// Handshake continues...
+		// 
+		// This method will be called again from doReadData or doWriteData.
 	}
-	else if (value)
+	else
+	{
+		[self closeWithError:[self sslError:status]];
+	}
+}
+
+/**
+ * Continues the handshake of a socket using the handshake pool (see GCDAsyncSocketSSLUseHandshakePool).
+ * 
+ * Each step of the handshake goes through the following:
+ * - Any output from the previous step is written to the socket.
+ * - The result of the previous step is processed (exactly as if SSLHandshake had been invoked directly).
+ * - All available encrypted input is read from the socket, and handed to the GCDAsyncSocketSSLHandshakeIO.
+ * - SSLHandshake is invoked on the handshake pool, and the result is posted back to the socketQueue.
+**/
+- (void)ssl_continueSSLHandshakeOnPool
+{
+	LogTrace();
+	
+	if (flags & kSSLHandshakeInFlight)
 	{
-		NSAssert(NO, @"Invalid value for kCFStreamSSLPeerName. Value must be of type NSString.");
-		
-		[self closeWithError:[self otherError:@"Invalid value for kCFStreamSSLPeerName."]];
+		// The current step will continue the handshake once it completes.
 		return;
 	}
 	
-	// 2. kCFStreamSSLCertificates
+	GCDAsyncSocketSSLHandshakeIO *io = sslHandshakeIO;
 	
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLCertificates];
-	if ([value isKindOfClass:[NSArray class]])
+	// Write any output from the previous step
+	
+	if (![self ssl_flushHandshakeOutput])
 	{
-		NSArray *certs = (NSArray *)value;
+		// Waiting for the writeSource to notify us of available space in the socket's internal buffer.
+		// In the meantime there's no point in monitoring the socket for incoming data.
 		
-		status = SSLSetCertificate(sslContext, (__bridge CFArrayRef)certs);
-		if (status != noErr)
+		if (socketFDBytesAvailable > 0)
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetCertificate"]];
-			return;
+			[self suspendReadSource];
 		}
-	}
-	else if (value)
-	{
-		NSAssert(NO, @"Invalid value for kCFStreamSSLCertificates. Value must be of type NSArray.");
-		
-		[self closeWithError:[self otherError:@"Invalid value for kCFStreamSSLCertificates."]];
 		return;
 	}
 	
-	// 3. GCDAsyncSocketSSLPeerID
+	// Process the result of the previous step
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLPeerID];
-	if ([value isKindOfClass:[NSData class]])
+	if (io->hasPendingStatus)
 	{
-		NSData *peerIdData = (NSData *)value;
+		io->hasPendingStatus = NO;
+		OSStatus status = io->pendingStatus;
 		
-		status = SSLSetPeerID(sslContext, [peerIdData bytes], [peerIdData length]);
-		if (status != noErr)
+		BOOL hasMoreInput = (socketFDBytesAvailable > 0) || ([sslPreBuffer availableBytes] > 0);
+		
+		if ((status != errSSLWouldBlock) || !hasMoreInput)
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetPeerID"]];
+			[self ssl_handleSSLHandshakeStatus:status];
+			
+			if (status == errSSLWouldBlock)
+			{
+				// Need to wait for readSource to fire and notify us of
+				// available data in the socket's internal read buffer.
+				
+				[self resumeReadSource];
+			}
 			return;
 		}
+		
+		// More input arrived while the previous step was executing, so we can continue right away.
 	}
-	else if (value)
+	
+	// Admission control.
+	// If the pool is already saturated, the step is executed directly on the socketQueue instead.
+	
+	size_t maxPending = atomic_load_explicit(&tlsHandshakePoolMaxPending, memory_order_relaxed);
+	size_t pending = atomic_fetch_add_explicit(&tlsHandshakePoolPendingCount, 1, memory_order_relaxed);
+	
+	if ((maxPending > 0) && (pending >= maxPending))
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLPeerID. Value must be of type NSData."
-		             @" (You can convert strings to data using a method like"
-		             @" [string dataUsingEncoding:NSUTF8StringEncoding])");
+		atomic_fetch_sub_explicit(&tlsHandshakePoolPendingCount, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&tlsHandshakePoolOverflowCount, 1, memory_order_relaxed);
 		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLPeerID."]];
+		LogVerbose(@"Handshake pool saturated (%lu pending) - continuing handshake on socketQueue", (unsigned long)pending);
+		
+		OSStatus status = SSLHandshake(sslContext);
+		
+		[self ssl_handleSSLHandshakeStatus:status];
 		return;
 	}
 	
-	// 4. GCDAsyncSocketSSLProtocolVersionMin
+	// Hand all available encrypted input to the io object
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLProtocolVersionMin];
-	if ([value isKindOfClass:[NSNumber class]])
-	{
-		SSLProtocol minProtocol = (SSLProtocol)[(NSNumber *)value intValue];
-		if (minProtocol != kSSLProtocolUnknown)
-		{
-			status = SSLSetProtocolVersionMin(sslContext, minProtocol);
-			if (status != noErr)
+	[self ssl_readHandshakeInput];
+	
+	// Submit the step.
+	// 
+	// While the step is executing we must not touch the sslContext,
+	// so we stop monitoring the socket until the step completes.
+	
+	flags |= kSSLHandshakeInFlight;
+	lastSSLHandshakeError = errSSLWouldBlock;
+	
+	[self suspendReadSource];
+	[self suspendWriteSource];
+	
+	__weak GCDAsyncSocket *weakSelf = self;
+	dispatch_queue_t theSocketQueue = socketQueue;
+	
+	dispatch_async(GCDAsyncSocketNextHandshakeQueue(), ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		io->offSocketQueue = YES;
+		OSStatus status = SSLHandshake(io->sslContext);
+		io->offSocketQueue = NO;
+		
+		atomic_fetch_sub_explicit(&tlsHandshakePoolPendingCount, 1, memory_order_relaxed);
+		
+		dispatch_async(theSocketQueue, ^{ @autoreleasepool {
+			
+			__strong GCDAsyncSocket *strongSelf = weakSelf;
+			if (strongSelf)
 			{
-				[self closeWithError:[self otherError:@"Error in SSLSetProtocolVersionMin"]];
-				return;
+				[strongSelf ssl_didCompleteHandshakeStep:io status:status];
 			}
-		}
+		}});
+		
+	#pragma clang diagnostic pop
+	}});
+}
+
+- (void)ssl_didCompleteHandshakeStep:(GCDAsyncSocketSSLHandshakeIO *)io status:(OSStatus)status
+{
+	LogTrace();
+	
+	if (io != sslHandshakeIO)
+	{
+		LogInfo(@"Ignoring handshake step - invalid state (maybe disconnected)");
+		return;
 	}
-	else if (value)
+	
+	flags &= ~kSSLHandshakeInFlight;
+	
+	// Give any unconsumed input back to the sslPreBuffer.
+	// The sslPreBuffer was drained before the step was submitted, so ordering is preserved.
+	
+	size_t leftover = [io->inBuffer availableBytes];
+	if (leftover > 0)
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLProtocolVersionMin. Value must be of type NSNumber.");
+		[sslPreBuffer ensureCapacityForWrite:leftover];
 		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLProtocolVersionMin."]];
-		return;
+		memcpy([sslPreBuffer writeBuffer], [io->inBuffer readBuffer], leftover);
+		[io->inBuffer didRead:leftover];
+		[sslPreBuffer didWrite:leftover];
 	}
 	
-	// 5. GCDAsyncSocketSSLProtocolVersionMax
+	io->pendingStatus = status;
+	io->hasPendingStatus = YES;
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLProtocolVersionMax];
-	if ([value isKindOfClass:[NSNumber class]])
+	[self ssl_continueSSLHandshakeOnPool];
+}
+
+/**
+ * Moves all encrypted data available (in the sslPreBuffer and the socket) into the io object's input buffer.
+**/
+- (void)ssl_readHandshakeInput
+{
+	GCDAsyncSocketSSLHandshakeIO *io = sslHandshakeIO;
+	
+	size_t sslPreBufferLength = [sslPreBuffer availableBytes];
+	if (sslPreBufferLength > 0)
 	{
-		SSLProtocol maxProtocol = (SSLProtocol)[(NSNumber *)value intValue];
-		if (maxProtocol != kSSLProtocolUnknown)
+		[io->inBuffer ensureCapacityForWrite:sslPreBufferLength];
+		
+		memcpy([io->inBuffer writeBuffer], [sslPreBuffer readBuffer], sslPreBufferLength);
+		[sslPreBuffer didRead:sslPreBufferLength];
+		[io->inBuffer didWrite:sslPreBufferLength];
+	}
+	
+	if (socketFDBytesAvailable > 0)
+	{
+		int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+		
+		size_t bytesToRead = (size_t)socketFDBytesAvailable;
+		[io->inBuffer ensureCapacityForWrite:bytesToRead];
+		
+		TRACE_SYSCALL_BEGIN();
+		ssize_t result = read(socketFD, [io->inBuffer writeBuffer], bytesToRead);
+		TRACE_SYSCALL(GCDAsyncSocketTraceReadSyscall, result, result < 0);
+		LogVerbose(@"%@: read from socket = %zd", THIS_METHOD, result);
+		
+		STATISTICS_ADD(readSyscalls, 1);
+		if (result > 0) STATISTICS_ADD(bytesRead, result);
+		
+		if (result < 0)
 		{
-			status = SSLSetProtocolVersionMax(sslContext, maxProtocol);
-			if (status != noErr)
+			if (errno != EWOULDBLOCK)
 			{
-				[self closeWithError:[self otherError:@"Error in SSLSetProtocolVersionMax"]];
-				return;
+				io->inputClosed = YES;
 			}
+			socketFDBytesAvailable = 0;
+		}
+		else if (result == 0)
+		{
+			io->inputClosed = YES;
+			socketFDBytesAvailable = 0;
+		}
+		else
+		{
+			[io->inBuffer didWrite:(size_t)result];
+			
+			if (socketFDBytesAvailable > (size_t)result)
+				socketFDBytesAvailable -= (size_t)result;
+			else
+				socketFDBytesAvailable = 0;
 		}
 	}
-	else if (value)
+}
+
+/**
+ * Writes the output of the previous handshake step to the socket.
+ * Returns YES if everything has been written, NO if we need to wait for more space (or the socket was closed).
+**/
+- (BOOL)ssl_flushHandshakeOutput
+{
+	GCDAsyncSocketSSLHandshakeIO *io = sslHandshakeIO;
+	
+	size_t bytesToWrite = [io->outBuffer availableBytes];
+	if (bytesToWrite == 0)
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLProtocolVersionMax. Value must be of type NSNumber.");
-		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLProtocolVersionMax."]];
-		return;
+		return YES;
 	}
 	
-	// 6. GCDAsyncSocketSSLSessionOptionFalseStart
+	if (!(flags & kSocketCanAcceptBytes))
+	{
+		[self resumeWriteSource];
+		return NO;
+	}
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLSessionOptionFalseStart];
-	if ([value isKindOfClass:[NSNumber class]])
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	TRACE_SYSCALL_BEGIN();
+	ssize_t result = write(socketFD, [io->outBuffer readBuffer], bytesToWrite);
+	TRACE_SYSCALL(GCDAsyncSocketTraceWriteSyscall, result, result < 0);
+	LogVerbose(@"%@: write to socket = %zd", THIS_METHOD, result);
+	
+	STATISTICS_ADD(writeSyscalls, 1);
+	if (result > 0) STATISTICS_ADD(bytesWritten, result);
+	
+	if (result < 0)
 	{
-		NSNumber *falseStart = (NSNumber *)value;
-		status = SSLSetSessionOption(sslContext, kSSLSessionOptionFalseStart, [falseStart boolValue]);
-		if (status != noErr)
+		if (errno != EWOULDBLOCK)
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetSessionOption (kSSLSessionOptionFalseStart)"]];
-			return;
+			[self closeWithError:[self errorWithErrno:errno reason:@"Error in write() function"]];
+			return NO;
 		}
-	}
-	else if (value)
-	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLSessionOptionFalseStart. Value must be of type NSNumber.");
 		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLSessionOptionFalseStart."]];
-		return;
+		result = 0;
 	}
 	
-	// 7. GCDAsyncSocketSSLSessionOptionSendOneByteRecord
+	[io->outBuffer didRead:(size_t)result];
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLSessionOptionSendOneByteRecord];
-	if ([value isKindOfClass:[NSNumber class]])
+	if ((size_t)result < bytesToWrite)
 	{
-		NSNumber *oneByteRecord = (NSNumber *)value;
-		status = SSLSetSessionOption(sslContext, kSSLSessionOptionSendOneByteRecord, [oneByteRecord boolValue]);
-		if (status != noErr)
-		{
-			[self closeWithError:
-			  [self otherError:@"Error in SSLSetSessionOption (kSSLSessionOptionSendOneByteRecord)"]];
-			return;
-		}
+		flags &= ~kSocketCanAcceptBytes;
+		[self resumeWriteSource];
+		
+		return NO;
 	}
-	else if (value)
+	
+	return YES;
+}
+
+- (void)ssl_shouldTrustPeer:(BOOL)shouldTrust stateIndex:(int)aStateIndex
+{
+	LogTrace();
+	
+	if (aStateIndex != stateIndex)
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLSessionOptionSendOneByteRecord."
-		             @" Value must be of type NSNumber.");
+		LogInfo(@"Ignoring ssl_shouldTrustPeer - invalid state (maybe disconnected)");
+		
+		// One of the following is true
+		// - the socket was disconnected
+		// - the startTLS operation timed out
+		// - the completionHandler was already invoked once
 		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLSessionOptionSendOneByteRecord."]];
 		return;
 	}
 	
-	// 8. GCDAsyncSocketSSLCipherSuites
+	// Increment stateIndex to ensure completionHandler can only be called once.
+	stateIndex++;
 	
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLCipherSuites];
-	if ([value isKindOfClass:[NSArray class]])
+	if (shouldTrust)
 	{
-		NSArray *cipherSuites = (NSArray *)value;
-		NSUInteger numberCiphers = [cipherSuites count];
-		SSLCipherSuite ciphers[numberCiphers];
-		
-		NSUInteger cipherIndex;
-		for (cipherIndex = 0; cipherIndex < numberCiphers; cipherIndex++)
-		{
-			NSNumber *cipherObject = [cipherSuites objectAtIndex:cipherIndex];
-			ciphers[cipherIndex] = (SSLCipherSuite)[cipherObject unsignedIntValue];
-		}
-		
-		status = SSLSetEnabledCiphers(sslContext, ciphers, numberCiphers);
-		if (status != noErr)
-		{
-			[self closeWithError:[self otherError:@"Error in SSLSetEnabledCiphers"]];
-			return;
-		}
+        NSAssert(lastSSLHandshakeError == errSSLPeerAuthCompleted, @"ssl_shouldTrustPeer called when last error is %d and not errSSLPeerAuthCompleted", (int)lastSSLHandshakeError);
+		[self ssl_continueSSLHandshake];
 	}
-	else if (value)
+	else
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLCipherSuites. Value must be of type NSArray.");
-		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLCipherSuites."]];
-		return;
+		[self closeWithError:[self sslError:errSSLPeerBadCert]];
 	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Security via CFStream
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if TARGET_OS_IPHONE
+
+- (void)cf_finishSSLHandshake
+{
+	LogTrace();
 	
-	// 9. GCDAsyncSocketSSLDiffieHellmanParameters
-	
-	#if !TARGET_OS_IPHONE
-	value = [tlsSettings objectForKey:GCDAsyncSocketSSLDiffieHellmanParameters];
-	if ([value isKindOfClass:[NSData class]])
+	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
 	{
-		NSData *diffieHellmanData = (NSData *)value;
+		flags &= ~kStartingReadTLS;
+		flags &= ~kStartingWriteTLS;
 		
-		status = SSLSetDiffieHellmanParams(sslContext, [diffieHellmanData bytes], [diffieHellmanData length]);
-		if (status != noErr)
+		flags |= kSocketSecure;
+		
+		TRACE_EVENT(GCDAsyncSocketTraceTLSHandshakeStep, noErr);
+		
+		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+
+		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
 		{
-			[self closeWithError:[self otherError:@"Error in SSLSetDiffieHellmanParams"]];
-			return;
+			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+				
+				[theDelegate socketDidSecure:self];
+			}});
 		}
+		
+		[self endCurrentRead];
+		[self endCurrentWrite];
+		
+		[self maybeDequeueRead];
+		[self maybeDequeueWrite];
 	}
-	else if (value)
+}
+
+- (void)cf_abortSSLHandshake:(NSError *)error
+{
+	LogTrace();
+	
+	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
 	{
-		NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLDiffieHellmanParameters. Value must be of type NSData.");
+		flags &= ~kStartingReadTLS;
+		flags &= ~kStartingWriteTLS;
 		
-		[self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLDiffieHellmanParameters."]];
-		return;
+		[self closeWithError:error];
 	}
-	#endif
+}
 
-    // 10. kCFStreamSSLCertificates
-    value = [tlsSettings objectForKey:GCDAsyncSocketSSLALPN];
-    if ([value isKindOfClass:[NSArray class]])
-    {
-        if (@available(iOS 11.0, macOS 10.13, tvOS 11.0, *))
-        {
-            CFArrayRef protocols = (__bridge CFArrayRef)((NSArray *) value);
-            status = SSLSetALPNProtocols(sslContext, protocols);
-            if (status != noErr)
-            {
-                [self closeWithError:[self otherError:@"Error in SSLSetALPNProtocols"]];
-                return;
-            }
-        }
-        else
-        {
-            NSAssert(NO, @"Security option unavailable - GCDAsyncSocketSSLALPN"
-                     @" - iOS 11.0, macOS 10.13 required");
-            [self closeWithError:[self otherError:@"Security option unavailable - GCDAsyncSocketSSLALPN"]];
-        }
-    }
-    else if (value)
-    {
-        NSAssert(NO, @"Invalid value for GCDAsyncSocketSSLALPN. Value must be of type NSArray.");
-        
-        [self closeWithError:[self otherError:@"Invalid value for GCDAsyncSocketSSLALPN."]];
-        return;
-    }
-    
-	// DEPRECATED checks
+- (void)cf_startTLS
+{
+	LogTrace();
 	
-	// 10. kCFStreamSSLAllowsAnyRoot
+	LogVerbose(@"Starting TLS (via CFStream)...");
 	
-	#pragma clang diagnostic push
-	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsAnyRoot];
-	#pragma clang diagnostic pop
-	if (value)
+	if ([preBuffer availableBytes] > 0)
 	{
-		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsAnyRoot"
-		             @" - You must use manual trust evaluation");
+		NSString *msg = @"Invalid TLS transition. Handshake has already been read from socket.";
 		
-		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsAnyRoot"]];
+		[self closeWithError:[self otherError:msg]];
 		return;
 	}
 	
-	// 11. kCFStreamSSLAllowsExpiredRoots
+	[self suspendReadSource];
+	[self suspendWriteSource];
 	
-	#pragma clang diagnostic push
-	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsExpiredRoots];
-	#pragma clang diagnostic pop
-	if (value)
+	socketFDBytesAvailable = 0;
+	flags &= ~kSocketCanAcceptBytes;
+	flags &= ~kSecureSocketHasBytesAvailable;
+	
+	flags |=  kUsingCFStreamForTLS;
+	
+	if (![self createReadAndWriteStream])
 	{
-		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsExpiredRoots"
-		             @" - You must use manual trust evaluation");
-		
-		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsExpiredRoots"]];
+		[self closeWithError:[self otherError:@"Error in CFStreamCreatePairWithSocket"]];
 		return;
 	}
 	
-	// 12. kCFStreamSSLValidatesCertificateChain
+	if (![self registerForStreamCallbacksIncludingReadWrite:YES])
+	{
+		[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
+		return;
+	}
 	
-	#pragma clang diagnostic push
-	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLValidatesCertificateChain];
-	#pragma clang diagnostic pop
-	if (value)
+	if (![self addStreamsToRunLoop])
 	{
-		NSAssert(NO, @"Security option unavailable - kCFStreamSSLValidatesCertificateChain"
-		             @" - You must use manual trust evaluation");
-		
-		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLValidatesCertificateChain"]];
+		[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
 		return;
 	}
 	
-	// 13. kCFStreamSSLAllowsExpiredCertificates
+	NSAssert([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]], @"Invalid read packet for startTLS");
+	NSAssert([currentWrite isKindOfClass:[GCDAsyncSpecialPacket class]], @"Invalid write packet for startTLS");
 	
-	#pragma clang diagnostic push
-	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLAllowsExpiredCertificates];
-	#pragma clang diagnostic pop
-	if (value)
+	GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
+	CFDictionaryRef tlsSettings = (__bridge CFDictionaryRef)tlsPacket->tlsSettings;
+	
+	// Getting an error concerning kCFStreamPropertySSLSettings ?
+	// You need to add the CFNetwork framework to your iOS application.
+	
+	BOOL r1 = CFReadStreamSetProperty(readStream, kCFStreamPropertySSLSettings, tlsSettings);
+	BOOL r2 = CFWriteStreamSetProperty(writeStream, kCFStreamPropertySSLSettings, tlsSettings);
+	
+	// For some reason, starting around the time of iOS 4.3,
+	// the first call to set the kCFStreamPropertySSLSettings will return true,
+	// but the second will return false.
+	// 
+	// Order doesn't seem to matter.
+	// So you could call CFReadStreamSetProperty and then CFWriteStreamSetProperty, or you could reverse the order.
+	// Either way, the first call will return true, and the second returns false.
+	// 
+	// Interestingly, this doesn't seem to affect anything.
+	// Which is not altogether unusual, as the documentation seems to suggest that (for many settings)
+	// setting it on one side of the stream automatically sets it for the other side of the stream.
+	// 
+	// Although there isn't anything in the documentation to suggest that the second attempt would fail.
+	// 
+	// Furthermore, this only seems to affect streams that are negotiating a security upgrade.
+	// In other words, the socket gets connected, there is some back-and-forth communication over the unsecure
+	// connection, and then a startTLS is issued.
+	// So this mostly affects newer protocols (XMPP, IMAP) as opposed to older protocols (HTTPS).
+	
+	if (!r1 && !r2) // Yes, the && is correct - workaround for apple bug.
 	{
-		NSAssert(NO, @"Security option unavailable - kCFStreamSSLAllowsExpiredCertificates"
-		             @" - You must use manual trust evaluation");
-		
-		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLAllowsExpiredCertificates"]];
+		[self closeWithError:[self otherError:@"Error in CFStreamSetProperty"]];
 		return;
 	}
 	
-	// 14. kCFStreamSSLLevel
-	
-	#pragma clang diagnostic push
-	#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	value = [tlsSettings objectForKey:(__bridge NSString *)kCFStreamSSLLevel];
-	#pragma clang diagnostic pop
-	if (value)
+	if (![self openStreams])
 	{
-		NSAssert(NO, @"Security option unavailable - kCFStreamSSLLevel"
-		             @" - You must use GCDAsyncSocketSSLProtocolVersionMin & GCDAsyncSocketSSLProtocolVersionMax");
-		
-		[self closeWithError:[self otherError:@"Security option unavailable - kCFStreamSSLLevel"]];
+		[self closeWithError:[self otherError:@"Error in CFStreamOpen"]];
 		return;
 	}
 	
-	// Setup the sslPreBuffer
-	// 
-	// Any data in the preBuffer needs to be moved into the sslPreBuffer,
-	// as this data is now part of the secure read stream.
+	LogVerbose(@"Waiting for SSL Handshake to complete...");
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark CFStream
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if TARGET_OS_IPHONE
+
++ (void)ignore:(id)_
+{}
+
++ (void)startCFStreamThreadIfNeeded
+{
+	LogTrace();
+	
+	static dispatch_once_t predicate;
+	dispatch_once(&predicate, ^{
+		
+		cfstreamThreadRetainCount = 0;
+		cfstreamThreadSetupQueue = dispatch_queue_create("GCDAsyncSocket-CFStreamThreadSetup", DISPATCH_QUEUE_SERIAL);
+	});
+	
+	dispatch_sync(cfstreamThreadSetupQueue, ^{ @autoreleasepool {
+		
+		if (++cfstreamThreadRetainCount == 1)
+		{
+			cfstreamThread = [[NSThread alloc] initWithTarget:self
+			                                         selector:@selector(cfstreamThread:)
+			                                           object:nil];
+			[cfstreamThread start];
+		}
+	}});
+}
+
++ (void)stopCFStreamThreadIfNeeded
+{
+	LogTrace();
+	
+	// The creation of the cfstreamThread is relatively expensive.
+	// So we'd like to keep it available for recycling.
+	// However, there's a tradeoff here, because it shouldn't remain alive forever.
+	// So what we're going to do is use a little delay before taking it down.
+	// This way it can be reused properly in situations where multiple sockets are continually in flux.
+	
+	int delayInSeconds = 30;
+	dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delayInSeconds * NSEC_PER_SEC));
+	dispatch_after(when, cfstreamThreadSetupQueue, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		if (cfstreamThreadRetainCount == 0)
+		{
+			LogWarn(@"Logic error concerning cfstreamThread start / stop");
+			return_from_block;
+		}
+		
+		if (--cfstreamThreadRetainCount == 0)
+		{
+			[cfstreamThread cancel]; // set isCancelled flag
+			
+			// wake up the thread
+            [[self class] performSelector:@selector(ignore:)
+                                 onThread:cfstreamThread
+                               withObject:[NSNull null]
+                            waitUntilDone:NO];
+            
+			cfstreamThread = nil;
+		}
+		
+	#pragma clang diagnostic pop
+	}});
+}
+
++ (void)cfstreamThread:(id)unused { @autoreleasepool
+{
+	[[NSThread currentThread] setName:GCDAsyncSocketThreadName];
+	
+	LogInfo(@"CFStreamThread: Started");
+	
+	// We can't run the run loop unless it has an associated input source or a timer.
+	// So we'll just create a timer that will never fire - unless the server runs for decades.
+	[NSTimer scheduledTimerWithTimeInterval:[[NSDate distantFuture] timeIntervalSinceNow]
+	                                 target:self
+	                               selector:@selector(ignore:)
+	                               userInfo:nil
+	                                repeats:YES];
 	
-	sslPreBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+	NSThread *currentThread = [NSThread currentThread];
+	NSRunLoop *currentRunLoop = [NSRunLoop currentRunLoop];
 	
-	size_t preBufferLength  = [preBuffer availableBytes];
+	BOOL isCancelled = [currentThread isCancelled];
 	
-	if (preBufferLength > 0)
+	while (!isCancelled && [currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]])
 	{
-		[sslPreBuffer ensureCapacityForWrite:preBufferLength];
-		
-		memcpy([sslPreBuffer writeBuffer], [preBuffer readBuffer], preBufferLength);
-		[preBuffer didRead:preBufferLength];
-		[sslPreBuffer didWrite:preBufferLength];
+		isCancelled = [currentThread isCancelled];
 	}
 	
-	sslErrCode = lastSSLHandshakeError = noErr;
+	LogInfo(@"CFStreamThread: Stopped");
+}}
+
++ (void)scheduleCFStreams:(GCDAsyncSocket *)asyncSocket
+{
+	LogTrace();
+	NSAssert([NSThread currentThread] == cfstreamThread, @"Invoked on wrong thread");
 	
-	// Start the SSL Handshake process
+	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
 	
-	[self ssl_continueSSLHandshake];
+	if (asyncSocket->readStream)
+		CFReadStreamScheduleWithRunLoop(asyncSocket->readStream, runLoop, kCFRunLoopDefaultMode);
+	
+	if (asyncSocket->writeStream)
+		CFWriteStreamScheduleWithRunLoop(asyncSocket->writeStream, runLoop, kCFRunLoopDefaultMode);
 }
 
-- (void)ssl_continueSSLHandshake
++ (void)unscheduleCFStreams:(GCDAsyncSocket *)asyncSocket
 {
 	LogTrace();
+	NSAssert([NSThread currentThread] == cfstreamThread, @"Invoked on wrong thread");
 	
-	// If the return value is noErr, the session is ready for normal secure communication.
-	// If the return value is errSSLWouldBlock, the SSLHandshake function must be called again.
-	// If the return value is errSSLServerAuthCompleted, we ask delegate if we should trust the
-	// server and then call SSLHandshake again to resume the handshake or close the connection
-	// errSSLPeerBadCert SSL error.
-	// Otherwise, the return value indicates an error code.
+	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
 	
-	OSStatus status = SSLHandshake(sslContext);
-	lastSSLHandshakeError = status;
+	if (asyncSocket->readStream)
+		CFReadStreamUnscheduleFromRunLoop(asyncSocket->readStream, runLoop, kCFRunLoopDefaultMode);
 	
-	if (status == noErr)
-	{
-		LogVerbose(@"SSLHandshake complete");
-		
-		flags &= ~kStartingReadTLS;
-		flags &= ~kStartingWriteTLS;
-		
-		flags |=  kSocketSecure;
-		
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+	if (asyncSocket->writeStream)
+		CFWriteStreamUnscheduleFromRunLoop(asyncSocket->writeStream, runLoop, kCFRunLoopDefaultMode);
+}
 
-		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
+static void CFReadStreamCallback (CFReadStreamRef stream, CFStreamEventType type, void *pInfo)
+{
+	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)pInfo;
+	
+	switch(type)
+	{
+		case kCFStreamEventHasBytesAvailable:
 		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
 				
-				[theDelegate socketDidSecure:self];
+				LogCVerbose(@"CFReadStreamCallback - HasBytesAvailable");
+				
+				if (asyncSocket->readStream != stream)
+					return_from_block;
+				
+				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
+				{
+					// If we set kCFStreamPropertySSLSettings before we opened the streams, this might be a lie.
+					// (A callback related to the tcp stream, but not to the SSL layer).
+					
+					if (CFReadStreamHasBytesAvailable(asyncSocket->readStream))
+					{
+						asyncSocket->flags |= kSecureSocketHasBytesAvailable;
+						[asyncSocket cf_finishSSLHandshake];
+					}
+				}
+				else
+				{
+					asyncSocket->flags |= kSecureSocketHasBytesAvailable;
+					[asyncSocket doReadData];
+				}
 			}});
+			
+			break;
+		}
+		default:
+		{
+			NSError *error = (__bridge_transfer  NSError *)CFReadStreamCopyError(stream);
+			
+			if (error == nil && type == kCFStreamEventEndEncountered)
+			{
+				error = [asyncSocket connectionClosedError];
+			}
+			
+			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
+				
+				LogCVerbose(@"CFReadStreamCallback - Other");
+				
+				if (asyncSocket->readStream != stream)
+					return_from_block;
+				
+				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
+				{
+					[asyncSocket cf_abortSSLHandshake:error];
+				}
+				else
+				{
+					[asyncSocket closeWithError:error];
+				}
+			}});
+			
+			break;
 		}
-		
-		[self endCurrentRead];
-		[self endCurrentWrite];
-		
-		[self maybeDequeueRead];
-		[self maybeDequeueWrite];
 	}
-	else if (status == errSSLPeerAuthCompleted)
+	
+}
+
+static void CFWriteStreamCallback (CFWriteStreamRef stream, CFStreamEventType type, void *pInfo)
+{
+	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)pInfo;
+	
+	switch(type)
 	{
-		LogVerbose(@"SSLHandshake peerAuthCompleted - awaiting delegate approval");
-		
-		__block SecTrustRef trust = NULL;
-		status = SSLCopyPeerTrust(sslContext, &trust);
-		if (status != noErr)
+		case kCFStreamEventCanAcceptBytes:
 		{
-			[self closeWithError:[self sslError:status]];
-			return;
+			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
+				
+				LogCVerbose(@"CFWriteStreamCallback - CanAcceptBytes");
+				
+				if (asyncSocket->writeStream != stream)
+					return_from_block;
+				
+				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
+				{
+					// If we set kCFStreamPropertySSLSettings before we opened the streams, this might be a lie.
+					// (A callback related to the tcp stream, but not to the SSL layer).
+					
+					if (CFWriteStreamCanAcceptBytes(asyncSocket->writeStream))
+					{
+						asyncSocket->flags |= kSocketCanAcceptBytes;
+						[asyncSocket cf_finishSSLHandshake];
+					}
+				}
+				else
+				{
+					asyncSocket->flags |= kSocketCanAcceptBytes;
+					[asyncSocket doWriteData];
+				}
+			}});
+			
+			break;
 		}
-		
-		int aStateIndex = stateIndex;
-		dispatch_queue_t theSocketQueue = socketQueue;
-		
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-		void (^comletionHandler)(BOOL) = ^(BOOL shouldTrust){ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		default:
+		{
+			NSError *error = (__bridge_transfer NSError *)CFWriteStreamCopyError(stream);
 			
-			dispatch_async(theSocketQueue, ^{ @autoreleasepool {
+			if (error == nil && type == kCFStreamEventEndEncountered)
+			{
+				error = [asyncSocket connectionClosedError];
+			}
+			
+			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
 				
-				if (trust) {
-					CFRelease(trust);
-					trust = NULL;
-				}
+				LogCVerbose(@"CFWriteStreamCallback - Other");
 				
-				__strong GCDAsyncSocket *strongSelf = weakSelf;
-				if (strongSelf)
+				if (asyncSocket->writeStream != stream)
+					return_from_block;
+				
+				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
 				{
-					[strongSelf ssl_shouldTrustPeer:shouldTrust stateIndex:aStateIndex];
+					[asyncSocket cf_abortSSLHandshake:error];
+				}
+				else
+				{
+					[asyncSocket closeWithError:error];
 				}
 			}});
 			
-		#pragma clang diagnostic pop
-		}};
-		
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
+			break;
+		}
+	}
+	
+}
+
+- (BOOL)createReadAndWriteStream
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (readStream || writeStream)
+	{
+		// Streams already created
+		return YES;
+	}
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	
+	if (socketFD == SOCKET_NULL)
+	{
+		// Cannot create streams without a file descriptor
+		return NO;
+	}
+	
+	if (![self isConnected])
+	{
+		// Cannot create streams until file descriptor is connected
+		return NO;
+	}
+	
+	LogVerbose(@"Creating read and write stream...");
+	
+	CFStreamCreatePairWithSocket(NULL, (CFSocketNativeHandle)socketFD, &readStream, &writeStream);
+	
+	// The kCFStreamPropertyShouldCloseNativeSocket property should be false by default (for our case).
+	// But let's not take any chances.
+	
+	if (readStream)
+		CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanFalse);
+	if (writeStream)
+		CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanFalse);
+	
+	if ((readStream == NULL) || (writeStream == NULL))
+	{
+		LogWarn(@"Unable to create read and write stream...");
 		
-		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReceiveTrust:completionHandler:)])
+		if (readStream)
 		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-				[theDelegate socket:self didReceiveTrust:trust completionHandler:comletionHandler];
-			}});
+			CFReadStreamClose(readStream);
+			CFRelease(readStream);
+			readStream = NULL;
 		}
-		else
+		if (writeStream)
 		{
-			if (trust) {
-				CFRelease(trust);
-				trust = NULL;
-			}
-			
-			NSString *msg = @"GCDAsyncSocketManuallyEvaluateTrust specified in tlsSettings,"
-			                @" but delegate doesn't implement socket:shouldTrustPeer:";
-			
-			[self closeWithError:[self otherError:msg]];
-			return;
+			CFWriteStreamClose(writeStream);
+			CFRelease(writeStream);
+			writeStream = NULL;
 		}
-	}
-	else if (status == errSSLWouldBlock)
-	{
-		LogVerbose(@"SSLHandshake continues...");
 		
-		// Handshake continues...
-		// 
-		// This method will be called again from doReadData or doWriteData.
-	}
-	else
-	{
-		[self closeWithError:[self sslError:status]];
+		return NO;
 	}
+	
+	return YES;
 }
 
-- (void)ssl_shouldTrustPeer:(BOOL)shouldTrust stateIndex:(int)aStateIndex
+- (BOOL)registerForStreamCallbacksIncludingReadWrite:(BOOL)includeReadWrite
 {
-	LogTrace();
+	LogVerbose(@"%@ %@", THIS_METHOD, (includeReadWrite ? @"YES" : @"NO"));
 	
-	if (aStateIndex != stateIndex)
-	{
-		LogInfo(@"Ignoring ssl_shouldTrustPeer - invalid state (maybe disconnected)");
-		
-		// One of the following is true
-		// - the socket was disconnected
-		// - the startTLS operation timed out
-		// - the completionHandler was already invoked once
-		
-		return;
-	}
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
 	
-	// Increment stateIndex to ensure completionHandler can only be called once.
-	stateIndex++;
+	streamContext.version = 0;
+	streamContext.info = (__bridge void *)(self);
+	streamContext.retain = nil;
+	streamContext.release = nil;
+	streamContext.copyDescription = nil;
 	
-	if (shouldTrust)
+	CFOptionFlags readStreamEvents = kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered;
+	if (includeReadWrite)
+		readStreamEvents |= kCFStreamEventHasBytesAvailable;
+	
+	if (!CFReadStreamSetClient(readStream, readStreamEvents, &CFReadStreamCallback, &streamContext))
 	{
-        NSAssert(lastSSLHandshakeError == errSSLPeerAuthCompleted, @"ssl_shouldTrustPeer called when last error is %d and not errSSLPeerAuthCompleted", (int)lastSSLHandshakeError);
-		[self ssl_continueSSLHandshake];
+		return NO;
 	}
-	else
+	
+	CFOptionFlags writeStreamEvents = kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered;
+	if (includeReadWrite)
+		writeStreamEvents |= kCFStreamEventCanAcceptBytes;
+	
+	if (!CFWriteStreamSetClient(writeStream, writeStreamEvents, &CFWriteStreamCallback, &streamContext))
 	{
-		[self closeWithError:[self sslError:errSSLPeerBadCert]];
+		return NO;
 	}
+	
+	return YES;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Security via CFStream
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-#if TARGET_OS_IPHONE
-
-- (void)cf_finishSSLHandshake
+- (BOOL)addStreamsToRunLoop
 {
 	LogTrace();
 	
-	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
+	
+	if (!(flags & kAddedStreamsToRunLoop))
 	{
-		flags &= ~kStartingReadTLS;
-		flags &= ~kStartingWriteTLS;
-		
-		flags |= kSocketSecure;
-		
-		__strong id<GCDAsyncSocketDelegate> theDelegate = delegate;
-
-		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
-		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
-				
-				[theDelegate socketDidSecure:self];
-			}});
-		}
-		
-		[self endCurrentRead];
-		[self endCurrentWrite];
+		LogVerbose(@"Adding streams to runloop...");
 		
-		[self maybeDequeueRead];
-		[self maybeDequeueWrite];
+		[[self class] startCFStreamThreadIfNeeded];
+        dispatch_sync(cfstreamThreadSetupQueue, ^{
+            [[self class] performSelector:@selector(scheduleCFStreams:)
+                                 onThread:cfstreamThread
+                               withObject:self
+                            waitUntilDone:YES];
+        });
+		flags |= kAddedStreamsToRunLoop;
 	}
+	
+	return YES;
 }
 
-- (void)cf_abortSSLHandshake:(NSError *)error
+- (void)removeStreamsFromRunLoop
 {
 	LogTrace();
 	
-	if ((flags & kStartingReadTLS) && (flags & kStartingWriteTLS))
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
+	
+	if (flags & kAddedStreamsToRunLoop)
 	{
-		flags &= ~kStartingReadTLS;
-		flags &= ~kStartingWriteTLS;
+		LogVerbose(@"Removing streams from runloop...");
+        
+        dispatch_sync(cfstreamThreadSetupQueue, ^{
+            [[self class] performSelector:@selector(unscheduleCFStreams:)
+                                 onThread:cfstreamThread
+                               withObject:self
+                            waitUntilDone:YES];
+        });
+		[[self class] stopCFStreamThreadIfNeeded];
 		
-		[self closeWithError:error];
+		flags &= ~kAddedStreamsToRunLoop;
 	}
 }
 
-- (void)cf_startTLS
+- (BOOL)openStreams
 {
 	LogTrace();
 	
-	LogVerbose(@"Starting TLS (via CFStream)...");
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
 	
-	if ([preBuffer availableBytes] > 0)
+	CFStreamStatus readStatus = CFReadStreamGetStatus(readStream);
+	CFStreamStatus writeStatus = CFWriteStreamGetStatus(writeStream);
+	
+	if ((readStatus == kCFStreamStatusNotOpen) || (writeStatus == kCFStreamStatusNotOpen))
 	{
-		NSString *msg = @"Invalid TLS transition. Handshake has already been read from socket.";
+		LogVerbose(@"Opening read and write stream...");
 		
-		[self closeWithError:[self otherError:msg]];
-		return;
+		BOOL r1 = CFReadStreamOpen(readStream);
+		BOOL r2 = CFWriteStreamOpen(writeStream);
+		
+		if (!r1 || !r2)
+		{
+			LogError(@"Error in CFStreamOpen");
+			return NO;
+		}
 	}
 	
-	[self suspendReadSource];
-	[self suspendWriteSource];
-	
-	socketFDBytesAvailable = 0;
-	flags &= ~kSocketCanAcceptBytes;
-	flags &= ~kSecureSocketHasBytesAvailable;
-	
-	flags |=  kUsingCFStreamForTLS;
-	
-	if (![self createReadAndWriteStream])
-	{
-		[self closeWithError:[self otherError:@"Error in CFStreamCreatePairWithSocket"]];
-		return;
-	}
+	return YES;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Advanced
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * See header file for big discussion of this method.
+**/
+- (BOOL)autoDisconnectOnClosedReadStream
+{
+	// Note: YES means kAllowHalfDuplexConnection is OFF
 	
-	if (![self registerForStreamCallbacksIncludingReadWrite:YES])
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
-		return;
+		return ((config & kAllowHalfDuplexConnection) == 0);
 	}
-	
-	if (![self addStreamsToRunLoop])
+	else
 	{
-		[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
-		return;
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+            result = ((self->config & kAllowHalfDuplexConnection) == 0);
+		});
+		
+		return result;
 	}
+}
+
+/**
+ * See header file for big discussion of this method.
+**/
+- (void)setAutoDisconnectOnClosedReadStream:(BOOL)flag
+{
+	// Note: YES means kAllowHalfDuplexConnection is OFF
 	
-	NSAssert([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]], @"Invalid read packet for startTLS");
-	NSAssert([currentWrite isKindOfClass:[GCDAsyncSpecialPacket class]], @"Invalid write packet for startTLS");
-	
-	GCDAsyncSpecialPacket *tlsPacket = (GCDAsyncSpecialPacket *)currentRead;
-	CFDictionaryRef tlsSettings = (__bridge CFDictionaryRef)tlsPacket->tlsSettings;
-	
-	// Getting an error concerning kCFStreamPropertySSLSettings ?
-	// You need to add the CFNetwork framework to your iOS application.
-	
-	BOOL r1 = CFReadStreamSetProperty(readStream, kCFStreamPropertySSLSettings, tlsSettings);
-	BOOL r2 = CFWriteStreamSetProperty(writeStream, kCFStreamPropertySSLSettings, tlsSettings);
-	
-	// For some reason, starting around the time of iOS 4.3,
-	// the first call to set the kCFStreamPropertySSLSettings will return true,
-	// but the second will return false.
-	// 
-	// Order doesn't seem to matter.
-	// So you could call CFReadStreamSetProperty and then CFWriteStreamSetProperty, or you could reverse the order.
-	// Either way, the first call will return true, and the second returns false.
-	// 
-	// Interestingly, this doesn't seem to affect anything.
-	// Which is not altogether unusual, as the documentation seems to suggest that (for many settings)
-	// setting it on one side of the stream automatically sets it for the other side of the stream.
-	// 
-	// Although there isn't anything in the documentation to suggest that the second attempt would fail.
-	// 
-	// Furthermore, this only seems to affect streams that are negotiating a security upgrade.
-	// In other words, the socket gets connected, there is some back-and-forth communication over the unsecure
-	// connection, and then a startTLS is issued.
-	// So this mostly affects newer protocols (XMPP, IMAP) as opposed to older protocols (HTTPS).
-	
-	if (!r1 && !r2) // Yes, the && is correct - workaround for apple bug.
+	dispatch_block_t block = ^{
+		
+		if (flag)
+            self->config &= ~kAllowHalfDuplexConnection;
+		else
+            self->config |= kAllowHalfDuplexConnection;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+
+- (BOOL)synchronousDelegateCallbacks
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		[self closeWithError:[self otherError:@"Error in CFStreamSetProperty"]];
-		return;
+		return ((config & kSynchronousDelegateCalls) != 0);
 	}
-	
-	if (![self openStreams])
+	else
 	{
-		[self closeWithError:[self otherError:@"Error in CFStreamOpen"]];
-		return;
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = ((self->config & kSynchronousDelegateCalls) != 0);
+		});
+		
+		return result;
 	}
-	
-	LogVerbose(@"Waiting for SSL Handshake to complete...");
 }
 
-#endif
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark CFStream
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (void)setSynchronousDelegateCallbacks:(BOOL)flag
+{
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			self->config |= kSynchronousDelegateCalls;
+		else
+			self->config &= ~kSynchronousDelegateCalls;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
 
-#if TARGET_OS_IPHONE
+- (BOOL)synchronousWrites
+{
+	return atomic_load(&synchronousWrites);
+}
 
-+ (void)ignore:(id)_
-{}
+- (void)setSynchronousWrites:(BOOL)flag
+{
+	atomic_store(&synchronousWrites, flag);
+}
 
-+ (void)startCFStreamThreadIfNeeded
+/**
+ * Invokes a read/write delegate callback.
+ * 
+ * If synchronousDelegateCallbacks is enabled, and the delegateQueue is the socketQueue,
+ * the block is invoked inline (we're already on the right queue).
+ * Otherwise it's dispatched asynchronously onto the delegateQueue, as usual.
+**/
+- (void)invokeDataDelegateBlock:(dispatch_block_t)block
 {
-	LogTrace();
+	if ((flags & kDisconnectAfterCallout) && (config & kSynchronousDelegateCalls) && (delegateQueue == socketQueue))
+	{
+		// The user asked to disconnect from within an earlier callout.
+		// The socket is about to be closed, so don't report anything further to the delegate.
+		// 
+		// Note that completion blocks are exempt from this: each one is promised a result (or an error).
+		return;
+	}
 	
-	static dispatch_once_t predicate;
-	dispatch_once(&predicate, ^{
-		
-		cfstreamThreadRetainCount = 0;
-		cfstreamThreadSetupQueue = dispatch_queue_create("GCDAsyncSocket-CFStreamThreadSetup", DISPATCH_QUEUE_SERIAL);
-	});
+	[self invokeDataBlock:block onQueue:delegateQueue];
+}
+
+/**
+ * Invokes the completion block of a block-based read/write on the completionQueue.
+ * If no completionQueue is set, the delegateQueue is used, or failing that, the main queue.
+**/
+- (void)invokeCompletionBlock:(dispatch_block_t)block
+{
+	dispatch_queue_t queue = completionQueue ? completionQueue : (delegateQueue ? delegateQueue : dispatch_get_main_queue());
 	
-	dispatch_sync(cfstreamThreadSetupQueue, ^{ @autoreleasepool {
+	[self invokeDataBlock:block onQueue:queue];
+}
+
+/**
+ * Same as invokeCompletionBlock:, but internal completions (i.e. those of a relay) are invoked right away,
+ * on the socketQueue. Like synchronous delegate calls, they may queue further reads & writes directly.
+**/
+- (void)invokeCompletionBlock:(dispatch_block_t)block onSocketQueue:(BOOL)onSocketQueue
+{
+	if (onSocketQueue)
+	{
+		delegateCalloutDepth++;
 		
-		if (++cfstreamThreadRetainCount == 1)
-		{
-			cfstreamThread = [[NSThread alloc] initWithTarget:self
-			                                         selector:@selector(cfstreamThread:)
-			                                           object:nil];
-			[cfstreamThread start];
+		@autoreleasepool {
+			block();
 		}
-	}});
+		
+		delegateCalloutDepth--;
+	}
+	else
+	{
+		[self invokeCompletionBlock:block];
+	}
 }
 
-+ (void)stopCFStreamThreadIfNeeded
+- (void)invokeDataBlock:(dispatch_block_t)block onQueue:(dispatch_queue_t)queue
 {
-	LogTrace();
-	
-	// The creation of the cfstreamThread is relatively expensive.
-	// So we'd like to keep it available for recycling.
-	// However, there's a tradeoff here, because it shouldn't remain alive forever.
-	// So what we're going to do is use a little delay before taking it down.
-	// This way it can be reused properly in situations where multiple sockets are continually in flux.
-	
-	int delayInSeconds = 30;
-	dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delayInSeconds * NSEC_PER_SEC));
-	dispatch_after(when, cfstreamThreadSetupQueue, ^{ @autoreleasepool {
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+	if ((config & kSynchronousDelegateCalls) && (queue == socketQueue))
+	{
+		delegateCalloutDepth++;
 		
-		if (cfstreamThreadRetainCount == 0)
-		{
-			LogWarn(@"Logic error concerning cfstreamThread start / stop");
-			return_from_block;
+		@autoreleasepool {
+			block();
 		}
 		
-		if (--cfstreamThreadRetainCount == 0)
-		{
-			[cfstreamThread cancel]; // set isCancelled flag
+		delegateCalloutDepth--;
+	}
+	else
+	{
+		dispatch_async(queue, ^{ @autoreleasepool {
 			
-			// wake up the thread
-            [[self class] performSelector:@selector(ignore:)
-                                 onThread:cfstreamThread
-                               withObject:[NSNull null]
-                            waitUntilDone:NO];
-            
-			cfstreamThread = nil;
-		}
-		
-	#pragma clang diagnostic pop
-	}});
+			block();
+		}});
+	}
 }
 
-+ (void)cfstreamThread:(id)unused { @autoreleasepool
+/**
+ * See header file for big discussion of this method.
+**/
+- (void)markSocketQueueTargetQueue:(dispatch_queue_t)socketNewTargetQueue
 {
-	[[NSThread currentThread] setName:GCDAsyncSocketThreadName];
-	
-	LogInfo(@"CFStreamThread: Started");
-	
-	// We can't run the run loop unless it has an associated input source or a timer.
-	// So we'll just create a timer that will never fire - unless the server runs for decades.
-	[NSTimer scheduledTimerWithTimeInterval:[[NSDate distantFuture] timeIntervalSinceNow]
-	                                 target:self
-	                               selector:@selector(ignore:)
-	                               userInfo:nil
-	                                repeats:YES];
-	
-	NSThread *currentThread = [NSThread currentThread];
-	NSRunLoop *currentRunLoop = [NSRunLoop currentRunLoop];
+	void *nonNullUnusedPointer = (__bridge void *)self;
+	dispatch_queue_set_specific(socketNewTargetQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
+}
+
+/**
+ * See header file for big discussion of this method.
+**/
+- (void)unmarkSocketQueueTargetQueue:(dispatch_queue_t)socketOldTargetQueue
+{
+	dispatch_queue_set_specific(socketOldTargetQueue, IsOnSocketQueueOrTargetQueueKey, NULL, NULL);
+}
+
+/**
+ * See header file for big discussion of this method.
+**/
+- (void)performBlock:(dispatch_block_t)block
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+}
+
+/**
+ * Questions? Have you read the header file?
+**/
+- (int)socketFD
+{
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return SOCKET_NULL;
+	}
 	
-	BOOL isCancelled = [currentThread isCancelled];
+	if (socket4FD != SOCKET_NULL)
+		return socket4FD;
+	else
+		return socket6FD;
+}
+
+/**
+ * Questions? Have you read the header file?
+**/
+- (int)socket4FD
+{
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return SOCKET_NULL;
+	}
 	
-	while (!isCancelled && [currentRunLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]])
+	return socket4FD;
+}
+
+/**
+ * Questions? Have you read the header file?
+**/
+- (int)socket6FD
+{
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		isCancelled = [currentThread isCancelled];
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return SOCKET_NULL;
 	}
 	
-	LogInfo(@"CFStreamThread: Stopped");
-}}
+	return socket6FD;
+}
 
-+ (void)scheduleCFStreams:(GCDAsyncSocket *)asyncSocket
+#if TARGET_OS_IPHONE
+
+/**
+ * Questions? Have you read the header file?
+**/
+- (CFReadStreamRef)readStream
 {
-	LogTrace();
-	NSAssert([NSThread currentThread] == cfstreamThread, @"Invoked on wrong thread");
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return NULL;
+	}
 	
-	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+	if (readStream == NULL)
+		[self createReadAndWriteStream];
 	
-	if (asyncSocket->readStream)
-		CFReadStreamScheduleWithRunLoop(asyncSocket->readStream, runLoop, kCFRunLoopDefaultMode);
+	return readStream;
+}
+
+/**
+ * Questions? Have you read the header file?
+**/
+- (CFWriteStreamRef)writeStream
+{
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return NULL;
+	}
+	
+	if (writeStream == NULL)
+		[self createReadAndWriteStream];
 	
-	if (asyncSocket->writeStream)
-		CFWriteStreamScheduleWithRunLoop(asyncSocket->writeStream, runLoop, kCFRunLoopDefaultMode);
+	return writeStream;
 }
 
-+ (void)unscheduleCFStreams:(GCDAsyncSocket *)asyncSocket
+- (BOOL)enableBackgroundingOnSocketWithCaveat:(BOOL)caveat
 {
-	LogTrace();
-	NSAssert([NSThread currentThread] == cfstreamThread, @"Invoked on wrong thread");
+	if (![self createReadAndWriteStream])
+	{
+		// Error occurred creating streams (perhaps socket isn't open)
+		return NO;
+	}
 	
-	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+	BOOL r1, r2;
 	
-	if (asyncSocket->readStream)
-		CFReadStreamUnscheduleFromRunLoop(asyncSocket->readStream, runLoop, kCFRunLoopDefaultMode);
+	LogVerbose(@"Enabling backgrouding on socket");
 	
-	if (asyncSocket->writeStream)
-		CFWriteStreamUnscheduleFromRunLoop(asyncSocket->writeStream, runLoop, kCFRunLoopDefaultMode);
-}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	r1 = CFReadStreamSetProperty(readStream, kCFStreamNetworkServiceType, kCFStreamNetworkServiceTypeVoIP);
+	r2 = CFWriteStreamSetProperty(writeStream, kCFStreamNetworkServiceType, kCFStreamNetworkServiceTypeVoIP);
+#pragma clang diagnostic pop
 
-static void CFReadStreamCallback (CFReadStreamRef stream, CFStreamEventType type, void *pInfo)
-{
-	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)pInfo;
+	if (!r1 || !r2)
+	{
+		return NO;
+	}
 	
-	switch(type)
+	if (!caveat)
 	{
-		case kCFStreamEventHasBytesAvailable:
-		{
-			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
-				
-				LogCVerbose(@"CFReadStreamCallback - HasBytesAvailable");
-				
-				if (asyncSocket->readStream != stream)
-					return_from_block;
-				
-				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
-				{
-					// If we set kCFStreamPropertySSLSettings before we opened the streams, this might be a lie.
-					// (A callback related to the tcp stream, but not to the SSL layer).
-					
-					if (CFReadStreamHasBytesAvailable(asyncSocket->readStream))
-					{
-						asyncSocket->flags |= kSecureSocketHasBytesAvailable;
-						[asyncSocket cf_finishSSLHandshake];
-					}
-				}
-				else
-				{
-					asyncSocket->flags |= kSecureSocketHasBytesAvailable;
-					[asyncSocket doReadData];
-				}
-			}});
-			
-			break;
-		}
-		default:
+		if (![self openStreams])
 		{
-			NSError *error = (__bridge_transfer  NSError *)CFReadStreamCopyError(stream);
-			
-			if (error == nil && type == kCFStreamEventEndEncountered)
-			{
-				error = [asyncSocket connectionClosedError];
-			}
-			
-			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
-				
-				LogCVerbose(@"CFReadStreamCallback - Other");
-				
-				if (asyncSocket->readStream != stream)
-					return_from_block;
-				
-				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
-				{
-					[asyncSocket cf_abortSSLHandshake:error];
-				}
-				else
-				{
-					[asyncSocket closeWithError:error];
-				}
-			}});
-			
-			break;
+			return NO;
 		}
 	}
 	
+	return YES;
 }
 
-static void CFWriteStreamCallback (CFWriteStreamRef stream, CFStreamEventType type, void *pInfo)
+/**
+ * Questions? Have you read the header file?
+**/
+- (BOOL)enableBackgroundingOnSocket
 {
-	GCDAsyncSocket *asyncSocket = (__bridge GCDAsyncSocket *)pInfo;
+	LogTrace();
 	
-	switch(type)
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		case kCFStreamEventCanAcceptBytes:
-		{
-			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
-				
-				LogCVerbose(@"CFWriteStreamCallback - CanAcceptBytes");
-				
-				if (asyncSocket->writeStream != stream)
-					return_from_block;
-				
-				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
-				{
-					// If we set kCFStreamPropertySSLSettings before we opened the streams, this might be a lie.
-					// (A callback related to the tcp stream, but not to the SSL layer).
-					
-					if (CFWriteStreamCanAcceptBytes(asyncSocket->writeStream))
-					{
-						asyncSocket->flags |= kSocketCanAcceptBytes;
-						[asyncSocket cf_finishSSLHandshake];
-					}
-				}
-				else
-				{
-					asyncSocket->flags |= kSocketCanAcceptBytes;
-					[asyncSocket doWriteData];
-				}
-			}});
-			
-			break;
-		}
-		default:
-		{
-			NSError *error = (__bridge_transfer NSError *)CFWriteStreamCopyError(stream);
-			
-			if (error == nil && type == kCFStreamEventEndEncountered)
-			{
-				error = [asyncSocket connectionClosedError];
-			}
-			
-			dispatch_async(asyncSocket->socketQueue, ^{ @autoreleasepool {
-				
-				LogCVerbose(@"CFWriteStreamCallback - Other");
-				
-				if (asyncSocket->writeStream != stream)
-					return_from_block;
-				
-				if ((asyncSocket->flags & kStartingReadTLS) && (asyncSocket->flags & kStartingWriteTLS))
-				{
-					[asyncSocket cf_abortSSLHandshake:error];
-				}
-				else
-				{
-					[asyncSocket closeWithError:error];
-				}
-			}});
-			
-			break;
-		}
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return NO;
 	}
 	
+	return [self enableBackgroundingOnSocketWithCaveat:NO];
 }
 
-- (BOOL)createReadAndWriteStream
+- (BOOL)enableBackgroundingOnSocketWithCaveat // Deprecated in iOS 4.???
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	
-	if (readStream || writeStream)
-	{
-		// Streams already created
-		return YES;
-	}
+	// This method was created as a workaround for a bug in iOS.
+	// Apple has since fixed this bug.
+	// I'm not entirely sure which version of iOS they fixed it in...
 	
-	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : (socket6FD != SOCKET_NULL) ? socket6FD : socketUN;
+	LogTrace();
 	
-	if (socketFD == SOCKET_NULL)
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		// Cannot create streams without a file descriptor
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
 		return NO;
 	}
 	
-	if (![self isConnected])
+	return [self enableBackgroundingOnSocketWithCaveat:YES];
+}
+
+#endif
+
+- (SSLContextRef)sslContext
+{
+	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		// Cannot create streams until file descriptor is connected
-		return NO;
+		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
+		return NULL;
 	}
 	
-	LogVerbose(@"Creating read and write stream...");
-	
-	CFStreamCreatePairWithSocket(NULL, (CFSocketNativeHandle)socketFD, &readStream, &writeStream);
-	
-	// The kCFStreamPropertyShouldCloseNativeSocket property should be false by default (for our case).
-	// But let's not take any chances.
+	return sslContext;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Class Utilities
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
++ (NSMutableArray *)lookupHost:(NSString *)host port:(uint16_t)port error:(NSError **)errPtr
+{
+	LogTrace();
 	
-	if (readStream)
-		CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanFalse);
-	if (writeStream)
-		CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanFalse);
+	NSMutableArray *addresses = nil;
+	NSError *error = nil;
 	
-	if ((readStream == NULL) || (writeStream == NULL))
+	if ([host isEqualToString:@"localhost"] || [host isEqualToString:@"loopback"])
 	{
-		LogWarn(@"Unable to create read and write stream...");
+		// Use LOOPBACK address
+		struct sockaddr_in nativeAddr4;
+		nativeAddr4.sin_len         = sizeof(struct sockaddr_in);
+		nativeAddr4.sin_family      = AF_INET;
+		nativeAddr4.sin_port        = htons(port);
+		nativeAddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		memset(&(nativeAddr4.sin_zero), 0, sizeof(nativeAddr4.sin_zero));
+		
+		struct sockaddr_in6 nativeAddr6;
+		nativeAddr6.sin6_len        = sizeof(struct sockaddr_in6);
+		nativeAddr6.sin6_family     = AF_INET6;
+		nativeAddr6.sin6_port       = htons(port);
+		nativeAddr6.sin6_flowinfo   = 0;
+		nativeAddr6.sin6_addr       = in6addr_loopback;
+		nativeAddr6.sin6_scope_id   = 0;
+		
+		// Wrap the native address structures
+		
+		NSData *address4 = [NSData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
+		NSData *address6 = [NSData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
+		
+		addresses = [NSMutableArray arrayWithCapacity:2];
+		[addresses addObject:address4];
+		[addresses addObject:address6];
+	}
+	else
+	{
+		NSString *portStr = [NSString stringWithFormat:@"%hu", port];
+		
+		struct addrinfo hints, *res, *res0;
+		
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = PF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		
+		int gai_error = getaddrinfo([host UTF8String], [portStr UTF8String], &hints, &res0);
 		
-		if (readStream)
+		if (gai_error)
 		{
-			CFReadStreamClose(readStream);
-			CFRelease(readStream);
-			readStream = NULL;
+			error = [self gaiError:gai_error];
 		}
-		if (writeStream)
+		else
 		{
-			CFWriteStreamClose(writeStream);
-			CFRelease(writeStream);
-			writeStream = NULL;
+			NSUInteger capacity = 0;
+			for (res = res0; res; res = res->ai_next)
+			{
+				if (res->ai_family == AF_INET || res->ai_family == AF_INET6) {
+					capacity++;
+				}
+			}
+			
+			addresses = [NSMutableArray arrayWithCapacity:capacity];
+			
+			for (res = res0; res; res = res->ai_next)
+			{
+				if (res->ai_family == AF_INET)
+				{
+					// Found IPv4 address.
+					// Wrap the native address structure, and add to results.
+					
+					NSData *address4 = [NSData dataWithBytes:res->ai_addr length:res->ai_addrlen];
+					[addresses addObject:address4];
+				}
+				else if (res->ai_family == AF_INET6)
+				{
+					// Fixes connection issues with IPv6
+					// https://github.com/robbiehanson/CocoaAsyncSocket/issues/429#issuecomment-222477158
+					
+					// Found IPv6 address.
+					// Wrap the native address structure, and add to results.
+					
+					struct sockaddr_in6 *sockaddr = (struct sockaddr_in6 *)(void *)res->ai_addr;
+					in_port_t *portPtr = &sockaddr->sin6_port;
+					if ((portPtr != NULL) && (*portPtr == 0)) {
+					        *portPtr = htons(port);
+					}
+
+					NSData *address6 = [NSData dataWithBytes:res->ai_addr length:res->ai_addrlen];
+					[addresses addObject:address6];
+				}
+			}
+			freeaddrinfo(res0);
+			
+			if ([addresses count] == 0)
+			{
+				error = [self gaiError:EAI_FAIL];
+			}
 		}
-		
-		return NO;
 	}
 	
-	return YES;
+	if (errPtr) *errPtr = error;
+	return addresses;
 }
 
-- (BOOL)registerForStreamCallbacksIncludingReadWrite:(BOOL)includeReadWrite
++ (NSString *)hostFromSockaddr4:(const struct sockaddr_in *)pSockaddr4
 {
-	LogVerbose(@"%@ %@", THIS_METHOD, (includeReadWrite ? @"YES" : @"NO"));
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
-	
-	streamContext.version = 0;
-	streamContext.info = (__bridge void *)(self);
-	streamContext.retain = nil;
-	streamContext.release = nil;
-	streamContext.copyDescription = nil;
-	
-	CFOptionFlags readStreamEvents = kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered;
-	if (includeReadWrite)
-		readStreamEvents |= kCFStreamEventHasBytesAvailable;
-	
-	if (!CFReadStreamSetClient(readStream, readStreamEvents, &CFReadStreamCallback, &streamContext))
-	{
-		return NO;
-	}
-	
-	CFOptionFlags writeStreamEvents = kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered;
-	if (includeReadWrite)
-		writeStreamEvents |= kCFStreamEventCanAcceptBytes;
+	char addrBuf[INET_ADDRSTRLEN];
 	
-	if (!CFWriteStreamSetClient(writeStream, writeStreamEvents, &CFWriteStreamCallback, &streamContext))
+	if (inet_ntop(AF_INET, &pSockaddr4->sin_addr, addrBuf, (socklen_t)sizeof(addrBuf)) == NULL)
 	{
-		return NO;
+		addrBuf[0] = '\0';
 	}
 	
-	return YES;
+	return [NSString stringWithCString:addrBuf encoding:NSASCIIStringEncoding];
 }
 
-- (BOOL)addStreamsToRunLoop
++ (NSString *)hostFromSockaddr6:(const struct sockaddr_in6 *)pSockaddr6
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
+	char addrBuf[INET6_ADDRSTRLEN];
 	
-	if (!(flags & kAddedStreamsToRunLoop))
+	if (inet_ntop(AF_INET6, &pSockaddr6->sin6_addr, addrBuf, (socklen_t)sizeof(addrBuf)) == NULL)
 	{
-		LogVerbose(@"Adding streams to runloop...");
-		
-		[[self class] startCFStreamThreadIfNeeded];
-        dispatch_sync(cfstreamThreadSetupQueue, ^{
-            [[self class] performSelector:@selector(scheduleCFStreams:)
-                                 onThread:cfstreamThread
-                               withObject:self
-                            waitUntilDone:YES];
-        });
-		flags |= kAddedStreamsToRunLoop;
+		addrBuf[0] = '\0';
 	}
 	
-	return YES;
+	return [NSString stringWithCString:addrBuf encoding:NSASCIIStringEncoding];
 }
 
-- (void)removeStreamsFromRunLoop
++ (uint16_t)portFromSockaddr4:(const struct sockaddr_in *)pSockaddr4
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
-	
-	if (flags & kAddedStreamsToRunLoop)
-	{
-		LogVerbose(@"Removing streams from runloop...");
-        
-        dispatch_sync(cfstreamThreadSetupQueue, ^{
-            [[self class] performSelector:@selector(unscheduleCFStreams:)
-                                 onThread:cfstreamThread
-                               withObject:self
-                            waitUntilDone:YES];
-        });
-		[[self class] stopCFStreamThreadIfNeeded];
-		
-		flags &= ~kAddedStreamsToRunLoop;
-	}
+	return ntohs(pSockaddr4->sin_port);
 }
 
-- (BOOL)openStreams
++ (uint16_t)portFromSockaddr6:(const struct sockaddr_in6 *)pSockaddr6
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert((readStream != NULL && writeStream != NULL), @"Read/Write stream is null");
+	return ntohs(pSockaddr6->sin6_port);
+}
+
++ (NSURL *)urlFromSockaddrUN:(const struct sockaddr_un *)pSockaddr
+{
+	NSString *path = [NSString stringWithUTF8String:pSockaddr->sun_path];
+	return [NSURL fileURLWithPath:path];
+}
+
++ (NSString *)hostFromAddress:(NSData *)address
+{
+	NSString *host;
 	
-	CFStreamStatus readStatus = CFReadStreamGetStatus(readStream);
-	CFStreamStatus writeStatus = CFWriteStreamGetStatus(writeStream);
+	if ([self getHost:&host port:NULL fromAddress:address])
+		return host;
+	else
+		return nil;
+}
+
++ (uint16_t)portFromAddress:(NSData *)address
+{
+	uint16_t port;
 	
-	if ((readStatus == kCFStreamStatusNotOpen) || (writeStatus == kCFStreamStatusNotOpen))
+	if ([self getHost:NULL port:&port fromAddress:address])
+		return port;
+	else
+		return 0;
+}
+
++ (BOOL)isIPv4Address:(NSData *)address
+{
+	if ([address length] >= sizeof(struct sockaddr))
 	{
-		LogVerbose(@"Opening read and write stream...");
-		
-		BOOL r1 = CFReadStreamOpen(readStream);
-		BOOL r2 = CFWriteStreamOpen(writeStream);
+		const struct sockaddr *sockaddrX = [address bytes];
 		
-		if (!r1 || !r2)
-		{
-			LogError(@"Error in CFStreamOpen");
-			return NO;
+		if (sockaddrX->sa_family == AF_INET) {
+			return YES;
 		}
 	}
 	
-	return YES;
+	return NO;
 }
 
-#endif
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Advanced
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-/**
- * See header file for big discussion of this method.
-**/
-- (BOOL)autoDisconnectOnClosedReadStream
++ (BOOL)isIPv6Address:(NSData *)address
 {
-	// Note: YES means kAllowHalfDuplexConnection is OFF
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return ((config & kAllowHalfDuplexConnection) == 0);
-	}
-	else
+	if ([address length] >= sizeof(struct sockaddr))
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-            result = ((self->config & kAllowHalfDuplexConnection) == 0);
-		});
+		const struct sockaddr *sockaddrX = [address bytes];
 		
-		return result;
+		if (sockaddrX->sa_family == AF_INET6) {
+			return YES;
+		}
 	}
+	
+	return NO;
 }
 
-/**
- * See header file for big discussion of this method.
-**/
-- (void)setAutoDisconnectOnClosedReadStream:(BOOL)flag
++ (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr fromAddress:(NSData *)address
 {
-	// Note: YES means kAllowHalfDuplexConnection is OFF
-	
-	dispatch_block_t block = ^{
+	return [self getHost:hostPtr port:portPtr family:NULL fromAddress:address];
+}
+
++ (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr family:(sa_family_t *)afPtr fromAddress:(NSData *)address
+{
+	if ([address length] >= sizeof(struct sockaddr))
+	{
+		const struct sockaddr *sockaddrX = [address bytes];
 		
-		if (flag)
-            self->config &= ~kAllowHalfDuplexConnection;
-		else
-            self->config |= kAllowHalfDuplexConnection;
-	};
+		if (sockaddrX->sa_family == AF_INET)
+		{
+			if ([address length] >= sizeof(struct sockaddr_in))
+			{
+				struct sockaddr_in sockaddr4;
+				memcpy(&sockaddr4, sockaddrX, sizeof(sockaddr4));
+				
+				if (hostPtr) *hostPtr = [self hostFromSockaddr4:&sockaddr4];
+				if (portPtr) *portPtr = [self portFromSockaddr4:&sockaddr4];
+				if (afPtr)   *afPtr   = AF_INET;
+				
+				return YES;
+			}
+		}
+		else if (sockaddrX->sa_family == AF_INET6)
+		{
+			if ([address length] >= sizeof(struct sockaddr_in6))
+			{
+				struct sockaddr_in6 sockaddr6;
+				memcpy(&sockaddr6, sockaddrX, sizeof(sockaddr6));
+				
+				if (hostPtr) *hostPtr = [self hostFromSockaddr6:&sockaddr6];
+				if (portPtr) *portPtr = [self portFromSockaddr6:&sockaddr6];
+				if (afPtr)   *afPtr   = AF_INET6;
+				
+				return YES;
+			}
+		}
+	}
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	return NO;
 }
 
-
-/**
- * See header file for big discussion of this method.
-**/
-- (void)markSocketQueueTargetQueue:(dispatch_queue_t)socketNewTargetQueue
++ (NSData *)CRLFData
 {
-	void *nonNullUnusedPointer = (__bridge void *)self;
-	dispatch_queue_set_specific(socketNewTargetQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
+	return [NSData dataWithBytes:"\x0D\x0A" length:2];
 }
 
-/**
- * See header file for big discussion of this method.
-**/
-- (void)unmarkSocketQueueTargetQueue:(dispatch_queue_t)socketOldTargetQueue
++ (NSData *)CRData
 {
-	dispatch_queue_set_specific(socketOldTargetQueue, IsOnSocketQueueOrTargetQueueKey, NULL, NULL);
+	return [NSData dataWithBytes:"\x0D" length:1];
 }
 
-/**
- * See header file for big discussion of this method.
-**/
-- (void)performBlock:(dispatch_block_t)block
++ (NSData *)LFData
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	return [NSData dataWithBytes:"\x0A" length:1];
 }
 
-/**
- * Questions? Have you read the header file?
-**/
-- (int)socketFD
++ (NSData *)ZeroData
 {
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return SOCKET_NULL;
-	}
-	
-	if (socket4FD != SOCKET_NULL)
-		return socket4FD;
-	else
-		return socket6FD;
+	return [NSData dataWithBytes:"" length:1];
 }
 
-/**
- * Questions? Have you read the header file?
-**/
-- (int)socket4FD
-{
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return SOCKET_NULL;
-	}
-	
-	return socket4FD;
-}
+@end	
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * Questions? Have you read the header file?
+ * A member of a GCDAsyncSocketBroadcastGroup.
 **/
-- (int)socket6FD
+@interface GCDAsyncSocketBroadcastSubscriber : NSObject
 {
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return SOCKET_NULL;
-	}
-	
-	return socket6FD;
+  @public
+	__weak GCDAsyncSocket *socket;
+	atomic_uint_fast64_t missedBroadcasts;
+	atomic_bool lagging;
 }
+@end
 
-#if TARGET_OS_IPHONE
+@implementation GCDAsyncSocketBroadcastSubscriber
+@end
 
 /**
- * Questions? Have you read the header file?
+ * The subscribers of a GCDAsyncSocketBroadcastGroup that share a socketQueue.
+ * 
+ * The subscribers array is immutable, and replaced (under the group's lock) when the lane changes,
+ * so a broadcast can take it without copying it.
 **/
-- (CFReadStreamRef)readStream
+@interface GCDAsyncSocketBroadcastLane : NSObject
 {
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return NULL;
-	}
-	
-	if (readStream == NULL)
-		[self createReadAndWriteStream];
-	
-	return readStream;
+  @public
+	dispatch_queue_t queue;
+	NSArray *subscribers;
 }
+@end
 
-/**
- * Questions? Have you read the header file?
-**/
-- (CFWriteStreamRef)writeStream
+@implementation GCDAsyncSocketBroadcastLane
+
+- (void)dealloc
 {
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return NULL;
-	}
-	
-	if (writeStream == NULL)
-		[self createReadAndWriteStream];
-	
-	return writeStream;
+	#if !OS_OBJECT_USE_OBJC
+	if (queue) dispatch_release(queue);
+	#endif
 }
 
-- (BOOL)enableBackgroundingOnSocketWithCaveat:(BOOL)caveat
-{
-	if (![self createReadAndWriteStream])
-	{
-		// Error occurred creating streams (perhaps socket isn't open)
-		return NO;
-	}
-	
-	BOOL r1, r2;
-	
-	LogVerbose(@"Enabling backgrouding on socket");
-	
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-	r1 = CFReadStreamSetProperty(readStream, kCFStreamNetworkServiceType, kCFStreamNetworkServiceTypeVoIP);
-	r2 = CFWriteStreamSetProperty(writeStream, kCFStreamNetworkServiceType, kCFStreamNetworkServiceTypeVoIP);
-#pragma clang diagnostic pop
+@end
 
-	if (!r1 || !r2)
-	{
-		return NO;
-	}
-	
-	if (!caveat)
-	{
-		if (![self openStreams])
-		{
-			return NO;
-		}
-	}
-	
-	return YES;
-}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/**
- * Questions? Have you read the header file?
-**/
-- (BOOL)enableBackgroundingOnSocket
+static NSValue *BroadcastLaneKey(dispatch_queue_t queue)
 {
-	LogTrace();
-	
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return NO;
-	}
-	
-	return [self enableBackgroundingOnSocketWithCaveat:NO];
+	#if OS_OBJECT_USE_OBJC
+	return [NSValue valueWithPointer:(__bridge const void *)queue];
+	#else
+	return [NSValue valueWithPointer:queue];
+	#endif
 }
 
-- (BOOL)enableBackgroundingOnSocketWithCaveat // Deprecated in iOS 4.???
+@implementation GCDAsyncSocketBroadcastGroup
 {
-	// This method was created as a workaround for a bug in iOS.
-	// Apple has since fixed this bug.
-	// I'm not entirely sure which version of iOS they fixed it in...
+	pthread_mutex_t lock;
 	
-	LogTrace();
+	NSMutableDictionary *lanes; // socketQueue (as NSValue pointer) -> GCDAsyncSocketBroadcastLane
+	NSMapTable *subscribers; // GCDAsyncSocket (weak) -> GCDAsyncSocketBroadcastSubscriber
 	
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return NO;
-	}
+	GCDAsyncSocketBroadcastLagBlock lagHandler;
+	dispatch_queue_t lagHandlerQueue;
 	
-	return [self enableBackgroundingOnSocketWithCaveat:YES];
+	atomic_uint_fast64_t maxSubscriberLag;
+	atomic_bool dropsLaggingSubscribers;
 }
 
-#endif
-
-- (SSLContextRef)sslContext
+- (instancetype)init
 {
-	if (!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if ((self = [super init]))
 	{
-		LogWarn(@"%@ - Method only available from within the context of a performBlock: invocation", THIS_METHOD);
-		return NULL;
+		pthread_mutex_init(&lock, NULL);
+		
+		lanes = [[NSMutableDictionary alloc] init];
+		subscribers = [NSMapTable weakToStrongObjectsMapTable];
 	}
-	
-	return sslContext;
+	return self;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Class Utilities
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (void)dealloc
+{
+	pthread_mutex_destroy(&lock);
+	
+	#if !OS_OBJECT_USE_OBJC
+	if (lagHandlerQueue) dispatch_release(lagHandlerQueue);
+	#endif
+}
 
-+ (NSMutableArray *)lookupHost:(NSString *)host port:(uint16_t)port error:(NSError **)errPtr
+- (void)addSocket:(GCDAsyncSocket *)sock
 {
-	LogTrace();
+	if (sock == nil) return;
 	
-	NSMutableArray *addresses = nil;
-	NSError *error = nil;
+	dispatch_queue_t queue = [sock broadcastQueue];
 	
-	if ([host isEqualToString:@"localhost"] || [host isEqualToString:@"loopback"])
-	{
-		// Use LOOPBACK address
-		struct sockaddr_in nativeAddr4;
-		nativeAddr4.sin_len         = sizeof(struct sockaddr_in);
-		nativeAddr4.sin_family      = AF_INET;
-		nativeAddr4.sin_port        = htons(port);
-		nativeAddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-		memset(&(nativeAddr4.sin_zero), 0, sizeof(nativeAddr4.sin_zero));
-		
-		struct sockaddr_in6 nativeAddr6;
-		nativeAddr6.sin6_len        = sizeof(struct sockaddr_in6);
-		nativeAddr6.sin6_family     = AF_INET6;
-		nativeAddr6.sin6_port       = htons(port);
-		nativeAddr6.sin6_flowinfo   = 0;
-		nativeAddr6.sin6_addr       = in6addr_loopback;
-		nativeAddr6.sin6_scope_id   = 0;
-		
-		// Wrap the native address structures
-		
-		NSData *address4 = [NSData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
-		NSData *address6 = [NSData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
-		
-		addresses = [NSMutableArray arrayWithCapacity:2];
-		[addresses addObject:address4];
-		[addresses addObject:address6];
-	}
-	else
-	{
-		NSString *portStr = [NSString stringWithFormat:@"%hu", port];
-		
-		struct addrinfo hints, *res, *res0;
-		
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family   = PF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		
-		int gai_error = getaddrinfo([host UTF8String], [portStr UTF8String], &hints, &res0);
-		
-		if (gai_error)
-		{
-			error = [self gaiError:gai_error];
-		}
-		else
+	pthread_mutex_lock(&lock);
+	
+	if ([subscribers objectForKey:sock] == nil)
+	{
+		GCDAsyncSocketBroadcastSubscriber *subscriber = [[GCDAsyncSocketBroadcastSubscriber alloc] init];
+		subscriber->socket = sock;
+		
+		NSValue *laneKey = BroadcastLaneKey(queue);
+		
+		GCDAsyncSocketBroadcastLane *lane = [lanes objectForKey:laneKey];
+		if (lane == nil)
 		{
-			NSUInteger capacity = 0;
-			for (res = res0; res; res = res->ai_next)
-			{
-				if (res->ai_family == AF_INET || res->ai_family == AF_INET6) {
-					capacity++;
-				}
-			}
-			
-			addresses = [NSMutableArray arrayWithCapacity:capacity];
+			lane = [[GCDAsyncSocketBroadcastLane alloc] init];
+			lane->queue = queue;
+			lane->subscribers = @[];
 			
-			for (res = res0; res; res = res->ai_next)
-			{
-				if (res->ai_family == AF_INET)
-				{
-					// Found IPv4 address.
-					// Wrap the native address structure, and add to results.
-					
-					NSData *address4 = [NSData dataWithBytes:res->ai_addr length:res->ai_addrlen];
-					[addresses addObject:address4];
-				}
-				else if (res->ai_family == AF_INET6)
-				{
-					// Fixes connection issues with IPv6
-					// https://github.com/robbiehanson/CocoaAsyncSocket/issues/429#issuecomment-222477158
-					
-					// Found IPv6 address.
-					// Wrap the native address structure, and add to results.
-					
-					struct sockaddr_in6 *sockaddr = (struct sockaddr_in6 *)(void *)res->ai_addr;
-					in_port_t *portPtr = &sockaddr->sin6_port;
-					if ((portPtr != NULL) && (*portPtr == 0)) {
-					        *portPtr = htons(port);
-					}
-
-					NSData *address6 = [NSData dataWithBytes:res->ai_addr length:res->ai_addrlen];
-					[addresses addObject:address6];
-				}
-			}
-			freeaddrinfo(res0);
+			#if !OS_OBJECT_USE_OBJC
+			dispatch_retain(queue);
+			#endif
 			
-			if ([addresses count] == 0)
-			{
-				error = [self gaiError:EAI_FAIL];
-			}
+			[lanes setObject:lane forKey:laneKey];
 		}
+		
+		lane->subscribers = [lane->subscribers arrayByAddingObject:subscriber];
+		[subscribers setObject:subscriber forKey:sock];
 	}
 	
-	if (errPtr) *errPtr = error;
-	return addresses;
+	pthread_mutex_unlock(&lock);
 }
 
-+ (NSString *)hostFromSockaddr4:(const struct sockaddr_in *)pSockaddr4
+- (void)removeSocket:(GCDAsyncSocket *)sock
 {
-	char addrBuf[INET_ADDRSTRLEN];
+	if (sock == nil) return;
 	
-	if (inet_ntop(AF_INET, &pSockaddr4->sin_addr, addrBuf, (socklen_t)sizeof(addrBuf)) == NULL)
+	pthread_mutex_lock(&lock);
+	
+	GCDAsyncSocketBroadcastSubscriber *subscriber = [subscribers objectForKey:sock];
+	if (subscriber)
 	{
-		addrBuf[0] = '\0';
+		[subscribers removeObjectForKey:sock];
+		[self removeSubscribers:@[ subscriber ] fromQueue:[sock broadcastQueue]];
 	}
 	
-	return [NSString stringWithCString:addrBuf encoding:NSASCIIStringEncoding];
+	pthread_mutex_unlock(&lock);
 }
 
-+ (NSString *)hostFromSockaddr6:(const struct sockaddr_in6 *)pSockaddr6
+/**
+ * Removes the given subscribers from the lane of the given queue. Must be invoked with the lock held.
+**/
+- (void)removeSubscribers:(NSArray *)removedSubscribers fromQueue:(dispatch_queue_t)queue
 {
-	char addrBuf[INET6_ADDRSTRLEN];
+	NSValue *laneKey = BroadcastLaneKey(queue);
 	
-	if (inet_ntop(AF_INET6, &pSockaddr6->sin6_addr, addrBuf, (socklen_t)sizeof(addrBuf)) == NULL)
+	GCDAsyncSocketBroadcastLane *lane = [lanes objectForKey:laneKey];
+	if (lane == nil) return;
+	
+	NSMutableArray *remaining = [lane->subscribers mutableCopy];
+	[remaining removeObjectsInArray:removedSubscribers];
+	
+	if ([remaining count] > 0)
+		lane->subscribers = [remaining copy];
+	else
+		[lanes removeObjectForKey:laneKey];
+}
+
+- (NSUInteger)socketCount
+{
+	NSUInteger result = 0;
+	
+	pthread_mutex_lock(&lock);
+	
+	for (GCDAsyncSocketBroadcastLane *lane in [lanes objectEnumerator])
 	{
-		addrBuf[0] = '\0';
+		result += [lane->subscribers count];
 	}
 	
-	return [NSString stringWithCString:addrBuf encoding:NSASCIIStringEncoding];
+	pthread_mutex_unlock(&lock);
+	
+	return result;
 }
 
-+ (uint16_t)portFromSockaddr4:(const struct sockaddr_in *)pSockaddr4
+- (NSUInteger)maxSubscriberLag
 {
-	return ntohs(pSockaddr4->sin_port);
+	return (NSUInteger)atomic_load(&maxSubscriberLag);
 }
 
-+ (uint16_t)portFromSockaddr6:(const struct sockaddr_in6 *)pSockaddr6
+- (void)setMaxSubscriberLag:(NSUInteger)lag
 {
-	return ntohs(pSockaddr6->sin6_port);
+	atomic_store(&maxSubscriberLag, (uint_fast64_t)lag);
 }
 
-+ (NSURL *)urlFromSockaddrUN:(const struct sockaddr_un *)pSockaddr
+- (BOOL)dropsLaggingSubscribers
 {
-	NSString *path = [NSString stringWithUTF8String:pSockaddr->sun_path];
-	return [NSURL fileURLWithPath:path];
+	return atomic_load(&dropsLaggingSubscribers);
 }
 
-+ (NSString *)hostFromAddress:(NSData *)address
+- (void)setDropsLaggingSubscribers:(BOOL)flag
 {
-	NSString *host;
-	
-	if ([self getHost:&host port:NULL fromAddress:address])
-		return host;
-	else
-		return nil;
+	atomic_store(&dropsLaggingSubscribers, flag);
 }
 
-+ (uint16_t)portFromAddress:(NSData *)address
+- (void)setLagHandler:(GCDAsyncSocketBroadcastLagBlock)handler queue:(dispatch_queue_t)queue
 {
-	uint16_t port;
+	#if !OS_OBJECT_USE_OBJC
+	if (queue) dispatch_retain(queue);
+	#endif
 	
-	if ([self getHost:NULL port:&port fromAddress:address])
-		return port;
-	else
-		return 0;
+	pthread_mutex_lock(&lock);
+	
+	#if !OS_OBJECT_USE_OBJC
+	if (lagHandlerQueue) dispatch_release(lagHandlerQueue);
+	#endif
+	
+	lagHandler = [handler copy];
+	lagHandlerQueue = queue;
+	
+	pthread_mutex_unlock(&lock);
 }
 
-+ (BOOL)isIPv4Address:(NSData *)address
+- (void)broadcastData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	if ([address length] >= sizeof(struct sockaddr))
+	if ([data length] == 0) return;
+	
+	NSUInteger maxLag = (NSUInteger)atomic_load(&maxSubscriberLag);
+	BOOL drops = atomic_load(&dropsLaggingSubscribers);
+	
+	// The lock is held while dispatching, so that broadcasts are queued on each lane in the order they're made
+	pthread_mutex_lock(&lock);
+	
+	for (GCDAsyncSocketBroadcastLane *lane in [lanes objectEnumerator])
 	{
-		const struct sockaddr *sockaddrX = [address bytes];
+		dispatch_queue_t queue = lane->queue;
+		NSArray *laneSubscribers = lane->subscribers;
 		
-		if (sockaddrX->sa_family == AF_INET) {
-			return YES;
-		}
+		dispatch_async(queue, ^{ @autoreleasepool {
+			
+			NSMutableArray *removedSubscribers = nil;
+			
+			for (GCDAsyncSocketBroadcastSubscriber *subscriber in laneSubscribers)
+			{
+				GCDAsyncSocket *sock = subscriber->socket;
+				
+				if (sock == nil)
+				{
+					// Deallocated
+					if (removedSubscribers == nil) removedSubscribers = [NSMutableArray array];
+					[removedSubscribers addObject:subscriber];
+					continue;
+				}
+				
+				NSUInteger lag = 0;
+				
+				if ([sock enqueueBroadcastData:data timeout:timeout tag:tag maxLag:maxLag lag:&lag])
+				{
+					atomic_store(&subscriber->lagging, false);
+					continue;
+				}
+				
+				atomic_fetch_add(&subscriber->missedBroadcasts, 1);
+				
+				if (lag == 0) continue; // Not connected (rather than lagging)
+				
+				if (drops)
+				{
+					if (removedSubscribers == nil) removedSubscribers = [NSMutableArray array];
+					[removedSubscribers addObject:subscriber];
+					
+					[self reportLagOfSocket:sock queuedWriteBytes:lag dropped:YES];
+				}
+				else if (!atomic_exchange(&subscriber->lagging, true))
+				{
+					[self reportLagOfSocket:sock queuedWriteBytes:lag dropped:NO];
+				}
+			}
+			
+			if (removedSubscribers)
+			{
+				pthread_mutex_lock(&self->lock);
+				
+				for (GCDAsyncSocketBroadcastSubscriber *subscriber in removedSubscribers)
+				{
+					GCDAsyncSocket *sock = subscriber->socket;
+					if (sock && ([self->subscribers objectForKey:sock] == subscriber))
+					{
+						[self->subscribers removeObjectForKey:sock];
+					}
+				}
+				[self removeSubscribers:removedSubscribers fromQueue:queue];
+				
+				pthread_mutex_unlock(&self->lock);
+			}
+		}});
 	}
 	
-	return NO;
+	pthread_mutex_unlock(&lock);
 }
 
-+ (BOOL)isIPv6Address:(NSData *)address
+- (void)reportLagOfSocket:(GCDAsyncSocket *)sock queuedWriteBytes:(NSUInteger)lag dropped:(BOOL)dropped
 {
-	if ([address length] >= sizeof(struct sockaddr))
+	pthread_mutex_lock(&lock);
+	
+	GCDAsyncSocketBroadcastLagBlock handler = lagHandler;
+	dispatch_queue_t queue = lagHandlerQueue ? lagHandlerQueue : dispatch_get_main_queue();
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_retain(queue);
+	#endif
+	
+	pthread_mutex_unlock(&lock);
+	
+	if (handler)
 	{
-		const struct sockaddr *sockaddrX = [address bytes];
-		
-		if (sockaddrX->sa_family == AF_INET6) {
-			return YES;
-		}
+		dispatch_async(queue, ^{ @autoreleasepool {
+			
+			handler(sock, lag, dropped);
+		}});
 	}
 	
-	return NO;
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(queue);
+	#endif
 }
 
-+ (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr fromAddress:(NSData *)address
+- (void)enumerateSubscriberLagUsingBlock:(void (^)(GCDAsyncSocket *sock, NSUInteger queuedWriteBytes, uint64_t missedBroadcasts))block
 {
-	return [self getHost:hostPtr port:portPtr family:NULL fromAddress:address];
+	pthread_mutex_lock(&lock);
+	
+	NSMutableArray *allSubscribers = [NSMutableArray array];
+	for (GCDAsyncSocketBroadcastLane *lane in [lanes objectEnumerator])
+	{
+		[allSubscribers addObjectsFromArray:lane->subscribers];
+	}
+	
+	pthread_mutex_unlock(&lock);
+	
+	for (GCDAsyncSocketBroadcastSubscriber *subscriber in allSubscribers)
+	{
+		GCDAsyncSocket *sock = subscriber->socket;
+		if (sock == nil) continue;
+		
+		block(sock, [sock queuedWriteBytes], (uint64_t)atomic_load(&subscriber->missedBroadcasts));
+	}
 }
 
-+ (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr family:(sa_family_t *)afPtr fromAddress:(NSData *)address
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation GCDAsyncSocketTracing
+
++ (BOOL)isCompiledIn
 {
-	if ([address length] >= sizeof(struct sockaddr))
+	return GCDAsyncSocketTracingEnabled ? YES : NO;
+}
+
+#if GCDAsyncSocketTracingEnabled
+
+/**
+ * Returns the Chrome trace event for the given recorded event.
+**/
++ (NSDictionary *)chromeTraceEventWithEvent:(const GCDAsyncSocketTraceEvent *)event
+                                        pid:(int)pid
+                                        tid:(uint32_t)tid
+{
+	NSString *name;
+	NSString *category;
+	NSString *valueName = nil;
+	
+	switch ((GCDAsyncSocketTraceEventType)event->type)
+	{
+		case GCDAsyncSocketTraceReadEnqueue       : name = @"readEnqueue";  category = @"read";  valueName = @"tag"; break;
+		case GCDAsyncSocketTraceReadDequeue       : name = @"readDequeue";  category = @"read";  valueName = @"tag"; break;
+		case GCDAsyncSocketTraceWriteEnqueue      : name = @"writeEnqueue"; category = @"write"; valueName = @"tag"; break;
+		case GCDAsyncSocketTraceWriteDequeue      : name = @"writeDequeue"; category = @"write"; valueName = @"tag"; break;
+		case GCDAsyncSocketTraceReadSyscall       : name = @"read";         category = @"read";  valueName = @"result"; break;
+		case GCDAsyncSocketTraceWriteSyscall      : name = @"write";        category = @"write"; valueName = @"result"; break;
+		case GCDAsyncSocketTraceReadSourceSuspend : name = @"readSourceSuspend";  category = @"read";  break;
+		case GCDAsyncSocketTraceReadSourceResume  : name = @"readSourceResume";   category = @"read";  break;
+		case GCDAsyncSocketTraceWriteSourceSuspend: name = @"writeSourceSuspend"; category = @"write"; break;
+		case GCDAsyncSocketTraceWriteSourceResume : name = @"writeSourceResume";  category = @"write"; break;
+		case GCDAsyncSocketTraceTLSStart          : name = @"tlsStart";     category = @"tls"; break;
+		case GCDAsyncSocketTraceTLSHandshakeStep  : name = @"tlsHandshake"; category = @"tls";    valueName = @"status"; break;
+		case GCDAsyncSocketTraceClose             : name = @"close";        category = @"socket"; valueName = @"code"; break;
+		default                                   : return nil;
+	}
+	
+	NSMutableDictionary *args = [NSMutableDictionary dictionaryWithCapacity:3];
+	args[@"socket"] = [NSString stringWithFormat:@"0x%llx", (unsigned long long)event->socket];
+	if (valueName) args[valueName] = @(event->value);
+	if (event->error) args[@"errno"] = @(event->error);
+	
+	NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:9];
+	result[@"name"] = name;
+	result[@"cat"] = category;
+	result[@"pid"] = @(pid);
+	result[@"tid"] = @(tid);
+	result[@"ts"] = @((double)event->timestamp / 1000.0); // Microseconds
+	result[@"args"] = args;
+	
+	if ((event->type == GCDAsyncSocketTraceReadSyscall) || (event->type == GCDAsyncSocketTraceWriteSyscall))
+	{
+		result[@"ph"] = @"X";
+		result[@"dur"] = @((double)event->duration / 1000.0);
+	}
+	else
 	{
-		const struct sockaddr *sockaddrX = [address bytes];
+		result[@"ph"] = @"i";
+		result[@"s"] = @"t";
+	}
+	
+	return result;
+}
+
++ (NSData *)chromeTraceData
+{
+	NSMutableArray *traceEvents = [NSMutableArray array];
+	int pid = (int)getpid();
+	
+	// Holding the lock keeps rings from being reused while we're reading them,
+	// but doesn't block the sockets recording into them.
+	pthread_mutex_lock(&traceRingsLock);
+	
+	for (GCDAsyncSocketTraceRing *ring = traceRings; ring; ring = ring->next)
+	{
+		uint_fast64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (head == 0) continue;
 		
-		if (sockaddrX->sa_family == AF_INET)
-		{
-			if ([address length] >= sizeof(struct sockaddr_in))
-			{
-				struct sockaddr_in sockaddr4;
-				memcpy(&sockaddr4, sockaddrX, sizeof(sockaddr4));
-				
-				if (hostPtr) *hostPtr = [self hostFromSockaddr4:&sockaddr4];
-				if (portPtr) *portPtr = [self portFromSockaddr4:&sockaddr4];
-				if (afPtr)   *afPtr   = AF_INET;
-				
-				return YES;
-			}
-		}
-		else if (sockaddrX->sa_family == AF_INET6)
+		[traceEvents addObject:@{
+			@"name" : @"thread_name",
+			@"ph"   : @"M",
+			@"pid"  : @(pid),
+			@"tid"  : @(ring->identifier),
+			@"args" : @{ @"name" : [NSString stringWithFormat:@"%s #%u", ring->label, ring->identifier] },
+		}];
+		
+		uint_fast64_t first = (head > GCDAsyncSocketTraceRingCapacity) ? (head - GCDAsyncSocketTraceRingCapacity) : 0;
+		
+		for (uint_fast64_t index = first; index < head; index++)
 		{
-			if ([address length] >= sizeof(struct sockaddr_in6))
-			{
-				struct sockaddr_in6 sockaddr6;
-				memcpy(&sockaddr6, sockaddrX, sizeof(sockaddr6));
-				
-				if (hostPtr) *hostPtr = [self hostFromSockaddr6:&sockaddr6];
-				if (portPtr) *portPtr = [self portFromSockaddr6:&sockaddr6];
-				if (afPtr)   *afPtr   = AF_INET6;
-				
-				return YES;
-			}
+			const GCDAsyncSocketTraceEvent *slot = &ring->events[index & (GCDAsyncSocketTraceRingCapacity - 1)];
+			
+			uint_fast64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+			if (sequence != (index + 1)) continue; // Overwritten since we read the head
+			
+			GCDAsyncSocketTraceEvent event;
+			memcpy(&event, slot, sizeof(event));
+			
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) continue; // Torn
+			
+			NSDictionary *traceEvent = [self chromeTraceEventWithEvent:&event pid:pid tid:ring->identifier];
+			if (traceEvent) [traceEvents addObject:traceEvent];
 		}
 	}
 	
-	return NO;
+	pthread_mutex_unlock(&traceRingsLock);
+	
+	NSDictionary *document = @{
+		@"traceEvents"     : traceEvents,
+		@"displayTimeUnit" : @"ns",
+	};
+	
+	return [NSJSONSerialization dataWithJSONObject:document options:0 error:NULL];
 }
 
-+ (NSData *)CRLFData
-{
-	return [NSData dataWithBytes:"\x0D\x0A" length:2];
-}
+#else
 
-+ (NSData *)CRData
++ (NSData *)chromeTraceData
 {
-	return [NSData dataWithBytes:"\x0D" length:1];
+	return nil;
 }
 
-+ (NSData *)LFData
-{
-	return [NSData dataWithBytes:"\x0A" length:1];
-}
+#endif
 
-+ (NSData *)ZeroData
++ (BOOL)writeChromeTraceToURL:(NSURL *)url error:(NSError **)errPtr
 {
-	return [NSData dataWithBytes:"" length:1];
+	NSData *data = [self chromeTraceData];
+	if (data == nil)
+	{
+		if (errPtr)
+		{
+			NSString *errMsg = @"Tracing is not compiled in (define GCDAsyncSocketTracingEnabled to 1)";
+			NSDictionary *userInfo = @{NSLocalizedDescriptionKey : errMsg};
+			
+			*errPtr = [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+		}
+		return NO;
+	}
+	
+	return [data writeToURL:url options:NSDataWritingAtomic error:errPtr];
 }
 
-@end	
+@end
@@ -0,0 +1,84 @@
+//  
+//  GCDAsyncSocketRegistry.h
+//  
+//  This class is in the public domain.
+//  Updated and maintained by Deusty LLC and the Apple development community.
+//  
+//  https://github.com/robbiehanson/CocoaAsyncSocket
+//
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ * Implemented by the sockets a GCDAsyncSocketRegistry keeps track of (GCDAsyncSocket and GCDAsyncUdpSocket).
+**/
+@protocol GCDAsyncSocketRegistryEntry <NSObject>
+
+/**
+ * Returns a description of the socket's current state, as a JSON compatible dictionary.
+ * 
+ * The keys "class", "state", "socketQueue" and "bufferedBytes" are always present,
+ * and are what the registry's aggregate counters are made of.
+ * 
+ * The snapshot is taken synchronously on the socket's socketQueue,
+ * so this must not be invoked on a socketQueue (it asserts as much).
+**/
+- (NSDictionary *)registrySnapshot;
+
+@end
+
+/**
+ * An opt-in registry of the live sockets in the process, for diagnosing leaks and imbalanced socket queues.
+ * 
+ * Once enabled, every GCDAsyncSocket and GCDAsyncUdpSocket created (including accepted sockets) registers itself.
+ * Sockets created while the registry is disabled are never registered.
+ * Registration is cheap: a sharded, weak hash table insert. Sockets are dropped automatically once deallocated.
+ * 
+ * The aggregate counters and snapshots query each socket on its socketQueue (synchronously),
+ * so they're meant for on-demand diagnostics, not for hot paths.
+ * For the same reason, aggregateCounters and JSONSnapshot must NOT be invoked on the socketQueue of any socket
+ * (e.g. from a synchronous delegate callback). Waiting on other sockets' queues from there can deadlock,
+ * so it's asserted against.
+ * 
+ * All methods are thread-safe.
+**/
+@interface GCDAsyncSocketRegistry : NSObject
+
++ (GCDAsyncSocketRegistry *)sharedRegistry;
+
+/**
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite, getter=isEnabled) BOOL enabled;
+
+/**
+ * Registers a socket (if the registry is enabled). Invoked by the sockets themselves when they're created.
+**/
+- (void)registerSocket:(id<GCDAsyncSocketRegistryEntry>)sock;
+
+/**
+ * The live registered sockets.
+**/
+@property (atomic, readonly) NSArray<id<GCDAsyncSocketRegistryEntry>> *allSockets;
+
+/**
+ * Returns aggregate counters over all live registered sockets:
+ * 
+ * - "sockets": the number of sockets
+ * - "states": the number of sockets per class and state (e.g. states.GCDAsyncSocket.connected)
+ * - "bufferedBytes": the total number of bytes buffered (prebuffered for reading, or queued for writing)
+ * - "socketsPerQueue": the number of sockets per socketQueue
+**/
+- (NSDictionary *)aggregateCounters;
+
+/**
+ * Returns a JSON document with the aggregate counters ("aggregate"),
+ * and the registrySnapshot of each live registered socket ("sockets").
+**/
+- (nullable NSData *)JSONSnapshot;
+
+@end
+
+NS_ASSUME_NONNULL_END
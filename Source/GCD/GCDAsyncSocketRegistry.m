@@ -0,0 +1,211 @@
+//  
+//  GCDAsyncSocketRegistry.m
+//  
+//  This class is in the public domain.
+//  Updated and maintained by Deusty LLC and the Apple development community.
+//  
+//  https://github.com/robbiehanson/CocoaAsyncSocket
+//
+
+#import "GCDAsyncSocketRegistry.h"
+
+#if ! __has_feature(objc_arc)
+#warning This file must be compiled with ARC. Use -fobjc-arc flag (or convert project to ARC).
+// For more information see: https://github.com/robbiehanson/CocoaAsyncSocket/wiki/ARC
+#endif
+
+#import <pthread.h>
+#import <stdatomic.h>
+
+
+#if 0
+
+// Logging Enabled - See log level below
+
+// Logging uses the CocoaLumberjack framework (which is also GCD based).
+// https://github.com/robbiehanson/CocoaLumberjack
+// 
+// It allows us to do a lot of logging without significantly slowing down the code.
+#import "DDLog.h"
+
+#define LogAsync   NO
+#define LogContext 65535
+
+#define LogObjc(flg, frmt, ...) LOG_OBJC_MAYBE(LogAsync, logLevel, flg, LogContext, frmt, ##__VA_ARGS__)
+
+#define LogError(frmt, ...)     LogObjc(LOG_FLAG_ERROR,   (@"%@: " frmt), THIS_FILE, ##__VA_ARGS__)
+
+// Log levels : off, error, warn, info, verbose
+static const int logLevel = LOG_LEVEL_VERBOSE;
+
+#else
+
+// Logging Disabled
+
+#define LogError(frmt, ...)     {}
+
+#endif
+
+/**
+ * The registry is split into shards, each with its own lock,
+ * so sockets created concurrently on different queues rarely contend.
+**/
+#define REGISTRY_SHARD_COUNT 16
+
+static atomic_bool registryEnabled;
+
+@implementation GCDAsyncSocketRegistry
+{
+	pthread_mutex_t shardLocks[REGISTRY_SHARD_COUNT];
+	NSHashTable *shardSockets[REGISTRY_SHARD_COUNT]; // Weak
+}
+
++ (GCDAsyncSocketRegistry *)sharedRegistry
+{
+	static GCDAsyncSocketRegistry *sharedRegistry;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		
+		sharedRegistry = [[GCDAsyncSocketRegistry alloc] init];
+	});
+	
+	return sharedRegistry;
+}
+
+- (instancetype)init
+{
+	if ((self = [super init]))
+	{
+		for (NSUInteger i = 0; i < REGISTRY_SHARD_COUNT; i++)
+		{
+			pthread_mutex_init(&shardLocks[i], NULL);
+			shardSockets[i] = [NSHashTable weakObjectsHashTable];
+		}
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	for (NSUInteger i = 0; i < REGISTRY_SHARD_COUNT; i++)
+	{
+		pthread_mutex_destroy(&shardLocks[i]);
+	}
+}
+
+- (BOOL)isEnabled
+{
+	return atomic_load(&registryEnabled);
+}
+
+- (void)setEnabled:(BOOL)flag
+{
+	atomic_store(&registryEnabled, flag);
+}
+
+- (void)registerSocket:(id<GCDAsyncSocketRegistryEntry>)sock
+{
+	if (sock == nil) return;
+	if (!atomic_load_explicit(&registryEnabled, memory_order_relaxed)) return;
+	
+	// Objects are at least 16 byte aligned, so the low bits of the address carry no information
+	uintptr_t address = (uintptr_t)(__bridge void *)sock;
+	NSUInteger shard = (NSUInteger)((address >> 4) % REGISTRY_SHARD_COUNT);
+	
+	pthread_mutex_lock(&shardLocks[shard]);
+	[shardSockets[shard] addObject:sock];
+	pthread_mutex_unlock(&shardLocks[shard]);
+}
+
+- (NSArray *)allSockets
+{
+	NSMutableArray *result = [NSMutableArray array];
+	
+	for (NSUInteger i = 0; i < REGISTRY_SHARD_COUNT; i++)
+	{
+		pthread_mutex_lock(&shardLocks[i]);
+		[result addObjectsFromArray:[shardSockets[i] allObjects]];
+		pthread_mutex_unlock(&shardLocks[i]);
+	}
+	
+	return result;
+}
+
+/**
+ * Takes a snapshot of each socket. The shard locks aren't held meanwhile,
+ * as each snapshot is taken synchronously on the socket's socketQueue.
+**/
+- (NSArray *)socketSnapshots
+{
+	NSArray *sockets = [self allSockets];
+	NSMutableArray *result = [NSMutableArray arrayWithCapacity:[sockets count]];
+	
+	for (id<GCDAsyncSocketRegistryEntry> sock in sockets)
+	{
+		NSDictionary *snapshot = [sock registrySnapshot];
+		if (snapshot) [result addObject:snapshot];
+	}
+	
+	return result;
+}
+
+- (NSDictionary *)aggregateCountersOfSnapshots:(NSArray *)snapshots
+{
+	NSMutableDictionary *states = [NSMutableDictionary dictionary];
+	NSMutableDictionary *socketsPerQueue = [NSMutableDictionary dictionary];
+	uint64_t bufferedBytes = 0;
+	
+	for (NSDictionary *snapshot in snapshots)
+	{
+		NSString *className = snapshot[@"class"];
+		NSString *state = snapshot[@"state"];
+		NSString *queue = snapshot[@"socketQueue"];
+		
+		NSMutableDictionary *classStates = states[className];
+		if (classStates == nil)
+		{
+			classStates = [NSMutableDictionary dictionary];
+			states[className] = classStates;
+		}
+		
+		classStates[state] = @([classStates[state] unsignedIntegerValue] + 1);
+		socketsPerQueue[queue] = @([socketsPerQueue[queue] unsignedIntegerValue] + 1);
+		
+		bufferedBytes += [snapshot[@"bufferedBytes"] unsignedLongLongValue];
+	}
+	
+	return @{
+		@"sockets"         : @([snapshots count]),
+		@"states"          : states,
+		@"bufferedBytes"   : @(bufferedBytes),
+		@"socketsPerQueue" : socketsPerQueue,
+	};
+}
+
+- (NSDictionary *)aggregateCounters
+{
+	return [self aggregateCountersOfSnapshots:[self socketSnapshots]];
+}
+
+- (NSData *)JSONSnapshot
+{
+	NSArray *snapshots = [self socketSnapshots];
+	
+	NSDictionary *document = @{
+		@"aggregate" : [self aggregateCountersOfSnapshots:snapshots],
+		@"sockets"   : snapshots,
+	};
+	
+	NSError *error = nil;
+	NSData *result = [NSJSONSerialization dataWithJSONObject:document options:0 error:&error];
+	
+	if (result == nil)
+	{
+		LogError(@"Error serializing registry snapshot: %@", error);
+	}
+	
+	return result;
+}
+
+@end
@@ -9,6 +9,7 @@
 //
 
 #import "GCDAsyncUdpSocket.h"
+#import "GCDAsyncSocketRegistry.h"
 
 #if ! __has_feature(objc_arc)
 #warning This file must be compiled with ARC. Use -fobjc-arc flag (or convert project to ARC).
@@ -25,6 +26,7 @@
 #import <ifaddrs.h>
 #import <netdb.h>
 #import <net/if.h>
+#import <objc/runtime.h>
 #import <sys/socket.h>
 #import <sys/types.h>
 
@@ -140,11 +142,13 @@ enum GCDAsyncUdpSocketConfig
 	kPreferIPv6    = 1 << 3,  // If set, IPv6 is preferred over IPv4
 };
 
+typedef void (*GCDAsyncUdpSocketDidReceiveDataIMP)(id, SEL, GCDAsyncUdpSocket *, NSData *, NSData *, id);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-@interface GCDAsyncUdpSocket ()
+@interface GCDAsyncUdpSocket () <GCDAsyncSocketRegistryEntry>
 {
 #if __has_feature(objc_arc_weak)
 	__weak id delegate;
@@ -153,6 +157,9 @@ enum GCDAsyncUdpSocketConfig
 #endif
 	dispatch_queue_t delegateQueue;
 	
+	__unsafe_unretained Class delegateClass;
+	GCDAsyncUdpSocketDidReceiveDataIMP delegateDidReceiveData;
+	
 	GCDAsyncUdpSocketReceiveFilterBlock receiveFilterBlock;
 	dispatch_queue_t receiveFilterQueue;
 	BOOL receiveFilterAsync;
@@ -373,6 +380,7 @@ enum GCDAsyncUdpSocketConfig
 	if ((self = [super init]))
 	{
 		delegate = aDelegate;
+		[self updateDelegateCapabilities:aDelegate];
 		
 		if (dq)
 		{
@@ -434,6 +442,8 @@ enum GCDAsyncUdpSocketConfig
 		currentSend = nil;
 		sendQueue = [[NSMutableArray alloc] initWithCapacity:5];
 		
+		[[GCDAsyncSocketRegistry sharedRegistry] registerSocket:self];
+		
 		#if TARGET_OS_IPHONE
 		[[NSNotificationCenter defaultCenter] addObserver:self
 		                                         selector:@selector(applicationWillEnterForeground:)
@@ -499,10 +509,27 @@ enum GCDAsyncUdpSocketConfig
 	}
 }
 
+/**
+ * Caches the delegate's implementation of udpSocket:didReceiveData:fromAddress:withFilterContext:
+ * (or NULL if it doesn't implement it), saving a respondsToSelector: for every received datagram.
+**/
+- (void)updateDelegateCapabilities:(id)theDelegate
+{
+	SEL selector = @selector(udpSocket:didReceiveData:fromAddress:withFilterContext:);
+
+	delegateClass = object_getClass(theDelegate);
+
+	if ([theDelegate respondsToSelector:selector])
+		delegateDidReceiveData = (GCDAsyncUdpSocketDidReceiveDataIMP)[theDelegate methodForSelector:selector];
+	else
+		delegateDidReceiveData = NULL;
+}
+
 - (void)setDelegate:(id<GCDAsyncUdpSocketDelegate>)newDelegate synchronously:(BOOL)synchronously
 {
 	dispatch_block_t block = ^{
         self->delegate = newDelegate;
+		[self updateDelegateCapabilities:newDelegate];
 	};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
@@ -604,6 +631,7 @@ enum GCDAsyncUdpSocketConfig
 	dispatch_block_t block = ^{
 		
         self->delegate = newDelegate;
+		[self updateDelegateCapabilities:newDelegate];
 		
 		#if !OS_OBJECT_USE_OBJC
         if (self->delegateQueue) dispatch_release(self->delegateQueue);
@@ -1009,11 +1037,20 @@ enum GCDAsyncUdpSocketConfig
 	SEL selector = @selector(udpSocket:didReceiveData:fromAddress:withFilterContext:);
 	
 	__strong id<GCDAsyncUdpSocketDelegate> theDelegate = delegate;
-	if (delegateQueue && [theDelegate respondsToSelector:selector])
+	
+	// The cache is keyed on the delegate's class (which may change due to KVO, or the delegate going away)
+	if (object_getClass(theDelegate) != delegateClass)
+	{
+		[self updateDelegateCapabilities:theDelegate];
+	}
+	
+	GCDAsyncUdpSocketDidReceiveDataIMP didReceiveData = delegateDidReceiveData;
+	
+	if (delegateQueue && didReceiveData)
 	{
 		dispatch_async(delegateQueue, ^{ @autoreleasepool {
 			
-			[theDelegate udpSocket:self didReceiveData:data fromAddress:address withFilterContext:context];
+			didReceiveData(theDelegate, selector, self, data, address, context);
 		}});
 	}
 }
@@ -2767,6 +2804,76 @@ enum GCDAsyncUdpSocketConfig
 	return result;
 }
 
+- (NSDictionary *)registrySnapshot
+{
+	__block NSDictionary *result = nil;
+	
+	dispatch_block_t block = ^{
+		
+		NSString *state;
+		if (self->flags & kDidConnect)
+			state = @"connected";
+		else if (self->flags & kConnecting)
+			state = @"connecting";
+		else if (self->flags & kDidBind)
+			state = @"bound";
+		else if (self->flags & kDidCreateSockets)
+			state = @"open";
+		else
+			state = @"closed";
+		
+		NSUInteger sendQueueDepth = [self->sendQueue count] + (self->currentSend ? 1 : 0);
+		
+		uint64_t queuedSendBytes = 0;
+		
+		if ([self->currentSend isKindOfClass:[GCDAsyncUdpSendPacket class]])
+		{
+			queuedSendBytes += [self->currentSend->buffer length];
+		}
+		for (id packet in self->sendQueue)
+		{
+			if ([packet isKindOfClass:[GCDAsyncUdpSendPacket class]])
+			{
+				queuedSendBytes += [((GCDAsyncUdpSendPacket *)packet)->buffer length];
+			}
+		}
+		
+		NSMutableDictionary *snapshot = [NSMutableDictionary dictionaryWithCapacity:12];
+		
+		snapshot[@"class"] = NSStringFromClass([self class]);
+		snapshot[@"state"] = state;
+		snapshot[@"socketQueue"] = [NSString stringWithFormat:@"%s (%p)",
+		                             dispatch_queue_get_label(self->socketQueue), self->socketQueue];
+		snapshot[@"receiving"] = @((self->flags & (kReceiveOnce | kReceiveContinuous)) ? YES : NO);
+		snapshot[@"sendQueueDepth"] = @(sendQueueDepth);
+		snapshot[@"queuedSendBytes"] = @(queuedSendBytes);
+		snapshot[@"bufferedBytes"] = @(queuedSendBytes);
+		
+		if (self->flags & kDidCreateSockets)
+		{
+			snapshot[@"localPort"] = @([self localPort]);
+		}
+		if (self->flags & kDidConnect)
+		{
+			NSString *connectedHost = [self connectedHost];
+			
+			if (connectedHost) snapshot[@"connectedHost"] = connectedHost;
+			snapshot[@"connectedPort"] = @([self connectedPort]);
+		}
+		
+		result = [snapshot copy];
+	};
+	
+	// The registry waits on each socket's socketQueue in turn.
+	// On a socketQueue, that's a recipe for deadlock (and the key below can't tell our queue from another socket's).
+	NSAssert(!dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey),
+	         @"The socket registry must not be queried from a socketQueue");
+	
+	dispatch_sync(socketQueue, AutoreleasedBlock(block));
+	
+	return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Binding
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
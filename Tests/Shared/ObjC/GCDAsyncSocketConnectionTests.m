@@ -10,8 +10,41 @@
 #import <XCTest/XCTest.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 @import CocoaAsyncSocket;
 
+// Private to GCDAsyncSocket, for verifying that packets are reused
+@interface GCDAsyncSocket (PacketPoolTesting)
+@property (atomic, readonly) NSUInteger packetAllocationCount;
+@end
+
+// Forwards every message to its target, like the delegate proxies of many frameworks
+@interface GCDAsyncSocketTestDelegateProxy : NSProxy
+@property (nonatomic, strong) id target;
+- (instancetype)initWithTarget:(id)target;
+@end
+
+@implementation GCDAsyncSocketTestDelegateProxy
+
+- (instancetype)initWithTarget:(id)target {
+    _target = target;
+    return self;
+}
+
+- (BOOL)respondsToSelector:(SEL)aSelector {
+    return [self.target respondsToSelector:aSelector];
+}
+
+- (NSMethodSignature *)methodSignatureForSelector:(SEL)sel {
+    return [self.target methodSignatureForSelector:sel];
+}
+
+- (void)forwardInvocation:(NSInvocation *)invocation {
+    [invocation invokeWithTarget:self.target];
+}
+
+@end
+
 @interface GCDAsyncSocketConnectionTests : XCTestCase <GCDAsyncSocketDelegate>
 @property (nonatomic) uint16_t portNumber;
 @property (nonatomic, strong) GCDAsyncSocket *clientSocket;
@@ -19,6 +52,8 @@
 @property (nonatomic, strong) GCDAsyncSocket *acceptedServerSocket;
 
 @property (nonatomic, strong) XCTestExpectation *expectation;
+@property (nonatomic, strong) XCTestExpectation *readExpectation;
+@property (nonatomic, strong) NSMutableArray *watermarkEvents;
 @end
 
 @implementation GCDAsyncSocketConnectionTests
@@ -198,6 +233,799 @@
   XCTAssertTrue(socket.connectedPort == self.portNumber, @"Something is wrong with the GCDAsyncSocket. Connected port is wrong");
 }
 
+- (void)testEchoLoopWithReusedPackets {
+    [self connectSockets];
+    
+    // Many more round trips than the sockets keep packets around for,
+    // so that nearly all of them run on packets that have been used before.
+    const NSUInteger roundTrips = 2000;
+    const NSUInteger messageLength = 64;
+    
+    [self echoOnSocket:self.acceptedServerSocket messageLength:messageLength];
+    
+    XCTestExpectation *echoExpectation = [self expectationWithDescription:@"Echo loop"];
+    [self sendMessage:0 of:roundTrips length:messageLength expectation:echoExpectation];
+    
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+    
+    // Each round trip takes a read and a write packet on both ends.
+    // Without reuse, that would be an allocation per packet.
+    XCTAssertLessThanOrEqual(self.clientSocket.packetAllocationCount, 32u);
+    XCTAssertLessThanOrEqual(self.acceptedServerSocket.packetAllocationCount, 32u);
+}
+
+- (void)testDelegateProxy {
+    [self connectSockets];
+
+    // The proxy's own methodForSelector: must not be used for the target's socket:didReadData:withTag:
+    GCDAsyncSocketTestDelegateProxy *proxy = [[GCDAsyncSocketTestDelegateProxy alloc] initWithTarget:self];
+    [self.acceptedServerSocket synchronouslySetDelegate:(id<GCDAsyncSocketDelegate>)proxy];
+
+    NSData *message = [self messageWithIndex:0 length:64];
+    self.readExpectation = [self expectationWithDescription:@"Read via proxy"];
+    [self.clientSocket writeData:message withTimeout:30 tag:0];
+    [self.acceptedServerSocket readDataToLength:message.length withTimeout:30 tag:0];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    [self.acceptedServerSocket synchronouslySetDelegate:self];
+}
+
+- (void)testReceiveLowWaterMarkAcrossReads {
+    [self connectSockets];
+
+    self.acceptedServerSocket.maxReceiveLowWaterMark = 1024 * 64;
+
+    // Back to back fixed-length reads, followed by a read of whatever is available.
+    // The last read must not be held back by the low water mark of the reads before it.
+    NSData *first = [self messageWithIndex:0 length:(1024 * 32)];
+    NSData *second = [self messageWithIndex:1 length:(1024 * 32)];
+    NSData *last = [self messageWithIndex:2 length:16];
+
+    XCTestExpectation *fixedExpectation = [self expectationWithDescription:@"Fixed-length reads completed"];
+    [self.acceptedServerSocket readDataToLength:first.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, first);
+    }];
+    [self.acceptedServerSocket readDataToLength:second.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, second);
+        [fixedExpectation fulfill];
+    }];
+    [self.clientSocket writeData:first withTimeout:30 tag:0];
+    [self.clientSocket writeData:second withTimeout:30 tag:0];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    XCTestExpectation *lastExpectation = [self expectationWithDescription:@"Last read completed"];
+    [self.acceptedServerSocket readDataWithTimeout:10 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertEqualObjects(data, last);
+        [lastExpectation fulfill];
+    }];
+    [self.clientSocket writeData:last withTimeout:30 tag:0];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+}
+
+- (void)testWriteFileRange {
+    [self connectSockets];
+
+    // Large enough to need several windows when the file can't be sent via sendfile(),
+    // and starting at an offset that isn't page aligned.
+    NSData *contents = [self messageWithIndex:7 length:(1024 * 1024 * 20)];
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    XCTAssertTrue([contents writeToFile:path atomically:NO]);
+
+    NSRange range = NSMakeRange(1000, contents.length - 2000);
+
+    [self.clientSocket writeFileAtPath:path range:range withTimeout:30 tag:0];
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read file"];
+    [self.acceptedServerSocket readDataToLength:range.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertEqualObjects(data, [contents subdataWithRange:range]);
+        [readExpectation fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
+- (void)testReadToLengthIntoFile {
+    [self connectSockets];
+
+    // Spans several mapped windows, starting at an offset that isn't page aligned.
+    NSData *contents = [self messageWithIndex:3 length:(1024 * 1024 * 20)];
+    const off_t fileOffset = 100;
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    int fd = open(path.fileSystemRepresentation, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    XCTAssertTrue(fd >= 0);
+
+    self.readExpectation = [self expectationWithDescription:@"Read into file"];
+    [self.acceptedServerSocket readDataToLength:contents.length intoFileDescriptor:fd offset:fileOffset withTimeout:30 tag:0];
+    [self.clientSocket writeData:contents withTimeout:30 tag:0];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+    close(fd);
+
+    NSData *fileContents = [NSData dataWithContentsOfFile:path];
+    XCTAssertEqual(fileContents.length, (NSUInteger)fileOffset + contents.length);
+    XCTAssertEqualObjects([fileContents subdataWithRange:NSMakeRange((NSUInteger)fileOffset, contents.length)], contents);
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
+- (void)testBidirectionalRelay {
+    [self connectSockets];
+
+    // clientSocket <-> upstream ~relay~ proxyClient <-> downstream
+    GCDAsyncSocket *upstream = self.acceptedServerSocket;
+    GCDAsyncSocket *proxyClient = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+    GCDAsyncSocket *downstream = [self connectAnotherClient:proxyClient];
+
+    // Keep both relay sources writable after the end of their stream (half-close)
+    upstream.autoDisconnectOnClosedReadStream = NO;
+    proxyClient.autoDisconnectOnClosedReadStream = NO;
+    upstream.statisticsEnabled = YES;
+
+    NSMutableDictionary *relayed = [NSMutableDictionary dictionary];
+    XCTestExpectation *upstreamDone = [self expectationWithDescription:@"Upstream relay finished"];
+    XCTestExpectation *downstreamDone = [self expectationWithDescription:@"Downstream relay finished"];
+    [upstream relayTo:proxyClient bidirectional:YES completion:^(GCDAsyncSocket *source, uint64_t bytesRelayed, NSError *error) {
+        XCTAssertNil(error);
+        relayed[(source == upstream) ? @"up" : @"down"] = @(bytesRelayed);
+        [(source == upstream) ? upstreamDone : downstreamDone fulfill];
+    }];
+
+    // Much more than the relay lets pile up, and than the kernel buffers hold
+    NSData *request = [self messageWithIndex:1 length:(1024 * 1024 * 32)];
+    [self.clientSocket writeData:request withTimeout:30 tag:0];
+
+    // Nobody reads downstream yet, so the relay has to stop reading from upstream
+    XCTestExpectation *relaying = [self expectationForPredicate:[NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return upstream.relayedByteCount > 0;
+    }] evaluatedWithObject:self handler:nil];
+    [self waitForExpectations:@[relaying] timeout:30];
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+
+    uint64_t bytesRead = [upstream statisticsSnapshot].bytesRead;
+    uint64_t bytesRelayed = upstream.relayedByteCount;
+    XCTAssertLessThan(bytesRead, (uint64_t)request.length);
+    XCTAssertLessThanOrEqual(bytesRead, bytesRelayed + (1024 * 1024) + (1024 * 64)); // In flight: 1 MB, plus a chunk
+
+    XCTestExpectation *requestRead = [self expectationWithDescription:@"Request relayed"];
+    [downstream readDataToLength:request.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, request);
+        [requestRead fulfill];
+    }];
+    [self waitForExpectations:@[requestRead] timeout:60];
+
+    NSData *response = [self messageWithIndex:2 length:(1024 * 100)];
+    XCTestExpectation *responseRead = [self expectationWithDescription:@"Response relayed"];
+    [downstream writeData:response withTimeout:30 tag:0];
+    [self.clientSocket readDataToLength:response.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, response);
+        [responseRead fulfill];
+    }];
+    [self waitForExpectations:@[responseRead] timeout:30];
+
+    // The end of the request stream reaches downstream as a half-close, which closes it (and with it, the other direction)
+    XCTestExpectation *downstreamClosed = [self expectationWithDescription:@"Downstream closed"];
+    [downstream readDataWithTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqual(error.code, GCDAsyncSocketClosedError);
+        [downstreamClosed fulfill];
+    }];
+    [self.clientSocket disconnectAfterWriting];
+
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+    XCTAssertEqualObjects(relayed[@"up"], @(request.length));
+    XCTAssertEqualObjects(relayed[@"down"], @(response.length));
+
+    [upstream disconnect];
+    [proxyClient disconnect];
+}
+
+- (void)testRelayDestinationFailure {
+    [self connectSockets];
+
+    GCDAsyncSocket *upstream = self.acceptedServerSocket;
+    GCDAsyncSocket *proxyClient = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+    [self connectAnotherClient:proxyClient];
+
+    XCTestExpectation *relayDone = [self expectationWithDescription:@"Relay failed"];
+    [upstream relayTo:proxyClient bidirectional:NO completion:^(GCDAsyncSocket *source, uint64_t bytesRelayed, NSError *error) {
+        XCTAssertNotNil(error);
+        [relayDone fulfill];
+    }];
+    [proxyClient disconnect];
+
+    // The first chunk is read by the relay, and fails to be written to the destination
+    [self.clientSocket writeData:[self messageWithIndex:1 length:16] withTimeout:30 tag:0];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    // The relay's read mustn't linger on the source, and swallow what comes next
+    NSData *next = [self messageWithIndex:2 length:16];
+    XCTestExpectation *nextRead = [self expectationWithDescription:@"Next chunk read"];
+    [upstream readDataToLength:next.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, next);
+        [nextRead fulfill];
+    }];
+    [self.clientSocket writeData:next withTimeout:30 tag:0];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    [upstream disconnect];
+}
+
+- (void)testSynchronousWritesPreserveOrder {
+    [self connectSockets];
+
+    self.clientSocket.synchronousWrites = YES;
+
+    // Small writes go straight to the kernel, the large one fills the socket buffer and is partially queued.
+    NSMutableData *expected = [NSMutableData data];
+    NSArray *lengths = @[@(16), @(1024), @(1024 * 1024 * 8), @(16), @(512)];
+    for (NSUInteger i = 0; i < lengths.count; i++) {
+        NSData *message = [self messageWithIndex:i length:[lengths[i] unsignedIntegerValue]];
+        [expected appendData:message];
+        [self.clientSocket writeData:message withTimeout:30 tag:(long)i];
+    }
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read all writes"];
+    [self.acceptedServerSocket readDataToLength:expected.length withTimeout:30 completion:^(NSData *data, NSError *readError) {
+        XCTAssertNil(readError);
+        XCTAssertEqualObjects(data, expected);
+        [readExpectation fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+- (void)testInlineWriteAfterStartTLSOnSocketQueue {
+    // Calls on the socketQueue may take the inline write path
+    dispatch_queue_t socketQueue = dispatch_queue_create("GCDAsyncSocketInlineWriteTests", NULL);
+    self.clientSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:socketQueue socketQueue:socketQueue];
+    [self connectSockets];
+
+    NSData *message = [self messageWithIndex:1 length:16];
+    dispatch_async(socketQueue, ^{
+        [self.clientSocket startTLS:nil];
+        [self.clientSocket writeData:message withTimeout:30 tag:0];
+    });
+
+    // The write must wait for the TLS handshake, so what arrives first is the ClientHello (a record of content type 22)
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read handshake"];
+    [self.acceptedServerSocket readDataToLength:1 withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(((const uint8_t *)data.bytes)[0], 22);
+        [readExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+}
+
+- (void)testDispatchDataWriteAndRead {
+    [self connectSockets];
+
+    NSData *header = [self messageWithIndex:1 length:64];
+    NSData *body = [self messageWithIndex:2 length:(1024 * 600)];
+    NSData *trailer = [self messageWithIndex:3 length:8];
+
+    dispatch_data_t data = dispatch_data_empty;
+    for (NSData *part in @[header, body, trailer]) {
+        dispatch_data_t region = dispatch_data_create(part.bytes, part.length, NULL, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        data = dispatch_data_create_concat(data, region);
+    }
+
+    NSMutableData *expected = [NSMutableData dataWithData:header];
+    [expected appendData:body];
+    [expected appendData:trailer];
+
+    XCTestExpectation *writeExpectation = [self expectationWithDescription:@"Dispatch data written"];
+    [self.clientSocket writeDispatchData:data withTimeout:30 completion:^(NSError *writeError) {
+        XCTAssertNil(writeError);
+        [writeExpectation fulfill];
+    }];
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Dispatch data read"];
+    [self.acceptedServerSocket readDispatchDataToLength:expected.length withTimeout:30 completion:^(dispatch_data_t received, NSError *readError) {
+        XCTAssertNil(readError);
+        NSMutableData *flattened = [NSMutableData data];
+        dispatch_data_apply(received, ^bool(dispatch_data_t region, size_t offset, const void *bytes, size_t size) {
+            [flattened appendBytes:bytes length:size];
+            return true;
+        });
+        XCTAssertEqualObjects(flattened, expected);
+        [readExpectation fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+- (void)testCompletionsWithoutConnection {
+    GCDAsyncSocket *socket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read failed"];
+    [socket readDataToLength:4 withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertEqualObjects(error.domain, GCDAsyncSocketErrorDomain);
+        [readExpectation fulfill];
+    }];
+    XCTestExpectation *dispatchDataExpectation = [self expectationWithDescription:@"Dispatch data read failed"];
+    [socket readDispatchDataToLength:4 withTimeout:30 completion:^(dispatch_data_t received, NSError *error) {
+        XCTAssertNil(received);
+        XCTAssertNotNil(error);
+        [dispatchDataExpectation fulfill];
+    }];
+    XCTestExpectation *writeExpectation = [self expectationWithDescription:@"Write failed"];
+    [socket writeData:[self messageWithIndex:0 length:4] withTimeout:30 completion:^(NSError *error) {
+        XCTAssertEqualObjects(error.domain, GCDAsyncSocketErrorDomain);
+        [writeExpectation fulfill];
+    }];
+
+    // Empty reads & writes complete right away (even without a connection)
+    XCTestExpectation *emptyReadExpectation = [self expectationWithDescription:@"Empty read completed"];
+    [socket readDataToLength:0 withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertEqual(data.length, 0u);
+        [emptyReadExpectation fulfill];
+    }];
+    XCTestExpectation *emptyWriteExpectation = [self expectationWithDescription:@"Empty write completed"];
+    [socket writeData:[NSData data] withTimeout:30 completion:^(NSError *error) {
+        XCTAssertNil(error);
+        [emptyWriteExpectation fulfill];
+    }];
+    XCTestExpectation *separatorExpectation = [self expectationWithDescription:@"Empty separator rejected"];
+    [socket readDataToData:[NSData data] withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertEqual(error.code, GCDAsyncSocketBadParamError);
+        [separatorExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testPendingCompletionsFailOnDisconnect {
+    [self connectSockets];
+
+    // Nothing is written by the server, so both reads are pending when the client disconnects
+    XCTestExpectation *firstExpectation = [self expectationWithDescription:@"First read failed"];
+    [self.clientSocket readDataToLength:16 withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertNotNil(error);
+        [firstExpectation fulfill];
+    }];
+    XCTestExpectation *secondExpectation = [self expectationWithDescription:@"Second read failed"];
+    [self.clientSocket readDataWithTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertNotNil(error);
+        [secondExpectation fulfill];
+    }];
+    [self.clientSocket disconnect];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+
+    // Reads queued after the disconnect fail too
+    XCTestExpectation *lateExpectation = [self expectationWithDescription:@"Late read failed"];
+    [self.clientSocket readDataToLength:16 withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertNotNil(error);
+        [lateExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testBroadcastGroup {
+    [self connectSockets];
+
+    GCDAsyncSocketBroadcastGroup *group = [[GCDAsyncSocketBroadcastGroup alloc] init];
+    [group addSocket:self.acceptedServerSocket];
+    [group addSocket:self.acceptedServerSocket];
+    XCTAssertEqual(group.socketCount, 1u);
+
+    NSMutableData *expected = [NSMutableData data];
+    for (NSUInteger i = 0; i < 3; i++) {
+        NSData *message = [self messageWithIndex:i length:1024];
+        [expected appendData:message];
+        [group broadcastData:message withTimeout:30 tag:(long)i];
+    }
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read broadcasts"];
+    [self.clientSocket readDataToLength:expected.length withTimeout:30 completion:^(NSData *data, NSError *readError) {
+        XCTAssertNil(readError);
+        XCTAssertEqualObjects(data, expected);
+        [readExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+
+    __block NSUInteger reported = 0;
+    [group enumerateSubscriberLagUsingBlock:^(GCDAsyncSocket *sock, NSUInteger queuedWriteBytes, uint64_t missedBroadcasts) {
+        XCTAssertEqual(missedBroadcasts, 0u);
+        reported++;
+    }];
+    XCTAssertEqual(reported, 1u);
+
+    [group removeSocket:self.acceptedServerSocket];
+    XCTAssertEqual(group.socketCount, 0u);
+}
+
+- (void)testWriteQueueWatermarks {
+    [self connectSockets];
+
+    self.watermarkEvents = [NSMutableArray array];
+    self.clientSocket.writeQueueHighWatermark = 1024 * 1024 * 8;
+    self.clientSocket.writeQueueLowWatermark = 1024 * 1024;
+
+    // More than the kernel buffers hold, so it stays queued until the server reads it
+    NSData *message = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+
+    for (NSUInteger round = 1; round <= 2; round++) {
+        [self.clientSocket writeData:message withTimeout:30 tag:0];
+
+        [self expectationForPredicate:[NSPredicate predicateWithFormat:@"watermarkEvents.@count == %lu", (unsigned long)(round * 2 - 1)] evaluatedWithObject:self handler:nil];
+        [self waitForExpectationsWithTimeout:30 handler:nil];
+
+        XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read message"];
+        [self.acceptedServerSocket readDataToLength:message.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+            XCTAssertEqualObjects(data, message);
+            [readExpectation fulfill];
+        }];
+        [self expectationForPredicate:[NSPredicate predicateWithFormat:@"watermarkEvents.@count == %lu", (unsigned long)(round * 2)] evaluatedWithObject:self handler:nil];
+        [self waitForExpectationsWithTimeout:60 handler:nil];
+    }
+
+    NSArray *expected = @[@"high", @"low", @"high", @"low"];
+    XCTAssertEqualObjects(self.watermarkEvents, expected);
+    XCTAssertEqual(self.clientSocket.queuedWriteBytes, 0u);
+}
+
+- (void)testWriteQueueCap {
+    [self connectSockets];
+
+    self.clientSocket.maxQueuedWriteBytes = 1024 * 1024;
+
+    // Not subject to the cap, and more than the kernel buffers hold
+    NSData *bulk = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+    [self.clientSocket writeData:bulk withTimeout:30 tag:0];
+
+    NSData *message = [self messageWithIndex:1 length:16];
+    NSError *error = nil;
+    XCTAssertFalse([self.clientSocket writeData:message withTimeout:30 tag:1 error:&error]);
+    XCTAssertEqualObjects(error.domain, GCDAsyncSocketErrorDomain);
+    XCTAssertEqual(error.code, GCDAsyncSocketWriteQueueFullError);
+    XCTAssertEqual(self.clientSocket.queuedWriteBytes, bulk.length);
+
+    XCTestExpectation *bulkRead = [self expectationWithDescription:@"Read bulk"];
+    [self.acceptedServerSocket readDataToLength:bulk.length withTimeout:30 completion:^(NSData *data, NSError *readError) {
+        XCTAssertEqualObjects(data, bulk);
+        [bulkRead fulfill];
+    }];
+    [self expectationForPredicate:[NSPredicate predicateWithFormat:@"clientSocket.queuedWriteBytes == 0"] evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+
+    // Once the queue has drained, the refused message fits (and only it is sent)
+    error = nil;
+    XCTAssertTrue([self.clientSocket writeData:message withTimeout:30 tag:1 error:&error], @"%@", error);
+
+    XCTestExpectation *messageRead = [self expectationWithDescription:@"Read message"];
+    [self.acceptedServerSocket readDataToLength:message.length withTimeout:30 completion:^(NSData *data, NSError *readError) {
+        XCTAssertEqualObjects(data, message);
+        [messageRead fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+}
+
+- (void)testWritePriorityOvertaking {
+    [self connectSockets];
+
+    // Stays in progress until the server reads it, so the writes below are queued behind it
+    NSData *bulk = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+    NSData *low = [self messageWithIndex:1 length:16];
+    NSData *normal = [self messageWithIndex:2 length:16];
+    NSData *high = [self messageWithIndex:3 length:16];
+
+    [self.clientSocket writeData:bulk withTimeout:30 tag:0];
+    [self.clientSocket writeData:low priority:GCDAsyncSocketWritePriorityLow withTimeout:30 tag:1];
+    [self.clientSocket writeData:normal withTimeout:30 tag:2];
+    [self.clientSocket writeData:high priority:GCDAsyncSocketWritePriorityHigh withTimeout:30 tag:3];
+
+    [self expectServerToRead:@[bulk, high, normal, low]];
+}
+
+- (void)testWritePriorityBypassLimit {
+    [self connectSockets];
+
+    NSData *bulk = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+    NSData *low = [self messageWithIndex:1 length:16];
+
+    [self.clientSocket writeData:bulk withTimeout:30 tag:0];
+    [self.clientSocket writeData:low priority:GCDAsyncSocketWritePriorityLow withTimeout:30 tag:1];
+
+    NSMutableArray *highs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 10; i++) {
+        NSData *high = [self messageWithIndex:(i + 2) length:16];
+        [highs addObject:high];
+        [self.clientSocket writeData:high priority:GCDAsyncSocketWritePriorityHigh withTimeout:30 tag:(long)(i + 2)];
+    }
+
+    // The low priority write is overtaken 8 times (WRITE_PRIORITY_MAX_BYPASS), but no more
+    NSMutableArray *expected = [NSMutableArray arrayWithObject:bulk];
+    [expected addObjectsFromArray:[highs subarrayWithRange:NSMakeRange(0, 8)]];
+    [expected addObject:low];
+    [expected addObjectsFromArray:[highs subarrayWithRange:NSMakeRange(8, 2)]];
+
+    [self expectServerToRead:expected];
+}
+
+- (void)testWritePriorityKeepsDispatchDataTogether {
+    [self connectSockets];
+
+    // The first region stays in progress until the server reads it
+    NSData *head = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+    NSData *middle = [self messageWithIndex:1 length:16];
+    NSData *tail = [self messageWithIndex:2 length:16];
+    NSData *high = [self messageWithIndex:3 length:16];
+
+    dispatch_data_t data = dispatch_data_empty;
+    for (NSData *part in @[head, middle, tail]) {
+        dispatch_data_t region = dispatch_data_create(part.bytes, part.length, NULL, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        data = dispatch_data_create_concat(data, region);
+    }
+
+    [self.clientSocket writeDispatchData:data withTimeout:30 tag:0];
+    [self.clientSocket writeData:high priority:GCDAsyncSocketWritePriorityHigh withTimeout:30 tag:1];
+
+    [self expectServerToRead:@[head, middle, tail, high]];
+}
+
+- (void)testWritePriorityKeepsStartTLSInPlace {
+    [self connectSockets];
+
+    NSData *bulk = [self messageWithIndex:0 length:(1024 * 1024 * 32)];
+    NSData *high = [self messageWithIndex:1 length:16];
+
+    [self.clientSocket writeData:bulk withTimeout:30 tag:0];
+    [self.clientSocket startTLS:nil];
+    [self.clientSocket writeData:high priority:GCDAsyncSocketWritePriorityHigh withTimeout:30 tag:1];
+
+    // Had the high priority write overtaken startTLS, it would follow the bulk write in the clear.
+    // Instead, what follows is the TLS handshake (a record of content type 22).
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read bulk and handshake"];
+    [self.acceptedServerSocket readDataToLength:(bulk.length + 1) withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects([data subdataWithRange:NSMakeRange(0, bulk.length)], bulk);
+        XCTAssertEqual(((const uint8_t *)data.bytes)[bulk.length], 22);
+        [readExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+- (void)testStatisticsSnapshot {
+    [self connectSockets];
+
+    self.clientSocket.statisticsEnabled = YES;
+    self.acceptedServerSocket.statisticsEnabled = YES;
+
+    NSData *message = [self messageWithIndex:0 length:(1024 * 64)];
+
+    XCTestExpectation *writeExpectation = [self expectationWithDescription:@"Write completed"];
+    [self.clientSocket writeData:message withTimeout:30 completion:^(NSError *writeError) {
+        [writeExpectation fulfill];
+    }];
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read completed"];
+    [self.acceptedServerSocket readDataToLength:message.length withTimeout:30 completion:^(NSData *data, NSError *readError) {
+        [readExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    GCDAsyncSocketStatistics clientStatistics = [self.clientSocket statisticsSnapshot];
+    XCTAssertEqual(clientStatistics.bytesWritten, (uint64_t)message.length);
+    XCTAssertEqual(clientStatistics.writesCompleted, 1u);
+    XCTAssertEqual(clientStatistics.writeLatency.totalCount, 1u);
+    XCTAssertTrue(clientStatistics.writeSyscalls >= 1);
+
+    GCDAsyncSocketStatistics serverStatistics = [self.acceptedServerSocket statisticsSnapshot];
+    XCTAssertEqual(serverStatistics.bytesRead, (uint64_t)message.length);
+    XCTAssertEqual(serverStatistics.readsCompleted, 1u);
+    XCTAssertEqual(serverStatistics.readLatency.totalCount, 1u);
+
+    GCDAsyncSocketLatencyHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    histogram.counts[20] = 99; // 64-79 µs
+    histogram.counts[40] = 1;  // 2048-2559 µs
+    histogram.totalCount = 100;
+    histogram.maxValue = 2100;
+    XCTAssertEqual([GCDAsyncSocket lowerBoundOfLatencyBucket:20], 64u);
+    XCTAssertEqual([GCDAsyncSocket latencyAtPercentile:50 ofHistogram:&histogram], 79u);
+    XCTAssertEqual([GCDAsyncSocket latencyAtPercentile:100 ofHistogram:&histogram], 2100u);
+}
+
+- (void)testTCPInfo {
+    [self connectSockets];
+
+    XCTAssertFalse(self.clientSocket.lastTCPInfo.valid);
+
+    GCDAsyncSocketTCPInfo info = [self.clientSocket tcpInfo];
+    XCTAssertTrue(info.valid);
+    XCTAssertTrue(info.maxSegmentSize > 0);
+    XCTAssertEqual(self.clientSocket.lastTCPInfo.timestamp, info.timestamp);
+
+    // Sampled periodically from now on
+    self.clientSocket.tcpInfoSamplingInterval = 0.05;
+    [self expectationForPredicate:[NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return self.clientSocket.lastTCPInfo.timestamp > info.timestamp;
+    }] evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+
+    // Sampling stops on disconnect, and the last sample is kept
+    [self.clientSocket disconnect];
+    uint64_t lastTimestamp = self.clientSocket.lastTCPInfo.timestamp;
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.3]];
+    XCTAssertEqual(self.clientSocket.lastTCPInfo.timestamp, lastTimestamp);
+
+    // ... and resumes on reconnect
+    self.expectation = [self expectationWithDescription:@"Reconnected"];
+    NSError *error = nil;
+    XCTAssertTrue([self.clientSocket connectToHost:@"127.0.0.1" onPort:self.portNumber error:&error], @"%@", error);
+    [self expectationForPredicate:[NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return self.clientSocket.lastTCPInfo.timestamp > lastTimestamp;
+    }] evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testSocketRegistry {
+    GCDAsyncSocketRegistry *registry = [GCDAsyncSocketRegistry sharedRegistry];
+    XCTAssertFalse(registry.enabled);
+    registry.enabled = YES;
+
+    dispatch_queue_t delegateQueue = dispatch_queue_create("GCDAsyncSocketRegistryTests", NULL);
+    GCDAsyncSocket *listener = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:delegateQueue];
+    GCDAsyncUdpSocket *udpSocket = [[GCDAsyncUdpSocket alloc] initWithDelegate:nil delegateQueue:NULL];
+    registry.enabled = NO;
+
+    NSError *error = nil;
+    XCTAssertTrue([listener acceptOnPort:0 error:&error], @"%@", error);
+
+    NSArray *sockets = registry.allSockets;
+    XCTAssertTrue([sockets containsObject:listener]);
+    XCTAssertTrue([sockets containsObject:udpSocket]);
+    XCTAssertFalse([sockets containsObject:self.clientSocket]);
+
+    NSDictionary *counters = [registry aggregateCounters];
+    XCTAssertGreaterThanOrEqual([counters[@"sockets"] unsignedIntegerValue], 2u);
+    XCTAssertGreaterThanOrEqual([counters[@"states"][@"GCDAsyncSocket"][@"accepting"] unsignedIntegerValue], 1u);
+    XCTAssertGreaterThanOrEqual([counters[@"states"][@"GCDAsyncUdpSocket"][@"closed"] unsignedIntegerValue], 1u);
+
+    NSData *json = [registry JSONSnapshot];
+    XCTAssertNotNil(json);
+    NSDictionary *document = [NSJSONSerialization JSONObjectWithData:json options:0 error:&error];
+    XCTAssertNotNil(document, @"%@", error);
+    XCTAssertEqual([document[@"sockets"] count], [document[@"aggregate"][@"sockets"] unsignedIntegerValue]);
+
+    [listener disconnect];
+}
+
+- (void)testChromeTraceExport {
+    [self connectSockets];
+
+    NSData *message = [self messageWithIndex:0 length:16];
+    [self.clientSocket writeData:message withTimeout:30 tag:0];
+    [self expectServerToRead:@[message]];
+
+    NSData *trace = [GCDAsyncSocketTracing chromeTraceData];
+    if (![GCDAsyncSocketTracing isCompiledIn]) {
+        XCTAssertNil(trace);
+        NSError *error = nil;
+        NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"GCDAsyncSocketTrace.json"]];
+        XCTAssertFalse([GCDAsyncSocketTracing writeChromeTraceToURL:url error:&error]);
+        XCTAssertNotNil(error);
+        return;
+    }
+
+    NSError *error = nil;
+    NSDictionary *document = [NSJSONSerialization JSONObjectWithData:trace options:0 error:&error];
+    XCTAssertNotNil(document, @"%@", error);
+    NSArray *events = document[@"traceEvents"];
+    XCTAssertTrue([events isKindOfClass:[NSArray class]]);
+    NSMutableSet *names = [NSMutableSet set];
+    for (NSDictionary *event in events) {
+        XCTAssertNotNil(event[@"ph"]);
+        XCTAssertNotNil(event[@"tid"]);
+        [names addObject:event[@"name"]];
+    }
+
+    // The socketQueues of both sockets have recorded the exchange
+    XCTAssertTrue([names containsObject:@"thread_name"]);
+    XCTAssertTrue([names containsObject:@"writeEnqueue"]);
+    XCTAssertTrue([names containsObject:@"write"]);
+    XCTAssertTrue([names containsObject:@"readEnqueue"]);
+    XCTAssertTrue([names containsObject:@"read"]);
+
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"GCDAsyncSocketTrace.json"]];
+    XCTAssertTrue([GCDAsyncSocketTracing writeChromeTraceToURL:url error:&error], @"%@", error);
+    [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+}
+
+/**
+ * Connects the clientSocket to the serverSocket (over loopback),
+ * and waits until the server has accepted the connection (acceptedServerSocket).
+ */
+- (void)connectSockets {
+    NSError *error = nil;
+    BOOL success = NO;
+    success = [self.serverSocket acceptOnPort:self.portNumber error:&error];
+    XCTAssertTrue(success, @"Server failed setting up socket on port %d %@", self.portNumber, error);
+    success = [self.clientSocket connectToHost:@"127.0.0.1" onPort:self.portNumber error:&error];
+    XCTAssertTrue(success, @"Client failed connecting to up server socket on port %d %@", self.portNumber, error);
+
+    self.expectation = [self expectationWithDescription:@"Test Full Connection"];
+    [self expectationForPredicate:[NSPredicate predicateWithFormat:@"acceptedServerSocket != nil"] evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+}
+
+/**
+ * Connects another client to the serverSocket (once connectSockets has set it up),
+ * and returns the socket that accepted it. acceptedServerSocket refers to the new one afterwards.
+ */
+- (GCDAsyncSocket *)connectAnotherClient:(GCDAsyncSocket *)client {
+    self.acceptedServerSocket = nil;
+
+    NSError *error = nil;
+    BOOL success = [client connectToHost:@"127.0.0.1" onPort:self.portNumber error:&error];
+    XCTAssertTrue(success, @"Client failed connecting to up server socket on port %d %@", self.portNumber, error);
+
+    self.expectation = [self expectationWithDescription:@"Another Connection"];
+    [self expectationForPredicate:[NSPredicate predicateWithFormat:@"acceptedServerSocket != nil"] evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    return self.acceptedServerSocket;
+}
+
+/**
+ * Reads the given messages (back to back) on the acceptedServerSocket, and waits until they've arrived.
+ */
+- (void)expectServerToRead:(NSArray *)messages {
+    NSMutableData *expected = [NSMutableData data];
+    for (NSData *message in messages) {
+        [expected appendData:message];
+    }
+
+    XCTestExpectation *readExpectation = [self expectationWithDescription:@"Read messages"];
+    [self.acceptedServerSocket readDataToLength:expected.length withTimeout:30 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertEqualObjects(data, expected);
+        [readExpectation fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+}
+
+- (NSData *)messageWithIndex:(NSUInteger)index length:(NSUInteger)length {
+    NSMutableData *message = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = message.mutableBytes;
+    for (NSUInteger i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)(index + i);
+    }
+    return message;
+}
+
+- (void)echoOnSocket:(GCDAsyncSocket *)sock messageLength:(NSUInteger)length {
+    [sock readDataToLength:length withTimeout:10 completion:^(NSData *data, NSError *error) {
+        if (data == nil) {
+            return;
+        }
+        [sock writeData:data withTimeout:10 tag:0];
+        [self echoOnSocket:sock messageLength:length];
+    }];
+}
+
+- (void)sendMessage:(NSUInteger)index of:(NSUInteger)count length:(NSUInteger)length expectation:(XCTestExpectation *)expectation {
+    NSData *message = [self messageWithIndex:index length:length];
+    
+    [self.clientSocket writeData:message withTimeout:10 completion:^(NSError *error) {
+        XCTAssertNil(error, @"Write %lu failed: %@", (unsigned long)index, error);
+    }];
+    [self.clientSocket readDataToLength:length withTimeout:10 completion:^(NSData *data, NSError *error) {
+        XCTAssertNil(error, @"Read %lu failed: %@", (unsigned long)index, error);
+        XCTAssertEqualObjects(data, message, @"Echoed message %lu does not match", (unsigned long)index);
+        
+        if (data == nil || index + 1 == count) {
+            [expectation fulfill];
+        } else {
+            [self sendMessage:index + 1 of:count length:length expectation:expectation];
+        }
+    }];
+}
+
 #pragma mark GCDAsyncSocketDelegate methods
 
 /**
@@ -224,5 +1052,17 @@
     [self.expectation fulfill];
 }
 
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag {
+    [self.readExpectation fulfill];
+}
+
+- (void)socketWriteQueueDidExceedHighWatermark:(GCDAsyncSocket *)sock {
+    [self.watermarkEvents addObject:@"high"];
+}
+
+- (void)socketWriteQueueDidDrainBelowLowWatermark:(GCDAsyncSocket *)sock {
+    [self.watermarkEvents addObject:@"low"];
+}
+
 
 @end
@@ -32,4 +32,49 @@ class GCDAsyncSocketReadTests: XCTestCase {
 
 		XCTAssertEqual(client.bytesRead, 1024 * 100)
 	}
+
+	func test_whenReadingIntoFileOverTLS_readCrossesWindowBoundary() {
+		TestSocket.waiterDelegate = self
+
+		let server = TestServer()
+		let (client, accepted) = server.createSecurePair()
+
+		let path = (NSTemporaryDirectory() as NSString).appendingPathComponent(UUID().uuidString)
+		let fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0o600)
+		XCTAssertGreaterThanOrEqual(fd, 0)
+
+		defer {
+			client.close()
+			accepted.close()
+			server.close()
+
+			Darwin.close(fd)
+			unlink(path)
+		}
+
+		// Larger than the 8 MB window the file is mapped with, so the read has to map a second window.
+		// Over TLS, the bytes for the second window are typically already decrypted (or sitting in the
+		// sslPreBuffer) when the first window fills, so the readSource won't fire again for them.
+		let length = 8 * 1024 * 1024 + 64 * 1024
+		let bytes = (0..<length).map { UInt8(truncatingIfNeeded: $0 % 251) }
+		let data = Data(bytes)
+
+		client.onDisconnect = {
+			XCTFail("Socket was disconnected")
+		}
+
+		let waiter = XCTWaiter(delegate: TestSocket.waiterDelegate)
+		let didRead = XCTestExpectation(description: "Read data into file")
+
+		client.onRead = {
+			didRead.fulfill()
+		}
+
+		accepted.socket.write(data, withTimeout: -1, tag: 1)
+		client.socket.readData(toLength: UInt(length), intoFileDescriptor: fd, offset: 0, withTimeout: 10, tag: 1)
+
+		waiter.wait(for: [didRead], timeout: 15)
+
+		XCTAssertEqual(try? Data(contentsOf: URL(fileURLWithPath: path)), data)
+	}
 }
@@ -32,7 +32,11 @@ POD_TEST_MAC="xcodebuild -workspace ./${SCRIPT_DIR}/Mac/CocoaAsyncSocket.xcworks
 FRAMEWORK_IOS="xcodebuild -project ./${SCRIPT_DIR}/Framework/CocoaAsyncSocketTests.xcodeproj -scheme \"CocoaAsyncSocketTests (iOS)\" -sdk iphonesimulator -destination \"${IOS_DESTINATION}\" test ${CODE_SIGNING} ${XCPRETTY}"
 FRAMEWORK_MAC="xcodebuild -project ./${SCRIPT_DIR}/Framework/CocoaAsyncSocketTests.xcodeproj -scheme \"CocoaAsyncSocketTests (macOS)\" -sdk macosx -destination \"${MACOS_DESTINATION}\" test ${CODE_SIGNING} ${XCPRETTY}"
 
-declare -a TESTS=("${POD_TEST_IOS}" "${POD_TEST_MAC}" "${FRAMEWORK_IOS}" "${FRAMEWORK_MAC}")
+# Again, with event tracing compiled in (it's compiled out by default)
+TRACING="GCC_PREPROCESSOR_DEFINITIONS='\$(inherited) GCDAsyncSocketTracingEnabled=1'"
+FRAMEWORK_MAC_TRACING="xcodebuild -project ./${SCRIPT_DIR}/Framework/CocoaAsyncSocketTests.xcodeproj -scheme \"CocoaAsyncSocketTests (macOS)\" -sdk macosx -destination \"${MACOS_DESTINATION}\" test ${CODE_SIGNING} ${TRACING} ${XCPRETTY}"
+
+declare -a TESTS=("${POD_TEST_IOS}" "${POD_TEST_MAC}" "${FRAMEWORK_IOS}" "${FRAMEWORK_MAC}" "${FRAMEWORK_MAC_TRACING}")
 
 for TEST in "${TESTS[@]}"
 do